@@ -69,7 +69,17 @@ namespace
 # include "avhttp/bencode.hpp"
 # include "avhttp/rangefield.hpp"
 # include "avhttp/bitfield.hpp"
+# include "avhttp/io_service_pool.hpp"
+# include "avhttp/io_uring_service.hpp"
+# include "avhttp/async_storage.hpp"
+# include "avhttp/meta_store.hpp"
+# include "avhttp/delta_control.hpp"
 # include "avhttp/multi_download.hpp"
+# include "avhttp/uring_storage.hpp"
+# include "avhttp/mmap_storage.hpp"
+# include "avhttp/direct_storage.hpp"
+# include "avhttp/memory_storage.hpp"
+# include "avhttp/download_manager.hpp"
 #endif
 #if (BOOST_VERSION >= 105400)
 # include "avhttp/async_read_body.hpp"
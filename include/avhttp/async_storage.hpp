@@ -0,0 +1,142 @@
+﻿//
+// async_storage.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// path LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_ASYNC_STORAGE_HPP
+#define AVHTTP_ASYNC_STORAGE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "avhttp/storage_interface.hpp"
+#include "avhttp/io_service_pool.hpp"
+
+namespace avhttp {
+
+// 把storage_interface包装成async_storage_interface.
+// 异步操作按发起的顺序在一个后台线程中调用原存储的同步接口, 线程在第一次发起异步
+// 操作时创建, 只使用同步接口时不创建线程. 定义AVHTTP_DISABLE_THREAD时改为在open
+// 指定的io_service中执行. 所有读写都在内部锁定, 原存储不需要考虑多线程, 只有sync
+// 可能与写入同时执行, 与storage_interface::sync的约定相同.
+// @begin example
+//  avhttp::storage_adapter storage(avhttp::default_storage_constructor());
+//  storage.open("file", avhttp::storage_hints(), ec);
+//  storage.async_write(0, buffers, handler);
+// @end example
+class storage_adapter
+	: public async_storage_interface
+	, public boost::noncopyable
+{
+public:
+
+	/// Constructor.
+	// @param storage是被包装的存储, 由storage_adapter负责删除.
+	AVHTTP_DECL explicit storage_adapter(storage_interface* storage);
+
+	/// Destructor.
+	// 备注: 析构时没有完成的异步操作将被放弃, 回调不会被调用.
+	AVHTTP_DECL virtual ~storage_adapter();
+
+	///返回被包装的存储.
+	AVHTTP_DECL storage_interface* get() const;
+
+	// 打开被包装的存储.
+	AVHTTP_DECL virtual void open(const fs::path& file_path, const storage_hints& hints,
+		boost::system::error_code& ec);
+
+	// 关闭被包装的存储.
+	AVHTTP_DECL virtual void close();
+
+	// 在后台线程中按顺序写入缓冲序列.
+	AVHTTP_DECL virtual void async_write(boost::int64_t offset, const const_buffers_type& buffers,
+		io_handler_type handler);
+
+	// 在后台线程中读取数据.
+	AVHTTP_DECL virtual void async_read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		io_handler_type handler);
+
+	// 之前发起的操作完成后调用handler.
+	AVHTTP_DECL virtual void async_flush(completion_handler_type handler);
+
+	// 之前发起的操作完成后调用原存储的sync, 再调用handler.
+	AVHTTP_DECL virtual void async_sync(completion_handler_type handler);
+
+	// 在调用者的线程中写入数据.
+	AVHTTP_DECL virtual std::size_t write(boost::int64_t offset, const const_buffers_type& buffers,
+		boost::system::error_code& ec);
+
+	// 在调用者的线程中读取数据.
+	AVHTTP_DECL virtual std::size_t read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		boost::system::error_code& ec);
+
+	// 调用原存储的sync.
+	AVHTTP_DECL virtual void sync(boost::system::error_code& ec);
+
+	// 以下转发给原存储.
+	AVHTTP_DECL virtual void allocate(boost::int64_t size, boost::system::error_code& ec);
+
+	AVHTTP_DECL virtual bool find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right);
+
+	AVHTTP_DECL virtual int native_handle();
+
+	AVHTTP_DECL virtual boost::shared_ptr<const char> view(boost::int64_t offset,
+		std::size_t size, std::size_t& length);
+
+private:
+
+	AVHTTP_DECL void handle_write(boost::int64_t offset, const_buffers_type buffers,
+		io_handler_type handler);
+
+	AVHTTP_DECL void handle_read(boost::int64_t offset, mutable_buffers_type buffers,
+		io_handler_type handler);
+
+	AVHTTP_DECL void handle_sync(completion_handler_type handler);
+
+	// 执行异步操作的io_service.
+	AVHTTP_DECL boost::asio::io_service& work_io_service();
+
+private:
+
+	// 被包装的存储.
+	boost::scoped_ptr<storage_interface> m_storage;
+
+	// open时指定的io_service.
+	boost::asio::io_service* m_io_service;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保证原存储读写的唯一性.
+	boost::mutex m_storage_mutex;
+
+	// 保护后台线程的创建.
+	boost::mutex m_pool_mutex;
+
+	// 执行异步操作的线程, 只用一个线程以保证操作的顺序.
+	// 备注: 必须在m_storage之后定义, 保证先于m_storage析构.
+	boost::scoped_ptr<io_service_pool> m_pool;
+#endif
+};
+
+// 以storage_adapter包装constructor创建的存储.
+inline async_storage_interface* make_storage_adapter(const storage_constructor_type& constructor)
+{
+	return new storage_adapter(constructor());
+}
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/async_storage.ipp"
+#endif
+
+#endif // AVHTTP_ASYNC_STORAGE_HPP
@@ -35,27 +35,33 @@
 # pragma once
 #endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
 
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>    // for std::min
+
+#include <boost/cstdint.hpp>
 #include <boost/assert.hpp>
 
 namespace avhttp {
 
 // 一个位图的类实现.
-//
+// 位按高位在前的顺序保存在字节中, bytes()的内容即为meta文件中保存的格式.
+// 计数, 查找以及区间设置都按64位一次处理, 大量分片时也很快.
 
 struct bitfield
 {
 public:
     bitfield(void) : m_bytes(0), m_size(0), m_own(false) {}
-    bitfield(int bits): m_bytes(0), m_size(0)
+    bitfield(boost::int64_t bits): m_bytes(0), m_size(0), m_own(false)
     { resize(bits); }
-    bitfield(int bits, bool val): m_bytes(0), m_size(0)
+    bitfield(boost::int64_t bits, bool val): m_bytes(0), m_size(0), m_own(false)
     { resize(bits, val); }
-    bitfield(char const* b, int bits): m_bytes(0), m_size(0)
+    bitfield(char const* b, boost::int64_t bits): m_bytes(0), m_size(0), m_own(false)
     { assign(b, bits); }
     bitfield(bitfield const& rhs): m_bytes(0), m_size(0), m_own(false)
     { assign(rhs.bytes(), rhs.size()); }
 
-    void borrow_bytes(char* b, int bits)
+    void borrow_bytes(char* b, boost::int64_t bits)
     {
         dealloc();
         m_bytes = (unsigned char*)b;
@@ -64,66 +70,91 @@ public:
     }
 
     ~bitfield() { dealloc(); }
-    void assign(char const* b, int bits)
-    { resize(bits); std::memcpy(m_bytes, b, (bits + 7) / 8); clear_trailing_bits(); }
+    void assign(char const* b, boost::int64_t bits)
+    { resize(bits); std::memcpy(m_bytes, b, byte_count(bits)); clear_trailing_bits(); }
 
-    bool operator[](int index) const
+    bool operator[](boost::int64_t index) const
     { return get_bit(index); }
 
-    bool get_bit(int index) const
+    bool get_bit(boost::int64_t index) const
     {
         BOOST_ASSERT(index >= 0);
         BOOST_ASSERT(index < m_size);
         return (m_bytes[index / 8] & (0x80 >> (index & 7))) != 0;
     }
 
-    void clear_bit(int index)
+    void clear_bit(boost::int64_t index)
     {
         BOOST_ASSERT(index >= 0);
         BOOST_ASSERT(index < m_size);
         m_bytes[index / 8] &= ~(0x80 >> (index & 7));
     }
 
-    void set_bit(int index)
+    void set_bit(boost::int64_t index)
     {
         BOOST_ASSERT(index >= 0);
         BOOST_ASSERT(index < m_size);
         m_bytes[index / 8] |= (0x80 >> (index & 7));
     }
 
-    std::size_t bytes_size() const { return m_size / 8 + (m_size % 8 == 0 ? 0 : 1); }
-    std::size_t size() const { return m_size; }
+    ///设置[first, last)之间的所有位.
+    void set_range(boost::int64_t first, boost::int64_t last)
+    {
+        fill_range(first, last, true);
+    }
+
+    ///清除[first, last)之间的所有位.
+    void clear_range(boost::int64_t first, boost::int64_t last)
+    {
+        fill_range(first, last, false);
+    }
+
+    ///查找from之后(包括from)第一个为1的位, 没有找到返回-1.
+    boost::int64_t find_first_set(boost::int64_t from = 0) const
+    {
+        return find_first(from, 0);
+    }
+
+    ///查找from之后(包括from)第一个为0的位, 没有找到返回-1.
+    boost::int64_t find_first_clear(boost::int64_t from = 0) const
+    {
+        return find_first(from, 0xff);
+    }
+
+    ///是否所有位都为1.
+    bool all_set() const
+    {
+        return find_first_clear() == -1;
+    }
+
+    std::size_t bytes_size() const { return static_cast<std::size_t>(byte_count(m_size)); }
+    std::size_t size() const { return static_cast<std::size_t>(m_size); }
     bool empty() const { return m_size == 0; }
 
     char const* bytes() const { return (char*)m_bytes; }
 
     bitfield& operator=(bitfield const& rhs)
     {
-        assign(rhs.bytes(), rhs.size());
+        if (this != &rhs)
+            assign(rhs.bytes(), rhs.size());
         return *this;
     }
 
-    int count() const
+    boost::int64_t count() const
     {
-        // 0000, 0001, 0010, 0011, 0100, 0101, 0110, 0111,
-        // 1000, 1001, 1010, 1011, 1100, 1101, 1110, 1111
-        const static char num_bits[] =
-        {
-            0, 1, 1, 2, 1, 2, 2, 3,
-            1, 2, 2, 3, 2, 3, 3, 4
-        };
-
-        int ret = 0;
-        const int num_bytes = m_size / 8;
-        for (int i = 0; i < num_bytes; ++i)
+        // 末尾不足一个字节的位总是被清0的, 所以可以直接按字节统计.
+        boost::int64_t ret = 0;
+        const boost::int64_t num_bytes = byte_count(m_size);
+        boost::int64_t i = 0;
+        for (; i + 8 <= num_bytes; i += 8)
         {
-            ret += num_bits[m_bytes[i] & 0xf] + num_bits[m_bytes[i] >> 4];
+            boost::uint64_t w;
+            std::memcpy(&w, m_bytes + i, 8);
+            ret += popcount(w);
         }
-
-        int rest = m_size - num_bytes * 8;
-        for (int i = 0; i < rest; ++i)
+        for (; i < num_bytes; ++i)
         {
-            ret += (m_bytes[num_bytes] >> (7-i)) & 1;
+            ret += popcount(m_bytes[i]);
         }
         BOOST_ASSERT(ret <= m_size);
         BOOST_ASSERT(ret >= 0);
@@ -156,7 +187,7 @@ public:
         { return byte != rhs.byte || bit != rhs.bit; }
 
         const_iterator& operator+(boost::uint64_t rhs)
-        { for (int i = 0; i < rhs; i++)inc(); return *this; }
+        { for (boost::uint64_t i = 0; i < rhs; i++)inc(); return *this; }
 
     private:
         void inc()
@@ -192,44 +223,40 @@ public:
     };
 
     const_iterator begin() const { return const_iterator(m_bytes, 0); }
-    const_iterator end() const { return const_iterator(m_bytes + m_size / 8, m_size & 7); }
+    const_iterator end() const { return const_iterator(m_bytes + m_size / 8, int(m_size & 7)); }
 
-    void resize(int bits, bool val)
+    void resize(boost::int64_t bits, bool val)
     {
-        int s = m_size;
-        int b = m_size & 7;
+        boost::int64_t s = m_size;
         resize(bits);
         if (s >= m_size) return;
-        int old_size_bytes = (s + 7) / 8;
-        int new_size_bytes = (m_size + 7) / 8;
         if (val)
         {
-            if (old_size_bytes && b) m_bytes[old_size_bytes - 1] |= (0xff >> b);
-            if (old_size_bytes < new_size_bytes)
-                std::memset(m_bytes + old_size_bytes, 0xff, new_size_bytes - old_size_bytes);
-            clear_trailing_bits();
+            set_range(s, m_size);
         }
         else
         {
+            boost::int64_t old_size_bytes = byte_count(s);
+            boost::int64_t new_size_bytes = byte_count(m_size);
             if (old_size_bytes < new_size_bytes)
-                std::memset(m_bytes + old_size_bytes, 0x00, new_size_bytes - old_size_bytes);
+                std::memset(m_bytes + old_size_bytes, 0x00, static_cast<std::size_t>(new_size_bytes - old_size_bytes));
         }
     }
 
     void set_all()
     {
-        std::memset(m_bytes, 0xff, (m_size + 7) / 8);
+        std::memset(m_bytes, 0xff, bytes_size());
         clear_trailing_bits();
     }
 
     void clear_all()
     {
-        std::memset(m_bytes, 0x00, (m_size + 7) / 8);
+        std::memset(m_bytes, 0x00, bytes_size());
     }
 
-    void resize(int bits)
+    void resize(boost::int64_t bits)
     {
-        const int b = (bits + 7) / 8;
+        const std::size_t b = static_cast<std::size_t>(byte_count(bits));
         if (m_bytes)
         {
             if (m_own)
@@ -240,7 +267,7 @@ public:
             else if (bits > m_size)
             {
                 unsigned char* tmp = (unsigned char*)std::malloc(b);
-                std::memcpy(tmp, m_bytes, (std::min)(int(m_size + 7)/ 8, b));
+                std::memcpy(tmp, m_bytes, (std::min)(bytes_size(), b));
                 m_bytes = tmp;
                 m_own = true;
             }
@@ -258,19 +285,137 @@ public:
 
 private:
 
+    static boost::int64_t byte_count(boost::int64_t bits)
+    {
+        return (bits + 7) / 8;
+    }
+
+    static int popcount(boost::uint64_t w)
+    {
+#if defined(__GNUC__)
+        return __builtin_popcountll(w);
+#else
+        w = w - ((w >> 1) & 0x5555555555555555ULL);
+        w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+        w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return static_cast<int>((w * 0x0101010101010101ULL) >> 56);
+#endif
+    }
+
+    // w不能为0.
+    static int leading_zeros(boost::uint64_t w)
+    {
+        BOOST_ASSERT(w != 0);
+#if defined(__GNUC__)
+        return __builtin_clzll(w);
+#else
+        int n = 0;
+        if (!(w & 0xffffffff00000000ULL)) { n += 32; w <<= 32; }
+        if (!(w & 0xffff000000000000ULL)) { n += 16; w <<= 16; }
+        if (!(w & 0xff00000000000000ULL)) { n += 8; w <<= 8; }
+        if (!(w & 0xf000000000000000ULL)) { n += 4; w <<= 4; }
+        if (!(w & 0xc000000000000000ULL)) { n += 2; w <<= 2; }
+        if (!(w & 0x8000000000000000ULL)) { n += 1; }
+        return n;
+#endif
+    }
+
+    // 按高位在前读取8个字节, 编译器会将其优化为一次读取和字节交换.
+    static boost::uint64_t load_word(const unsigned char* p)
+    {
+        boost::uint64_t w = 0;
+        for (int i = 0; i < 8; i++)
+            w = (w << 8) | p[i];
+        return w;
+    }
+
+    // 查找from之后第一个与flip不同的位, flip为0时查找1, 为0xff时查找0.
+    boost::int64_t find_first(boost::int64_t from, unsigned char flip) const
+    {
+        if (from < 0)
+            from = 0;
+        if (from >= m_size)
+            return -1;
+
+        const boost::int64_t num_bytes = byte_count(m_size);
+        const boost::uint64_t flip_word = flip ? ~boost::uint64_t(0) : 0;
+        boost::int64_t i = from / 8;
+        boost::int64_t result = -1;
+
+        // 第一个字节中from之前的位不参与查找.
+        unsigned char first = (m_bytes[i] ^ flip) & (0xff >> (from & 7));
+        if (first)
+        {
+            result = i * 8 + leading_zeros(first) - 56;
+        }
+        else
+        {
+            for (++i; i + 8 <= num_bytes; i += 8)
+            {
+                boost::uint64_t w = load_word(m_bytes + i) ^ flip_word;
+                if (w)
+                {
+                    result = i * 8 + leading_zeros(w);
+                    break;
+                }
+            }
+            for (; result == -1 && i < num_bytes; ++i)
+            {
+                unsigned char c = m_bytes[i] ^ flip;
+                if (c)
+                    result = i * 8 + leading_zeros(c) - 56;
+            }
+        }
+
+        // 末尾被清0的位不在位图中.
+        return result < m_size ? result : -1;
+    }
+
+    void fill_range(boost::int64_t first, boost::int64_t last, bool val)
+    {
+        BOOST_ASSERT(first >= 0 && last <= m_size);
+        if (first >= last)
+            return;
+
+        boost::int64_t first_byte = first / 8;
+        boost::int64_t last_byte = (last - 1) / 8;
+        unsigned char first_mask = 0xff >> (first & 7);
+        unsigned char last_mask = 0xff << (7 - ((last - 1) & 7));
+
+        if (first_byte == last_byte)
+        {
+            first_mask &= last_mask;
+            if (val) m_bytes[first_byte] |= first_mask;
+            else m_bytes[first_byte] &= ~first_mask;
+            return;
+        }
+
+        if (val)
+        {
+            m_bytes[first_byte] |= first_mask;
+            m_bytes[last_byte] |= last_mask;
+        }
+        else
+        {
+            m_bytes[first_byte] &= ~first_mask;
+            m_bytes[last_byte] &= ~last_mask;
+        }
+        std::memset(m_bytes + first_byte + 1, val ? 0xff : 0x00,
+            static_cast<std::size_t>(last_byte - first_byte - 1));
+    }
+
     void clear_trailing_bits()
     {
         // clear the tail bits in the last byte.
-        if (m_size & 7) m_bytes[(m_size + 7) / 8 - 1] &= 0xff << (8 - (m_size & 7));
+        if (m_size & 7) m_bytes[byte_count(m_size) - 1] &= 0xff << (8 - (m_size & 7));
     }
 
     void dealloc() { if (m_own) std::free(m_bytes); m_bytes = 0; }
     unsigned char* m_bytes;
-    int m_size:31; // in bits.
-    bool m_own:1;
+    boost::int64_t m_size; // in bits.
+    bool m_own;
 };
 
 } // namespace avhttp
 
 #endif // AVHTTP_BITFIELD_HPP
-
@@ -15,6 +15,8 @@
 # pragma once
 #endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
 
+#include <algorithm>	// for std::max
+
 #include "avhttp/file.hpp"
 #include "avhttp/storage_interface.hpp"
 
@@ -23,7 +25,10 @@ namespace avhttp {
 class default_storge : public storage_interface
 {
 public:
-	default_storge()
+	// @param sparse为true时文件保持稀疏, allocate只设置文件大小, 否则同时预分配
+	// 磁盘空间, 避免乱序写入造成文件碎片.
+	explicit default_storge(bool sparse = false)
+		: m_sparse(sparse)
 	{}
 
 	virtual ~default_storge()
@@ -34,7 +39,7 @@ public:
 	// @param ec在出错时保存了详细的错误信息.
 	virtual void open(const fs::path& file_path, boost::system::error_code& ec)
 	{
-		m_file.open(file_path, file::read_write, ec);
+		m_file.open(file_path, file::read_write | (m_sparse ? file::sparse : 0), ec);
 	}
 
 	// 关闭存储组件.
@@ -97,16 +102,87 @@ public:
 		return ret == 0 ? true : false;
 	}
 
+	// 将已经写入的数据同步到磁盘.
+	// @返回值true表示同步成功.
+	virtual bool sync()
+	{
+		return m_file.flush();
+	}
+
+	// 设置文件大小, 非稀疏文件同时预分配磁盘空间(文件系统不支持时保持稀疏).
+	// @param size是文件大小.
+	// @param ec在出错时保存了详细的错误信息.
+	virtual void allocate(boost::int64_t size, boost::system::error_code& ec)
+	{
+		m_file.set_size(size, ec);
+	}
+
+	// 查找offset之后的第一个文件空洞.
+	// @param offset是开始查找的位置.
+	// @param left返回空洞的起始位置.
+	// @param right返回空洞的结束位置(不包含), -1表示空洞一直到文件尾之后.
+	// @返回值false表示不支持查找.
+	virtual bool find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
+	{
+		return find_file_hole(m_file, offset, left, right);
+	}
+
+#ifndef WIN32
+	// 返回文件描述符, 数据可以通过splice直接写入文件.
+	virtual int native_handle()
+	{
+		return m_file.native_handle();
+	}
+#endif
+
+	// 通过SEEK_HOLE/SEEK_DATA(windows下为FSCTL_QUERY_ALLOCATED_RANGES)查找文件空洞,
+	// 不支持时只能发现文件尾之后的部分.
+	static bool find_file_hole(const file& f, boost::int64_t offset,
+		boost::int64_t& left, boost::int64_t& right)
+	{
+		boost::system::error_code ec;
+		boost::int64_t size = f.get_size(ec);
+		if (ec)
+		{
+			return false;
+		}
+
+		left = f.data_end(offset);
+		if (left >= size)
+		{
+			left = (std::max)(offset, size);
+			right = -1;
+			return true;
+		}
+
+		right = f.sparse_end(left);
+		if (right <= left || right >= size)
+		{
+			// 之后再没有数据, 空洞一直到文件尾之后.
+			right = -1;
+		}
+		return true;
+	}
+
 protected:
 	file m_file;
+
+	// 是否使用稀疏文件.
+	bool m_sparse;
 };
 
 // 默认存储对象.
-static storage_interface* default_storage_constructor()
+inline storage_interface* default_storage_constructor()
 {
 	return new default_storge();
 }
 
+// 使用稀疏文件的存储对象, 不预分配磁盘空间.
+inline storage_interface* sparse_storage_constructor()
+{
+	return new default_storge(true);
+}
+
 } // namespace avhttp
 
 #endif // AVHTTP_DEFAULT_STORAGE_HPP
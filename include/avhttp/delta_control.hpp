@@ -0,0 +1,131 @@
+﻿//
+// delta_control.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DELTA_CONTROL_HPP
+#define AVHTTP_DELTA_CONTROL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+#include <string>
+#include <utility>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "avhttp/storage_interface.hpp"	// for fs
+
+namespace avhttp {
+
+// 差分下载(类似zsync)的控制文件, 保存文件每个块的滚动校验和以及sha1.
+// 控制文件为bencode编码的字典, 包含"block size", "length"以及"checksums",
+// checksums为每个块4字节(高位在前)的滚动校验和与20字节的sha1依次连接.
+// 下载新版本的文件时, 在旧版本的本地文件中按滚动校验和查找相同的块, 相同的
+// 块直接复制, 只下载变化的部分.
+// @begin example
+//  // 发布时为新版本的文件生成控制文件.
+//  avhttp::delta_control control;
+//  control.create("nightly.zip", 4096, ec);
+//  control.save("nightly.zip.delta", ec);
+//
+//  // 下载时指定控制文件和旧版本的本地文件.
+//  avhttp::settings s;
+//  s.delta_control_file = "nightly.zip.delta";
+//  s.seed_file = "old/nightly.zip";
+//  d.start("http://example.com/nightly.zip", s);
+// @end example
+class delta_control
+{
+public:
+
+	// 找到相同的块时调用, 参数为块在新文件中的偏移, 块的数据和大小.
+	typedef boost::function<void (boost::int64_t, const char*, std::size_t)> match_handler;
+
+	/// Constructor.
+	AVHTTP_DECL delta_control();
+
+	/// Destructor.
+	AVHTTP_DECL ~delta_control();
+
+public:
+
+	///为指定的文件生成控制数据.
+	// @param file_path文件路径.
+	// @param block_size块大小.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	AVHTTP_DECL void create(const fs::path& file_path, int block_size, boost::system::error_code& ec);
+
+	///从控制文件加载.
+	// @param file_path控制文件路径.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	AVHTTP_DECL void load(const fs::path& file_path, boost::system::error_code& ec);
+
+	///保存到控制文件.
+	// @param file_path控制文件路径.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	AVHTTP_DECL void save(const fs::path& file_path, boost::system::error_code& ec) const;
+
+	///在旧版本的文件中查找与控制数据相同的块.
+	// @param seed_path旧版本的文件路径.
+	// @param handler每找到一个相同的块时调用, 每个块最多调用一次.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	// @备注: 按滚动校验和逐字节扫描整个文件, 所以块在旧文件中的位置可以与新文件不同.
+	AVHTTP_DECL void match(const fs::path& seed_path,
+		const match_handler& handler, boost::system::error_code& ec) const;
+
+	///块大小.
+	AVHTTP_DECL int block_size() const;
+
+	///文件大小.
+	AVHTTP_DECL boost::int64_t length() const;
+
+	///块的个数.
+	AVHTTP_DECL int block_num() const;
+
+private:
+
+	// 按滚动校验和排序块的索引, 用于查找.
+	AVHTTP_DECL void build_lookup();
+
+	// 块的大小, 最后一个块可能不足block_size.
+	AVHTTP_DECL std::size_t block_length(int index) const;
+
+	// 检查[data, data + size)是否与块index相同, 相同则调用handler.
+	AVHTTP_DECL bool check_block(int index, const char* data, std::size_t size,
+		std::vector<bool>& found, const match_handler& handler) const;
+
+private:
+
+	// 块大小.
+	int m_block_size;
+
+	// 文件大小.
+	boost::int64_t m_length;
+
+	// 每个块的滚动校验和.
+	std::vector<boost::uint32_t> m_weak;
+
+	// 每个块的sha1(20字节二进制).
+	std::vector<std::string> m_strong;
+
+	// 按滚动校验和排序的(校验和, 块索引), 只包含完整大小的块.
+	std::vector<std::pair<boost::uint32_t, int> > m_lookup;
+};
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/delta_control.ipp"
+#endif
+
+#endif // AVHTTP_DELTA_CONTROL_HPP
@@ -0,0 +1,272 @@
+﻿//
+// byteranges_parser.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_BYTERANGES_PARSER_HPP
+#define AVHTTP_BYTERANGES_PARSER_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <string>
+#include <cstring>
+#include <algorithm>    // for std::min
+
+#include <boost/cstdint.hpp>
+#include <boost/algorithm/string.hpp>
+
+namespace avhttp {
+namespace detail {
+
+// 增量解析multipart/byteranges响应(RFC 7233), 每个部分的数据按Content-Range
+// 给出的文件偏移返回, 数据可以分多次输入.
+// @begin example
+//  avhttp::detail::byteranges_parser parser;
+//  parser.reset(boundary);
+//  boost::int64_t offset;
+//  const char* body;
+//  std::size_t body_size;
+//  while (parser.parse(data, size, offset, body, body_size)
+//  	== avhttp::detail::byteranges_parser::body_part)
+//  {
+//  	// 将[body, body + body_size)写入文件的offset处.
+//  }
+// @end example
+class byteranges_parser
+{
+public:
+
+	enum result
+	{
+		// 输入的数据已经处理完, 需要更多的数据.
+		need_more,
+
+		// 返回了一段部分的数据.
+		body_part,
+
+		// 已经解析到结束分隔符.
+		finished,
+
+		// 响应格式错误.
+		failed
+	};
+
+	byteranges_parser()
+		: m_state(state_header)
+		, m_offset(0)
+		, m_remain(0)
+	{}
+
+	///从Content-Type中得到分隔符, 不是multipart/byteranges时返回空.
+	static std::string boundary(const std::string& content_type)
+	{
+		std::string lower = boost::to_lower_copy(content_type);
+		if (lower.compare(0, 20, "multipart/byteranges") != 0)
+		{
+			return "";
+		}
+
+		std::string::size_type pos = lower.find("boundary=");
+		if (pos == std::string::npos)
+		{
+			return "";
+		}
+
+		std::string value = content_type.substr(pos + 9);
+		value = value.substr(0, value.find(';'));
+		boost::trim(value);
+		if (value.size() >= 2 && value[0] == '"' && value[value.size() - 1] == '"')
+		{
+			value = value.substr(1, value.size() - 2);
+		}
+		return value;
+	}
+
+	///使用指定的分隔符重新开始解析.
+	void reset(const std::string& boundary)
+	{
+		m_delimiter = "--" + boundary;
+		m_close_delimiter = m_delimiter + "--";
+		m_header.clear();
+		m_state = state_header;
+		m_offset = 0;
+		m_remain = 0;
+	}
+
+	///是否已经解析到结束分隔符.
+	bool is_finished() const
+	{
+		return m_state == state_end;
+	}
+
+	///解析数据.
+	// @param data输入的数据, 返回时指向还没有处理的数据.
+	// @param size输入数据的大小, 返回时为还没有处理的数据大小.
+	// @param offset返回body_part时, 为这段数据在文件中的偏移.
+	// @param body返回body_part时, 指向这段数据.
+	// @param body_size返回body_part时, 为这段数据的大小.
+	result parse(const char*& data, std::size_t& size,
+		boost::int64_t& offset, const char*& body, std::size_t& body_size)
+	{
+		while (size != 0 || m_state == state_end)
+		{
+			if (m_state == state_end)
+			{
+				// 忽略结束分隔符之后的数据.
+				data += size;
+				size = 0;
+				return finished;
+			}
+
+			if (m_state == state_body)
+			{
+				std::size_t n = static_cast<std::size_t>(
+					(std::min)(static_cast<boost::int64_t>(size), m_remain));
+				offset = m_offset;
+				body = data;
+				body_size = n;
+				data += n;
+				size -= n;
+				m_offset += n;
+				m_remain -= n;
+				if (m_remain == 0)
+				{
+					m_state = state_header;
+				}
+				return body_part;
+			}
+
+			// 部分的头以分隔符开始, 以空行结束, 头很短, 逐字节处理即可.
+			m_header += *data++;
+			size--;
+			if (m_header.size() > max_header_size)
+			{
+				return failed;
+			}
+
+			if (ends_with(m_close_delimiter))
+			{
+				m_state = state_end;
+				continue;
+			}
+
+			if (ends_with("\r\n\r\n"))
+			{
+				if (!parse_header())
+				{
+					return failed;
+				}
+				m_header.clear();
+			}
+		}
+
+		return need_more;
+	}
+
+private:
+
+	bool ends_with(const std::string& s) const
+	{
+		return m_header.size() >= s.size()
+			&& m_header.compare(m_header.size() - s.size(), s.size(), s) == 0;
+	}
+
+	// 解析十进制数字, 跳过前面的空白.
+	static bool parse_number(const char*& p, boost::int64_t& value)
+	{
+		while (*p == ' ' || *p == '\t')
+		{
+			p++;
+		}
+		const char* begin = p;
+		value = 0;
+		for (; *p >= '0' && *p <= '9' && p - begin < 18; p++)
+		{
+			value = value * 10 + (*p - '0');
+		}
+		return p != begin;
+	}
+
+	// 解析部分的头, 得到这个部分在文件中的区间.
+	bool parse_header()
+	{
+		std::string::size_type pos = m_header.find(m_delimiter + "\r\n");
+		if (pos == std::string::npos)
+		{
+			return false;
+		}
+
+		std::string lower = boost::to_lower_copy(m_header.substr(pos + m_delimiter.size()));
+		pos = lower.find("\r\ncontent-range:");
+		if (pos == std::string::npos)
+		{
+			return false;
+		}
+
+		// Content-Range: bytes first-last/length
+		const char* p = lower.c_str() + pos + 16;
+		while (*p == ' ' || *p == '\t')
+		{
+			p++;
+		}
+		if (std::strncmp(p, "bytes", 5) != 0)
+		{
+			return false;
+		}
+		p += 5;
+
+		boost::int64_t first = 0;
+		boost::int64_t last = 0;
+		if (!parse_number(p, first) || *p++ != '-' || !parse_number(p, last) || last < first)
+		{
+			return false;
+		}
+
+		m_offset = first;
+		m_remain = last - first + 1;
+		m_state = state_body;
+		return true;
+	}
+
+private:
+
+	enum state
+	{
+		state_header,
+		state_body,
+		state_end
+	};
+
+	// 部分头的最大长度.
+	enum { max_header_size = 8192 };
+
+	// 分隔符, 即"--" + boundary.
+	std::string m_delimiter;
+
+	// 结束分隔符, 即m_delimiter + "--".
+	std::string m_close_delimiter;
+
+	// 正在解析的部分头.
+	std::string m_header;
+
+	// 解析状态.
+	state m_state;
+
+	// 当前部分下一个数据在文件中的偏移.
+	boost::int64_t m_offset;
+
+	// 当前部分剩余的数据大小.
+	boost::int64_t m_remain;
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_BYTERANGES_PARSER_HPP
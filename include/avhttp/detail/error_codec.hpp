@@ -72,6 +72,15 @@ enum errc_t
 	/// Invalid redirect address
 	invalid_redirect = 12,
 
+	/// Invalid piece hashes or hash manifest.
+	invalid_piece_hashes = 13,
+
+	/// The remote file changed during the download.
+	remote_file_changed = 14,
+
+	/// Invalid delta control file.
+	invalid_delta_control = 15,
+
 	// Server-generated status codes.
 
 	/// The server-generated status code "100 Continue".
@@ -274,6 +283,12 @@ class error_category_impl
 			return "Invalid chunked encoding";
 		case errc::invalid_redirect:
 			return "Invalid redirect address";
+		case errc::invalid_piece_hashes:
+			return "Invalid piece hashes";
+		case errc::remote_file_changed:
+			return "Remote file changed";
+		case errc::invalid_delta_control:
+			return "Invalid delta control file";
 		case errc::continue_request:
 			return "Continue";
 		case errc::switching_protocols:
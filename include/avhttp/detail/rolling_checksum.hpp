@@ -0,0 +1,79 @@
+﻿//
+// rolling_checksum.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_ROLLING_CHECKSUM_HPP
+#define AVHTTP_ROLLING_CHECKSUM_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstddef>
+
+#include <boost/cstdint.hpp>
+
+namespace avhttp {
+namespace detail {
+
+// rsync使用的滚动校验和, 窗口向后移动一个字节时可以在O(1)内更新.
+// @begin example
+//  avhttp::detail::rolling_checksum rc;
+//  rc.reset(data, block_size);
+//  rc.roll(data[0], data[block_size]); // 窗口变为data + 1.
+//  boost::uint32_t sum = rc.value();
+// @end example
+class rolling_checksum
+{
+public:
+
+	rolling_checksum()
+		: m_a(0)
+		, m_b(0)
+		, m_size(0)
+	{}
+
+	///计算[data, data + size)的校验和, 窗口大小即为size.
+	void reset(const char* data, std::size_t size)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		m_a = 0;
+		m_b = 0;
+		m_size = static_cast<boost::uint32_t>(size);
+		for (std::size_t i = 0; i < size; i++)
+		{
+			m_a += p[i];
+			m_b += static_cast<boost::uint32_t>(size - i) * p[i];
+		}
+	}
+
+	///窗口向后移动一个字节, out为移出窗口的字节, in为移入窗口的字节.
+	void roll(char out, char in)
+	{
+		boost::uint32_t o = static_cast<unsigned char>(out);
+		m_a += static_cast<unsigned char>(in) - o;
+		m_b += m_a - m_size * o;
+	}
+
+	///返回当前窗口的校验和.
+	boost::uint32_t value() const
+	{
+		return (m_a & 0xffff) | (m_b << 16);
+	}
+
+private:
+	boost::uint32_t m_a;
+	boost::uint32_t m_b;
+	boost::uint32_t m_size;
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_ROLLING_CHECKSUM_HPP
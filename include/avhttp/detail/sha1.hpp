@@ -0,0 +1,201 @@
+﻿//
+// sha1.hpp
+// ~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_SHA1_HPP
+#define AVHTTP_SHA1_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <string>
+#include <cstring>
+#include <algorithm>    // for std::min
+
+#include <boost/cstdint.hpp>
+
+namespace avhttp {
+namespace detail {
+
+// 按FIPS 180-1实现的sha1, 用于校验下载数据.
+// @begin example
+//  avhttp::detail::sha1 h;
+//  h.update(data, size);
+//  std::string digest = h.final(); // 20字节的二进制摘要.
+// @end example
+class sha1
+{
+public:
+
+	enum { digest_size = 20 };
+
+	sha1()
+	{
+		reset();
+	}
+
+	///重置为初始状态.
+	void reset()
+	{
+		m_state[0] = 0x67452301;
+		m_state[1] = 0xEFCDAB89;
+		m_state[2] = 0x98BADCFE;
+		m_state[3] = 0x10325476;
+		m_state[4] = 0xC3D2E1F0;
+		m_length = 0;
+	}
+
+	///添加数据.
+	void update(const char* data, std::size_t size)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		std::size_t used = static_cast<std::size_t>(m_length % 64);
+		m_length += size;
+
+		// 先填满上次剩余的块.
+		if (used != 0)
+		{
+			std::size_t n = (std::min)(size, 64 - used);
+			std::memcpy(m_block + used, p, n);
+			p += n;
+			size -= n;
+			if (used + n < 64)
+			{
+				return;
+			}
+			transform(m_block);
+		}
+
+		for (; size >= 64; p += 64, size -= 64)
+		{
+			transform(p);
+		}
+
+		if (size != 0)
+		{
+			std::memcpy(m_block, p, size);
+		}
+	}
+
+	///结束计算, 返回20字节的二进制摘要, 之后需要reset才能重新使用.
+	std::string final()
+	{
+		boost::uint64_t bits = m_length * 8;
+
+		// 填充0x80和0, 使长度模64余56, 最后8字节为数据的位长度.
+		unsigned char pad[72] = { 0x80 };
+		std::size_t used = static_cast<std::size_t>(m_length % 64);
+		std::size_t pad_size = (used < 56 ? 56 : 120) - used;
+		for (int i = 0; i < 8; i++)
+		{
+			pad[pad_size + i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+		}
+		update(reinterpret_cast<const char*>(pad), pad_size + 8);
+
+		std::string digest(digest_size, '\0');
+		for (int i = 0; i < digest_size; i++)
+		{
+			digest[i] = static_cast<char>(m_state[i / 4] >> (24 - (i % 4) * 8));
+		}
+
+		return digest;
+	}
+
+	///转换为16进制字符串.
+	static std::string to_hex(const std::string& digest)
+	{
+		static const char hex[] = "0123456789abcdef";
+		std::string result;
+		for (std::size_t i = 0; i < digest.size(); i++)
+		{
+			unsigned char c = static_cast<unsigned char>(digest[i]);
+			result += hex[c >> 4];
+			result += hex[c & 0x0f];
+		}
+		return result;
+	}
+
+private:
+
+	static boost::uint32_t rol(boost::uint32_t value, int bits)
+	{
+		return (value << bits) | (value >> (32 - bits));
+	}
+
+	void transform(const unsigned char* block)
+	{
+		boost::uint32_t w[80];
+		for (int i = 0; i < 16; i++)
+		{
+			w[i] = (boost::uint32_t(block[i * 4]) << 24)
+				| (boost::uint32_t(block[i * 4 + 1]) << 16)
+				| (boost::uint32_t(block[i * 4 + 2]) << 8)
+				| boost::uint32_t(block[i * 4 + 3]);
+		}
+		for (int i = 16; i < 80; i++)
+		{
+			w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+
+		boost::uint32_t a = m_state[0];
+		boost::uint32_t b = m_state[1];
+		boost::uint32_t c = m_state[2];
+		boost::uint32_t d = m_state[3];
+		boost::uint32_t e = m_state[4];
+
+		for (int i = 0; i < 80; i++)
+		{
+			boost::uint32_t f, k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+
+			boost::uint32_t temp = rol(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rol(b, 30);
+			b = a;
+			a = temp;
+		}
+
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+	}
+
+private:
+	boost::uint32_t m_state[5];
+	boost::uint64_t m_length;
+	unsigned char m_block[64];
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_SHA1_HPP
@@ -0,0 +1,242 @@
+﻿//
+// splice_pipe.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_SPLICE_PIPE_HPP
+#define AVHTTP_SPLICE_PIPE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstddef>
+#include <algorithm>	// for std::min
+
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/asio/error.hpp>
+
+#if defined(__linux__) && !defined(AVHTTP_DISABLE_SPLICE)
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	define AVHTTP_HAS_SPLICE 1
+#endif
+
+namespace avhttp {
+namespace detail {
+
+// 通过splice(2)在socket和文件之间移动数据的管道, 数据只在内核中传递, 不复制到用户态.
+// 先用fill把socket中的数据移入管道, 再用drain把管道中的数据写入文件的指定位置.
+// 不是linux或者定义了AVHTTP_DISABLE_SPLICE时, open总是返回operation_not_supported.
+// @begin example
+//  avhttp::detail::splice_pipe pipe;
+//  pipe.open(ec);
+//  std::size_t n = pipe.fill(socket_fd, 65536, ec);
+//  pipe.drain(file_fd, offset, n, ec);
+// @end example
+class splice_pipe : public boost::noncopyable
+{
+public:
+	enum
+	{
+		// 尝试设置的管道容量, 每次最多移动这么多数据.
+		default_capacity = 1024 * 1024
+	};
+
+	splice_pipe()
+		: m_capacity(0)
+		, m_size(0)
+	{
+		m_fds[0] = -1;
+		m_fds[1] = -1;
+	}
+
+	~splice_pipe()
+	{
+		close();
+	}
+
+	///创建管道.
+	// @返回值false表示不支持, 错误信息在ec中.
+	bool open(boost::system::error_code& ec)
+	{
+		close();
+#ifdef AVHTTP_HAS_SPLICE
+		if (::pipe2(m_fds, O_NONBLOCK | O_CLOEXEC) != 0)
+		{
+			ec.assign(errno, boost::system::system_category());
+			m_fds[0] = -1;
+			m_fds[1] = -1;
+			return false;
+		}
+
+		// 默认的管道容量只有64k, 尽量调大以减少系统调用的次数, 失败时使用默认值.
+#ifdef F_SETPIPE_SZ
+		::fcntl(m_fds[1], F_SETPIPE_SZ, static_cast<int>(default_capacity));
+#endif
+#ifdef F_GETPIPE_SZ
+		int capacity = ::fcntl(m_fds[1], F_GETPIPE_SZ);
+		m_capacity = capacity > 0 ? static_cast<std::size_t>(capacity) : 64 * 1024;
+#else
+		m_capacity = 64 * 1024;
+#endif
+		ec = boost::system::error_code();
+		return true;
+#else
+		ec = boost::asio::error::operation_not_supported;
+		return false;
+#endif
+	}
+
+	///关闭管道.
+	void close()
+	{
+#ifdef AVHTTP_HAS_SPLICE
+		for (int i = 0; i < 2; i++)
+		{
+			if (m_fds[i] != -1)
+			{
+				::close(m_fds[i]);
+				m_fds[i] = -1;
+			}
+		}
+#endif
+		m_capacity = 0;
+		m_size = 0;
+	}
+
+	///管道是否已经打开.
+	bool is_open() const
+	{
+		return m_fds[0] != -1;
+	}
+
+	///管道的容量.
+	std::size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	///管道中还没有取出的字节数.
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	///从socket中移动最多size字节的数据到管道.
+	// @返回值为移入的字节数, 为0时ec中为would_block, eof或者其它错误.
+	std::size_t fill(int fd, std::size_t size, boost::system::error_code& ec)
+	{
+#ifdef AVHTTP_HAS_SPLICE
+		ssize_t ret;
+		do
+		{
+			ret = ::splice(fd, NULL, m_fds[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				ec = boost::asio::error::would_block;
+			}
+			else
+			{
+				ec.assign(errno, boost::system::system_category());
+			}
+			return 0;
+		}
+		if (ret == 0)
+		{
+			ec = boost::asio::error::eof;
+			return 0;
+		}
+
+		ec = boost::system::error_code();
+		m_size += static_cast<std::size_t>(ret);
+		return static_cast<std::size_t>(ret);
+#else
+		ec = boost::asio::error::operation_not_supported;
+		return 0;
+#endif
+	}
+
+	///把管道中最多size字节的数据写入文件的offset位置.
+	// @返回值为写入的字节数, 小于size时ec中保存了错误信息, 没有写入的数据仍在管道中.
+	// 备注: 文件系统不支持splice时ec为EINVAL, 可以用read取出管道中的数据再写入.
+	std::size_t drain(int fd, boost::int64_t offset, std::size_t size, boost::system::error_code& ec)
+	{
+		ec = boost::system::error_code();
+		std::size_t written = 0;
+#ifdef AVHTTP_HAS_SPLICE
+		size = (std::min)(size, m_size);
+		loff_t off = static_cast<loff_t>(offset);
+		while (written < size)
+		{
+			ssize_t ret = ::splice(m_fds[0], NULL, fd, &off, size - written, SPLICE_F_MOVE);
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ret <= 0)
+			{
+				ec.assign(ret < 0 ? errno : EIO, boost::system::system_category());
+				break;
+			}
+			written += static_cast<std::size_t>(ret);
+		}
+		m_size -= written;
+#else
+		ec = boost::asio::error::operation_not_supported;
+#endif
+		return written;
+	}
+
+	///从管道中取出最多size字节的数据到buf.
+	// @返回值为取出的字节数.
+	std::size_t read(char* buf, std::size_t size)
+	{
+		std::size_t bytes = 0;
+#ifdef AVHTTP_HAS_SPLICE
+		size = (std::min)(size, m_size);
+		while (bytes < size)
+		{
+			ssize_t ret = ::read(m_fds[0], buf + bytes, size - bytes);
+			if (ret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (ret <= 0)
+			{
+				break;
+			}
+			bytes += static_cast<std::size_t>(ret);
+		}
+		m_size -= bytes;
+#endif
+		return bytes;
+	}
+
+private:
+	// 管道的读端和写端.
+	int m_fds[2];
+
+	// 管道的容量.
+	std::size_t m_capacity;
+
+	// 管道中的字节数.
+	std::size_t m_size;
+};
+
+} // namespace detail
+} // namespace avhttp
+
+#endif // AVHTTP_SPLICE_PIPE_HPP
@@ -0,0 +1,191 @@
+﻿//
+// direct_storage.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// path LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DIRECT_STORAGE_HPP
+#define AVHTTP_DIRECT_STORAGE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <map>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "avhttp/file.hpp"
+#include "avhttp/rangefield.hpp"
+#include "avhttp/default_storage.hpp"
+
+namespace avhttp {
+
+// 绕过页缓存(O_DIRECT, windows下为FILE_FLAG_NO_BUFFERING)读写文件的存储, 用于
+// 下载大文件时不挤占系统的页缓存.
+// 写入的数据先复制到按块对齐的暂存缓冲中, 一个块写满后整块写入文件; sync, close或者
+// 暂存块数超出限制时, 未写满的块先读出文件中对应的数据, 合并后整块写回.
+// 读取时按对齐的位置读取文件, 并叠加还在暂存块中的数据.
+// 文件系统不支持直接读写时, 以普通方式打开文件, 仍按块写入.
+// @begin example
+//  avhttp::settings s;
+//  s.storage = avhttp::direct_storage_constructor;
+//  d.start(url, s);
+// @end example
+class direct_storage : public storage_interface
+{
+	// 暂存块, 对应文件中[offset, offset + m_block_size)的数据.
+	struct block
+	{
+		// 块在文件中的起始位置.
+		boost::int64_t offset;
+
+		// 对齐的暂存缓冲.
+		char* data;
+
+		// 块中已经写入的区间, 相对于块的起始位置.
+		rangefield written;
+
+		// 最后一次写入的序号, 用于选出最久未写入的块.
+		boost::uint64_t last_use;
+	};
+	typedef std::map<boost::int64_t, block> block_map;
+
+public:
+
+	enum
+	{
+		// 暂存块大小, 打开文件后向上对齐到文件的对齐要求.
+		default_block_size = 1024 * 1024,
+
+		// 最多同时暂存的块数.
+		default_max_blocks = 32
+	};
+
+	/// Constructor.
+	// @param block_size指定暂存块的大小.
+	// @param max_blocks指定最多同时暂存的块数.
+	AVHTTP_DECL explicit direct_storage(std::size_t block_size = default_block_size,
+		std::size_t max_blocks = default_max_blocks);
+
+	/// Destructor.
+	AVHTTP_DECL virtual ~direct_storage();
+
+	// 存储组件初始化.
+	// @param file_path指定了文件名路径信息.
+	// @param ec在出错时保存了详细的错误信息.
+	AVHTTP_DECL virtual void open(const fs::path& file_path, boost::system::error_code& ec);
+
+	// 关闭存储组件, 写入所有暂存的数据.
+	AVHTTP_DECL virtual void close();
+
+	// 在当前位置写入数据.
+	AVHTTP_DECL virtual std::streamsize write(const char* buf, int size);
+
+	// 写入数据.
+	// @param buf是需要写入的数据缓冲.
+	// @param offset是写入的偏移位置.
+	// @param size指定了写入的数据缓冲大小.
+	// @返回值为实际写入的字节数, 返回-1表示写入失败.
+	AVHTTP_DECL virtual std::streamsize write(const char* buf, boost::int64_t offset, int size);
+
+	// 在当前位置读取数据.
+	AVHTTP_DECL virtual std::streamsize read(char* buf, int size);
+
+	// 读取数据.
+	// @param buf是需要读取的数据缓冲.
+	// @param offset是读取的偏移位置.
+	// @param size指定了读取的数据缓冲大小.
+	// @返回值为实际读取的字节数, 返回-1表示读取失败.
+	AVHTTP_DECL virtual std::streamsize read(char* buf, boost::int64_t offset, int size);
+
+	// 判断是否文件结束.
+	AVHTTP_DECL virtual bool eof();
+
+	// 写入所有暂存的数据并同步到磁盘.
+	// @返回值true表示同步成功.
+	AVHTTP_DECL virtual bool sync();
+
+	// 设置文件大小.
+	// @param size是文件大小.
+	// @param ec在出错时保存了详细的错误信息.
+	AVHTTP_DECL virtual void allocate(boost::int64_t size, boost::system::error_code& ec);
+
+	// 查找offset之后的第一个文件空洞, 续传时使用, 不考虑暂存块中的数据.
+	AVHTTP_DECL virtual bool find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right);
+
+	///文件是否以直接读写方式打开.
+	AVHTTP_DECL bool is_direct() const;
+
+private:
+
+	// 返回offset所在的暂存块, 不存在时创建, 必要时先写出最久未写入的块.
+	AVHTTP_DECL block* stage(boost::int64_t offset);
+
+	// 将暂存块整块写入文件, 未写满的块先读出文件中的数据合并.
+	AVHTTP_DECL bool flush_block(block& b);
+
+	// 写出所有暂存块.
+	AVHTTP_DECL bool flush_all();
+
+	// 返回块在文件中的有效长度.
+	AVHTTP_DECL std::size_t block_length(const block& b) const;
+
+	// 以对齐的位置和长度读取文件中[offset, offset + size)的数据到buf, 超过文件尾的部分填0.
+	AVHTTP_DECL bool read_aligned(char* buf, boost::int64_t offset, std::size_t size);
+
+	// 从缓冲池中分配或者释放一个对齐的块缓冲.
+	AVHTTP_DECL char* alloc_buffer();
+	AVHTTP_DECL void free_buffer(char* buffer);
+
+private:
+	file m_file;
+
+	// 暂存块的大小及最大块数.
+	std::size_t m_block_size;
+	std::size_t m_max_blocks;
+
+	// 文件的对齐要求.
+	std::size_t m_alignment;
+
+	// 文件大小, 由allocate指定, 否则为已经写入的最大位置.
+	boost::int64_t m_size;
+	bool m_allocated;
+
+	// 顺序读写的位置.
+	boost::int64_t m_offset;
+
+	// 暂存块.
+	block_map m_blocks;
+	boost::uint64_t m_use_count;
+
+	// 空闲的对齐缓冲.
+	std::vector<char*> m_free_buffers;
+
+	// 读取及合并未写满的块时使用的对齐缓冲.
+	char* m_bounce;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// multi_download在单独的线程中调用sync, 可能与write同时执行.
+	boost::mutex m_mutex;
+#endif
+};
+
+// 直接读写存储对象.
+inline storage_interface* direct_storage_constructor()
+{
+	return new direct_storage();
+}
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/direct_storage.ipp"
+#endif
+
+#endif // AVHTTP_DIRECT_STORAGE_HPP
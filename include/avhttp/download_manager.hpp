@@ -0,0 +1,223 @@
+﻿//
+// download_manager.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DOWNLOAD_MANAGER_HPP
+#define AVHTTP_DOWNLOAD_MANAGER_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+#include <map>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#ifndef AVHTTP_DISABLE_THREAD
+#	include <boost/thread/mutex.hpp>
+#endif
+
+#include "avhttp/settings.hpp"
+#include "avhttp/io_service_pool.hpp"
+#include "avhttp/multi_download.hpp"
+
+
+namespace avhttp {
+
+// 一些默认的值.
+static const int default_total_connections_limit = 100;
+static const int default_host_connections_limit = 16;
+
+// 管理多个multi_download的下载队列.
+// 所有下载由一个共享的定时器统一驱动, download_manager每秒按优先级在各下载
+// 之间分配全局连接数, 同时保证每个主机的连接数不超过限制, 并把全局限速按连
+// 接数分配给各下载. 调整优先级后, 连接会在下一次tick时从低优先级的下载转移到
+// 高优先级的下载.
+// @begin example
+//  avhttp::download_manager m(io_service);
+//  m.connections_limit(50);
+//  m.per_host_connections_limit(8);
+//  int id = m.add("http://www.boost.org/LICENSE_1_0.txt");
+//  m.priority(id, 10);
+//  m.start();
+//  io_service.run();
+// @end example
+class download_manager : public boost::noncopyable
+{
+	// 下载任务.
+	struct download_item;
+	typedef boost::shared_ptr<download_item> download_item_ptr;
+
+public:
+
+	// 重定义multi_download_ptr指针.
+	typedef boost::shared_ptr<multi_download> multi_download_ptr;
+
+	// 下载任务的状态.
+	enum download_state
+	{
+		// 排队等待连接数额.
+		queued,
+
+		// 正在下载.
+		running,
+
+		// 下载已经完成或出错终止, 出错时可以通过error得到错误信息.
+		finished
+	};
+
+	/// Constructor.
+	AVHTTP_DECL explicit download_manager(boost::asio::io_service& io);
+
+#ifndef AVHTTP_DISABLE_THREAD
+	/// Constructor.
+	// @param pool指定的io_service池, 所有下载的连接都从池中分配io_service.
+	// @备注: 由用户负责调用pool.run()运行io_service池, 并保证pool的生命期
+	// 长于download_manager.
+	AVHTTP_DECL explicit download_manager(io_service_pool& pool);
+#endif
+
+	/// Destructor.
+	AVHTTP_DECL ~download_manager();
+
+public:
+
+	///添加一个下载任务到队列.
+	// @param u 将要下载的URL.
+	// @param s 下载设置参数信息, 其中connections_limit为该下载最多使用的连接数,
+	//          download_rate_limit为该下载自身的限速.
+	// @param priority 优先级, 数值越大优先级越高, 相同优先级按添加顺序.
+	// @返回下载任务的id.
+	AVHTTP_DECL int add(const std::string& u,
+		const settings& s = settings(), int priority = 0);
+
+	///从队列中删除下载任务, 正在下载的任务将被停止.
+	AVHTTP_DECL void remove(int id);
+
+	///设置下载任务的优先级, 将在下一次tick时重新分配连接.
+	AVHTTP_DECL void priority(int id, int priority);
+
+	///返回下载任务的优先级.
+	AVHTTP_DECL int priority(int id) const;
+
+	///返回下载任务的状态.
+	AVHTTP_DECL download_state state(int id) const;
+
+	///返回下载任务出错时的错误信息.
+	AVHTTP_DECL boost::system::error_code error(int id) const;
+
+	///返回下载任务对应的multi_download, 用于查询下载进度及读取数据.
+	// @备注: 返回的对象由download_manager驱动, 不要调用它的start和stop.
+	AVHTTP_DECL multi_download_ptr download(int id) const;
+
+	///设置全局连接数限制, -1为无限制.
+	AVHTTP_DECL void connections_limit(int limit);
+
+	///返回全局连接数限制.
+	AVHTTP_DECL int connections_limit() const;
+
+	///设置每个主机的连接数限制, -1为无限制.
+	AVHTTP_DECL void per_host_connections_limit(int limit);
+
+	///返回每个主机的连接数限制.
+	AVHTTP_DECL int per_host_connections_limit() const;
+
+	///设置全局下载速率, -1为无限制, 单位byte/s.
+	AVHTTP_DECL void download_rate_limit(int rate);
+
+	///返回全局限速.
+	AVHTTP_DECL int download_rate_limit() const;
+
+	///所有下载的速率总和, 单位byte/s.
+	AVHTTP_DECL int download_rate() const;
+
+	///开始调度队列中的下载任务.
+	AVHTTP_DECL void start();
+
+	///停止所有下载任务, 正在下载的任务重新回到排队状态, 再次start时继续下载.
+	AVHTTP_DECL void stop();
+
+	///是否所有下载都已经停止.
+	// @备注: 必须保证在析构前已经处于停止状态.
+	AVHTTP_DECL bool stopped() const;
+
+protected:
+
+	AVHTTP_DECL void on_tick(const boost::system::error_code& e);
+
+	AVHTTP_DECL void handle_start(download_item_ptr item,
+		const boost::system::error_code& ec);
+
+	AVHTTP_DECL void handle_tick(download_item_ptr item);
+
+private:
+
+	// 按优先级分配连接数并启动排队中的下载, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL void schedule();
+
+	// 投递一次tick到下载自己的io_service中执行, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL void post_tick(download_item_ptr item);
+
+	// 停止一个正在下载的任务, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL void stop_download(download_item_ptr item);
+
+	// 根据id查找下载任务, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL download_item_ptr find(int id) const;
+
+private:
+
+	// io_service引用.
+	boost::asio::io_service& m_io_service;
+
+	// io_service池, 为空时所有下载使用m_io_service.
+	io_service_pool* m_io_service_pool;
+
+	// 按添加顺序保存的下载任务.
+	std::vector<download_item_ptr> m_downloads;
+
+	// 已经删除但尚未完全停止的下载任务, 必须等到停止后才能释放.
+	std::vector<download_item_ptr> m_removed;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面的成员以及下载任务.
+	mutable boost::mutex m_mutex;
+#endif
+
+	// 下一个下载任务的id.
+	int m_next_id;
+
+	// 全局连接数限制.
+	int m_connections_limit;
+
+	// 每个主机的连接数限制.
+	int m_host_connections_limit;
+
+	// 全局下载速率限制.
+	int m_download_rate_limit;
+
+	// 共享的定时器, 驱动所有下载的tick.
+	boost::asio::deadline_timer m_timer;
+
+	// 定时器是否在等待中.
+	bool m_timer_pending;
+
+	// 是否中止工作.
+	bool m_abort;
+};
+
+} // avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/download_manager.ipp"
+#endif
+
+#endif // AVHTTP_DOWNLOAD_MANAGER_HPP
@@ -43,6 +43,15 @@ public:
 		attribute_mask = attribute_hidden | attribute_executable
 	};
 
+	// readv/writev的flags.
+	// 支持pwritev2的linux上直接转换为RWF_DSYNC/RWF_HIPRI传给内核, 其它posix系统
+	// 上io_dsync在写入后调用fdatasync, io_hipri被忽略. windows下忽略flags.
+	enum
+	{
+		io_dsync = 1,
+		io_hipri = 2
+	};
+
 #ifdef WIN32
 	struct iovec_t
 	{
@@ -97,8 +106,14 @@ public:
 	AVHTTP_DECL size_type write(size_type offset, const char* buf, int size);
 	AVHTTP_DECL size_type read(size_type offset, char* buf, int size);
 
-	AVHTTP_DECL size_type writev(size_type file_offset, iovec_t const* bufs, int num_bufs, boost::system::error_code& ec);
-	AVHTTP_DECL size_type readv(size_type file_offset, iovec_t const* bufs, int num_bufs, boost::system::error_code& ec);
+	// file_offset为-1时从当前文件指针处读写并移动文件指针, 否则在file_offset处读写.
+	// posix下定位读写使用preadv/pwritev, 不依赖也不改变文件指针, 所以多个线程可以
+	// 同时对同一个file进行定位读写(写入的区域不重叠时互不影响), 但不能与使用文件
+	// 指针的读写, offset(), open/close等同时调用.
+	AVHTTP_DECL size_type writev(size_type file_offset, iovec_t const* bufs, int num_bufs,
+		boost::system::error_code& ec, int flags = 0);
+	AVHTTP_DECL size_type readv(size_type file_offset, iovec_t const* bufs, int num_bufs,
+		boost::system::error_code& ec, int flags = 0);
 
 	AVHTTP_DECL bool flush();
 
@@ -111,6 +126,12 @@ public:
 	// belongs to a data-region
 	AVHTTP_DECL size_type sparse_end(size_type start) const;
 
+	// return the offset of the first byte at or after
+	// start that belongs to a hole, the end of the file
+	// counts as a hole. Like sparse_end, this may move
+	// the file pointer on posix
+	AVHTTP_DECL size_type data_end(size_type start) const;
+
 	AVHTTP_DECL size_type phys_offset(size_type offset);
 
 #ifdef WIN32
@@ -553,6 +553,16 @@ public:
 	// @content_length信息, 如果没有则为-1.
 	AVHTTP_DECL boost::int64_t content_length();
 
+	///返回可以直接读取body原始数据的socket.
+	// @返回NULL表示body只能通过read_some/async_read_some读取: 连接使用了ssl, body使用了
+	// gzip或者chunked编码, 或者接收缓冲中还有没有读取的数据.
+	// @备注: 绕过http_stream直接从socket读取body之后, 必须调用consume_body更新读取的字节数,
+	// 否则在keep-alive连接上无法判断body是否已经读取完成.
+	AVHTTP_DECL tcp::socket* raw_body_socket();
+
+	///直接从socket读取了bytes字节的body之后, 更新已经读取的body字节数.
+	AVHTTP_DECL void consume_body(std::size_t bytes);
+
 	///设置是否认证服务器证书.
 	// @param is_check 如果为true表示认证服务器证书, 如果为false表示不认证服务器证书.
 	// 默认为认证服务器证书.
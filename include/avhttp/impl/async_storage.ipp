@@ -0,0 +1,248 @@
+﻿//
+// impl/async_storage.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_ASYNC_STORAGE_IPP
+#define AVHTTP_ASYNC_STORAGE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <limits>
+#include <algorithm>    // for std::min
+
+#include <boost/bind.hpp>
+#include <boost/assert.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "avhttp/async_storage.hpp"
+
+namespace avhttp {
+
+storage_adapter::storage_adapter(storage_interface* storage)
+	: m_storage(storage)
+	, m_io_service(NULL)
+{
+	BOOST_ASSERT(m_storage);
+}
+
+storage_adapter::~storage_adapter()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	// 先停止后台线程, 再删除原存储.
+	m_pool.reset();
+#endif
+}
+
+storage_interface* storage_adapter::get() const
+{
+	return m_storage.get();
+}
+
+void storage_adapter::open(const fs::path& file_path, const storage_hints& hints,
+	boost::system::error_code& ec)
+{
+	m_io_service = hints.io_service;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	m_storage->open(file_path, ec);
+}
+
+void storage_adapter::close()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	m_storage->close();
+}
+
+void storage_adapter::async_write(boost::int64_t offset, const const_buffers_type& buffers,
+	io_handler_type handler)
+{
+	work_io_service().post(boost::bind(&storage_adapter::handle_write,
+		this, offset, buffers, handler));
+}
+
+void storage_adapter::async_read(boost::int64_t offset, const mutable_buffers_type& buffers,
+	io_handler_type handler)
+{
+	work_io_service().post(boost::bind(&storage_adapter::handle_read,
+		this, offset, buffers, handler));
+}
+
+void storage_adapter::async_flush(completion_handler_type handler)
+{
+	// 异步操作在一个线程中按顺序执行, 排在之后执行即可.
+	work_io_service().post(boost::bind(handler, boost::system::error_code()));
+}
+
+void storage_adapter::async_sync(completion_handler_type handler)
+{
+	work_io_service().post(boost::bind(&storage_adapter::handle_sync, this, handler));
+}
+
+std::size_t storage_adapter::write(boost::int64_t offset, const const_buffers_type& buffers,
+	boost::system::error_code& ec)
+{
+	ec = boost::system::error_code();
+	std::size_t written = 0;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	for (const_buffers_type::const_iterator i = buffers.begin(); i != buffers.end(); i++)
+	{
+		const char* data = boost::asio::buffer_cast<const char*>(*i);
+		std::size_t size = boost::asio::buffer_size(*i);
+
+		// storage_interface每次最多写入int能表示的大小.
+		while (size > 0)
+		{
+			int bytes = static_cast<int>((std::min)(size,
+				static_cast<std::size_t>((std::numeric_limits<int>::max)())));
+			std::streamsize ret = m_storage->write(data, offset + written, bytes);
+			if (ret != bytes)
+			{
+				written += ret > 0 ? static_cast<std::size_t>(ret) : 0;
+				ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+				return written;
+			}
+			data += bytes;
+			size -= bytes;
+			written += bytes;
+		}
+	}
+
+	return written;
+}
+
+std::size_t storage_adapter::read(boost::int64_t offset, const mutable_buffers_type& buffers,
+	boost::system::error_code& ec)
+{
+	ec = boost::system::error_code();
+	std::size_t bytes_read = 0;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	for (mutable_buffers_type::const_iterator i = buffers.begin(); i != buffers.end(); i++)
+	{
+		char* data = boost::asio::buffer_cast<char*>(*i);
+		std::size_t size = boost::asio::buffer_size(*i);
+
+		while (size > 0)
+		{
+			int bytes = static_cast<int>((std::min)(size,
+				static_cast<std::size_t>((std::numeric_limits<int>::max)())));
+			std::streamsize ret = m_storage->read(data, offset + bytes_read, bytes);
+			if (ret < 0)
+			{
+				ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+				return bytes_read;
+			}
+			bytes_read += static_cast<std::size_t>(ret);
+
+			// 读到文件尾.
+			if (ret != bytes)
+			{
+				return bytes_read;
+			}
+			data += bytes;
+			size -= bytes;
+		}
+	}
+
+	return bytes_read;
+}
+
+void storage_adapter::sync(boost::system::error_code& ec)
+{
+	// 与storage_interface::sync的约定相同, 不锁定, 可以与写入同时执行.
+	ec = boost::system::error_code();
+	if (!m_storage->sync())
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+	}
+}
+
+void storage_adapter::allocate(boost::int64_t size, boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	m_storage->allocate(size, ec);
+}
+
+bool storage_adapter::find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	return m_storage->find_hole(offset, left, right);
+}
+
+int storage_adapter::native_handle()
+{
+	return m_storage->native_handle();
+}
+
+boost::shared_ptr<const char> storage_adapter::view(boost::int64_t offset,
+	std::size_t size, std::size_t& length)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	return m_storage->view(offset, size, length);
+}
+
+void storage_adapter::handle_write(boost::int64_t offset, const_buffers_type buffers,
+	io_handler_type handler)
+{
+	boost::system::error_code ec;
+	std::size_t bytes = write(offset, buffers, ec);
+	handler(ec, bytes);
+}
+
+void storage_adapter::handle_read(boost::int64_t offset, mutable_buffers_type buffers,
+	io_handler_type handler)
+{
+	boost::system::error_code ec;
+	std::size_t bytes = read(offset, buffers, ec);
+	handler(ec, bytes);
+}
+
+void storage_adapter::handle_sync(completion_handler_type handler)
+{
+	boost::system::error_code ec;
+	sync(ec);
+	handler(ec);
+}
+
+boost::asio::io_service& storage_adapter::work_io_service()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_pool_mutex);
+	if (!m_pool)
+	{
+		m_pool.reset(new io_service_pool(1));
+		m_pool->run();
+	}
+	return m_pool->get_io_service();
+#else
+	BOOST_ASSERT(m_io_service && "open must be given an io_service when threads are disabled.");
+	return *m_io_service;
+#endif
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_ASYNC_STORAGE_IPP
@@ -0,0 +1,375 @@
+﻿//
+// impl/delta_control.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DELTA_CONTROL_IPP
+#define AVHTTP_DELTA_CONTROL_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+
+#include <boost/filesystem/fstream.hpp>
+
+#include "avhttp/delta_control.hpp"
+#include "avhttp/file.hpp"
+#include "avhttp/entry.hpp"
+#include "avhttp/bencode.hpp"
+#include "avhttp/detail/sha1.hpp"
+#include "avhttp/detail/rolling_checksum.hpp"
+#include "avhttp/detail/error_codec.hpp"
+
+namespace avhttp {
+
+namespace detail {
+
+// 每个块在控制文件中占用的字节数, 4字节的滚动校验和与20字节的sha1.
+static const int delta_checksum_size = 4 + sha1::digest_size;
+
+// 扫描旧文件时每次读取的大小.
+static const int delta_read_size = 1024 * 1024;
+
+inline std::string delta_sha1(const char* data, std::size_t size)
+{
+	sha1 h;
+	h.update(data, size);
+	return h.final();
+}
+
+} // namespace detail
+
+delta_control::delta_control()
+	: m_block_size(0)
+	, m_length(0)
+{}
+
+delta_control::~delta_control()
+{}
+
+void delta_control::create(const fs::path& file_path, int block_size, boost::system::error_code& ec)
+{
+	m_block_size = 0;
+	m_length = 0;
+	m_weak.clear();
+	m_strong.clear();
+	m_lookup.clear();
+
+	if (block_size <= 0)
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		return;
+	}
+
+	file f;
+	f.open(file_path, file::read_only, ec);
+	if (ec)
+	{
+		return;
+	}
+
+	boost::int64_t size = f.get_size(ec);
+	if (ec)
+	{
+		return;
+	}
+
+	m_block_size = block_size;
+	m_length = size;
+
+	std::vector<char> buffer(block_size);
+	detail::rolling_checksum rc;
+	for (int index = 0; index < block_num(); index++)
+	{
+		int length = static_cast<int>(block_length(index));
+		boost::int64_t offset = static_cast<boost::int64_t>(index) * m_block_size;
+		if (f.read(offset, &buffer[0], length) != length)
+		{
+			ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+			return;
+		}
+
+		rc.reset(&buffer[0], length);
+		m_weak.push_back(rc.value());
+		m_strong.push_back(detail::delta_sha1(&buffer[0], length));
+	}
+
+	build_lookup();
+}
+
+void delta_control::load(const fs::path& file_path, boost::system::error_code& ec)
+{
+	m_block_size = 0;
+	m_length = 0;
+	m_weak.clear();
+	m_strong.clear();
+	m_lookup.clear();
+
+	fs::ifstream control(file_path, std::ios::in | std::ios::binary);
+	if (!control.is_open())
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+		return;
+	}
+	std::vector<char> buffer((std::istreambuf_iterator<char>(control)),
+		std::istreambuf_iterator<char>());
+
+	entry e = bdecode(buffer.begin(), buffer.end());
+	entry* block_size = e.type() == entry::dictionary_t ? e.find_key("block size") : NULL;
+	entry* length = e.type() == entry::dictionary_t ? e.find_key("length") : NULL;
+	entry* checksums = e.type() == entry::dictionary_t ? e.find_key("checksums") : NULL;
+	if (!block_size || !length || !checksums || block_size->type() != entry::int_t
+		|| length->type() != entry::int_t || checksums->type() != entry::string_t
+		|| block_size->integer() <= 0 || block_size->integer() > 0x7fffffff
+		|| length->integer() < 0)
+	{
+		ec = errc::invalid_delta_control;
+		return;
+	}
+
+	m_block_size = static_cast<int>(block_size->integer());
+	m_length = length->integer();
+
+	const std::string& data = checksums->string();
+	if (data.size() != static_cast<std::size_t>(block_num()) * detail::delta_checksum_size)
+	{
+		m_block_size = 0;
+		m_length = 0;
+		ec = errc::invalid_delta_control;
+		return;
+	}
+
+	for (std::size_t i = 0; i < data.size(); i += detail::delta_checksum_size)
+	{
+		boost::uint32_t weak = 0;
+		for (int j = 0; j < 4; j++)
+		{
+			weak = (weak << 8) | static_cast<unsigned char>(data[i + j]);
+		}
+		m_weak.push_back(weak);
+		m_strong.push_back(data.substr(i + 4, detail::sha1::digest_size));
+	}
+
+	build_lookup();
+}
+
+void delta_control::save(const fs::path& file_path, boost::system::error_code& ec) const
+{
+	std::string checksums;
+	for (std::size_t i = 0; i < m_weak.size(); i++)
+	{
+		for (int j = 3; j >= 0; j--)
+		{
+			checksums += static_cast<char>((m_weak[i] >> (j * 8)) & 0xff);
+		}
+		checksums += m_strong[i];
+	}
+
+	entry e;
+	e["block size"] = m_block_size;
+	e["length"] = m_length;
+	e["checksums"] = checksums;
+
+	std::vector<char> buffer;
+	bencode(std::back_inserter(buffer), e);
+
+	fs::ofstream control(file_path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (buffer.empty() || !control.write(&buffer[0], buffer.size()))
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+	}
+}
+
+void delta_control::match(const fs::path& seed_path,
+	const match_handler& handler, boost::system::error_code& ec) const
+{
+	if (m_block_size <= 0 || m_weak.empty())
+	{
+		return;
+	}
+
+	file f;
+	f.open(seed_path, file::read_only, ec);
+	if (ec)
+	{
+		return;
+	}
+
+	boost::int64_t size = f.get_size(ec);
+	if (ec)
+	{
+		return;
+	}
+
+	std::vector<bool> found(m_weak.size(), false);
+	std::size_t block_size = static_cast<std::size_t>(m_block_size);
+
+	// 逐字节移动窗口, 窗口的滚动校验和与某个块相同时再比较sha1, 找到相同的块
+	// 之后跳过整个窗口. buffer中保存文件[base, base + length)的数据.
+	std::vector<char> buffer(block_size + (std::max)(block_size, std::size_t(detail::delta_read_size)));
+	boost::int64_t base = 0;
+	std::size_t length = 0;
+	boost::int64_t pos = 0;
+	bool reset = true;
+	detail::rolling_checksum rc;
+
+	// 还没有找到的完整大小的块数, 全部找到后不再扫描.
+	std::size_t remain = m_lookup.size();
+
+	while (remain != 0 && pos + m_block_size <= size)
+	{
+		// 保证buffer中有窗口以及窗口之后的一个字节.
+		boost::int64_t need = (std::min)(pos + m_block_size + 1, size);
+		if (need > base + static_cast<boost::int64_t>(length))
+		{
+			std::size_t keep = length - static_cast<std::size_t>(pos - base);
+			std::memmove(&buffer[0], &buffer[static_cast<std::size_t>(pos - base)], keep);
+			base = pos;
+			length = keep;
+
+			int bytes = static_cast<int>((std::min)(
+				static_cast<boost::int64_t>(buffer.size() - length), size - (base + static_cast<boost::int64_t>(length))));
+			if (f.read(base + length, &buffer[length], bytes) != bytes)
+			{
+				ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+				return;
+			}
+			length += bytes;
+		}
+
+		const char* window = &buffer[static_cast<std::size_t>(pos - base)];
+		if (reset)
+		{
+			rc.reset(window, block_size);
+			reset = false;
+		}
+
+		// 滚动校验和相同的块可能有多个, 内容相同的块都使用这个窗口的数据.
+		bool matched = false;
+		std::vector<std::pair<boost::uint32_t, int> >::const_iterator i =
+			std::lower_bound(m_lookup.begin(), m_lookup.end(), std::make_pair(rc.value(), 0));
+		std::string digest;
+		for (; i != m_lookup.end() && i->first == rc.value(); ++i)
+		{
+			if (digest.empty())
+			{
+				digest = detail::delta_sha1(window, block_size);
+			}
+			if (m_strong[i->second] != digest)
+			{
+				continue;
+			}
+			matched = true;
+			if (!found[i->second])
+			{
+				found[i->second] = true;
+				remain--;
+				handler(static_cast<boost::int64_t>(i->second) * m_block_size, window, block_size);
+			}
+		}
+
+		if (matched)
+		{
+			pos += m_block_size;
+			reset = true;
+			continue;
+		}
+
+		if (pos + m_block_size >= size)
+		{
+			break;
+		}
+		rc.roll(window[0], window[block_size]);
+		pos++;
+	}
+
+	// 最后一个块不足block_size时不参与滚动查找, 只检查旧文件的末尾以及相同的位置.
+	int last = block_num() - 1;
+	std::size_t last_length = block_length(last);
+	if (last_length != block_size && !found[last] && size >= static_cast<boost::int64_t>(last_length))
+	{
+		boost::int64_t offsets[2] = { size - static_cast<boost::int64_t>(last_length),
+			static_cast<boost::int64_t>(last) * m_block_size };
+		for (int n = 0; n < 2 && !found[last]; n++)
+		{
+			if (offsets[n] + static_cast<boost::int64_t>(last_length) > size)
+			{
+				continue;
+			}
+			if (f.read(offsets[n], &buffer[0], static_cast<int>(last_length))
+				!= static_cast<int>(last_length))
+			{
+				ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+				return;
+			}
+			check_block(last, &buffer[0], last_length, found, handler);
+		}
+	}
+}
+
+int delta_control::block_size() const
+{
+	return m_block_size;
+}
+
+boost::int64_t delta_control::length() const
+{
+	return m_length;
+}
+
+int delta_control::block_num() const
+{
+	if (m_block_size <= 0)
+	{
+		return 0;
+	}
+	return static_cast<int>((m_length + m_block_size - 1) / m_block_size);
+}
+
+void delta_control::build_lookup()
+{
+	m_lookup.clear();
+	for (int i = 0; i < static_cast<int>(m_weak.size()); i++)
+	{
+		if (block_length(i) == static_cast<std::size_t>(m_block_size))
+		{
+			m_lookup.push_back(std::make_pair(m_weak[i], i));
+		}
+	}
+	std::sort(m_lookup.begin(), m_lookup.end());
+}
+
+std::size_t delta_control::block_length(int index) const
+{
+	boost::int64_t offset = static_cast<boost::int64_t>(index) * m_block_size;
+	return static_cast<std::size_t>((std::min)(
+		static_cast<boost::int64_t>(m_block_size), m_length - offset));
+}
+
+bool delta_control::check_block(int index, const char* data, std::size_t size,
+	std::vector<bool>& found, const match_handler& handler) const
+{
+	detail::rolling_checksum rc;
+	rc.reset(data, size);
+	if (rc.value() != m_weak[index] || detail::delta_sha1(data, size) != m_strong[index])
+	{
+		return false;
+	}
+
+	found[index] = true;
+	handler(static_cast<boost::int64_t>(index) * m_block_size, data, size);
+	return true;
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_DELTA_CONTROL_IPP
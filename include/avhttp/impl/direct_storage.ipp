@@ -0,0 +1,491 @@
+﻿//
+// impl/direct_storage.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DIRECT_STORAGE_IPP
+#define AVHTTP_DIRECT_STORAGE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <new>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>    // for std::min/std::max
+
+#ifdef WIN32
+#	include <malloc.h>
+#endif
+
+#include "avhttp/direct_storage.hpp"
+#include "avhttp/logging.hpp"
+
+namespace avhttp {
+namespace detail {
+
+inline void* aligned_malloc(std::size_t size, std::size_t alignment)
+{
+#ifdef WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* buffer = NULL;
+	if (posix_memalign(&buffer, alignment, size) != 0)
+	{
+		return NULL;
+	}
+	return buffer;
+#endif
+}
+
+inline void aligned_free(void* buffer)
+{
+#ifdef WIN32
+	_aligned_free(buffer);
+#else
+	std::free(buffer);
+#endif
+}
+
+} // namespace detail
+
+direct_storage::direct_storage(std::size_t block_size, std::size_t max_blocks)
+	: m_block_size(block_size)
+	, m_max_blocks((std::max)(max_blocks, std::size_t(1)))
+	, m_alignment(4096)
+	, m_size(0)
+	, m_allocated(false)
+	, m_offset(0)
+	, m_use_count(0)
+	, m_bounce(NULL)
+{}
+
+direct_storage::~direct_storage()
+{
+	close();
+	for (std::size_t i = 0; i < m_free_buffers.size(); i++)
+	{
+		detail::aligned_free(m_free_buffers[i]);
+	}
+}
+
+void direct_storage::open(const fs::path& file_path, boost::system::error_code& ec)
+{
+	m_file.open(file_path, file::read_write | file::no_buffer, ec);
+	if (ec)
+	{
+		return;
+	}
+
+	// 缓冲至少按页面对齐, 块大小按文件的对齐要求向上取整.
+	std::size_t alignment = (std::max)(m_alignment, static_cast<std::size_t>((std::max)(
+		m_file.pos_alignment(), (std::max)(m_file.buf_alignment(), m_file.size_alignment()))));
+	std::size_t block_size = (m_block_size + alignment - 1) / alignment * alignment;
+	if (alignment != m_alignment || block_size != m_block_size)
+	{
+		// 缓冲池中的缓冲不再满足要求.
+		for (std::size_t i = 0; i < m_free_buffers.size(); i++)
+		{
+			detail::aligned_free(m_free_buffers[i]);
+		}
+		m_free_buffers.clear();
+		m_alignment = alignment;
+		m_block_size = block_size;
+	}
+
+	if (!is_direct())
+	{
+		AVHTTP_LOG_DBG << "Direct I/O is not supported for \'" << file_path << "\'.";
+	}
+
+	m_size = m_file.get_size(ec);
+	if (ec)
+	{
+		m_file.close();
+		return;
+	}
+	m_allocated = false;
+	m_offset = 0;
+
+	if (!m_bounce)
+	{
+		m_bounce = alloc_buffer();
+	}
+}
+
+void direct_storage::close()
+{
+	if (!m_file.is_open())
+	{
+		return;
+	}
+
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_mutex);
+#endif
+		if (!flush_all())
+		{
+			AVHTTP_LOG_ERR << "Flush direct storage failed when closing.";
+		}
+	}
+
+	if (m_bounce)
+	{
+		free_buffer(m_bounce);
+		m_bounce = NULL;
+	}
+	m_file.close();
+}
+
+std::streamsize direct_storage::write(const char* buf, int size)
+{
+	std::streamsize ret = write(buf, m_offset, size);
+	if (ret > 0)
+	{
+		m_offset += ret;
+	}
+	return ret;
+}
+
+std::streamsize direct_storage::write(const char* buf, boost::int64_t offset, int size)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	if (offset < 0 || size < 0)
+	{
+		return -1;
+	}
+	m_size = (std::max)(m_size, offset + size);
+
+	int written = 0;
+	while (written < size)
+	{
+		block* b = stage(offset + written);
+		if (!b)
+		{
+			return -1;
+		}
+
+		std::size_t pos = static_cast<std::size_t>(offset + written - b->offset);
+		std::size_t bytes = (std::min)(static_cast<std::size_t>(size - written), m_block_size - pos);
+		std::memcpy(b->data + pos, buf + written, bytes);
+		b->written.update(pos, pos + bytes);
+		b->last_use = ++m_use_count;
+		written += static_cast<int>(bytes);
+
+		// 块已经写满, 整块写入文件. 文件大小未知时, 最后一个块在写出时才确定长度.
+		std::size_t capacity = m_allocated ? block_length(*b) : m_block_size;
+		if (b->written.range_size() >= static_cast<boost::int64_t>(capacity))
+		{
+			boost::int64_t base = b->offset;
+			bool ok = flush_block(*b);
+			free_buffer(b->data);
+			m_blocks.erase(base);
+			if (!ok)
+			{
+				return -1;
+			}
+		}
+	}
+
+	return written;
+}
+
+std::streamsize direct_storage::read(char* buf, int size)
+{
+	std::streamsize ret = read(buf, m_offset, size);
+	if (ret > 0)
+	{
+		m_offset += ret;
+	}
+	return ret;
+}
+
+std::streamsize direct_storage::read(char* buf, boost::int64_t offset, int size)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	if (offset < 0 || size < 0)
+	{
+		return -1;
+	}
+
+	// 与读取文件一样, 超过文件尾的部分不读取.
+	if (offset >= m_size)
+	{
+		return 0;
+	}
+	if (size > m_size - offset)
+	{
+		size = static_cast<int>(m_size - offset);
+	}
+
+	if (!read_aligned(buf, offset, size))
+	{
+		return -1;
+	}
+
+	// 叠加还在暂存块中的数据.
+	boost::int64_t end = offset + size;
+	block_map::iterator i = m_blocks.lower_bound(offset - offset % m_block_size);
+	for (; i != m_blocks.end() && i->first < end; ++i)
+	{
+		std::vector<range> ranges;
+		i->second.written.ranges(ranges);
+		for (std::size_t k = 0; k < ranges.size(); k++)
+		{
+			boost::int64_t left = (std::max)(i->first + ranges[k].left, offset);
+			boost::int64_t right = (std::min)(i->first + ranges[k].right, end);
+			if (left < right)
+			{
+				std::memcpy(buf + (left - offset), i->second.data + (left - i->first),
+					static_cast<std::size_t>(right - left));
+			}
+		}
+	}
+
+	return size;
+}
+
+bool direct_storage::eof()
+{
+	return m_offset >= m_size;
+}
+
+bool direct_storage::sync()
+{
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_mutex);
+#endif
+		if (!flush_all())
+		{
+			return false;
+		}
+	}
+
+	return m_file.flush();
+}
+
+void direct_storage::allocate(boost::int64_t size, boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	m_file.set_size(size, ec);
+	if (ec)
+	{
+		return;
+	}
+	m_size = size;
+	m_allocated = true;
+}
+
+bool direct_storage::find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
+{
+	return default_storge::find_file_hole(m_file, offset, left, right);
+}
+
+bool direct_storage::is_direct() const
+{
+	return (m_file.open_mode() & file::no_buffer) != 0;
+}
+
+direct_storage::block* direct_storage::stage(boost::int64_t offset)
+{
+	boost::int64_t base = offset - offset % m_block_size;
+	block_map::iterator found = m_blocks.find(base);
+	if (found != m_blocks.end())
+	{
+		return &found->second;
+	}
+
+	// 暂存块已满, 写出最久未写入的块.
+	if (m_blocks.size() >= m_max_blocks)
+	{
+		block_map::iterator oldest = m_blocks.begin();
+		for (block_map::iterator i = m_blocks.begin(); i != m_blocks.end(); ++i)
+		{
+			if (i->second.last_use < oldest->second.last_use)
+			{
+				oldest = i;
+			}
+		}
+		bool ok = flush_block(oldest->second);
+		free_buffer(oldest->second.data);
+		m_blocks.erase(oldest);
+		if (!ok)
+		{
+			return NULL;
+		}
+	}
+
+	block& b = m_blocks[base];
+	b.offset = base;
+	b.data = alloc_buffer();
+	b.written.reset(m_block_size);
+	b.last_use = m_use_count;
+	return &b;
+}
+
+bool direct_storage::flush_block(block& b)
+{
+	std::size_t length = block_length(b);
+	if (length == 0)
+	{
+		return true;
+	}
+	std::size_t aligned_length = (length + m_alignment - 1) / m_alignment * m_alignment;
+
+	char* data = b.data;
+	if (b.written.range_size() < static_cast<boost::int64_t>(length))
+	{
+		// 未写满, 读出文件中的数据, 合并暂存的数据后写回.
+		if (!read_aligned(m_bounce, b.offset, aligned_length))
+		{
+			return false;
+		}
+		std::vector<range> ranges;
+		b.written.ranges(ranges);
+		for (std::size_t i = 0; i < ranges.size(); i++)
+		{
+			std::memcpy(m_bounce + ranges[i].left, b.data + ranges[i].left,
+				static_cast<std::size_t>(ranges[i].right - ranges[i].left));
+		}
+		data = m_bounce;
+	}
+
+	// 整块对齐写入, 超过文件尾的部分随后截断.
+	file::iovec_t buf;
+	buf.iov_base = data;
+	buf.iov_len = aligned_length;
+	boost::system::error_code ec;
+	file::size_type ret = m_file.writev(b.offset, &buf, 1, ec);
+	if (ec || ret != static_cast<file::size_type>(aligned_length))
+	{
+		AVHTTP_LOG_ERR << "Direct write failed, offset: " << b.offset << ", error: " << ec.message();
+		return false;
+	}
+
+	if (aligned_length != length)
+	{
+		m_file.set_size(m_size, ec);
+		if (ec)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool direct_storage::flush_all()
+{
+	bool ok = true;
+	for (block_map::iterator i = m_blocks.begin(); i != m_blocks.end(); ++i)
+	{
+		if (!flush_block(i->second))
+		{
+			ok = false;
+		}
+		free_buffer(i->second.data);
+	}
+	m_blocks.clear();
+	return ok;
+}
+
+std::size_t direct_storage::block_length(const block& b) const
+{
+	if (m_size <= b.offset)
+	{
+		return 0;
+	}
+	return static_cast<std::size_t>((std::min)(
+		static_cast<boost::int64_t>(m_block_size), m_size - b.offset));
+}
+
+bool direct_storage::read_aligned(char* buf, boost::int64_t offset, std::size_t size)
+{
+	boost::int64_t end = offset + size;
+	while (offset < end)
+	{
+		boost::int64_t begin = offset - offset % m_alignment;
+		std::size_t length = static_cast<std::size_t>((std::min)(
+			static_cast<boost::int64_t>(m_block_size), end - begin));
+		std::size_t aligned_length = (length + m_alignment - 1) / m_alignment * m_alignment;
+
+		// 对齐的读取直接读到buf, 否则经过m_bounce.
+		char* target = m_bounce;
+		if (begin == offset && aligned_length == length
+			&& (reinterpret_cast<std::size_t>(buf) & (m_alignment - 1)) == 0)
+		{
+			target = buf;
+		}
+
+		file::iovec_t vec;
+		vec.iov_base = target;
+		vec.iov_len = aligned_length;
+		boost::system::error_code ec;
+		file::size_type ret = m_file.readv(begin, &vec, 1, ec);
+		if (ec)
+		{
+			AVHTTP_LOG_ERR << "Direct read failed, offset: " << begin << ", error: " << ec.message();
+			return false;
+		}
+
+		// 文件中还没有的部分为0.
+		if (ret < static_cast<file::size_type>(length))
+		{
+			std::memset(target + ret, 0, length - static_cast<std::size_t>(ret));
+		}
+
+		std::size_t skip = static_cast<std::size_t>(offset - begin);
+		if (target != buf)
+		{
+			std::memcpy(buf, target + skip, length - skip);
+		}
+		buf += length - skip;
+		offset = begin + length;
+	}
+
+	return true;
+}
+
+char* direct_storage::alloc_buffer()
+{
+	if (!m_free_buffers.empty())
+	{
+		char* buffer = m_free_buffers.back();
+		m_free_buffers.pop_back();
+		return buffer;
+	}
+
+	void* buffer = detail::aligned_malloc(m_block_size, m_alignment);
+	if (!buffer)
+	{
+		throw std::bad_alloc();
+	}
+	return static_cast<char*>(buffer);
+}
+
+void direct_storage::free_buffer(char* buffer)
+{
+	// 同时使用的缓冲不超过m_max_blocks + 1个, 全部留在缓冲池中重复使用.
+	m_free_buffers.push_back(buffer);
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_DIRECT_STORAGE_IPP
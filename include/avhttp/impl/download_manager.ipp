@@ -0,0 +1,640 @@
+﻿//
+// impl/download_manager.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_DOWNLOAD_MANAGER_IPP
+#define AVHTTP_DOWNLOAD_MANAGER_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <limits>
+#include <algorithm>
+
+#include "avhttp/url.hpp"
+#include "avhttp/download_manager.hpp"
+
+namespace avhttp {
+
+struct download_manager::download_item
+{
+	download_item()
+		: id(0)
+		, priority(0)
+		, max_connections(default_connections_limit)
+		, quota(0)
+		, state(download_manager::queued)
+		, starting(false)
+		, pending_ticks(0)
+	{}
+
+	// 下载任务id.
+	int id;
+
+	// 下载的url.
+	std::string url;
+
+	// url中的主机名, 用于统计每个主机的连接数.
+	std::string host;
+
+	// 用户指定的下载设置.
+	settings set;
+
+	// 优先级.
+	int priority;
+
+	// 该下载最多使用的连接数.
+	int max_connections;
+
+	// 本次调度分配到的连接数.
+	int quota;
+
+	// 下载状态.
+	download_manager::download_state state;
+
+	// 已经调用async_start, 但还没有回调.
+	bool starting;
+
+	// 已经投递到下载的io_service中, 但还没有执行完的tick个数.
+	int pending_ticks;
+
+	// 出错时的错误信息.
+	boost::system::error_code ec;
+
+	// 下载对象.
+	download_manager::multi_download_ptr download;
+};
+
+namespace detail {
+
+// 按优先级从高到低排序, 相同优先级保持添加顺序.
+template <typename Ptr>
+struct priority_greater
+{
+	bool operator()(const Ptr& lhs, const Ptr& rhs) const
+	{
+		return lhs->priority > rhs->priority;
+	}
+};
+
+} // namespace detail
+
+download_manager::download_manager(boost::asio::io_service& io)
+	: m_io_service(io)
+	, m_io_service_pool(NULL)
+	, m_next_id(0)
+	, m_connections_limit(default_total_connections_limit)
+	, m_host_connections_limit(default_host_connections_limit)
+	, m_download_rate_limit(-1)
+	, m_timer(io)
+	, m_timer_pending(false)
+	, m_abort(true)
+{}
+
+#ifndef AVHTTP_DISABLE_THREAD
+download_manager::download_manager(io_service_pool& pool)
+	: m_io_service(pool.get_io_service())
+	, m_io_service_pool(&pool)
+	, m_next_id(0)
+	, m_connections_limit(default_total_connections_limit)
+	, m_host_connections_limit(default_host_connections_limit)
+	, m_download_rate_limit(-1)
+	, m_timer(m_io_service)
+	, m_timer_pending(false)
+	, m_abort(true)
+{}
+#endif
+
+download_manager::~download_manager()
+{
+	BOOST_ASSERT(stopped()); // 必须保证在析构前已经处于停止状态.
+}
+
+int download_manager::add(const std::string& u, const settings& s, int priority)
+{
+	download_item_ptr item = boost::make_shared<download_item>();
+
+	item->url = u;
+	item->set = s;
+	item->priority = priority;
+	if (s.connections_limit > 0)
+	{
+		item->max_connections = s.connections_limit;
+	}
+
+	// 解析主机名, 解析失败时由async_start返回错误.
+	boost::system::error_code ec;
+	url parsed = url::from_string(u, ec);
+	if (!ec)
+	{
+		item->host = parsed.host();
+	}
+
+	// 创建下载对象, 由download_manager统一驱动tick.
+#ifndef AVHTTP_DISABLE_THREAD
+	if (m_io_service_pool)
+	{
+		item->download = boost::make_shared<multi_download>(boost::ref(*m_io_service_pool));
+	}
+	else
+#endif
+	{
+		item->download = boost::make_shared<multi_download>(boost::ref(m_io_service));
+	}
+	item->download->m_external_tick = true;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	item->id = m_next_id++;
+	m_downloads.push_back(item);
+
+	return item->id;
+}
+
+void download_manager::remove(int id)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	std::vector<download_item_ptr>::iterator iter = m_downloads.begin();
+	for (; iter != m_downloads.end(); ++iter)
+	{
+		if ((*iter)->id == id)
+		{
+			break;
+		}
+	}
+	if (iter == m_downloads.end())
+	{
+		return;
+	}
+
+	download_item_ptr item = *iter;
+	m_downloads.erase(iter);
+
+	if (item->state == running)
+	{
+		stop_download(item);
+	}
+	item->state = finished;
+
+	// 下载对象在完全停止之前不能释放.
+	if (item->starting || item->pending_ticks > 0 || !item->download->stopped())
+	{
+		m_removed.push_back(item);
+	}
+}
+
+void download_manager::priority(int id, int priority)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	download_item_ptr item = find(id);
+	if (item)
+	{
+		item->priority = priority;
+	}
+}
+
+int download_manager::priority(int id) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	download_item_ptr item = find(id);
+	return item ? item->priority : 0;
+}
+
+download_manager::download_state download_manager::state(int id) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	download_item_ptr item = find(id);
+	return item ? item->state : finished;
+}
+
+boost::system::error_code download_manager::error(int id) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	download_item_ptr item = find(id);
+	return item ? item->ec : boost::system::error_code();
+}
+
+download_manager::multi_download_ptr download_manager::download(int id) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	download_item_ptr item = find(id);
+	return item ? item->download : multi_download_ptr();
+}
+
+void download_manager::connections_limit(int limit)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_connections_limit = limit;
+}
+
+int download_manager::connections_limit() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_connections_limit;
+}
+
+void download_manager::per_host_connections_limit(int limit)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_host_connections_limit = limit;
+}
+
+int download_manager::per_host_connections_limit() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_host_connections_limit;
+}
+
+void download_manager::download_rate_limit(int rate)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_download_rate_limit = rate;
+}
+
+int download_manager::download_rate_limit() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_download_rate_limit;
+}
+
+int download_manager::download_rate() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	int rate = 0;
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		if (m_downloads[i]->state == running)
+		{
+			rate += m_downloads[i]->download->download_rate();
+		}
+	}
+	return rate;
+}
+
+void download_manager::start()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	if (!m_abort)
+	{
+		return;
+	}
+	m_abort = false;
+
+	// 立即调度一次, 之后每秒调度一次.
+	schedule();
+
+	m_timer_pending = true;
+	m_timer.expires_from_now(boost::posix_time::seconds(1));
+	m_timer.async_wait(boost::bind(&download_manager::on_tick,
+		this, boost::asio::placeholders::error));
+}
+
+void download_manager::stop()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_abort = true;
+
+	boost::system::error_code ignore;
+	m_timer.cancel(ignore);
+
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		download_item_ptr& item = m_downloads[i];
+		if (item->state == running)
+		{
+			stop_download(item);
+			item->state = queued;
+		}
+	}
+}
+
+bool download_manager::stopped() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	if (!m_abort || m_timer_pending)
+	{
+		return false;
+	}
+
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		const download_item& item = *m_downloads[i];
+		if (item.starting || item.pending_ticks > 0 || !item.download->stopped())
+		{
+			return false;
+		}
+	}
+
+	for (std::size_t i = 0; i < m_removed.size(); i++)
+	{
+		const download_item& item = *m_removed[i];
+		if (item.starting || item.pending_ticks > 0 || !item.download->stopped())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// 以下为内部实现.
+
+void download_manager::on_tick(const boost::system::error_code& e)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_timer_pending = false;
+
+	if (e || m_abort)
+	{
+		return;
+	}
+
+	// 驱动所有正在下载的任务, 上一次的tick还没有执行完时跳过.
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		download_item_ptr& item = m_downloads[i];
+		if (item->state != running || item->starting || item->pending_ticks > 0)
+		{
+			continue;
+		}
+
+		post_tick(item);
+	}
+
+	// 释放已经完全停止的删除任务.
+	for (std::size_t i = 0; i < m_removed.size();)
+	{
+		if (!m_removed[i]->starting && m_removed[i]->pending_ticks == 0
+			&& m_removed[i]->download->stopped())
+		{
+			m_removed.erase(m_removed.begin() + i);
+			continue;
+		}
+		i++;
+	}
+
+	// 重新分配连接数.
+	schedule();
+
+	// 每隔1秒进行一次on_tick.
+	m_timer_pending = true;
+	m_timer.expires_from_now(boost::posix_time::seconds(1));
+	m_timer.async_wait(boost::bind(&download_manager::on_tick,
+		this, boost::asio::placeholders::error));
+}
+
+void download_manager::handle_start(download_item_ptr item,
+	const boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	item->starting = false;
+
+	if (ec)
+	{
+		AVHTTP_LOG_WARN << "Start download \'" << item->url << "\' failed, error: " << ec.message();
+		item->ec = ec;
+		item->state = finished;
+		item->quota = 0;
+		item->download->stop();
+		return;
+	}
+
+	// 在启动过程中被停止或删除.
+	if (item->state != running)
+	{
+		item->download->stop();
+		post_tick(item);
+	}
+}
+
+void download_manager::post_tick(download_item_ptr item)
+{
+	// tick会访问下载的连接和存储, 投递到该下载自己的io_service中执行, 不在
+	// 持有m_mutex时执行, 与下载单独运行时由自己的定时器驱动相同.
+	item->pending_ticks++;
+	item->download->m_io_service.post(
+		boost::bind(&download_manager::handle_tick, this, item));
+}
+
+void download_manager::handle_tick(download_item_ptr item)
+{
+	bool ok = item->download->tick();
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	item->pending_ticks--;
+
+	// tick返回false表示该下载已经终止, 被停止或删除的下载不在这里更新状态.
+	if (!ok && item->state == running && !item->starting)
+	{
+		item->state = finished;
+		item->quota = 0;
+	}
+}
+
+void download_manager::schedule()
+{
+	const int unlimited = (std::numeric_limits<int>::max)();
+	int budget = m_connections_limit < 0 ? unlimited : m_connections_limit;
+	const int host_limit = m_host_connections_limit < 0 ? unlimited : m_host_connections_limit;
+
+	// 按优先级排序所有未完成的下载.
+	std::vector<download_item_ptr> items;
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		download_item_ptr& item = m_downloads[i];
+		if (item->state != finished)
+		{
+			item->quota = 0;
+			items.push_back(item);
+		}
+	}
+	std::stable_sort(items.begin(), items.end(),
+		detail::priority_greater<download_item_ptr>());
+
+	std::map<std::string, int> host_connections;
+
+	// 正在下载的任务至少保留1个连接, 避免已经开始的下载被饿死.
+	for (std::size_t i = 0; i < items.size(); i++)
+	{
+		download_item& item = *items[i];
+		if (item.state == running)
+		{
+			item.quota = 1;
+			budget--;
+			host_connections[item.host]++;
+		}
+	}
+
+	// 按优先级启动排队中的任务, 还没有完全停止的下载对象需要等待下一次调度.
+	for (std::size_t i = 0; i < items.size() && budget > 0; i++)
+	{
+		download_item& item = *items[i];
+		if (item.state != queued || item.starting || item.pending_ticks > 0
+			|| !item.download->stopped())
+		{
+			continue;
+		}
+		if (host_connections[item.host] >= host_limit)
+		{
+			continue;
+		}
+
+		item.quota = 1;
+		budget--;
+		host_connections[item.host]++;
+	}
+
+	// 剩余的连接按优先级从高到低分配, 高优先级的下载优先得到满额连接数.
+	for (std::size_t i = 0; i < items.size() && budget > 0; i++)
+	{
+		download_item& item = *items[i];
+		if (item.quota == 0)
+		{
+			continue;
+		}
+
+		int max_connections = item.max_connections;
+		// 不支持多点下载的任务只会使用1个连接.
+		if (item.state == running && !item.starting && !item.download->accept_multi())
+		{
+			max_connections = 1;
+		}
+
+		int& host_count = host_connections[item.host];
+		int extra = (std::min)(max_connections - item.quota, budget);
+		extra = (std::min)(extra, host_limit - host_count);
+		if (extra <= 0)
+		{
+			continue;
+		}
+
+		item.quota += extra;
+		host_count += extra;
+		budget -= extra;
+	}
+
+	// 统计分配出去的连接数, 用于按连接数分配全局限速.
+	int total_quota = 0;
+	for (std::size_t i = 0; i < items.size(); i++)
+	{
+		total_quota += items[i]->quota;
+	}
+
+	for (std::size_t i = 0; i < items.size(); i++)
+	{
+		download_item_ptr& item = items[i];
+		if (item->quota == 0)
+		{
+			continue;
+		}
+
+		// 计算限速, 取全局限速按连接数分配的份额与下载自身限速中的较小值.
+		int rate_limit = item->set.download_rate_limit;
+		if (m_download_rate_limit != -1 && total_quota > 0)
+		{
+			int share = static_cast<int>(
+				static_cast<boost::int64_t>(m_download_rate_limit) * item->quota / total_quota);
+			share = (std::max)(share, 1);
+			rate_limit = rate_limit == -1 ? share : (std::min)(rate_limit, share);
+		}
+
+		if (item->state == running)
+		{
+			// 启动过程中的下载在handle_start中会使用async_start时的设置.
+			if (!item->starting)
+			{
+				item->download->connections_limit(item->quota);
+				item->download->download_rate_limit(rate_limit);
+			}
+			continue;
+		}
+
+		// 启动排队中的下载.
+		settings s = item->set;
+		s.connections_limit = item->quota;
+		s.download_rate_limit = rate_limit;
+
+		item->state = running;
+		item->starting = true;
+		item->download->async_start(item->url, s,
+			boost::bind(&download_manager::handle_start,
+				this, item, boost::asio::placeholders::error));
+	}
+}
+
+void download_manager::stop_download(download_item_ptr item)
+{
+	item->quota = 0;
+	item->download->stop();
+
+	// 执行一次tick, 保存最后的下载状态. 启动过程中的下载在handle_start中处理.
+	if (!item->starting)
+	{
+		post_tick(item);
+	}
+}
+
+download_manager::download_item_ptr download_manager::find(int id) const
+{
+	for (std::size_t i = 0; i < m_downloads.size(); i++)
+	{
+		if (m_downloads[i]->id == id)
+		{
+			return m_downloads[i];
+		}
+	}
+	return download_item_ptr();
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_DOWNLOAD_MANAGER_IPP
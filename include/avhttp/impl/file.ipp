@@ -43,6 +43,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
+#include <limits.h>	// for IOV_MAX
+#include <errno.h>
 
 #endif
 
@@ -58,6 +60,9 @@
 
 #endif
 
+#include <cstring>
+#include <algorithm>
+
 namespace avhttp {
 
 file::file()
@@ -199,7 +204,7 @@ void file::open(fs::path const& path, int mode, boost::system::error_code& ec)
 	{
 		mode &= ~no_buffer;
 		m_fd = ::open(path.string().c_str()
-			, mode & (rw_mask | no_buffer), permissions);
+			, mode_array[mode & rw_mask], permissions);
 	}
 
 #endif
@@ -332,6 +337,130 @@ inline int bufs_size(file::iovec_t const* bufs, int num_bufs)
 	return size;
 }
 
+#ifndef WIN32
+
+// linux 4.7以上及glibc 2.26以上提供pwritev2/preadv2, 可以为单次读写指定RWF_*标志.
+#if defined __linux__ && defined RWF_DSYNC && defined RWF_HIPRI
+#define AVHTTP_HAS_PWRITEV2
+#endif
+
+#if defined __linux__ || defined __FreeBSD__ || defined __NetBSD__ \
+	|| defined __OpenBSD__ || defined __DragonFly__
+#define AVHTTP_HAS_PREADV
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// posix下的读写实现.
+// file_offset为-1时使用并移动文件指针, 否则使用preadv/pwritev在指定位置读写,
+// 不依赖也不改变文件指针, 因此多个线程可以同时对同一个file进行定位读写.
+// 短读写及EINTR时继续处理剩余部分, 读取到文件末尾时返回已读取的大小.
+inline file::size_type posix_io(int fd, bool write, file::size_type file_offset,
+	file::iovec_t const* bufs, int num_bufs, int flags, boost::system::error_code& ec)
+{
+	// 复制一份iovec, 短读写时需要调整.
+	file::iovec_t* vec = AVHTTP_ALLOCA(file::iovec_t, num_bufs);
+	std::memcpy(vec, bufs, sizeof(file::iovec_t) * num_bufs);
+
+#ifdef AVHTTP_HAS_PWRITEV2
+	int rwf = 0;
+	if (flags & file::io_dsync)
+		rwf |= RWF_DSYNC;
+	if (flags & file::io_hipri)
+		rwf |= RWF_HIPRI;
+#endif
+
+	file::size_type ret = 0;
+	for (;;)
+	{
+		// 跳过已经完成的以及长度为0的buffer.
+		while (num_bufs > 0 && vec->iov_len == 0)
+		{
+			++vec;
+			--num_bufs;
+		}
+		if (num_bufs == 0)
+			break;
+
+		int count = (std::min)(num_bufs, IOV_MAX);
+		ssize_t n;
+		if (file_offset == -1)
+		{
+			n = write ? ::writev(fd, vec, count) : ::readv(fd, vec, count);
+		}
+#ifdef AVHTTP_HAS_PWRITEV2
+		else if (rwf != 0)
+		{
+			n = write ? ::pwritev2(fd, vec, count, file_offset, rwf)
+				: ::preadv2(fd, vec, count, file_offset, rwf);
+			if (n < 0 && (errno == ENOSYS || errno == EOPNOTSUPP))
+			{
+				// 内核或文件系统不支持, 改用pwritev, io_dsync由之后的fdatasync完成.
+				rwf = 0;
+				continue;
+			}
+		}
+#endif
+		else
+		{
+#ifdef AVHTTP_HAS_PREADV
+			n = write ? ::pwritev(fd, vec, count, file_offset)
+				: ::preadv(fd, vec, count, file_offset);
+#else
+			n = write ? ::pwrite(fd, vec->iov_base, vec->iov_len, file_offset)
+				: ::pread(fd, vec->iov_base, vec->iov_len, file_offset);
+#endif
+		}
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ec = boost::system::error_code(errno, boost::system::generic_category());
+			return -1;
+		}
+
+		// 读取到文件末尾.
+		if (n == 0)
+			break;
+
+		ret += n;
+		if (file_offset != -1)
+			file_offset += n;
+
+		for (; num_bufs > 0 && std::size_t(n) >= vec->iov_len; ++vec, --num_bufs)
+			n -= vec->iov_len;
+		if (n > 0)
+		{
+			vec->iov_base = static_cast<char*>(vec->iov_base) + n;
+			vec->iov_len -= n;
+		}
+	}
+
+	if (write && (flags & file::io_dsync)
+#ifdef AVHTTP_HAS_PWRITEV2
+		&& (file_offset == -1 || !(rwf & RWF_DSYNC))
+#endif
+		)
+	{
+#ifdef __linux__
+		if (fdatasync(fd) < 0)
+#else
+		if (fsync(fd) < 0)
+#endif
+		{
+			ec = boost::system::error_code(errno, boost::system::generic_category());
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+#endif // WIN32
+
 static inline int page_size()
 {
 	static int s = 0;
@@ -383,7 +512,7 @@ file::size_type file::read(char* buf, int size)
 }
 
 file::size_type file::readv(file::size_type file_offset,
-	iovec_t const* bufs, int num_bufs, boost::system::error_code& ec)
+	iovec_t const* bufs, int num_bufs, boost::system::error_code& ec, int flags)
 {
 	ec = boost::system::error_code();
 
@@ -408,25 +537,6 @@ file::size_type file::readv(file::size_type file_offset,
 		}
 		file_offset = position.QuadPart;
 	}
-#else
-	if (file_offset == -1)
-	{
-		file_offset = lseek(m_fd, 0, SEEK_CUR);
-		if (file_offset < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-	}
-	else
-	{
-		size_type ret = lseek(m_fd, file_offset, SEEK_SET);
-		if (ret < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-	}
 #endif // WIN32
 
 #ifdef DEBUG
@@ -436,7 +546,10 @@ file::size_type file::readv(file::size_type file_offset,
 		int size = 0;
 		// when opened in no_buffer mode, the file_offset must
 		// be aligned to pos_alignment()
-		BOOST_ASSERT((file_offset & (pos_alignment()-1)) == 0);
+		if (file_offset != -1)
+		{
+			BOOST_ASSERT((file_offset & (pos_alignment()-1)) == 0);
+		}
 		for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
 		{
 			BOOST_ASSERT((uintptr_t(i->iov_base) & (buf_alignment()-1)) == 0);
@@ -447,7 +560,7 @@ file::size_type file::readv(file::size_type file_offset,
 			size += i->iov_len;
 		}
 		boost::system::error_code code;
-		if (eof) BOOST_ASSERT(file_offset + size >= get_size(code));
+		if (eof && file_offset != -1) BOOST_ASSERT(file_offset + size >= get_size(code));
 	}
 #endif
 
@@ -536,61 +649,7 @@ file::size_type file::readv(file::size_type file_offset,
 
 #else // WIN32
 
-#if AVHTTP_USE_READV
-
-#ifdef __linux__
-	bool aligned = false;
-	int size = 0;
-	// if we're not opened in no-buffer mode, we don't need alignment
-	if ((m_open_mode & no_buffer) == 0) aligned = true;
-	if (!aligned)
-	{
-		size = bufs_size(bufs, num_bufs);
-		if ((size & (size_alignment()-1)) == 0) aligned = true;
-	}
-	if (aligned)
-#endif // __linux__
-	{
-		ret = ::readv(m_fd, bufs, num_bufs);
-		if (ret < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-		return ret;
-	}
-#ifdef __linux__
-	file::iovec_t* temp_bufs = AVHTTP_ALLOCA(file::iovec_t, num_bufs);
-	memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * num_bufs);
-	iovec_t& last = temp_bufs[num_bufs-1];
-	last.iov_len = (last.iov_len & ~(size_alignment()-1)) + m_page_size;
-	ret = ::readv(m_fd, temp_bufs, num_bufs);
-	if (ret < 0)
-	{
-		ec = boost::system::error_code(errno, boost::system::generic_category());
-		return -1;
-	}
-	return (std::min)(ret, size_type(size));
-#endif // __linux__
-
-#else // AVHTTP_USE_READV
-
-	file::size_type ret = 0;
-
-	for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
-	{
-		int tmp = ::read(m_fd, i->iov_base, i->iov_len);
-		if (tmp < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-		ret += tmp;
-		if (tmp < i->iov_len) break;
-	}
-	return ret;
-
-#endif // AVHTTP_USE_READV
+	return posix_io(m_fd, false, file_offset, bufs, num_bufs, flags, ec);
 
 #endif // WIN32
 }
@@ -617,7 +676,8 @@ file::size_type file::write(size_type offset, const char* buf, int size)
 	return bytes;
 }
 
-file::size_type file::writev(file::size_type file_offset, iovec_t const* bufs, int num_bufs, boost::system::error_code& ec)
+file::size_type file::writev(file::size_type file_offset,
+	iovec_t const* bufs, int num_bufs, boost::system::error_code& ec, int flags)
 {
 	ec = boost::system::error_code();
 
@@ -642,25 +702,6 @@ file::size_type file::writev(file::size_type file_offset, iovec_t const* bufs, i
 		}
 		file_offset = position.QuadPart;
 	}
-#else
-	if (file_offset != -1)
-	{
-		size_type ret = lseek(m_fd, file_offset, SEEK_SET);
-		if (ret < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-	}
-	else
-	{
-		file_offset = lseek(m_fd, 0, SEEK_CUR);
-		if (file_offset < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-	}
 #endif // WIN32
 
 #ifdef DEBUG
@@ -818,65 +859,7 @@ file::size_type file::writev(file::size_type file_offset, iovec_t const* bufs, i
 	return ret;
 #else
 
-#if AVHTTP_USE_WRITEV
-
-#ifdef __linux__
-	bool aligned = false;
-	int size = 0;
-	// if we're not opened in no-buffer mode, we don't need alignment
-	if ((m_open_mode & no_buffer) == 0) aligned = true;
-	if (!aligned)
-	{
-		size = bufs_size(bufs, num_bufs);
-		if ((size & (size_alignment()-1)) == 0) aligned = true;
-	}
-	if (aligned)
-#endif
-	{
-		ret = ::writev(m_fd, bufs, num_bufs);
-		if (ret < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-		return ret;
-	}
-#ifdef __linux__
-	file::iovec_t* temp_bufs = AVHTTP_ALLOCA(file::iovec_t, num_bufs);
-	memcpy(temp_bufs, bufs, sizeof(file::iovec_t) * num_bufs);
-	iovec_t& last = temp_bufs[num_bufs-1];
-	last.iov_len = (last.iov_len & ~(size_alignment()-1)) + size_alignment();
-	ret = ::writev(m_fd, temp_bufs, num_bufs);
-	if (ret < 0)
-	{
-		ec = boost::system::error_code(errno, boost::system::generic_category());
-		return -1;
-	}
-	if (ftruncate(m_fd, file_offset + size) < 0)
-	{
-		ec = boost::system::error_code(errno, boost::system::generic_category());
-		return -1;
-	}
-	return (std::min)(ret, size_type(size));
-#endif // __linux__
-
-#else // AVHTTP_USE_WRITEV
-
-	file::size_type ret = 0;
-	for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
-	{
-		int tmp = ::write(m_fd, i->iov_base, i->iov_len);
-		if (tmp < 0)
-		{
-			ec = boost::system::error_code(errno, boost::system::generic_category());
-			return -1;
-		}
-		ret += tmp;
-		if (tmp < i->iov_len) break;
-	}
-	return ret;
-
-#endif // AVHTTP_USE_WRITEV
+	return posix_io(m_fd, true, file_offset, bufs, num_bufs, flags, ec);
 
 #endif // WIN32
 }
@@ -886,6 +869,10 @@ bool file::flush()
 #ifdef WIN32
 	BOOL ret = ::FlushFileBuffers(m_file_handle);
 	return ret ? true : false;
+#elif defined(__linux__)
+	// 只同步数据以及读取数据所需的元数据(如文件大小), 比fsync少一次inode写入.
+	int ret = fdatasync(m_fd);
+	return ret == 0 ? true : false;
 #else
 	int ret = fsync(m_fd);
 	return ret == 0 ? true : false;
@@ -1097,22 +1084,22 @@ bool file::set_size(size_type s, boost::system::error_code& ec)
 		}
 #endif // F_PREALLOCATE
 
-#if HAVE_FALLOCATE
+#ifdef __linux__
 		{
 			int ret = fallocate(m_fd, 0, 0, s);
 			// if we return 0, everything went fine
 			// the fallocate call succeeded
 			if (ret == 0) return true;
-			// otherwise, something went wrong. If the error
-			// is ENOSYS, just keep going and do it the old-fashioned
-			// way. If fallocate failed with some other error, it
-			// probably means the user should know about it, error out
-			// and report it.
-			if (errno != ENOSYS)
-			{
-				ec.assign(ret, boost::system::generic_category());
-				return false;
-			}
+			// otherwise, something went wrong. If the file system
+			// does not support it (ENOSYS or EOPNOTSUPP), keep the
+			// file sparse rather than falling back to posix_fallocate,
+			// which writes every block and is painfully slow for
+			// large files. If fallocate failed with some other error,
+			// it probably means the user should know about it, error
+			// out and report it.
+			if (errno == ENOSYS || errno == EOPNOTSUPP) return true;
+			ec.assign(errno, boost::system::generic_category());
+			return false;
 		}
 #endif // __linux__
 
@@ -1205,6 +1192,55 @@ file::size_type file::sparse_end(size_type start) const
 #endif
 }
 
+file::size_type file::data_end(size_type start) const
+{
+#ifdef WIN32
+#if defined(__MINGW32__) || defined(MINGW32)
+	typedef struct _FILE_ALLOCATED_RANGE_BUFFER {
+		LARGE_INTEGER FileOffset;
+		LARGE_INTEGER Length;
+	} FILE_ALLOCATED_RANGE_BUFFER, *PFILE_ALLOCATED_RANGE_BUFFER;
+#define FSCTL_QUERY_ALLOCATED_RANGES ((0x9 << 16) | (1 << 14) | (51 << 2) | 3)
+#endif
+	FILE_ALLOCATED_RANGE_BUFFER buffer;
+	DWORD bytes_returned = 0;
+	FILE_ALLOCATED_RANGE_BUFFER in;
+	boost::system::error_code ec;
+	size_type file_size = get_size(ec);
+	if (ec || start >= file_size) return start;
+	in.FileOffset.QuadPart = start;
+	in.Length.QuadPart = file_size - start;
+	if (!::DeviceIoControl(m_file_handle, FSCTL_QUERY_ALLOCATED_RANGES
+		, &in, sizeof(FILE_ALLOCATED_RANGE_BUFFER)
+		, &buffer, sizeof(FILE_ALLOCATED_RANGE_BUFFER), &bytes_returned, 0))
+	{
+		int err = ::GetLastError();
+		if (err != ERROR_INSUFFICIENT_BUFFER) return file_size;
+	}
+
+	// no allocated regions, start is in a hole
+	if (bytes_returned == 0) return start;
+
+	// start is in a hole before the first allocated region
+	if (buffer.FileOffset.QuadPart > start) return start;
+
+	// return the end of the allocated region containing start
+	return buffer.FileOffset.QuadPart + buffer.Length.QuadPart;
+
+#elif defined SEEK_HOLE
+	// start beyond the end of file fails with ENXIO
+	size_type ret = lseek(m_fd, start, SEEK_HOLE);
+	if (ret < 0) return start;
+	return ret;
+#else
+	// without hole information the whole file is data
+	boost::system::error_code ec;
+	size_type file_size = get_size(ec);
+	if (ec) return start;
+	return (std::max)(start, file_size);
+#endif
+}
+
 } // namespace avhttp
 
 #endif // AVHTTP_FILE_IPP
@@ -1747,6 +1747,28 @@ boost::int64_t http_stream::content_length()
 	return m_content_length;
 }
 
+tcp::socket* http_stream::raw_body_socket()
+{
+	if (m_is_chunked || m_response.size() != 0)
+	{
+		return NULL;
+	}
+#ifdef AVHTTP_ENABLE_ZLIB
+	if (m_is_gzip)
+	{
+		return NULL;
+	}
+#endif
+
+	// ssl连接时为NULL.
+	return m_sock.get<nossl_socket>();
+}
+
+void http_stream::consume_body(std::size_t bytes)
+{
+	m_body_size += bytes;
+}
+
 void http_stream::check_certificate(bool is_check)
 {
 #ifdef AVHTTP_ENABLE_OPENSSL
@@ -0,0 +1,727 @@
+﻿//
+// impl/io_uring_service.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_IO_URING_SERVICE_IPP
+#define AVHTTP_IO_URING_SERVICE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>    // for std::min
+
+#include <boost/bind.hpp>
+#include <boost/assert.hpp>
+
+// 收取完成事件需要单独的线程, 定义AVHTTP_DISABLE_THREAD时不启用io_uring.
+#if defined(AVHTTP_ENABLE_IO_URING) && defined(__linux__) && !defined(AVHTTP_DISABLE_THREAD)
+#	include <cerrno>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <sys/uio.h>
+#	include <linux/io_uring.h>
+#	define AVHTTP_HAS_IO_URING
+#	ifndef __NR_io_uring_setup
+#		define __NR_io_uring_setup 425
+#		define __NR_io_uring_enter 426
+#		define __NR_io_uring_register 427
+#	endif
+#endif
+
+#include "avhttp/io_uring_service.hpp"
+#include "avhttp/logging.hpp"
+
+namespace avhttp {
+
+struct io_uring_service::operation
+{
+	operation()
+		: is_write(false)
+		, handle(-1)
+		, offset(0)
+		, data(NULL)
+		, size(0)
+		, buffer_index(-1)
+	{}
+
+	virtual ~operation() {}
+
+	// 请求完成, 在收取完成事件的线程中调用.
+	virtual void complete(const boost::system::error_code& ec, std::size_t bytes) = 0;
+
+	bool is_write;
+	int handle;
+	boost::int64_t offset;
+
+	// 调用者的缓冲.
+	char* data;
+	std::size_t size;
+
+	// 使用的注册缓冲, -1表示直接使用调用者的缓冲.
+	int buffer_index;
+
+#if defined(AVHTTP_HAS_IO_URING)
+	// 不使用注册缓冲时, 通过readv/writev提交.
+	struct iovec iov;
+#endif
+};
+
+struct io_uring_service::sync_operation : public operation
+{
+	sync_operation()
+		: done(false)
+		, bytes(0)
+	{}
+
+	virtual void complete(const boost::system::error_code& e, std::size_t n)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(mutex);
+#endif
+		ec = e;
+		bytes = n;
+		done = true;
+#ifndef AVHTTP_DISABLE_THREAD
+		cond.notify_one();
+#endif
+	}
+
+	void wait()
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(mutex);
+		while (!done)
+		{
+			cond.wait(lock);
+		}
+#else
+		// 没有启用io_uring, 请求在submit中已经完成.
+		BOOST_ASSERT(done);
+#endif
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex mutex;
+	boost::condition cond;
+#endif
+	bool done;
+	boost::system::error_code ec;
+	std::size_t bytes;
+};
+
+struct io_uring_service::async_operation : public operation
+{
+	async_operation(boost::asio::io_service& io, handler_type h)
+		: io_service(io)
+		, handler(h)
+	{}
+
+	virtual void complete(const boost::system::error_code& ec, std::size_t bytes)
+	{
+		io_service.post(boost::bind(handler, ec, bytes));
+		delete this;
+	}
+
+	boost::asio::io_service& io_service;
+	handler_type handler;
+};
+
+#if defined(AVHTTP_HAS_IO_URING)
+
+namespace detail {
+
+inline int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+inline int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+} // namespace detail
+
+io_uring_service::io_uring_service(unsigned entries, std::size_t buffers, std::size_t buffer_size)
+	: m_ring_fd(-1)
+	, m_sq_ring(MAP_FAILED)
+	, m_sq_ring_size(0)
+	, m_cq_ring(MAP_FAILED)
+	, m_cq_ring_size(0)
+	, m_sqes(MAP_FAILED)
+	, m_sqes_size(0)
+	, m_sq_head(NULL)
+	, m_sq_tail(NULL)
+	, m_sq_mask(NULL)
+	, m_sq_array(NULL)
+	, m_sq_entries(0)
+	, m_cq_head(NULL)
+	, m_cq_tail(NULL)
+	, m_cq_mask(NULL)
+	, m_cqes(NULL)
+	, m_cq_entries(0)
+	, m_files_registered(false)
+	, m_buffers(NULL)
+	, m_buffer_size(0)
+	, m_unsubmitted(0)
+	, m_inflight(0)
+	, m_submitting(false)
+	, m_stopping(false)
+{
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	m_ring_fd = detail::io_uring_setup(entries, &params);
+	if (m_ring_fd < 0)
+	{
+		AVHTTP_LOG_DBG << "io_uring is not available, errno: " << errno;
+		m_ring_fd = -1;
+		return;
+	}
+
+	// 映射提交队列, 完成队列和sqe数组, 新内核中两个队列可以一次映射.
+	m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+	{
+		m_sq_ring_size = m_cq_ring_size = (std::max)(m_sq_ring_size, m_cq_ring_size);
+	}
+	m_sq_ring = ::mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ring != MAP_FAILED)
+	{
+		m_cq_ring = single_mmap ? m_sq_ring : ::mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+	}
+	m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	if (m_cq_ring != MAP_FAILED)
+	{
+		m_sqes = ::mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+	}
+	if (m_sqes == MAP_FAILED)
+	{
+		AVHTTP_LOG_WARN << "Map io_uring failed, errno: " << errno;
+		close();
+		return;
+	}
+
+	char* sq = static_cast<char*>(m_sq_ring);
+	m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	m_sq_entries = params.sq_entries;
+
+	char* cq = static_cast<char*>(m_cq_ring);
+	m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_cqes = cq + params.cq_off.cqes;
+	m_cq_entries = params.cq_entries;
+
+	// 注册一个空的文件表, 打开文件时再更新其中的项.
+	std::vector<int> fds(default_files, -1);
+	m_files_registered = detail::io_uring_register(m_ring_fd,
+		IORING_REGISTER_FILES, &fds[0], default_files) == 0;
+
+	// 注册缓冲, 受RLIMIT_MEMLOCK限制可能失败, 失败时直接使用调用者的缓冲.
+	if (buffers != 0 && buffer_size != 0)
+	{
+		void* p = NULL;
+		if (::posix_memalign(&p, 4096, buffers * buffer_size) == 0)
+		{
+			std::vector<struct iovec> iovs(buffers);
+			for (std::size_t i = 0; i < buffers; i++)
+			{
+				iovs[i].iov_base = static_cast<char*>(p) + i * buffer_size;
+				iovs[i].iov_len = buffer_size;
+			}
+			if (detail::io_uring_register(m_ring_fd, IORING_REGISTER_BUFFERS,
+				&iovs[0], static_cast<unsigned>(buffers)) == 0)
+			{
+				m_buffers = static_cast<char*>(p);
+				m_buffer_size = buffer_size;
+				for (int i = static_cast<int>(buffers) - 1; i >= 0; i--)
+				{
+					m_free_buffers.push_back(i);
+				}
+			}
+			else
+			{
+				AVHTTP_LOG_DBG << "Register io_uring buffers failed, errno: " << errno;
+				std::free(p);
+			}
+		}
+	}
+
+	m_thread.reset(new boost::thread(boost::bind(&io_uring_service::run, this)));
+}
+
+io_uring_service::~io_uring_service()
+{
+	if (m_thread)
+	{
+		// 等待所有请求完成, 再提交一个空请求唤醒收取完成事件的线程.
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_stopping = true;
+		while (m_inflight != 0)
+		{
+			m_space_cond.wait(lock);
+		}
+		push_sqe(NULL);
+		while (detail::io_uring_enter(m_ring_fd, m_unsubmitted, 0, 0) < 0 && errno == EINTR)
+			;
+		m_unsubmitted = 0;
+		lock.unlock();
+		m_thread->join();
+	}
+
+	close();
+}
+
+io_uring_service& io_uring_service::shared()
+{
+	static io_uring_service service;
+	return service;
+}
+
+bool io_uring_service::is_open() const
+{
+	return m_ring_fd != -1;
+}
+
+int io_uring_service::register_file(int fd)
+{
+	if (m_ring_fd == -1)
+	{
+		return -1;
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	int handle = static_cast<int>(std::find(m_files.begin(), m_files.end(), -1) - m_files.begin());
+	if (handle == static_cast<int>(m_files.size()))
+	{
+		m_files.push_back(-1);
+		m_fixed.push_back(0);
+	}
+	m_files[handle] = fd;
+	m_fixed[handle] = 0;
+
+	// 更新注册的文件表中对应的项, 文件表已满时直接使用fd.
+	if (m_files_registered && handle < default_files)
+	{
+		struct io_uring_files_update update;
+		std::memset(&update, 0, sizeof(update));
+		update.offset = handle;
+		update.fds = static_cast<boost::uint64_t>(reinterpret_cast<std::size_t>(&fd));
+		if (detail::io_uring_register(m_ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+		{
+			m_fixed[handle] = 1;
+		}
+	}
+
+	return handle;
+}
+
+void io_uring_service::unregister_file(int handle)
+{
+	boost::mutex::scoped_lock lock(m_mutex);
+	if (handle < 0 || handle >= static_cast<int>(m_files.size()))
+	{
+		return;
+	}
+
+	if (m_fixed[handle])
+	{
+		int fd = -1;
+		struct io_uring_files_update update;
+		std::memset(&update, 0, sizeof(update));
+		update.offset = handle;
+		update.fds = static_cast<boost::uint64_t>(reinterpret_cast<std::size_t>(&fd));
+		detail::io_uring_register(m_ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+	}
+
+	m_files[handle] = -1;
+	m_fixed[handle] = 0;
+}
+
+void io_uring_service::submit(operation* op)
+{
+	// 先取得一个注册缓冲, 在锁外复制写入的数据.
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		if (op->handle < 0 || op->handle >= static_cast<int>(m_files.size())
+			|| m_files[op->handle] == -1)
+		{
+			lock.unlock();
+			op->complete(boost::asio::error::bad_descriptor, 0);
+			return;
+		}
+		if (m_buffers && op->size <= m_buffer_size && !m_free_buffers.empty())
+		{
+			op->buffer_index = m_free_buffers.back();
+			m_free_buffers.pop_back();
+		}
+	}
+	if (op->buffer_index != -1 && op->is_write)
+	{
+		std::memcpy(m_buffers + op->buffer_index * m_buffer_size, op->data, op->size);
+	}
+
+	boost::mutex::scoped_lock lock(m_mutex);
+	while (m_inflight >= m_cq_entries
+		|| *m_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+	{
+		m_space_cond.wait(lock);
+	}
+	push_sqe(op);
+	m_inflight++;
+
+	// 已经有线程在提交, 它会在返回之前一起提交这个请求.
+	if (m_submitting)
+	{
+		return;
+	}
+
+	// 提交期间其它线程写入的请求也由这里一次提交.
+	m_submitting = true;
+	while (m_unsubmitted != 0)
+	{
+		unsigned n = m_unsubmitted;
+		m_unsubmitted = 0;
+		lock.unlock();
+		int ret = detail::io_uring_enter(m_ring_fd, n, 0, 0);
+		int error = errno;
+		lock.lock();
+		if (ret < 0)
+		{
+			// 完成队列已满(EBUSY)或者内存不足时, 等待完成事件被收取后重试.
+			m_unsubmitted += n;
+			if (error != EINTR)
+			{
+				lock.unlock();
+				boost::this_thread::sleep(boost::posix_time::millisec(1));
+				lock.lock();
+			}
+			continue;
+		}
+		m_unsubmitted += n - (std::min)(static_cast<unsigned>(ret), n);
+		m_space_cond.notify_all();
+	}
+	m_submitting = false;
+}
+
+void io_uring_service::push_sqe(operation* op)
+{
+	unsigned tail = *m_sq_tail;
+	unsigned index = tail & *m_sq_mask;
+	struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(m_sqes) + index;
+	std::memset(sqe, 0, sizeof(*sqe));
+
+	if (!op)
+	{
+		sqe->opcode = IORING_OP_NOP;
+	}
+	else
+	{
+		if (m_fixed[op->handle])
+		{
+			sqe->fd = op->handle;
+			sqe->flags = IOSQE_FIXED_FILE;
+		}
+		else
+		{
+			sqe->fd = m_files[op->handle];
+		}
+		sqe->off = op->offset;
+
+		if (op->buffer_index != -1)
+		{
+			sqe->opcode = op->is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->addr = static_cast<boost::uint64_t>(
+				reinterpret_cast<std::size_t>(m_buffers + op->buffer_index * m_buffer_size));
+			sqe->len = static_cast<boost::uint32_t>(op->size);
+			sqe->buf_index = static_cast<boost::uint16_t>(op->buffer_index);
+		}
+		else
+		{
+			op->iov.iov_base = op->data;
+			op->iov.iov_len = op->size;
+			sqe->opcode = op->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->addr = static_cast<boost::uint64_t>(reinterpret_cast<std::size_t>(&op->iov));
+			sqe->len = 1;
+		}
+		sqe->user_data = static_cast<boost::uint64_t>(reinterpret_cast<std::size_t>(op));
+	}
+
+	m_sq_array[index] = index;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	m_unsubmitted++;
+}
+
+void io_uring_service::run()
+{
+	struct io_uring_cqe* cqes = static_cast<struct io_uring_cqe*>(m_cqes);
+	for (;;)
+	{
+		unsigned head = *m_cq_head;
+		unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			detail::io_uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		bool stop = false;
+		unsigned completed = 0;
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe* cqe = &cqes[head & *m_cq_mask];
+			operation* op = reinterpret_cast<operation*>(static_cast<std::size_t>(cqe->user_data));
+			int result = cqe->res;
+			__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+			if (!op)
+			{
+				stop = true;
+				continue;
+			}
+			complete(op, result);
+			completed++;
+		}
+
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			m_inflight -= completed;
+			m_space_cond.notify_all();
+		}
+
+		if (stop)
+		{
+			return;
+		}
+	}
+}
+
+void io_uring_service::complete(operation* op, int result)
+{
+	boost::system::error_code ec;
+	std::size_t bytes = 0;
+	if (result < 0)
+	{
+		ec = boost::system::error_code(-result, boost::system::system_category());
+	}
+	else
+	{
+		bytes = static_cast<std::size_t>(result);
+	}
+
+	// 读取到注册缓冲的数据复制到调用者的缓冲, 然后释放注册缓冲.
+	if (op->buffer_index != -1)
+	{
+		if (!op->is_write && bytes != 0)
+		{
+			std::memcpy(op->data, m_buffers + op->buffer_index * m_buffer_size, bytes);
+		}
+
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_free_buffers.push_back(op->buffer_index);
+	}
+
+	op->complete(ec, bytes);
+}
+
+void io_uring_service::close()
+{
+	if (m_sqes != MAP_FAILED)
+	{
+		::munmap(m_sqes, m_sqes_size);
+		m_sqes = MAP_FAILED;
+	}
+	if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+	{
+		::munmap(m_cq_ring, m_cq_ring_size);
+	}
+	m_cq_ring = MAP_FAILED;
+	if (m_sq_ring != MAP_FAILED)
+	{
+		::munmap(m_sq_ring, m_sq_ring_size);
+		m_sq_ring = MAP_FAILED;
+	}
+	if (m_ring_fd != -1)
+	{
+		::close(m_ring_fd);
+		m_ring_fd = -1;
+	}
+	if (m_buffers)
+	{
+		std::free(m_buffers);
+		m_buffers = NULL;
+	}
+}
+
+#else // AVHTTP_HAS_IO_URING
+
+// 没有启用io_uring, is_open总是返回false.
+
+io_uring_service::io_uring_service(unsigned, std::size_t, std::size_t)
+	: m_ring_fd(-1)
+	, m_sq_ring(NULL)
+	, m_sq_ring_size(0)
+	, m_cq_ring(NULL)
+	, m_cq_ring_size(0)
+	, m_sqes(NULL)
+	, m_sqes_size(0)
+	, m_sq_head(NULL)
+	, m_sq_tail(NULL)
+	, m_sq_mask(NULL)
+	, m_sq_array(NULL)
+	, m_sq_entries(0)
+	, m_cq_head(NULL)
+	, m_cq_tail(NULL)
+	, m_cq_mask(NULL)
+	, m_cqes(NULL)
+	, m_cq_entries(0)
+	, m_files_registered(false)
+	, m_buffers(NULL)
+	, m_buffer_size(0)
+	, m_unsubmitted(0)
+	, m_inflight(0)
+	, m_submitting(false)
+	, m_stopping(false)
+{}
+
+io_uring_service::~io_uring_service()
+{}
+
+io_uring_service& io_uring_service::shared()
+{
+	static io_uring_service service;
+	return service;
+}
+
+bool io_uring_service::is_open() const
+{
+	return false;
+}
+
+int io_uring_service::register_file(int)
+{
+	return -1;
+}
+
+void io_uring_service::unregister_file(int)
+{}
+
+void io_uring_service::submit(operation* op)
+{
+	op->complete(boost::asio::error::operation_not_supported, 0);
+}
+
+void io_uring_service::push_sqe(operation*)
+{}
+
+void io_uring_service::run()
+{}
+
+void io_uring_service::complete(operation* op, int)
+{
+	op->complete(boost::asio::error::operation_not_supported, 0);
+}
+
+void io_uring_service::close()
+{}
+
+#endif // AVHTTP_HAS_IO_URING
+
+std::streamsize io_uring_service::write(int handle, boost::int64_t offset,
+	const char* buf, std::size_t size, boost::system::error_code& ec)
+{
+	return sync_io(true, handle, offset, const_cast<char*>(buf), size, ec);
+}
+
+std::streamsize io_uring_service::read(int handle, boost::int64_t offset,
+	char* buf, std::size_t size, boost::system::error_code& ec)
+{
+	return sync_io(false, handle, offset, buf, size, ec);
+}
+
+void io_uring_service::async_write(int handle, boost::int64_t offset, const char* buf,
+	std::size_t size, boost::asio::io_service& io, handler_type handler)
+{
+	start_async_io(true, handle, offset, const_cast<char*>(buf), size, io, handler);
+}
+
+void io_uring_service::async_read(int handle, boost::int64_t offset, char* buf,
+	std::size_t size, boost::asio::io_service& io, handler_type handler)
+{
+	start_async_io(false, handle, offset, buf, size, io, handler);
+}
+
+std::streamsize io_uring_service::sync_io(bool is_write, int handle, boost::int64_t offset,
+	char* buf, std::size_t size, boost::system::error_code& ec)
+{
+	ec = boost::system::error_code();
+	std::size_t done = 0;
+	while (done < size)
+	{
+		sync_operation op;
+		op.is_write = is_write;
+		op.handle = handle;
+		op.offset = offset + done;
+		op.data = buf + done;
+		op.size = (std::min)(size - done, static_cast<std::size_t>(1) << 30);
+		submit(&op);
+		op.wait();
+
+		if (op.ec == boost::asio::error::interrupted || op.ec == boost::asio::error::try_again)
+		{
+			continue;
+		}
+		if (op.ec)
+		{
+			ec = op.ec;
+			return -1;
+		}
+
+		// 读取到文件末尾.
+		if (op.bytes == 0)
+		{
+			break;
+		}
+		done += op.bytes;
+	}
+
+	return static_cast<std::streamsize>(done);
+}
+
+void io_uring_service::start_async_io(bool is_write, int handle, boost::int64_t offset,
+	char* buf, std::size_t size, boost::asio::io_service& io, handler_type handler)
+{
+	async_operation* op = new async_operation(io, handler);
+	op->is_write = is_write;
+	op->handle = handle;
+	op->offset = offset;
+	op->data = buf;
+	op->size = (std::min)(size, static_cast<std::size_t>(1) << 30);
+	submit(op);
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_IO_URING_SERVICE_IPP
@@ -0,0 +1,342 @@
+﻿//
+// impl/memory_storage.ipp
+// ~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_MEMORY_STORAGE_IPP
+#define AVHTTP_MEMORY_STORAGE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+#include <algorithm>    // for std::min/std::max
+
+#include <boost/make_shared.hpp>
+#include <boost/asio/error.hpp>
+
+#include "avhttp/memory_storage.hpp"
+
+namespace avhttp {
+
+memory_storage::memory_storage(std::size_t chunk_size, std::size_t contiguous_limit)
+	: m_chunk_size((std::max)(chunk_size, std::size_t(1)))
+	, m_contiguous_limit(contiguous_limit)
+	, m_block_size(m_chunk_size)
+	, m_size(0)
+	, m_allocated(false)
+	, m_offset(0)
+{}
+
+memory_storage::~memory_storage()
+{}
+
+void memory_storage::open(const fs::path& /*file_path*/, boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_chunks.clear();
+	m_block_size = m_chunk_size;
+	m_size = 0;
+	m_allocated = false;
+	m_offset = 0;
+	ec = boost::system::error_code();
+}
+
+void memory_storage::close()
+{
+	// 保留数据, 下载完成后由调用者取出.
+}
+
+std::streamsize memory_storage::write(const char* buf, int size)
+{
+	std::streamsize ret = write(buf, m_offset, size);
+	if (ret > 0)
+	{
+		m_offset += ret;
+	}
+	return ret;
+}
+
+std::streamsize memory_storage::write(const char* buf, boost::int64_t offset, int size)
+{
+	if (offset < 0 || size < 0)
+	{
+		return -1;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	m_size = (std::max)(m_size, offset + size);
+
+	int written = 0;
+	while (written < size)
+	{
+		boost::int64_t pos = offset + written;
+		std::size_t index = static_cast<std::size_t>(pos / m_block_size);
+		std::size_t chunk_offset = static_cast<std::size_t>(pos % m_block_size);
+		std::size_t bytes = (std::min)(static_cast<std::size_t>(size - written),
+			m_block_size - chunk_offset);
+
+		chunk_ptr c = chunk(index, true);
+		std::memcpy(&(*c)[chunk_offset], buf + written, bytes);
+		written += static_cast<int>(bytes);
+	}
+
+	return written;
+}
+
+std::streamsize memory_storage::read(char* buf, int size)
+{
+	std::streamsize ret = read(buf, m_offset, size);
+	if (ret > 0)
+	{
+		m_offset += ret;
+	}
+	return ret;
+}
+
+std::streamsize memory_storage::read(char* buf, boost::int64_t offset, int size)
+{
+	if (offset < 0 || size < 0)
+	{
+		return -1;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	// 与读取文件一样, 超过数据末尾的部分不读取.
+	if (offset >= m_size)
+	{
+		return 0;
+	}
+	if (size > m_size - offset)
+	{
+		size = static_cast<int>(m_size - offset);
+	}
+
+	int bytes_read = 0;
+	while (bytes_read < size)
+	{
+		boost::int64_t pos = offset + bytes_read;
+		std::size_t index = static_cast<std::size_t>(pos / m_block_size);
+		std::size_t chunk_offset = static_cast<std::size_t>(pos % m_block_size);
+		std::size_t bytes = (std::min)(static_cast<std::size_t>(size - bytes_read),
+			m_block_size - chunk_offset);
+
+		// 没有写入过的部分为0.
+		chunk_ptr c = chunk(index, false);
+		std::size_t copied = 0;
+		if (c && chunk_offset < c->size())
+		{
+			copied = (std::min)(bytes, c->size() - chunk_offset);
+			std::memcpy(buf + bytes_read, &(*c)[chunk_offset], copied);
+		}
+		std::memset(buf + bytes_read + copied, 0, bytes - copied);
+		bytes_read += static_cast<int>(bytes);
+	}
+
+	return bytes_read;
+}
+
+bool memory_storage::eof()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_offset >= m_size;
+}
+
+void memory_storage::allocate(boost::int64_t size, boost::system::error_code& ec)
+{
+	ec = boost::system::error_code();
+	if (size < 0 || static_cast<boost::uint64_t>(size) > static_cast<std::size_t>(-1))
+	{
+		ec = boost::asio::error::no_memory;
+		return;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	// 还没有写入数据时, 不超过contiguous_limit的数据使用一个连续的块.
+	if (m_chunks.empty() && size > 0
+		&& static_cast<boost::uint64_t>(size) <= m_contiguous_limit)
+	{
+		m_block_size = static_cast<std::size_t>(size);
+	}
+
+	m_size = size;
+	m_allocated = true;
+	m_chunks.resize(static_cast<std::size_t>((size + m_block_size - 1) / m_block_size));
+}
+
+bool memory_storage::find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	offset = (std::max)(offset, boost::int64_t(0));
+	if (offset >= m_size)
+	{
+		left = offset;
+		right = -1;
+		return true;
+	}
+
+	std::size_t index = static_cast<std::size_t>(offset / m_block_size);
+	while (index < m_chunks.size() && m_chunks[index])
+	{
+		index++;
+	}
+	left = (std::max)(offset, static_cast<boost::int64_t>(index) * static_cast<boost::int64_t>(m_block_size));
+
+	while (index < m_chunks.size() && !m_chunks[index])
+	{
+		index++;
+	}
+	right = index < m_chunks.size() ? static_cast<boost::int64_t>(index) * static_cast<boost::int64_t>(m_block_size) : -1;
+
+	return true;
+}
+
+boost::shared_ptr<const char> memory_storage::view(boost::int64_t offset,
+	std::size_t size, std::size_t& length)
+{
+	length = 0;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	if (offset < 0 || offset >= m_size || size == 0)
+	{
+		return boost::shared_ptr<const char>();
+	}
+
+	std::size_t index = static_cast<std::size_t>(offset / m_block_size);
+	std::size_t chunk_offset = static_cast<std::size_t>(offset % m_block_size);
+	chunk_ptr c = chunk(index, false);
+	if (!c || chunk_offset >= c->size())
+	{
+		return boost::shared_ptr<const char>();
+	}
+
+	length = (std::min)(size, c->size() - chunk_offset);
+	length = static_cast<std::size_t>((std::min)(static_cast<boost::int64_t>(length), m_size - offset));
+
+	// 视图与块共用引用计数, 保证视图释放前块不被释放.
+	return boost::shared_ptr<const char>(c, &(*c)[chunk_offset]);
+}
+
+boost::int64_t memory_storage::size()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_size;
+}
+
+std::vector<boost::asio::const_buffer> memory_storage::data()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	std::vector<boost::asio::const_buffer> buffers;
+	std::size_t count = static_cast<std::size_t>((m_size + m_block_size - 1) / m_block_size);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		// 没有写入过的块也需要分配, 以返回全0的数据.
+		chunk_ptr c = chunk(i, true);
+		buffers.push_back(boost::asio::const_buffer(&(*c)[0], chunk_length(i)));
+	}
+	return buffers;
+}
+
+void memory_storage::release(std::vector<char>& buffer)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	std::size_t size = static_cast<std::size_t>(m_size);
+	if (m_chunks.size() == 1 && m_chunks[0] && m_chunks[0].unique())
+	{
+		// 只有一个块, 直接交换, 不复制数据.
+		m_chunks[0]->resize(size);
+		buffer.swap(*m_chunks[0]);
+	}
+	else
+	{
+		buffer.assign(size, 0);
+		for (std::size_t i = 0; i < m_chunks.size(); i++)
+		{
+			const chunk_ptr& c = m_chunks[i];
+			std::size_t length = c ? (std::min)(chunk_length(i), c->size()) : 0;
+			if (length != 0)
+			{
+				std::memcpy(&buffer[i * m_block_size], &(*c)[0], length);
+			}
+		}
+	}
+
+	m_chunks.clear();
+	m_block_size = m_chunk_size;
+	m_size = 0;
+	m_allocated = false;
+	m_offset = 0;
+}
+
+memory_storage::chunk_ptr memory_storage::chunk(std::size_t index, bool create)
+{
+	if (index >= m_chunks.size())
+	{
+		if (!create)
+		{
+			return chunk_ptr();
+		}
+		m_chunks.resize(index + 1);
+	}
+
+	chunk_ptr& c = m_chunks[index];
+	if (!create)
+	{
+		return c;
+	}
+
+	// 大小已知时最后一块只分配需要的大小, 否则按整块分配.
+	std::size_t length = m_allocated ? chunk_length(index) : m_block_size;
+	if (!c)
+	{
+		c = boost::make_shared<std::vector<char> >(length);
+	}
+	else if (c->size() < length)
+	{
+		// 写入超过了allocate指定的大小, 换成更大的块, 已经返回的视图仍然引用原来的块.
+		chunk_ptr larger = boost::make_shared<std::vector<char> >(length);
+		std::memcpy(&(*larger)[0], &(*c)[0], c->size());
+		c = larger;
+	}
+
+	return c;
+}
+
+std::size_t memory_storage::chunk_length(std::size_t index) const
+{
+	boost::int64_t begin = static_cast<boost::int64_t>(index) * static_cast<boost::int64_t>(m_block_size);
+	return static_cast<std::size_t>((std::max)(boost::int64_t(0),
+		(std::min)(static_cast<boost::int64_t>(m_block_size), m_size - begin)));
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_MEMORY_STORAGE_IPP
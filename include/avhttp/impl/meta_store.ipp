@@ -0,0 +1,514 @@
+﻿//
+// impl/meta_store.ipp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_META_STORE_IPP
+#define AVHTTP_META_STORE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+
+#include <boost/crc.hpp>
+
+#include "avhttp/meta_store.hpp"
+
+namespace avhttp {
+
+namespace detail {
+
+// 存储文件以8字节的标识开始, 之后是依次追加的记录.
+// 每个记录的头为: 类型(1字节), key长度(4字节), 数据长度(4字节), 数据的crc32(4字节),
+// 整数均为小端字节序, 之后是key和数据.
+static const char meta_store_magic[] = "avhttpms";
+static const int meta_store_magic_size = 8;
+static const int meta_store_header_size = 13;
+
+// 记录类型.
+static const char meta_store_replace = 'R';
+static const char meta_store_append = 'A';
+static const char meta_store_remove = 'D';
+
+inline void meta_store_write_uint32(char* p, boost::uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		p[i] = static_cast<char>((v >> (i * 8)) & 0xff);
+	}
+}
+
+inline boost::uint32_t meta_store_read_uint32(const char* p)
+{
+	boost::uint32_t v = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		v |= static_cast<boost::uint32_t>(static_cast<unsigned char>(p[i])) << (i * 8);
+	}
+	return v;
+}
+
+inline boost::uint32_t meta_store_crc(const char* data, std::size_t size)
+{
+	boost::crc_32_type result;
+	result.process_bytes(data, size);
+	return result.checksum();
+}
+
+} // namespace detail
+
+meta_store::meta_store()
+	: m_size(0)
+	, m_live_size(0)
+{}
+
+meta_store::~meta_store()
+{
+	close();
+}
+
+void meta_store::open(const fs::path& file_path, boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	m_file.close();
+	m_index.clear();
+	m_size = 0;
+	m_live_size = 0;
+
+	m_file.open(file_path, file::read_write, ec);
+	if (ec)
+	{
+		return;
+	}
+	m_path = file_path;
+
+	boost::int64_t file_size = m_file.get_size(ec);
+	if (ec)
+	{
+		m_file.close();
+		return;
+	}
+
+	// 新文件, 写入标识.
+	if (file_size < detail::meta_store_magic_size)
+	{
+		m_file.set_size(0, ec);
+		if (m_file.write(0, detail::meta_store_magic, detail::meta_store_magic_size)
+			!= detail::meta_store_magic_size)
+		{
+			ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+			m_file.close();
+			return;
+		}
+		m_size = detail::meta_store_magic_size;
+		return;
+	}
+
+	char magic[detail::meta_store_magic_size];
+	if (m_file.read(0, magic, detail::meta_store_magic_size) != detail::meta_store_magic_size
+		|| std::memcmp(magic, detail::meta_store_magic, detail::meta_store_magic_size) != 0)
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		m_file.close();
+		return;
+	}
+
+	// 按块顺序读取记录头建立索引, 跳过数据部分.
+	std::vector<char> buffer(1024 * 1024);
+	boost::int64_t buffer_offset = 0;
+	int buffer_size = 0;
+	boost::int64_t offset = detail::meta_store_magic_size;
+	while (offset + detail::meta_store_header_size <= file_size)
+	{
+		// 记录头和key不在缓冲中, 从当前位置重新读取.
+		if (offset < buffer_offset
+			|| offset + detail::meta_store_header_size > buffer_offset + buffer_size)
+		{
+			buffer_offset = offset;
+			buffer_size = static_cast<int>(m_file.read(offset, &buffer[0], buffer.size()));
+			if (buffer_size < detail::meta_store_header_size)
+			{
+				break;
+			}
+		}
+
+		const char* p = &buffer[offset - buffer_offset];
+		char type = p[0];
+		boost::uint32_t key_size = detail::meta_store_read_uint32(p + 1);
+		boost::uint32_t data_size = detail::meta_store_read_uint32(p + 5);
+		boost::uint32_t crc = detail::meta_store_read_uint32(p + 9);
+
+		boost::int64_t end = offset + detail::meta_store_header_size + key_size + data_size;
+		if ((type != detail::meta_store_replace && type != detail::meta_store_append
+			&& type != detail::meta_store_remove) || key_size > buffer.size() / 2 || end > file_size)
+		{
+			break;
+		}
+
+		if (offset + detail::meta_store_header_size + key_size > buffer_offset + buffer_size)
+		{
+			buffer_offset = offset;
+			buffer_size = static_cast<int>(m_file.read(offset, &buffer[0], buffer.size()));
+			if (buffer_size < static_cast<int>(detail::meta_store_header_size + key_size))
+			{
+				break;
+			}
+			p = &buffer[0];
+		}
+
+		std::string key(p + detail::meta_store_header_size, key_size);
+		segment seg;
+		seg.offset = offset + detail::meta_store_header_size + key_size;
+		seg.size = data_size;
+		seg.crc = crc;
+
+		segments& segs = m_index[key];
+		if (type != detail::meta_store_append)
+		{
+			for (segments::iterator i = segs.begin(); i != segs.end(); i++)
+			{
+				m_live_size -= i->size;
+			}
+			segs.clear();
+		}
+		if (type == detail::meta_store_remove)
+		{
+			m_index.erase(key);
+		}
+		else
+		{
+			segs.push_back(seg);
+			m_live_size += data_size;
+		}
+
+		offset = end;
+	}
+
+	// 截断末尾不完整的记录.
+	m_size = offset;
+	if (m_size != file_size)
+	{
+		boost::system::error_code ignore;
+		m_file.set_size(m_size, ignore);
+	}
+}
+
+void meta_store::close()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	if (m_file.is_open())
+	{
+		m_file.close();
+	}
+	m_index.clear();
+	m_size = 0;
+	m_live_size = 0;
+}
+
+bool meta_store::is_open() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_file.is_open();
+}
+
+std::vector<std::string> meta_store::keys() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	std::vector<std::string> result;
+	result.reserve(m_index.size());
+	for (index_type::const_iterator i = m_index.begin(); i != m_index.end(); i++)
+	{
+		result.push_back(i->first);
+	}
+	return result;
+}
+
+bool meta_store::contains(const std::string& key) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	return m_index.find(key) != m_index.end();
+}
+
+bool meta_store::load(const std::string& key, std::vector<char>& data) const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	data.clear();
+
+	index_type::const_iterator iter = m_index.find(key);
+	if (iter == m_index.end())
+	{
+		return false;
+	}
+
+	const segments& segs = iter->second;
+	for (segments::const_iterator i = segs.begin(); i != segs.end(); i++)
+	{
+		if (i->size == 0)
+		{
+			continue;
+		}
+
+		std::size_t pos = data.size();
+		data.resize(pos + i->size);
+		if (m_file.read(i->offset, &data[pos], i->size) != i->size
+			|| detail::meta_store_crc(&data[pos], i->size) != i->crc)
+		{
+			// 数据损坏, 只返回之前完好的部分.
+			data.resize(pos);
+			return !data.empty();
+		}
+	}
+
+	return true;
+}
+
+bool meta_store::replace(const std::string& key, const char* data, std::size_t size)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	segment seg;
+	if (!write_record(detail::meta_store_replace, key, data, size, seg))
+	{
+		return false;
+	}
+
+	segments& segs = m_index[key];
+	for (segments::iterator i = segs.begin(); i != segs.end(); i++)
+	{
+		m_live_size -= i->size;
+	}
+	segs.clear();
+	segs.push_back(seg);
+	m_live_size += size;
+
+	// 无效的数据超过一半时整理存储文件.
+	if (m_size > 1024 * 1024 && m_size > m_live_size * 2)
+	{
+		boost::system::error_code ignore;
+		compact_impl(ignore);
+	}
+
+	return true;
+}
+
+bool meta_store::append(const std::string& key, const char* data, std::size_t size)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	segment seg;
+	if (!write_record(detail::meta_store_append, key, data, size, seg))
+	{
+		return false;
+	}
+
+	m_index[key].push_back(seg);
+	m_live_size += size;
+
+	return true;
+}
+
+bool meta_store::remove(const std::string& key)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	index_type::iterator iter = m_index.find(key);
+	if (iter == m_index.end())
+	{
+		return true;
+	}
+
+	segment seg;
+	if (!write_record(detail::meta_store_remove, key, NULL, 0, seg))
+	{
+		return false;
+	}
+
+	for (segments::iterator i = iter->second.begin(); i != iter->second.end(); i++)
+	{
+		m_live_size -= i->size;
+	}
+	m_index.erase(iter);
+
+	return true;
+}
+
+bool meta_store::flush()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	if (!m_file.is_open())
+	{
+		return false;
+	}
+	return m_file.flush();
+}
+
+void meta_store::compact(boost::system::error_code& ec)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+	compact_impl(ec);
+}
+
+bool meta_store::write_record(char type, const std::string& key,
+	const char* data, std::size_t size, segment& seg)
+{
+	if (!m_file.is_open())
+	{
+		return false;
+	}
+
+	std::vector<char> buffer(detail::meta_store_header_size + key.size() + size);
+	boost::uint32_t crc = detail::meta_store_crc(data, size);
+	buffer[0] = type;
+	detail::meta_store_write_uint32(&buffer[1], static_cast<boost::uint32_t>(key.size()));
+	detail::meta_store_write_uint32(&buffer[5], static_cast<boost::uint32_t>(size));
+	detail::meta_store_write_uint32(&buffer[9], crc);
+	std::memcpy(&buffer[detail::meta_store_header_size], key.data(), key.size());
+	if (size != 0)
+	{
+		std::memcpy(&buffer[detail::meta_store_header_size + key.size()], data, size);
+	}
+
+	if (m_file.write(m_size, &buffer[0], buffer.size()) != static_cast<file::size_type>(buffer.size()))
+	{
+		return false;
+	}
+
+	seg.offset = m_size + detail::meta_store_header_size + key.size();
+	seg.size = static_cast<boost::uint32_t>(size);
+	seg.crc = crc;
+	m_size += buffer.size();
+
+	return true;
+}
+
+void meta_store::compact_impl(boost::system::error_code& ec)
+{
+	if (!m_file.is_open())
+	{
+		ec = boost::system::errc::make_error_code(boost::system::errc::bad_file_descriptor);
+		return;
+	}
+
+	// 每个key的有效数据合并为一个记录写入临时文件, 然后替换存储文件.
+	fs::path temp_path = m_path.string() + ".tmp";
+	index_type index;
+	boost::int64_t size = detail::meta_store_magic_size;
+	boost::int64_t live_size = 0;
+	{
+		file temp;
+		temp.open(temp_path, file::read_write, ec);
+		if (ec)
+		{
+			return;
+		}
+		temp.set_size(0, ec);
+		if (temp.write(0, detail::meta_store_magic, detail::meta_store_magic_size)
+			!= detail::meta_store_magic_size)
+		{
+			ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+			return;
+		}
+
+		std::vector<char> data;
+		std::vector<char> buffer;
+		for (index_type::iterator i = m_index.begin(); i != m_index.end(); i++)
+		{
+			// 与load相同, 只保留第一个损坏的记录之前的数据, 避免损坏的数据以新的crc保存下来.
+			data.clear();
+			for (segments::iterator s = i->second.begin(); s != i->second.end(); s++)
+			{
+				if (s->size == 0)
+				{
+					continue;
+				}
+				std::size_t pos = data.size();
+				data.resize(pos + s->size);
+				if (m_file.read(s->offset, &data[pos], s->size) != s->size
+					|| detail::meta_store_crc(&data[pos], s->size) != s->crc)
+				{
+					data.resize(pos);
+					break;
+				}
+			}
+
+			const std::string& key = i->first;
+			const char* p = data.empty() ? NULL : &data[0];
+			buffer.resize(detail::meta_store_header_size + key.size() + data.size());
+			segment seg;
+			seg.offset = size + detail::meta_store_header_size + key.size();
+			seg.size = static_cast<boost::uint32_t>(data.size());
+			seg.crc = detail::meta_store_crc(p, data.size());
+			buffer[0] = detail::meta_store_replace;
+			detail::meta_store_write_uint32(&buffer[1], static_cast<boost::uint32_t>(key.size()));
+			detail::meta_store_write_uint32(&buffer[5], seg.size);
+			detail::meta_store_write_uint32(&buffer[9], seg.crc);
+			std::memcpy(&buffer[detail::meta_store_header_size], key.data(), key.size());
+			if (!data.empty())
+			{
+				std::memcpy(&buffer[detail::meta_store_header_size + key.size()], p, data.size());
+			}
+			if (temp.write(size, &buffer[0], buffer.size()) != static_cast<file::size_type>(buffer.size()))
+			{
+				ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+				return;
+			}
+			size += buffer.size();
+			live_size += seg.size;
+			index[key].push_back(seg);
+		}
+
+		temp.flush();
+	}
+
+	m_file.close();
+	fs::rename(temp_path, m_path, ec);
+	boost::system::error_code open_ec;
+	m_file.open(m_path, file::read_write, open_ec);
+	if (ec || open_ec)
+	{
+		// 替换失败时原文件没有变化, 重新打开后索引仍然有效.
+		if (!ec)
+		{
+			ec = open_ec;
+		}
+		return;
+	}
+
+	m_index.swap(index);
+	m_size = size;
+	m_live_size = live_size;
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_META_STORE_IPP
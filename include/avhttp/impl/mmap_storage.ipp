@@ -0,0 +1,292 @@
+﻿//
+// impl/mmap_storage.ipp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_MMAP_STORAGE_IPP
+#define AVHTTP_MMAP_STORAGE_IPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <cstring>
+#include <vector>
+#include <algorithm>    // for std::min
+
+#ifndef WIN32
+#	include <cerrno>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#endif
+
+#include "avhttp/mmap_storage.hpp"
+#include "avhttp/logging.hpp"
+
+namespace avhttp {
+
+mmap_storage::window::~window()
+{
+#ifdef WIN32
+	::UnmapViewOfFile(data);
+#else
+	::munmap(data, size);
+#endif
+}
+
+mmap_storage::mmap_storage(std::size_t window_size, std::size_t max_windows)
+	: m_window_size(window_size)
+	, m_max_windows((std::max)(max_windows, std::size_t(1)))
+	, m_size(-1)
+#ifdef WIN32
+	, m_mapping(NULL)
+#endif
+{
+	BOOST_ASSERT(m_window_size > 0 && m_window_size % (64 * 1024) == 0);
+}
+
+mmap_storage::~mmap_storage()
+{
+	close();
+}
+
+void mmap_storage::close()
+{
+	unmap();
+	default_storge::close();
+}
+
+std::streamsize mmap_storage::write(const char* buf, boost::int64_t offset, int size)
+{
+	if (m_size == -1 || offset < 0 || offset + size > m_size)
+	{
+		return default_storge::write(buf, offset, size);
+	}
+
+	int written = 0;
+	while (written < size)
+	{
+		window_ptr w = map_window(offset + written);
+		if (!w)
+		{
+			// 映射失败, 剩余的数据直接写入文件.
+			std::streamsize ret = default_storge::write(buf + written, offset + written, size - written);
+			return ret < 0 ? ret : written + ret;
+		}
+
+		std::size_t pos = static_cast<std::size_t>(offset + written - w->offset);
+		std::size_t bytes = (std::min)(static_cast<std::size_t>(size - written), w->size - pos);
+		std::memcpy(w->data + pos, buf + written, bytes);
+		written += static_cast<int>(bytes);
+	}
+
+	return written;
+}
+
+std::streamsize mmap_storage::read(char* buf, boost::int64_t offset, int size)
+{
+	if (m_size == -1 || offset < 0)
+	{
+		return default_storge::read(buf, offset, size);
+	}
+
+	// 与读取文件一样, 超过文件尾的部分不读取.
+	if (offset >= m_size)
+	{
+		return 0;
+	}
+	if (size > m_size - offset)
+	{
+		size = static_cast<int>(m_size - offset);
+	}
+
+	int bytes_read = 0;
+	while (bytes_read < size)
+	{
+		window_ptr w = map_window(offset + bytes_read);
+		if (!w)
+		{
+			std::streamsize ret = default_storge::read(buf + bytes_read, offset + bytes_read, size - bytes_read);
+			return ret < 0 ? ret : bytes_read + ret;
+		}
+
+		std::size_t pos = static_cast<std::size_t>(offset + bytes_read - w->offset);
+		std::size_t bytes = (std::min)(static_cast<std::size_t>(size - bytes_read), w->size - pos);
+		std::memcpy(buf + bytes_read, w->data + pos, bytes);
+		bytes_read += static_cast<int>(bytes);
+	}
+
+	return bytes_read;
+}
+
+bool mmap_storage::sync()
+{
+	bool ok = true;
+
+#ifdef __linux__
+	// linux下映射与文件共用页缓存, fdatasync会同时写回映射中修改的页面.
+#else
+	std::vector<window_ptr> windows;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_mutex);
+#endif
+		windows.assign(m_windows.begin(), m_windows.end());
+	}
+
+	for (std::size_t i = 0; i < windows.size(); i++)
+	{
+#ifdef WIN32
+		if (!::FlushViewOfFile(windows[i]->data, windows[i]->size))
+#else
+		if (::msync(windows[i]->data, windows[i]->size, MS_SYNC) != 0)
+#endif
+		{
+			ok = false;
+		}
+	}
+#endif // __linux__
+
+	return default_storge::sync() && ok;
+}
+
+void mmap_storage::allocate(boost::int64_t size, boost::system::error_code& ec)
+{
+	unmap();
+
+	m_file.set_size(size, ec);
+	if (ec || size == 0)
+	{
+		return;
+	}
+
+#ifdef WIN32
+	m_mapping = ::CreateFileMappingA(m_file.native_handle(), NULL, PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xffffffff), NULL);
+	if (m_mapping == NULL)
+	{
+		AVHTTP_LOG_WARN << "Create file mapping failed, error: " << ::GetLastError();
+		return;
+	}
+#endif
+
+	m_size = size;
+}
+
+boost::shared_ptr<const char> mmap_storage::view(boost::int64_t offset,
+	std::size_t size, std::size_t& length)
+{
+	length = 0;
+	if (m_size == -1 || offset < 0 || offset >= m_size || size == 0)
+	{
+		return boost::shared_ptr<const char>();
+	}
+
+	window_ptr w = map_window(offset);
+	if (!w)
+	{
+		return boost::shared_ptr<const char>();
+	}
+
+	std::size_t pos = static_cast<std::size_t>(offset - w->offset);
+	length = (std::min)(size, w->size - pos);
+
+	// 视图与窗口共用引用计数, 保证视图释放前窗口不被解除映射.
+	return boost::shared_ptr<const char>(w, w->data + pos);
+}
+
+bool mmap_storage::is_mapped() const
+{
+	return m_size != -1;
+}
+
+mmap_storage::window_ptr mmap_storage::map_window(boost::int64_t offset)
+{
+	boost::int64_t base = offset - offset % m_window_size;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_mutex);
+#endif
+
+	std::map<boost::int64_t, window_list::iterator>::iterator found = m_index.find(base);
+	if (found != m_index.end())
+	{
+		// 移到最前面, 表示最近使用过.
+		m_windows.splice(m_windows.begin(), m_windows, found->second);
+		return m_windows.front();
+	}
+
+	if (m_size == -1)
+	{
+		return window_ptr();
+	}
+
+	std::size_t size = static_cast<std::size_t>((std::min)(
+		static_cast<boost::int64_t>(m_window_size), m_size - base));
+
+#ifdef WIN32
+	void* data = ::MapViewOfFile(m_mapping, FILE_MAP_WRITE,
+		static_cast<DWORD>(base >> 32), static_cast<DWORD>(base & 0xffffffff), size);
+	if (data == NULL)
+	{
+		AVHTTP_LOG_WARN << "Map view of file failed, error: " << ::GetLastError();
+		return window_ptr();
+	}
+#else
+	void* data = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		m_file.native_handle(), static_cast<off_t>(base));
+	if (data == MAP_FAILED)
+	{
+		AVHTTP_LOG_WARN << "Map file failed, errno: " << errno;
+		return window_ptr();
+	}
+	// 各个连接在窗口中顺序写入, 读取数据时也大多是顺序的.
+	::madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+	window_ptr w(new window);
+	w->offset = base;
+	w->data = static_cast<char*>(data);
+	w->size = size;
+
+	m_windows.push_front(w);
+	m_index[base] = m_windows.begin();
+
+	// 超出地址空间预算时解除最久未使用的窗口.
+	while (m_windows.size() > m_max_windows)
+	{
+		m_index.erase(m_windows.back()->offset);
+		m_windows.pop_back();
+	}
+
+	return w;
+}
+
+void mmap_storage::unmap()
+{
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_mutex);
+#endif
+		m_index.clear();
+		m_windows.clear();
+		m_size = -1;
+	}
+
+#ifdef WIN32
+	if (m_mapping != NULL)
+	{
+		::CloseHandle(m_mapping);
+		m_mapping = NULL;
+	}
+#endif
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_MMAP_STORAGE_IPP
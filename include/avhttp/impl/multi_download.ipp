@@ -18,22 +18,71 @@
 #include "avhttp/http_stream.hpp"
 #include "avhttp/default_storage.hpp"
 
+#ifdef __linux__
+#	include <cerrno>
+#	include <fcntl.h>
+#endif
+
 namespace avhttp {
 
+#ifdef AVHTTP_ATOMIC_STATE
+template <typename T>
+struct multi_download::copyable_atomic : public boost::atomic<T>
+{
+	copyable_atomic(T v = T())
+		: boost::atomic<T>(v)
+	{}
+
+	copyable_atomic(const copyable_atomic& other)
+		: boost::atomic<T>(other.load())
+	{}
+
+	copyable_atomic& operator=(T v)
+	{
+		this->store(v);
+		return *this;
+	}
+
+	copyable_atomic& operator=(const copyable_atomic& other)
+	{
+		this->store(other.load());
+		return *this;
+	}
+};
+#endif
+
 struct multi_download::http_stream_object
 {
 	http_stream_object()
 		: request_range(0, 0)
 		, bytes_transferred(0)
 		, bytes_downloaded(0)
+		, position(0)
+		, position_end(0)
+		, multi_range(false)
 		, request_count(0)
+		, request_size(0)
+		, rtt(-1)
+		, throughput(0)
+		, response_bytes(0)
+		, written_left(0)
+		, written_right(0)
+		, multipart(false)
 		, done(false)
 		, direct_reconnect(false)
+		, retire(false)
+		, preempt(false)
+		, write_wait(false)
+		, splice_disabled(false)
+		, open_ended(false)
 	{}
 
 	// http_stream对象.
 	http_stream_ptr stream;
 
+	// 连接所属的strand, 该连接上的所有回调都通过它串行执行.
+	strand_ptr strand;
+
 	// 数据缓冲, 下载时的缓冲.
 	boost::array<char, default_buffer_size> buffer;
 
@@ -44,12 +93,65 @@ struct multi_download::http_stream_object
 	// bytes_transferred自动置为0.
 	boost::int64_t bytes_transferred;
 
-	// 当前对象下载的数据统计.
-	boost::int64_t bytes_downloaded;
+	// 当前对象下载的数据统计, tick中累加计算下载速率.
+	object_int64 bytes_downloaded;
+
+	// 供tick读取的状态快照: 当前读取位置, 区间结束位置(不含)以及是否为多区间请求.
+	// request_range, bytes_transferred和ranges只在连接的strand中访问, 修改后由
+	// publish更新快照, 这样tick在选择抢占的连接时不会与strand并发访问它们.
+	object_int64 position;
+	object_int64 position_end;
+	object_bool multi_range;
+
+	void publish()
+	{
+		position = request_range.left + bytes_transferred;
+		position_end = request_range.right + 1;
+		multi_range = !ranges.empty();
+	}
 
 	// 当前对象发起请求的次数.
 	int request_count;
 
+	// 下一次请求的大小, 根据连接的下载速率和往返时间计算, 0为默认大小.
+	boost::int64_t request_size;
+
+	// 往返时间的平滑值, 单位毫秒, -1为未知.
+	int rtt;
+
+	// 下载速率的平滑值, 单位byte/s, 0为未知.
+	boost::int64_t throughput;
+
+	// 发起请求的时间, 用于计算往返时间.
+	boost::posix_time::ptime request_time;
+
+	// 收到响应的时间, 用于计算区间的下载速率.
+	boost::posix_time::ptime response_time;
+
+	// 收到响应时本次请求已经下载的数据, 断点重连时不为0.
+	boost::int64_t response_bytes;
+
+	// 已经写入存储但还没有更新到m_downlaoded_field的连续区间[written_left, written_right),
+	// 只在连接的strand中访问, 到分片边界时才更新共享的下载区间位图.
+	// 启用写缓存时, 这个区间的数据保存在write_buffer中, 还没有写入存储.
+	boost::int64_t written_left;
+	boost::int64_t written_right;
+
+	// 写缓冲, 满一块后交给后台线程写入.
+	boost::shared_ptr<std::vector<char> > write_buffer;
+
+	// 多区间请求的所有区间, 第一个即为request_range, 为空时只请求request_range.
+	std::vector<range> ranges;
+
+	// 多区间请求中每个区间已经下载的字节数, 用于出错时释放没有下载的部分.
+	std::vector<boost::int64_t> ranges_received;
+
+	// 响应是否为multipart/byteranges.
+	bool multipart;
+
+	// 解析multipart/byteranges响应.
+	detail::byteranges_parser parser;
+
 	// 最后请求的时间.
 	boost::posix_time::ptime last_request_time;
 
@@ -57,21 +159,53 @@ struct multi_download::http_stream_object
 	boost::system::error_code ec;
 
 	// 是否操作功能完成.
-	bool done;
+	object_bool done;
 
 	// 立即重新尝试连接.
-	bool direct_reconnect;
+	object_bool direct_reconnect;
+
+	// 连接数被调低时标记为退役, 当前区间下载完成后即关闭, 不再分配新的区间.
+	object_bool retire;
+
+	// 被预读抢占, 放弃当前区间剩余的部分, 重新从读取点分配区间.
+	object_bool preempt;
+
+	// 因写缓存已满, 流式处理或限速暂停读取, 暂停期间不计算超时.
+	bool write_wait;
+
+	// 启用零拷贝时, 用于把socket中的数据移动到文件的管道.
+	boost::shared_ptr<detail::splice_pipe> pipe;
+
+	// splice失败, 这个连接不再使用splice.
+	bool splice_disabled;
+
+	// 请求没有指定结束位置(即启动时的bytes=0-), 服务器会一直发送到文件尾,
+	// 所以下载完分配的区间后必须断开重新连接.
+	bool open_ended;
+};
+
+struct multi_download::fetch_request
+{
+	// 读取数据的偏移位置.
+	boost::int64_t offset;
+
+	// 读取数据的大小.
+	std::size_t length;
+
+	// 数据下载完成后调用, 读取数据并回调用户的handler.
+	boost::function<void (const boost::system::error_code&)> handler;
 };
 
 struct multi_download::download_stat
 {
 	download_stat()
-		: bytes(0)
+		: last_bytes(0)
 		, rate(0)
 	{}
 
-	// 字节每秒计数.
-	int bytes;
+	// 上一次on_tick时所有连接已经下载的字节总数, 由各连接的bytes_downloaded
+	// 累加得到, 这样读取数据时无需修改共享的计数.
+	boost::int64_t last_bytes;
 
 	// 下载速率.
 	int rate;
@@ -95,6 +229,7 @@ struct multi_download::auto_outstanding
 
 multi_download::multi_download(boost::asio::io_service& io)
 	: m_io_service(io)
+	, m_io_service_pool(NULL)
 	, m_accept_multi(false)
 	, m_keep_alive(false)
 	, m_file_size(-1)
@@ -102,11 +237,73 @@ multi_download::multi_download(boost::asio::io_service& io)
 	, m_download_rate(new download_stat())
 	, m_number_of_connections(0)
 	, m_time_total(0)
+	, m_legacy_storage(NULL)
+	, m_remote_changed(false)
+	, m_multi_range(true)
+	, m_meta_size(0)
+	, m_meta_snapshot_size(0)
+	, m_download_point(0)
+	, m_read_ahead(false)
+	, m_syncing(false)
+	, m_sync_elapsed(0)
+	, m_write_bytes(0)
+	, m_finish_pending(false)
+	, m_rate_bytes(0)
+	, m_rate_timer(io)
+	, m_rate_timer_armed(false)
+	, m_outstanding(0)
+	, m_hash_piece_size(0)
+	, m_digest_point(0)
+	, m_digesting(false)
+	, m_hash_failures(0)
+	, m_meta_compact(false)
+	, m_stream_point(0)
+	, m_streaming(false)
+	, m_stream_pending(false)
+	, m_stream_eof(false)
+	, m_abort(true)
+	, m_external_tick(false)
+{}
+
+#ifndef AVHTTP_DISABLE_THREAD
+multi_download::multi_download(io_service_pool& pool)
+	: m_io_service(pool.get_io_service())
+	, m_io_service_pool(&pool)
+	, m_accept_multi(false)
+	, m_keep_alive(false)
+	, m_file_size(-1)
+	, m_timer(m_io_service)
+	, m_download_rate(new download_stat())
+	, m_number_of_connections(0)
+	, m_time_total(0)
+	, m_legacy_storage(NULL)
+	, m_remote_changed(false)
+	, m_multi_range(true)
+	, m_meta_size(0)
+	, m_meta_snapshot_size(0)
 	, m_download_point(0)
-	, m_drop_size(-1)
+	, m_read_ahead(false)
+	, m_syncing(false)
+	, m_sync_elapsed(0)
+	, m_write_bytes(0)
+	, m_finish_pending(false)
+	, m_rate_bytes(0)
+	, m_rate_timer(m_io_service)
+	, m_rate_timer_armed(false)
 	, m_outstanding(0)
+	, m_hash_piece_size(0)
+	, m_digest_point(0)
+	, m_digesting(false)
+	, m_hash_failures(0)
+	, m_meta_compact(false)
+	, m_stream_point(0)
+	, m_streaming(false)
+	, m_stream_pending(false)
+	, m_stream_eof(false)
 	, m_abort(true)
+	, m_external_tick(false)
 {}
+#endif
 
 multi_download::~multi_download()
 {
@@ -143,25 +340,13 @@ void multi_download::start(const std::string& u, const settings& s)
 void multi_download::start(const std::string& u, const settings& s, boost::system::error_code& ec)
 {
 	auto_outstanding ao(*this);
-	// 清空所有连接.
-	{
-#ifndef AVHTTP_DISABLE_THREAD
-		boost::mutex::scoped_lock lock(m_streams_mutex);
-#endif
-		m_streams.clear();
-	}
-
-	// 默认文件大小为-1.
-	m_file_size = -1;
-
-	// 保存设置.
-	m_settings = s;
+	// 清空上一次下载的状态并保存设置.
+	reset_state(s);
 
 	// 将url转换成utf8编码.
 	std::string utf8 = detail::ansi_utf8(u);
 	utf8 = detail::escape_path(utf8);
 	m_final_url = utf8;
-	m_file_name = "";
 
 	// 创建一个http_stream对象.
 	http_object_ptr obj = boost::make_shared<http_stream_object>();
@@ -171,7 +356,7 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 	req_opt.insert(http_options::connection, "keep-alive");
 
 	// 创建http_stream并同步打开, 检查返回状态码是否为206, 如果非206则表示该http服务器不支持多点下载.
-	obj->stream = boost::make_shared<http_stream>(boost::ref(m_io_service));
+	create_stream(*obj);
 	http_stream& h = *obj->stream;
 	// 添加代理设置.
 	h.proxy(m_settings.proxy);
@@ -255,6 +440,7 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 		m_file_size = file_size;
 		m_rangefield.reset(m_file_size);
 		m_downlaoded_field.reset(m_file_size);
+		m_meta_pending.reset(m_file_size);
 	}
 
 	// 是否有指定的文件名, 检查Content-Disposition: attachment; filename="file.zip"
@@ -270,6 +456,9 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 		}
 	}
 
+	// 保存文件的ETag/Last-Modified, 用于续传时确认文件没有变化.
+	save_validators(h);
+
 	// 是否支持长连接模式, 不支持多点下载, 长连接也没有意义.
 	if (m_accept_multi)
 	{
@@ -296,47 +485,28 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 		if (!open_meta(m_settings.meta_file))
 		{
 			// 位图打开失败, 无所谓, 下载过程中会创建新的位图, 删除meta文件.
-			m_file_meta.close();
-			boost::system::error_code ignore;
-			fs::remove(m_settings.meta_file, ignore);
+			remove_meta();
 		}
 	}
 
-	// 判断文件是否已经下载完成, 完成则直接返回.
-	if (m_downlaoded_field.is_full())
+	// 打开存储, 完成续传的准备, 文件已经下载完成时直接返回.
+	if (!prepare_storage(ec))
 	{
 		return;
 	}
 
-	// 创建存储对象.
-	if (!s.storage)
-	{
-		m_storage.reset(default_storage_constructor());
-	}
-	else
-	{
-		m_storage.reset(s.storage());
-	}
-	BOOST_ASSERT(m_storage);
-
-	// 打开文件, 构造文件名.
-	m_storage->open(boost::filesystem::path(file_name()), ec);
+	// 差分下载, 先从旧版本的文件中复制相同的块, 同步启动本来就会阻塞调用者.
+	apply_seed(ec);
 	if (ec)
 	{
 		return;
 	}
 
-	// 保存限速大小.
-	m_drop_size = s.download_rate_limit;
-
-	// 处理默认设置.
-	if (m_settings.connections_limit == -1)
-	{
-		m_settings.connections_limit = default_connections_limit;
-	}
-	if (m_settings.piece_size == -1 && m_file_size != -1)
+	// 初始化分片校验.
+	init_verify(ec);
+	if (ec)
 	{
-		m_settings.piece_size = default_piece_size(m_file_size);
+		return;
 	}
 
 	// 根据第1个连接返回的信息, 重新设置请求选项.
@@ -385,13 +555,20 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 			// 保存请求区间.
 			obj->request_range = req_range;
 
+			// 需要重新请求时, 可以同时请求其它的空隙.
+			if (need_reopen)
+			{
+				allocate_extra_ranges(*obj);
+			}
+			obj->publish();
+
 			// 设置请求区间到请求选项中.
 			req_opt.remove(http_options::range);
-			req_opt.insert(http_options::range, boost::str(
-				boost::format("bytes=%lld-%lld", std::locale("C")) % req_range.left % req_range.right));
+			req_opt.insert(http_options::range, range_option(*obj, req_range.left));
 
 			// 保存最后请求时间, 用于检查超时重置.
 			obj->last_request_time = boost::posix_time::microsec_clock::local_time();
+			obj->request_time = obj->last_request_time;
 
 			// 添加代理设置.
 			h.proxy(m_settings.proxy);
@@ -413,24 +590,31 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 				change_outstranding(true);
 				// 开始异步打开.
 				h.async_open(m_final_url,
-					boost::bind(&multi_download::handle_open,
-						this,
-						0, obj,
-						boost::asio::placeholders::error
+					obj->strand->wrap(
+						boost::bind(&multi_download::handle_open,
+							this,
+							0, obj,
+							boost::asio::placeholders::error
+						)
 					)
 				);
 			}
 			else
 			{
+				// 继续使用启动时bytes=0-的请求读取分配的区间.
+				obj->open_ended = true;
+
 				// 发起数据读取请求.
 				change_outstranding(true);
 				// 传入指针obj, 以确保多线程安全.
 				h.async_read_some(boost::asio::buffer(obj->buffer, available_bytes),
-					boost::bind(&multi_download::handle_read,
-						this,
-						0, obj,
-						boost::asio::placeholders::bytes_transferred,
-						boost::asio::placeholders::error
+					obj->strand->wrap(
+						boost::bind(&multi_download::handle_read,
+							this,
+							0, obj,
+							boost::asio::placeholders::bytes_transferred,
+							boost::asio::placeholders::error
+						)
 					)
 				);
 			}
@@ -448,11 +632,13 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 		change_outstranding(true);
 		// 传入指针obj, 以确保多线程安全.
 		h.async_read_some(boost::asio::buffer(obj->buffer, available_bytes),
-			boost::bind(&multi_download::handle_read,
-				this,
-				0, obj,
-				boost::asio::placeholders::bytes_transferred,
-				boost::asio::placeholders::error
+			obj->strand->wrap(
+				boost::bind(&multi_download::handle_read,
+					this,
+					0, obj,
+					boost::asio::placeholders::bytes_transferred,
+					boost::asio::placeholders::error
+				)
 			)
 		);
 	}
@@ -462,38 +648,15 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 	{
 		for (int i = 1; i < m_settings.connections_limit; i++)
 		{
-			http_object_ptr p = boost::make_shared<http_stream_object>();
-			http_stream_ptr ptr = boost::make_shared<http_stream>(boost::ref(m_io_service));
-			range req_range;
-
-			// 从文件间区中得到一段空间.
-			if (!allocate_range(req_range))
+			// 创建新的连接并开始异步打开, 分配空间失败说明可能已经没有空闲的空间
+			// 提供给这个stream进行下载了, 直接跳过好了.
+			http_object_ptr p = create_connection(i);
+			if (!p)
 			{
-				// 分配空间失败, 说明可能已经没有空闲的空间提供给这个stream进行下载了直接跳过好了.
-				p->done = true;
 				continue;
 			}
 
-			// 保存请求区间.
-			p->request_range = req_range;
-
-			// 设置请求区间到请求选项中.
-			req_opt.remove(http_options::range);
-			req_opt.insert(http_options::range, boost::str(
-				boost::format("bytes=%lld-%lld", std::locale("C")) % req_range.left % req_range.right));
-
-			// 设置请求选项.
-			ptr->request_options(req_opt);
-			// 如果是ssl连接, 默认为检查证书.
-			ptr->check_certificate(m_settings.check_certificate);
-			// 禁用重定向.
-			ptr->max_redirects(0);
-			// 添加代理设置.
-			ptr->proxy(m_settings.proxy);
-
 			// 将连接添加到容器中.
-			p->stream = ptr;
-
 			{
 #ifndef AVHTTP_DISABLE_THREAD
 				boost::mutex::scoped_lock lock(m_streams_mutex);
@@ -501,27 +664,15 @@ void multi_download::start(const std::string& u, const settings& s, boost::syste
 				m_streams.push_back(p);
 			}
 
-			// 保存最后请求时间, 方便检查超时重置.
-			p->last_request_time = boost::posix_time::microsec_clock::local_time();
-
 			m_number_of_connections++;
-			change_outstranding(true);
-
-			// 开始异步打开, 传入指针http_object_ptr, 以确保多线程安全.
-			p->stream->async_open(m_final_url,
-				boost::bind(&multi_download::handle_open,
-					this,
-					i, p,
-					boost::asio::placeholders::error
-				)
-			);
 		}
 	}
 
-	change_outstranding(true);
-	// 开启定时器, 执行任务.
-	m_timer.expires_from_now(boost::posix_time::seconds(1));
-	m_timer.async_wait(boost::bind(&multi_download::on_tick, this, boost::asio::placeholders::error));
+	// 开启定时器, 执行任务, 由外部驱动tick时不需要定时器.
+	if (!m_external_tick)
+	{
+		start_timer();
+	}
 
 	return;
 }
@@ -536,23 +687,13 @@ void multi_download::async_start(const std::string& u, Handler handler)
 template <typename Handler>
 void multi_download::async_start(const std::string& u, const settings& s, Handler handler)
 {
-	// 清空所有连接.
-	{
-#ifndef AVHTTP_DISABLE_THREAD
-		boost::mutex::scoped_lock lock(m_streams_mutex);
-#endif
-		m_streams.clear();
-	}
-
-	// 清空文件大小.
-	m_file_size = -1;
+	// 清空上一次下载的状态并保存设置.
+	reset_state(s);
 
 	// 保存参数.
 	std::string utf8 = detail::ansi_utf8(u);
 	utf8 = detail::escape_path(utf8);
 	m_final_url = utf8;
-	m_file_name = "";
-	m_settings = s;
 
 	// 设置状态.
 	m_abort = false;
@@ -565,7 +706,7 @@ void multi_download::async_start(const std::string& u, const settings& s, Handle
 	req_opt.insert(http_options::connection, "keep-alive");
 
 	// 创建http_stream并同步打开, 检查返回状态码是否为206, 如果非206则表示该http服务器不支持多点下载.
-	obj->stream = boost::make_shared<http_stream>(boost::ref(m_io_service));
+	create_stream(*obj);
 	http_stream& h = *obj->stream;
 
 	// 设置请求选项.
@@ -578,10 +719,12 @@ void multi_download::async_start(const std::string& u, const settings& s, Handle
 	change_outstranding(true);
 	typedef boost::function<void (boost::system::error_code)> HandlerWrapper;
 	h.async_open(m_final_url,
-		boost::bind(&multi_download::handle_start<HandlerWrapper>,
-			this,
-			HandlerWrapper(handler), obj,
-			boost::asio::placeholders::error
+		obj->strand->wrap(
+			boost::bind(&multi_download::handle_start<HandlerWrapper>,
+				this,
+				HandlerWrapper(handler), obj,
+				boost::asio::placeholders::error
+			)
 		)
 	);
 
@@ -592,8 +735,22 @@ void multi_download::stop()
 {
 	m_abort = true;
 
-	boost::system::error_code ignore;
-	m_timer.cancel(ignore);
+	// 定时器不是线程安全的, m_timer投递到m_io_service中取消, m_rate_timer
+	// 与defer_rate一样在m_rate_mutex保护下取消.
+	cancel_timer();
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rate_mutex);
+#endif
+		boost::system::error_code ignore;
+		m_rate_timer.cancel(ignore);
+	}
+
+	// 取消所有等待数据的异步读取请求.
+	check_fetch_requests(boost::asio::error::operation_aborted);
+
+	// 恢复因流式处理暂停的连接, 连接关闭后读取将返回错误.
+	resume_stream_waiters();
 
 #ifndef AVHTTP_DISABLE_THREAD
 	boost::mutex::scoped_lock lock(m_streams_mutex);
@@ -603,7 +760,7 @@ void multi_download::stop()
 		const http_object_ptr& ptr = m_streams[i];
 		if (ptr && ptr->stream)
 		{
-			ptr->stream->close(ignore);
+			close_stream(ptr);
 		}
 	}
 }
@@ -612,14 +769,6 @@ template <typename MutableBufferSequence>
 std::size_t multi_download::fetch_data(const MutableBufferSequence& buffers,
 	boost::int64_t offset)
 {
-	if (!m_storage) // 没有存储设备, 无法获得数据.
-	{
-		return 0;
-	}
-
-	// 更新下载点位置.
-	m_download_point = offset;
-
 	// 得到用户缓冲大小, 以确定最大读取字节数.
 	std::size_t buffer_length = 0;
 	{
@@ -633,117 +782,314 @@ std::size_t multi_download::fetch_data(const MutableBufferSequence& buffers,
 		}
 	}
 
-	// 得到offset后面可读取的数据大小, 使用折半法来获得可读空间大小.
-	while (buffer_length != 0)
-	{
-		if (m_downlaoded_field.check_range(offset, buffer_length))
-		{
-			break;
-		}
-		buffer_length /= 2;
-	}
+	buffer_length = readable_length(offset, buffer_length);
 
 	// 读取数据.
 	if (buffer_length != 0)
 	{
-		std::size_t available_length = buffer_length;
-		boost::int64_t offset_for_read = offset;
+		buffer_length = read_data(buffers, offset, buffer_length);
+	}
+
+	return buffer_length;
+}
 
+template <typename MutableBufferSequence, typename Handler>
+void multi_download::async_fetch(boost::int64_t offset,
+	const MutableBufferSequence& buffers, Handler handler)
+{
+	// 得到用户缓冲大小, 以确定最大读取字节数.
+	std::size_t buffer_length = 0;
+	{
 		typename MutableBufferSequence::const_iterator iter = buffers.begin();
 		typename MutableBufferSequence::const_iterator end = buffers.end();
 		// 计算得到用户buffers的总大小.
 		for (; iter != end; ++iter)
 		{
 			boost::asio::mutable_buffer buffer(*iter);
+			buffer_length += boost::asio::buffer_size(buffer);
+		}
+	}
 
-			char* buffer_ptr = boost::asio::buffer_cast<char*>(buffer);
-			std::size_t buffer_size = boost::asio::buffer_size(buffer);
-
-			if ((boost::int64_t)available_length - (boost::int64_t)buffer_size < 0)
-				buffer_size = available_length;
+	// 没有存储设备或不知道文件大小, 无法等待数据.
+	boost::system::error_code ec;
+	if (!m_storage || m_file_size == -1)
+	{
+		ec = boost::asio::error::operation_not_supported;
+	}
+	else if (offset < 0 || offset > m_file_size)
+	{
+		ec = boost::asio::error::invalid_argument;
+	}
+	else if (offset == m_file_size)
+	{
+		ec = boost::asio::error::eof;
+	}
 
-			std::size_t length = m_storage->read(buffer_ptr, offset_for_read, buffer_size);
-			BOOST_ASSERT(length == buffer_size);
-			offset_for_read += length;
-			available_length -= length;
+	if (ec || buffer_length == 0)
+	{
+		m_io_service.post(boost::asio::detail::bind_handler(handler, ec, 0));
+		return;
+	}
 
-			if (available_length == 0)
-			{
-				break;
-			}
-		}
-		// 计算实际读取的字节数.
-		buffer_length = offset_for_read - offset;
+	// 到文件尾时只等待剩余的数据.
+	if (static_cast<boost::int64_t>(buffer_length) > m_file_size - offset)
+	{
+		buffer_length = static_cast<std::size_t>(m_file_size - offset);
 	}
 
-	return buffer_length;
-}
+	// 更新下载点位置, 之后分配的区间将从offset开始.
+	move_read_point(offset);
 
-const settings& multi_download::set() const
-{
-	return m_settings;
-}
+	fetch_request request;
+	request.offset = offset;
+	request.length = buffer_length;
+	request.handler = boost::bind(
+		&multi_download::handle_fetch<MutableBufferSequence, Handler>,
+		this, buffers, offset, buffer_length, handler, boost::asio::placeholders::error);
 
-bool multi_download::stopped() const
-{
-	if (m_abort)
 	{
 #ifndef AVHTTP_DISABLE_THREAD
-		boost::mutex::scoped_lock lock(m_outstanding_mutex);
+		boost::mutex::scoped_lock lock(m_fetch_mutex);
 #endif
-		if (m_outstanding == 0)
+		if (m_abort)
 		{
-			return true;
+			ec = boost::asio::error::operation_aborted;
+		}
+		else
+		{
+			m_fetch_requests.push_back(request);
 		}
 	}
-	return false;
+
+	if (ec)
+	{
+		m_io_service.post(boost::asio::detail::bind_handler(handler, ec, 0));
+		return;
+	}
+
+	// 数据可能已经下载完成.
+	check_fetch_requests();
 }
 
-bool multi_download::wait_for_complete()
+template <typename MutableBufferSequence, typename Handler>
+void multi_download::handle_fetch(const MutableBufferSequence& buffers,
+	boost::int64_t offset, std::size_t length, Handler handler,
+	const boost::system::error_code& ec)
 {
-	while (!stopped())
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	if (ec)
 	{
-		if (!m_abort)
-		{
-			boost::mutex::scoped_lock l(m_quit_mtx);
-			m_quit_cond.wait(l);
-		}
+		handler(ec, 0);
+		return;
 	}
-	// 检查是否下载完成, 完成返回true, 否则返回false.
-	boost::int64_t fs = m_file_size;
-	if (fs != -1)
+
+	// 运行在m_io_service中, 不能阻塞读取存储, 交给存储异步读取.
+	async_storage_interface::mutable_buffers_type read_buffers;
+	std::size_t left = length;
+	typename MutableBufferSequence::const_iterator iter = buffers.begin();
+	typename MutableBufferSequence::const_iterator end = buffers.end();
+	for (; iter != end && left != 0; ++iter)
 	{
-		if (fs != bytes_download())
-		{
-			return false;	// 未下载完成.
-		}
+		boost::asio::mutable_buffer buffer(*iter);
+		std::size_t size = (std::min)(boost::asio::buffer_size(buffer), left);
+		read_buffers.push_back(boost::asio::buffer(buffer, size));
+		left -= size;
 	}
 
-	return true; // 下载完成.
+	change_outstranding(true);
+	m_storage->async_read(offset, read_buffers,
+		boost::bind(&multi_download::handle_fetch_read<Handler>, this, handler,
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
 }
 
-void multi_download::check_certificate(bool check)
+template <typename Handler>
+void multi_download::handle_fetch_read(Handler handler,
+	const boost::system::error_code& ec, std::size_t bytes_transferred)
 {
-	m_settings.check_certificate = check;
-}
+	auto_outstanding ao(*this);
+	change_outstranding(false);
 
-boost::int64_t multi_download::file_size() const
-{
-	return m_file_size;
+	// 存储的回调可能运行在存储的线程中, 回到m_io_service中回调用户的handler.
+	m_io_service.post(boost::asio::detail::bind_handler(handler, ec, bytes_transferred));
 }
 
-std::string multi_download::meta_name(const std::string& url) const
+template <typename MutableBufferSequence>
+std::size_t multi_download::read_data(const MutableBufferSequence& buffers,
+	boost::int64_t offset, std::size_t length)
 {
-	// 使用url的crc作为文件名, 这样只要url是确定的, 那么就不会找错meta文件.
-	boost::crc_32_type result;
-	result.process_bytes(url.c_str(), url.size());
-	std::stringstream ss;
-	ss.imbue(std::locale("C"));
-	ss << std::hex << result.checksum() << ".meta";
-	return ss.str();
-}
+	std::size_t available_length = length;
+	boost::int64_t offset_for_read = offset;
 
-std::string multi_download::file_name() const
+	typename MutableBufferSequence::const_iterator iter = buffers.begin();
+	typename MutableBufferSequence::const_iterator end = buffers.end();
+	for (; iter != end && available_length != 0; ++iter)
+	{
+		boost::asio::mutable_buffer buffer(*iter);
+
+		char* buffer_ptr = boost::asio::buffer_cast<char*>(buffer);
+		std::size_t buffer_size = boost::asio::buffer_size(buffer);
+
+		if ((boost::int64_t)available_length - (boost::int64_t)buffer_size < 0)
+			buffer_size = available_length;
+
+		std::size_t read_length = 0;
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+			// 存储支持视图时直接从视图复制, 省去读取的系统调用.
+			while (read_length < buffer_size)
+			{
+				std::size_t length = 0;
+				boost::shared_ptr<const char> view = m_storage->view(
+					offset_for_read + read_length, buffer_size - read_length, length);
+				if (!view)
+				{
+					break;
+				}
+				std::memcpy(buffer_ptr + read_length, view.get(), length);
+				read_length += length;
+			}
+			if (read_length < buffer_size)
+			{
+				boost::system::error_code ec;
+				read_length += m_storage->read(offset_for_read + read_length,
+					async_storage_interface::mutable_buffers_type(1, boost::asio::buffer(
+						buffer_ptr + read_length, buffer_size - read_length)), ec);
+			}
+		}
+		BOOST_ASSERT(read_length == buffer_size);
+		offset_for_read += read_length;
+		available_length -= read_length;
+	}
+
+	// 返回实际读取的字节数.
+	return static_cast<std::size_t>(offset_for_read - offset);
+}
+
+boost::shared_ptr<const char> multi_download::fetch_view(boost::int64_t offset,
+	std::size_t size, std::size_t& length)
+{
+	length = readable_length(offset, size);
+	if (length == 0)
+	{
+		return boost::shared_ptr<const char>();
+	}
+
+	boost::shared_ptr<const char> view;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+		view = m_storage->view(offset, length, length);
+	}
+
+	return view;
+}
+
+std::size_t multi_download::readable_length(boost::int64_t offset, std::size_t length)
+{
+	if (!m_storage) // 没有存储设备, 无法获得数据.
+	{
+		return 0;
+	}
+
+	// 更新下载点位置.
+	move_read_point(offset);
+
+	return downloaded_length(offset, length);
+}
+
+std::size_t multi_download::downloaded_length(boost::int64_t offset, std::size_t length)
+{
+	// 不能超过文件尾.
+	if (offset < 0 || offset >= m_file_size || length == 0)
+	{
+		return 0;
+	}
+	if (static_cast<boost::int64_t>(length) > m_file_size - offset)
+	{
+		length = static_cast<std::size_t>(m_file_size - offset);
+	}
+
+	// 直接取得包含offset的已下载区间, 截断到请求的长度.
+	boost::int64_t left = offset;
+	boost::int64_t right = offset + length;
+	if (!m_downlaoded_field.get_range(left, right))
+	{
+		return 0;
+	}
+
+	return static_cast<std::size_t>(right - offset);
+}
+
+const settings& multi_download::set() const
+{
+	return m_settings;
+}
+
+bool multi_download::stopped() const
+{
+	if (m_abort)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_outstanding_mutex);
+#endif
+		if (m_outstanding == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool multi_download::wait_for_complete()
+{
+	while (!stopped())
+	{
+		if (!m_abort)
+		{
+			boost::mutex::scoped_lock l(m_quit_mtx);
+			m_quit_cond.wait(l);
+		}
+	}
+	// 检查是否下载完成, 完成返回true, 否则返回false.
+	boost::int64_t fs = m_file_size;
+	if (fs != -1)
+	{
+		if (fs != bytes_download())
+		{
+			return false;	// 未下载完成.
+		}
+	}
+
+	return true; // 下载完成.
+}
+
+void multi_download::check_certificate(bool check)
+{
+	m_settings.check_certificate = check;
+}
+
+boost::int64_t multi_download::file_size() const
+{
+	return m_file_size;
+}
+
+std::string multi_download::meta_name(const std::string& url) const
+{
+	// 使用url的crc作为文件名, 这样只要url是确定的, 那么就不会找错meta文件.
+	boost::crc_32_type result;
+	result.process_bytes(url.c_str(), url.size());
+	std::stringstream ss;
+	ss.imbue(std::locale("C"));
+	ss << std::hex << result.checksum() << ".meta";
+	return ss.str();
+}
+
+std::string multi_download::file_name() const
 {
 	// 如果文件名为空, 则生成默认文件名.
 	if (m_file_name.empty())
@@ -814,6 +1160,201 @@ int multi_download::download_rate_limit() const
 	return m_settings.download_rate_limit;
 }
 
+void multi_download::connections_limit(int limit)
+{
+	m_settings.connections_limit = (std::max)(limit, 1);
+}
+
+int multi_download::connections_limit() const
+{
+	return m_settings.connections_limit;
+}
+
+int multi_download::number_of_connections() const
+{
+	return m_number_of_connections;
+}
+
+bool multi_download::accept_multi() const
+{
+	return m_accept_multi;
+}
+
+std::string multi_download::file_digest() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+	return m_file_digest;
+}
+
+int multi_download::hash_failures() const
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+	return m_hash_failures;
+}
+
+storage_interface* multi_download::storage() const
+{
+	return m_storage ? m_legacy_storage : NULL;
+}
+
+async_storage_interface* multi_download::async_storage() const
+{
+	return m_storage.get();
+}
+
+void multi_download::reset_state(const settings& s)
+{
+	// 清空所有连接.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_streams_mutex);
+#endif
+		m_streams.clear();
+	}
+
+	// 默认文件大小为-1.
+	m_file_size = -1;
+	m_file_name = "";
+
+	// 清空校验状态, 由open_meta和init_verify重新设置.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		m_hash_piece_size = 0;
+		m_verified.resize(0);
+		m_verified_pending.clear();
+		m_meta_compact = false;
+	}
+
+	// 清空流式处理的状态, 续传时从文件头重新交出.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+		m_stream_point = 0;
+		m_stream_pending = false;
+		m_stream_eof = false;
+		m_stream_waiters.clear();
+	}
+	if (s.stream_handler && (s.stream_prefer_prefix || s.stream_window > 0))
+	{
+		m_download_point = 0;
+		m_read_ahead = true;
+	}
+
+	// 清空文件的校验器, 由save_validators重新设置.
+	m_etag.clear();
+	m_last_modified.clear();
+	m_remote_changed = false;
+
+	// 重新尝试多区间请求.
+	m_multi_range = true;
+
+	// 第一次更新meta时重写快照.
+	m_meta_size = 0;
+	m_meta_snapshot_size = 0;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+		m_sync_inflight.clear();
+		m_synced.clear();
+		m_sync_elapsed = 0;
+	}
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+		m_finish_pending = false;
+	}
+
+	// 保存设置.
+	m_settings = s;
+#ifdef AVHTTP_DISABLE_THREAD
+	m_settings.write_cache_size = 0;
+#endif
+}
+
+bool multi_download::prepare_storage(boost::system::error_code& ec)
+{
+	// 创建存储对象并打开文件.
+	open_storage(ec);
+	if (ec)
+	{
+		return false;
+	}
+
+	// 续传时核对已下载的区间确实写入了文件.
+	check_downloaded();
+
+	// 判断文件是否已经下载完成, 完成则直接返回. 存储已经打开, 仍然可以读取数据.
+	// 启用流式处理时继续启动, 由on_tick把已经下载的文件交给stream_handler.
+	if (m_downlaoded_field.is_full() && !m_settings.stream_handler)
+	{
+		return false;
+	}
+
+	// 文件大小已知时, 由存储预分配或映射文件.
+	if (m_file_size != -1)
+	{
+		m_storage->allocate(m_file_size, ec);
+		if (ec)
+		{
+			return false;
+		}
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 启动流式处理线程.
+	if (m_settings.stream_handler && !m_stream_pool)
+	{
+		m_stream_pool.reset(new io_service_pool(1));
+		m_stream_pool->run();
+	}
+#endif
+
+	// 处理默认设置.
+	if (m_settings.connections_limit == -1)
+	{
+		m_settings.connections_limit = default_connections_limit;
+	}
+	if (m_settings.piece_size == -1 && m_file_size != -1)
+	{
+		m_settings.piece_size = default_piece_size(m_file_size);
+	}
+
+	return true;
+}
+
+void multi_download::open_storage(boost::system::error_code& ec)
+{
+	// 创建存储对象, storage_interface通过storage_adapter使用.
+	m_legacy_storage = NULL;
+	if (m_settings.async_storage)
+	{
+		m_storage.reset(m_settings.async_storage());
+	}
+	else
+	{
+		storage_adapter* adapter = new storage_adapter(m_settings.storage ?
+			m_settings.storage() : default_storage_constructor());
+		m_legacy_storage = adapter->get();
+		m_storage.reset(adapter);
+	}
+	BOOST_ASSERT(m_storage);
+
+	// 打开文件, 构造文件名.
+	storage_hints hints;
+	hints.size = m_file_size;
+	hints.io_service = &m_io_service;
+	m_storage->open(boost::filesystem::path(file_name()), hints, ec);
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 // 以下为内部实现.
@@ -833,8 +1374,7 @@ void multi_download::handle_open(const int index,
 		if (!m_accept_multi)
 		{
 			m_abort = true;
-			boost::system::error_code ignore;
-			m_timer.cancel(ignore);
+			cancel_timer();
 		}
 
 		return;
@@ -849,36 +1389,50 @@ void multi_download::handle_open(const int index,
 			m_file_size = object.stream->content_length();
 			m_rangefield.reset(m_file_size);
 			m_downlaoded_field.reset(m_file_size);
+			m_meta_pending.reset(m_file_size);
 		}
 	}
 
+	// 文件发生变化时终止下载.
+	if (!check_partial_content(object))
+	{
+		return;
+	}
+
+	// 多区间请求的响应不是multipart/byteranges时, 改为每次请求一个区间.
+	if (!check_multipart(object))
+	{
+		return;
+	}
+
 	// 保存最后请求时间, 方便检查超时重置.
 	object.last_request_time = boost::posix_time::microsec_clock::local_time();
 
-	// 计算可请求的字节数.
-	int available_bytes = default_buffer_size;
-	if (m_drop_size != -1)
+	// 更新往返时间.
+	update_rtt(object);
+
+	// 限速配额用完时暂停读取, 由限速定时器恢复.
+	if (defer_rate(index, object_ptr))
 	{
-		available_bytes = (std::min)(m_drop_size, default_buffer_size);
-		m_drop_size -= available_bytes;
-		if (available_bytes == 0)
-		{
-			// 避免空请求占用大量CPU, 让出CPU资源.
-			boost::this_thread::sleep(boost::posix_time::millisec(1));
-		}
+		return;
 	}
 
+	// 计算可请求的字节数.
+	int available_bytes = this->available_bytes();
+
 	// 发起数据读取请求.
 	http_stream_ptr& stream_ptr = object.stream;
 
 	change_outstranding(true);
 	// 传入指针http_object_ptr, 以确保多线程安全.
 	stream_ptr->async_read_some(boost::asio::buffer(object.buffer, available_bytes),
-		boost::bind(&multi_download::handle_read,
-			this,
-			index, object_ptr,
-			boost::asio::placeholders::bytes_transferred,
-			boost::asio::placeholders::error
+		object_ptr->strand->wrap(
+			boost::bind(&multi_download::handle_read,
+				this,
+				index, object_ptr,
+				boost::asio::placeholders::bytes_transferred,
+				boost::asio::placeholders::error
+			)
 		)
 	);
 }
@@ -890,39 +1444,56 @@ void multi_download::handle_read(const int index,
 	change_outstranding(false);
 	http_stream_object& object = *object_ptr;
 
-	// 用于计算下载速率.
-	m_download_rate->bytes += bytes_transferred;
-
 	// 保存数据, 当远程服务器断开时, ec为eof, 保证数据全部写入.
+	bool malformed = false;
 	if (m_storage && bytes_transferred != 0 && (!ec || ec == boost::asio::error::eof))
 	{
-		// 计算offset.
-		boost::int64_t offset = object.request_range.left + object.bytes_transferred;
-
-		// 更新完成下载区间位图.
-		if (m_file_size != -1)
+		if (object.multipart)
 		{
-			m_downlaoded_field.update(offset, offset + bytes_transferred);
+			// multipart/byteranges响应, 按每个部分的偏移写入.
+			malformed = !write_multipart(object, bytes_transferred, ec);
+		}
+		else
+		{
+			// 计算offset.
+			boost::int64_t offset = object.request_range.left + object.bytes_transferred;
+			write_data(object, offset, object.buffer.c_array(), bytes_transferred, ec);
 		}
-
-		// 使用m_storage写入.
-		m_storage->write(object.buffer.c_array(), offset, bytes_transferred);
 	}
 
+	handle_received(index, object_ptr, bytes_transferred, malformed, ec);
+}
+
+void multi_download::handle_received(const int index, http_object_ptr object_ptr,
+	int bytes_transferred, bool malformed, const boost::system::error_code& ec)
+{
+	http_stream_object& object = *object_ptr;
+
 	// 统计本次已经下载的总字节数.
 	object.bytes_transferred += bytes_transferred;
 	// 统计总下载字节数.
 	object.bytes_downloaded += bytes_transferred;
+	object.publish();
 
 	// 如果发生错误或终止.
-	if (ec || m_abort)
+	if (ec || m_abort || malformed)
 	{
+		// 连接不再写入数据, 更新累计的区间.
+		publish_range(object);
+
+		// 响应格式错误, 关闭连接, 由on_tick释放没有下载的区间后重新请求.
+		if (malformed)
+		{
+			AVHTTP_LOG_WARN << "Malformed multipart/byteranges response, reconnect.";
+			object.direct_reconnect = true;
+			return;
+		}
+
 		// 单连接模式, 表示下载停止, 终止下载.
 		if (!m_accept_multi)
 		{
 			m_abort = true;
-			boost::system::error_code ignore;
-			m_timer.cancel(ignore);
+			cancel_timer();
 		}
 
 		// 如果没有终止下载, 那么遇到错误, 这里返回将会在on_tick中计算
@@ -930,12 +1501,62 @@ void multi_download::handle_read(const int index,
 		return;
 	}
 
+	// 被预读抢占, 由on_tick关闭连接并释放剩余区间后重新分配.
+	if (object.preempt)
+	{
+		object.direct_reconnect = true;
+		return;
+	}
+
+	// 多区间请求在解析到结束分隔符并读完整个响应之后才算完成, 这样长连接
+	// 上的下一个请求不会读到这个响应剩余的数据.
+	bool complete = m_accept_multi && object.bytes_transferred >= object.request_range.size();
+	if (object.multipart)
+	{
+		complete = object.parser.is_finished() && bytes_transferred == 0;
+		if ((object.parser.is_finished() && object.stream->content_length() == -1)
+			|| (!object.parser.is_finished() && bytes_transferred == 0))
+		{
+			// 不知道响应的长度无法继续使用这个连接, 或者响应在结束分隔符之前
+			// 就结束了, 由on_tick释放没有下载的区间后重新请求.
+			publish_range(object);
+			object.direct_reconnect = true;
+			return;
+		}
+	}
+
 	// 判断请求区间的数据已经下载完成, 如果下载完成, 则分配新的区间, 发起新的请求.
-	if (m_accept_multi && object.bytes_transferred >= object.request_range.size())
+	if (complete)
 	{
+		// 更新累计的区间.
+		publish_range(object);
+
+		// 根据本次区间的下载情况计算下一次请求的大小.
+		update_request_size(object);
+
+		// 服务器可能没有返回所有的区间, 释放没有下载的部分.
+		if (!object.ranges.empty())
+		{
+			release_range(object);
+		}
+
+		// 连接已经退役, 关闭连接, 空出的连接数额由其它下载使用.
+		// 已经没有可以分配的区间时也直接关闭这个连接, 不必等到check_connection
+		// 重连时才发现, 这样tick可以及时判断下载完成.
+		if (object.retire || !has_free_range())
+		{
+			close_stream(object_ptr);
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_streams_mutex);
+#endif
+			object.done = true;
+			m_number_of_connections--;
+			return;
+		}
+
 		// 不支持长连接, 则创建新的连接.
-		// 如果是第1个连接, 请求范围是0-文件尾, 也需要断开重新连接.
-		if (!m_keep_alive || (object.request_range.left == 0 && index == 0))
+		// 请求没有指定结束位置时, 服务器还在发送之后的数据, 也需要断开重新连接.
+		if (!m_keep_alive || object.open_ended)
 		{
 			// 新建新的http_stream对象.
 			object.direct_reconnect = true;
@@ -954,7 +1575,7 @@ void multi_download::handle_read(const int index,
 		}
 
 		// 如果分配空闲空间失败, 则跳过这个socket, 并立即尝试连接这个socket.
-		if (!allocate_range(object.request_range))
+		if (!allocate_range(object.request_range, object.request_size))
 		{
 			object.direct_reconnect = true;
 			return;
@@ -963,10 +1584,12 @@ void multi_download::handle_read(const int index,
 		// 清空计数.
 		object.bytes_transferred = 0;
 
+		// 区间被已经下载的数据截断时, 同时请求其它的空隙.
+		allocate_extra_ranges(object);
+		object.publish();
+
 		// 插入新的区间请求.
-		req_opt.insert(http_options::range,
-			boost::str(boost::format("bytes=%lld-%lld", std::locale("C")) %
-			object.request_range.left % object.request_range.right));
+		req_opt.insert(http_options::range, range_option(object, object.request_range.left));
 
 		// 添加代理设置.
 		stream.proxy(m_settings.proxy);
@@ -979,26 +1602,31 @@ void multi_download::handle_read(const int index,
 
 		// 保存最后请求时间, 方便检查超时重置.
 		object.last_request_time = boost::posix_time::microsec_clock::local_time();
+		object.request_time = object.last_request_time;
 
 		change_outstranding(true);
 		// 发起异步http数据请求, 传入指针http_object_ptr, 以确保多线程安全.
 		if (!m_keep_alive)
 		{
 			stream.async_open(m_final_url,
-				boost::bind(&multi_download::handle_open,
-					this,
-					index, object_ptr,
-					boost::asio::placeholders::error
+				object_ptr->strand->wrap(
+					boost::bind(&multi_download::handle_open,
+						this,
+						index, object_ptr,
+						boost::asio::placeholders::error
+					)
 				)
 			);
 		}
 		else
 		{
 			stream.async_request(req_opt,
-				boost::bind(&multi_download::handle_request,
-					this,
-					index, object_ptr,
-					boost::asio::placeholders::error
+				object_ptr->strand->wrap(
+					boost::bind(&multi_download::handle_request,
+						this,
+						index, object_ptr,
+						boost::asio::placeholders::error
+					)
 				)
 			);
 		}
@@ -1010,38 +1638,232 @@ void multi_download::handle_read(const int index,
 			(m_file_size != -1 && object.bytes_downloaded == m_file_size))
 		{
 			m_abort = true;
-			boost::system::error_code ignore;
-			m_timer.cancel(ignore);
+			cancel_timer();
 			return;
 		}
 
-		// 保存最后请求时间, 方便检查超时重置.
-		object.last_request_time = boost::posix_time::microsec_clock::local_time();
+		// 写缓存已满时暂停读取, 由后台线程写入后恢复.
+		if (defer_read(index, object_ptr))
+		{
+			return;
+		}
 
-		// 计算可请求的字节数.
-		int available_bytes = default_buffer_size;
-		if (m_drop_size != -1)
+		// 领先流式处理太多时暂停读取, 流式处理跟上后恢复.
+		if (defer_stream(index, object_ptr))
 		{
-			available_bytes = (std::min)(m_drop_size, default_buffer_size);
-			m_drop_size -= available_bytes;
-			if (available_bytes == 0)
-			{
-				// 避免空请求占用大量CPU, 让出CPU资源.
-				boost::this_thread::sleep(boost::posix_time::millisec(1));
-			}
+			return;
 		}
 
-		change_outstranding(true);
-		// 继续读取数据, 传入指针http_object_ptr, 以确保多线程安全.
-		object.stream->async_read_some(boost::asio::buffer(object.buffer, available_bytes),
+		async_read(index, object_ptr);
+	}
+}
+
+void multi_download::async_read(int index, http_object_ptr object_ptr)
+{
+	http_stream_object& object = *object_ptr;
+
+	// 保存最后请求时间, 方便检查超时重置.
+	object.last_request_time = boost::posix_time::microsec_clock::local_time();
+
+	// 限速配额用完时暂停读取, 由限速定时器恢复.
+	if (defer_rate(index, object_ptr))
+	{
+		return;
+	}
+
+	// 启用零拷贝时直接把socket中的数据写入文件.
+	if (m_settings.zero_copy && async_splice(index, object_ptr))
+	{
+		return;
+	}
+
+	// 计算可请求的字节数.
+	int available_bytes = this->available_bytes();
+
+	change_outstranding(true);
+	// 继续读取数据, 传入指针http_object_ptr, 以确保多线程安全.
+	object.stream->async_read_some(boost::asio::buffer(object.buffer, available_bytes),
+		object_ptr->strand->wrap(
 			boost::bind(&multi_download::handle_read,
 				this,
 				index, object_ptr,
 				boost::asio::placeholders::bytes_transferred,
 				boost::asio::placeholders::error
 			)
-		);
+		)
+	);
+}
+
+bool multi_download::async_splice(int index, http_object_ptr object_ptr)
+{
+	http_stream_object& object = *object_ptr;
+
+	// multipart响应需要解析, 文件大小未知时没有下载区间位图, 只能普通读取.
+	if (object.splice_disabled || object.multipart || m_file_size == -1
+		|| !m_storage || m_storage->native_handle() == -1)
+	{
+		return false;
+	}
+
+	// 接收缓冲中还有数据时先普通读取, 读完之后再使用splice.
+	tcp::socket* sock = object.stream->raw_body_socket();
+	if (!sock)
+	{
+		return false;
+	}
+
+	if (!object.pipe)
+	{
+		boost::system::error_code ec;
+		object.pipe = boost::make_shared<detail::splice_pipe>();
+		if (!object.pipe->open(ec))
+		{
+			AVHTTP_LOG_WARN << "Create splice pipe failed, error: " << ec.message();
+			object.splice_disabled = true;
+			return false;
+		}
+	}
+
+	change_outstranding(true);
+	// 只等待socket可读, 数据在handle_splice中通过splice读取.
+	sock->async_read_some(boost::asio::null_buffers(),
+		object_ptr->strand->wrap(
+			boost::bind(&multi_download::handle_splice,
+				this,
+				index, object_ptr,
+				boost::asio::placeholders::error
+			)
+		)
+	);
+
+	return true;
+}
+
+void multi_download::handle_splice(const int index,
+	http_object_ptr object_ptr, const boost::system::error_code& ec)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+	http_stream_object& object = *object_ptr;
+
+	boost::system::error_code err = ec;
+	std::size_t bytes_transferred = 0;
+	if (!err && !m_abort)
+	{
+		bytes_transferred = splice_data(object, err);
+		if (err == boost::asio::error::would_block)
+		{
+			// 没有数据可读, 或者不能再使用splice, 由async_read决定如何继续读取.
+			async_read(index, object_ptr);
+			return;
+		}
+	}
+
+	handle_received(index, object_ptr, static_cast<int>(bytes_transferred), false, err);
+}
+
+std::size_t multi_download::splice_data(http_stream_object& object, boost::system::error_code& ec)
+{
+	ec = boost::system::error_code();
+
+	// 只读取本次请求剩余的数据, 之后的数据属于长连接上的下一个响应.
+	boost::int64_t offset = object.request_range.left + object.bytes_transferred;
+	boost::int64_t left = (m_accept_multi ? object.request_range.size() : m_file_size)
+		- object.bytes_transferred;
+	if (left <= 0)
+	{
+		ec = boost::asio::error::eof;
+		return 0;
+	}
+
+	tcp::socket* sock = object.stream->raw_body_socket();
+	if (!sock)
+	{
+		ec = boost::asio::error::would_block;
+		return 0;
+	}
+
+	// 限速时与普通读取一样扣除限速配额, 配额用完时本次不读取.
+	int size = available_bytes(static_cast<int>(
+		(std::min)(left, static_cast<boost::int64_t>(object.pipe->capacity()))));
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	// socket的可读通知可能不准确, splice期间设置为非阻塞, 避免阻塞io线程.
+	boost::system::error_code ignore;
+	sock->non_blocking(true, ignore);
+	std::size_t bytes = object.pipe->fill(sock->native_handle(), size, ec);
+	sock->non_blocking(false, ignore);
+
+	// 退回没有用到的限速配额.
+	release_bytes(size - static_cast<int>(bytes));
+
+	if (bytes == 0)
+	{
+		if (ec == boost::system::errc::invalid_argument
+			|| ec == boost::system::errc::function_not_supported)
+		{
+			// socket不支持splice, 改为普通读取.
+			object.splice_disabled = true;
+			ec = boost::asio::error::would_block;
+		}
+		return 0;
+	}
+	object.stream->consume_body(bytes);
+
+	std::size_t written = 0;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+		written = object.pipe->drain(m_storage->native_handle(), offset, bytes, ec);
+	}
+
+	if (written != 0)
+	{
+		// 累计到连接已经写入的区间, 与write_data不启用写缓存时相同.
+		if (object.write_buffer || object.written_right != offset)
+		{
+			publish_range(object);
+			object.written_left = offset;
+			object.written_right = offset;
+		}
+		object.written_right = offset + written;
+
+		boost::int64_t end = object.written_right;
+		if (offset / m_settings.piece_size != end / m_settings.piece_size
+			|| end > object.request_range.right || end == m_file_size
+			|| m_abort || object.preempt
+			|| in_read_ahead(object.written_left, end))
+		{
+			publish_range(object);
+		}
+	}
+
+	if (written < bytes)
+	{
+		// 文件系统不支持splice, 取出管道中剩余的数据按普通方式写入, 之后不再使用splice.
+		AVHTTP_LOG_WARN << "Splice to file failed, error: " << ec.message();
+		object.splice_disabled = true;
+		publish_range(object);
+
+		while (written < bytes)
+		{
+			std::size_t n = object.pipe->read(object.buffer.c_array(), object.buffer.size());
+			if (n == 0)
+			{
+				ec = boost::asio::error::broken_pipe;
+				return written;
+			}
+			write_data(object, offset + written, object.buffer.c_array(), n, boost::system::error_code());
+			written += n;
+		}
+		ec = boost::system::error_code();
 	}
+
+	return written;
 }
 
 void multi_download::handle_request(const int index,
@@ -1060,37 +1882,49 @@ void multi_download::handle_request(const int index,
 		if (!m_accept_multi)
 		{
 			m_abort = true;
-			boost::system::error_code ignore;
-			m_timer.cancel(ignore);
+			cancel_timer();
 		}
 
 		return;
 	}
 
+	// 文件发生变化时终止下载.
+	if (!check_partial_content(object))
+	{
+		return;
+	}
+
+	// 多区间请求的响应不是multipart/byteranges时, 改为每次请求一个区间.
+	if (!check_multipart(object))
+	{
+		return;
+	}
+
 	// 保存最后请求时间, 方便检查超时重置.
 	object.last_request_time = boost::posix_time::microsec_clock::local_time();
 
-	// 计算可请求的字节数.
-	int available_bytes = default_buffer_size;
-	if (m_drop_size != -1)
+	// 更新往返时间.
+	update_rtt(object);
+
+	// 限速配额用完时暂停读取, 由限速定时器恢复.
+	if (defer_rate(index, object_ptr))
 	{
-		available_bytes = (std::min)(m_drop_size, default_buffer_size);
-		m_drop_size -= available_bytes;
-		if (available_bytes == 0)
-		{
-			// 避免空请求占用大量CPU, 让出CPU资源.
-			boost::this_thread::sleep(boost::posix_time::millisec(1));
-		}
+		return;
 	}
 
+	// 计算可请求的字节数.
+	int available_bytes = this->available_bytes();
+
 	change_outstranding(true);
 	// 发起数据读取请求, 传入指针http_object_ptr, 以确保多线程安全.
 	object_ptr->stream->async_read_some(boost::asio::buffer(object.buffer, available_bytes),
-		boost::bind(&multi_download::handle_read,
-			this,
-			index, object_ptr,
-			boost::asio::placeholders::bytes_transferred,
-			boost::asio::placeholders::error
+		object_ptr->strand->wrap(
+			boost::bind(&multi_download::handle_read,
+				this,
+				index, object_ptr,
+				boost::asio::placeholders::bytes_transferred,
+				boost::asio::placeholders::error
+			)
 		)
 	);
 }
@@ -1184,6 +2018,7 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 		m_file_size = file_size;
 		m_rangefield.reset(m_file_size);
 		m_downlaoded_field.reset(m_file_size);
+		m_meta_pending.reset(m_file_size);
 	}
 
 	// 是否有指定的文件名, 检查Content-Disposition: attachment; filename="file.zip"
@@ -1199,6 +2034,9 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 		}
 	}
 
+	// 保存文件的ETag/Last-Modified, 用于续传时确认文件没有变化.
+	save_validators(h);
+
 	// 是否支持长连接模式, 不支持多点下载, 长连接也没有意义.
 	if (m_accept_multi)
 	{
@@ -1225,47 +2063,86 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 		if (!open_meta(m_settings.meta_file))
 		{
 			// 位图打开失败, 无所谓, 下载过程中会创建新的位图, 删除meta文件.
-			m_file_meta.close();
-			fs::remove(m_settings.meta_file, err);
+			remove_meta();
 		}
 	}
 
-	// 判断文件是否已经下载完成, 完成则直接返回.
-	if (m_downlaoded_field.is_full())
+	// 打开存储, 完成续传的准备, 文件已经下载完成时直接回调.
+	if (!prepare_storage(err))
 	{
 		handler(err);
 		return;
 	}
 
-	// 创建存储对象.
-	if (!m_settings.storage)
-	{
-		m_storage.reset(default_storage_constructor());
-	}
-	else
+	// 差分下载需要扫描整个旧版本的文件, 放到校验线程中执行, 不阻塞连接所在的
+	// io_service, 复制完成后再回到连接的strand中启动下载.
+	if (!m_settings.delta_control_file.empty() && !m_settings.seed_file.empty())
 	{
-		m_storage.reset(m_settings.storage());
+#ifndef AVHTTP_DISABLE_THREAD
+		{
+			boost::mutex::scoped_lock lock(m_hash_mutex);
+			if (!m_hash_pool)
+			{
+				m_hash_pool.reset(new io_service_pool((std::max)(m_settings.hash_threads, 1)));
+				m_hash_pool->run();
+			}
+		}
+#endif
+		change_outstranding(true);
+		hash_io_service().post(boost::bind(&multi_download::handle_seed<Handler>,
+			this, handler, object_ptr));
+		return;
 	}
-	BOOST_ASSERT(m_storage);
 
-	// 打开文件, 构造文件名.
-	m_storage->open(boost::filesystem::path(file_name()), err);
+	change_outstranding(true);
+	start_connections(handler, object_ptr, err);
+}
+
+template <typename Handler>
+void multi_download::handle_seed(Handler handler, http_object_ptr object_ptr)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	boost::system::error_code ec;
+	apply_seed(ec);
+
+	change_outstranding(true);
+	object_ptr->strand->post(boost::bind(&multi_download::start_connections<Handler>,
+		this, handler, object_ptr, ec));
+}
+
+template <typename Handler>
+void multi_download::start_connections(Handler handler,
+	http_object_ptr object_ptr, const boost::system::error_code& ec)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	boost::system::error_code err = ec;
 	if (err)
 	{
 		handler(err);
 		return;
 	}
 
-	// 处理默认设置.
-	if (m_settings.connections_limit == -1)
+	// 复制旧版本文件的过程中调用了stop.
+	if (m_abort)
 	{
-		m_settings.connections_limit = default_connections_limit;
+		handler(boost::asio::error::operation_aborted);
+		return;
 	}
-	if (m_settings.piece_size == -1 && m_file_size != -1)
+
+	// 初始化分片校验.
+	init_verify(err);
+	if (err)
 	{
-		m_settings.piece_size = default_piece_size(m_file_size);
+		handler(err);
+		return;
 	}
 
+	http_stream& h = *object_ptr->stream;
+
 	// 根据第1个连接返回的信息, 设置请求选项.
 	request_opts req_opt = m_settings.opts;
 	if (m_keep_alive)
@@ -1312,13 +2189,20 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 			// 保存请求区间.
 			object_ptr->request_range = req_range;
 
+			// 需要重新请求时, 可以同时请求其它的空隙.
+			if (need_reopen)
+			{
+				allocate_extra_ranges(*object_ptr);
+			}
+			object_ptr->publish();
+
 			// 设置请求区间到请求选项中.
 			req_opt.remove(http_options::range);
-			req_opt.insert(http_options::range, boost::str(
-				boost::format("bytes=%lld-%lld", std::locale("C")) % req_range.left % req_range.right));
+			req_opt.insert(http_options::range, range_option(*object_ptr, req_range.left));
 
 			// 保存最后请求时间, 用于检查超时重置.
 			object_ptr->last_request_time = boost::posix_time::microsec_clock::local_time();
+			object_ptr->request_time = object_ptr->last_request_time;
 
 			// 添加代理设置.
 			h.proxy(m_settings.proxy);
@@ -1341,24 +2225,31 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 				change_outstranding(true);
 				// 开始异步打开.
 				h.async_open(m_final_url,
-					boost::bind(&multi_download::handle_open,
-						this,
-						0, object_ptr,
-						boost::asio::placeholders::error
+					object_ptr->strand->wrap(
+						boost::bind(&multi_download::handle_open,
+							this,
+							0, object_ptr,
+							boost::asio::placeholders::error
+						)
 					)
 				);
 			}
 			else
 			{
+				// 继续使用启动时bytes=0-的请求读取分配的区间.
+				object_ptr->open_ended = true;
+
 				// 发起数据读取请求.
 				change_outstranding(true);
 				// 传入指针obj, 以确保多线程安全.
 				h.async_read_some(boost::asio::buffer(object_ptr->buffer, available_bytes),
-					boost::bind(&multi_download::handle_read,
-						this,
-						0, object_ptr,
-						boost::asio::placeholders::bytes_transferred,
-						boost::asio::placeholders::error
+					object_ptr->strand->wrap(
+						boost::bind(&multi_download::handle_read,
+							this,
+							0, object_ptr,
+							boost::asio::placeholders::bytes_transferred,
+							boost::asio::placeholders::error
+						)
 					)
 				);
 			}
@@ -1376,11 +2267,13 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 		change_outstranding(true);
 		// 传入指针obj, 以确保多线程安全.
 		h.async_read_some(boost::asio::buffer(object_ptr->buffer, available_bytes),
-			boost::bind(&multi_download::handle_read,
-				this,
-				0, object_ptr,
-				boost::asio::placeholders::bytes_transferred,
-				boost::asio::placeholders::error
+			object_ptr->strand->wrap(
+				boost::bind(&multi_download::handle_read,
+					this,
+					0, object_ptr,
+					boost::asio::placeholders::bytes_transferred,
+					boost::asio::placeholders::error
+				)
 			)
 		);
 	}
@@ -1390,38 +2283,15 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 	{
 		for (int i = 1; i < m_settings.connections_limit; i++)
 		{
-			http_object_ptr p = boost::make_shared<http_stream_object>();
-			http_stream_ptr ptr = boost::make_shared<http_stream>(boost::ref(m_io_service));
-			range req_range;
-
-			// 从文件间区中得到一段空间.
-			if (!allocate_range(req_range))
+			// 创建新的连接并开始异步打开, 分配空间失败说明可能已经没有空闲的空间
+			// 提供给这个stream进行下载了, 直接跳过好了.
+			http_object_ptr p = create_connection(i);
+			if (!p)
 			{
-				// 分配空间失败, 说明可能已经没有空闲的空间提供给这个stream进行下载了直接跳过好了.
-				p->done = true;
 				continue;
 			}
 
-			// 保存请求区间.
-			p->request_range = req_range;
-
-			// 设置请求区间到请求选项中.
-			req_opt.remove(http_options::range);
-			req_opt.insert(http_options::range, boost::str(
-				boost::format("bytes=%lld-%lld", std::locale("C")) % req_range.left % req_range.right));
-
-			// 设置请求选项.
-			ptr->request_options(req_opt);
-			// 添加代理设置.
-			ptr->proxy(m_settings.proxy);
-			// 如果是ssl连接, 默认为检查证书.
-			ptr->check_certificate(m_settings.check_certificate);
-			// 禁用重定向.
-			ptr->max_redirects(0);
-
 			// 将连接添加到容器中.
-			p->stream = ptr;
-
 			{
 #ifndef AVHTTP_DISABLE_THREAD
 				boost::mutex::scoped_lock lock(m_streams_mutex);
@@ -1429,28 +2299,15 @@ void multi_download::handle_start(Handler handler, http_object_ptr object_ptr, c
 				m_streams.push_back(p);
 			}
 
-			// 保存最后请求时间, 方便检查超时重置.
-			p->last_request_time = boost::posix_time::microsec_clock::local_time();
-
 			m_number_of_connections++;
-			change_outstranding(true);
-
-			// 开始异步打开, 传入指针http_object_ptr, 以确保多线程安全.
-			p->stream->async_open(m_final_url,
-				boost::bind(&multi_download::handle_open,
-					this,
-					i, p,
-					boost::asio::placeholders::error
-				)
-			);
 		}
 	}
 
-	change_outstranding(true);
-
-	// 开启定时器, 执行任务.
-	m_timer.expires_from_now(boost::posix_time::seconds(1));
-	m_timer.async_wait(boost::bind(&multi_download::on_tick, this, boost::asio::placeholders::error));
+	// 开启定时器, 执行任务, 由外部驱动tick时不需要定时器.
+	if (!m_external_tick)
+	{
+		start_timer();
+	}
 
 	// 回调通知用户, 已经成功启动下载.
 	handler(ec);
@@ -1462,168 +2319,356 @@ void multi_download::on_tick(const boost::system::error_code& e)
 {
 	auto_outstanding ao(*this);
 	change_outstranding(false);
-	m_time_total++;
 
-	// 在这里更新位图.
-	if (m_accept_multi)
+	// 定时器被取消时也需要执行一次tick, 以保存最后的下载状态.
+	if (!tick() || e)
 	{
-		update_meta();
+		return;
 	}
 
 	// 每隔1秒进行一次on_tick.
-	if (!m_abort && !e)
+	change_outstranding(true);
+	m_timer.expires_from_now(boost::posix_time::seconds(1));
+	m_timer.async_wait(boost::bind(&multi_download::on_tick,
+		this, boost::asio::placeholders::error));
+}
+
+void multi_download::start_timer()
+{
+	// 计入的m_outstanding由on_tick释放.
+	change_outstranding(true);
+	m_io_service.post(boost::bind(&multi_download::handle_start_timer, this));
+}
+
+void multi_download::handle_start_timer()
+{
+	m_timer.expires_from_now(boost::posix_time::seconds(1));
+	m_timer.async_wait(boost::bind(&multi_download::on_tick,
+		this, boost::asio::placeholders::error));
+}
+
+void multi_download::cancel_timer()
+{
+	// 连接的回调可能运行在io_service池的其它线程中, 不能直接操作m_timer.
+	change_outstranding(true);
+	m_io_service.post(boost::bind(&multi_download::handle_cancel_timer, this));
+}
+
+void multi_download::handle_cancel_timer()
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	boost::system::error_code ignore;
+	m_timer.cancel(ignore);
+}
+
+bool multi_download::tick()
+{
+	auto_outstanding ao(*this);
+	m_time_total++;
+
+	// 在这里更新位图, 下载终止时由finish_download同步所有数据.
+	if (m_remote_changed)
 	{
-		change_outstranding(true);
-		m_timer.expires_from_now(boost::posix_time::seconds(1));
-		m_timer.async_wait(boost::bind(&multi_download::on_tick,
-			this, boost::asio::placeholders::error));
+		// 文件已经变化, 删除meta文件, 下次启动时重新下载.
+		remove_meta();
 	}
-	else
+	else if (m_accept_multi && !m_abort)
 	{
-		// 整个下载已经终止.
-		if (m_file_meta.is_open())
-			m_file_meta.close();
-		return;
+		update_meta();
 	}
 
-	// 用于计算动态下载速率.
+	if (m_abort)
 	{
-		m_download_rate->rate = static_cast<int>((m_download_rate->rate * 7.0 + m_download_rate->bytes) / 8.0);
-		m_download_rate->bytes = 0;
+		// 整个下载已经终止.
+		finish_download();
+		return false;
 	}
 
-	// 计算限速.
-	m_drop_size = m_settings.download_rate_limit;
-
 #ifndef AVHTTP_DISABLE_THREAD
 	// 锁定m_streams容器进行操作, 保证m_streams操作的唯一性.
 	boost::mutex::scoped_lock lock(m_streams_mutex);
 #endif
+
+	// 用于计算动态下载速率, 由各连接的下载统计累加得到.
+	{
+		boost::int64_t bytes_downloaded = 0;
+		for (std::size_t i = 0; i < m_streams.size(); i++)
+		{
+			bytes_downloaded += m_streams[i]->bytes_downloaded;
+		}
+		boost::int64_t bytes = bytes_downloaded - m_download_rate->last_bytes;
+		m_download_rate->rate = static_cast<int>((m_download_rate->rate * 7.0 + bytes) / 8.0);
+		m_download_rate->last_bytes = bytes_downloaded;
+	}
+
+	// 超时检查和重连会修改连接的状态, 在连接所属的strand中执行, 避免与
+	// 该连接上正在执行的回调并发访问.
 	for (std::size_t i = 0; i < m_streams.size(); i++)
 	{
-		http_object_ptr& object_ptr = m_streams[i];
-		boost::posix_time::time_duration duration =
-			boost::posix_time::microsec_clock::local_time() - object_ptr->last_request_time;
-		bool expire = duration > boost::posix_time::seconds(m_settings.time_out);
-		if (!object_ptr->done && (expire || object_ptr->direct_reconnect))
-		{
-			// 超时或出错, 关闭并重新创建连接.
-			boost::system::error_code ec;
-			object_ptr->stream->close(ec);
-
-			// 出现下列之一的错误, 将不再尝试连接服务器, 因为重试也是没有意义的.
-			if (object_ptr->ec == avhttp::errc::forbidden
-				|| object_ptr->ec == avhttp::errc::not_found
-				|| object_ptr->ec == avhttp::errc::method_not_allowed)
-			{
-				object_ptr->done = true;
-				continue;
-			}
+		const http_object_ptr& object_ptr = m_streams[i];
+		if (object_ptr->done)
+		{
+			continue;
+		}
 
-			// 单连接模式, 表示下载停止, 终止下载.
-			if (!m_accept_multi)
-			{
-				m_abort = true;
-				object_ptr->done = true;
-				m_number_of_connections--;
-				continue;
-			}
+		change_outstranding(true);
+		object_ptr->strand->post(boost::bind(&multi_download::check_connection,
+			this, static_cast<int>(i), object_ptr));
+	}
 
-			// 重置重连标识.
-			object_ptr->direct_reconnect = false;
+	// 按connections_limit增减连接, 并为预读区间抢占连接.
+	if (m_accept_multi)
+	{
+		adjust_connections();
+		preempt_for_read_ahead();
+		preempt_for_stream();
+	}
 
-			// 重新创建http_object和http_stream.
-			object_ptr = boost::make_shared<http_stream_object>(*object_ptr);
-			http_stream_object& object = *object_ptr;
+	// 流式处理读取存储失败时在这里重试.
+	start_stream();
 
-			// 使用新的http_stream对象.
-			object.stream = boost::make_shared<http_stream>(boost::ref(m_io_service));
+	// 统计操作功能完成的http_stream的个数.
+	std::size_t done = 0;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		http_object_ptr& object_item_ptr = m_streams[i];
+		if (object_item_ptr->done)
+		{
+			done++;
+		}
+	}
 
-			http_stream& stream = *object.stream;
+	// 所有连接都done时还要等待异步写入完成, 写入失败的区间会在下一次tick时重新下载.
+	if (done == m_streams.size() && m_accept_multi && writing())
+	{
+		return true;
+	}
 
-			// 配置请求选项.
-			request_opts req_opt = m_settings.opts;
+	// 当m_streams中所有连接都done时, 表示已经下载完成, 但还需要等待所有分片
+	// 通过校验, 校验失败的分片会在下一次tick时重新创建连接下载.
+	if (done == m_streams.size() && (!verify_complete() || !stream_complete()))
+	{
+		check_pieces(0, m_file_size);
+		return true;
+	}
+	if (done == m_streams.size())
+	{
+		// tick运行在m_io_service中, 可以直接取消m_timer.
+		boost::system::error_code ignore;
+		m_abort = true;
+		m_timer.cancel(ignore);
+		finish_download();
+		return false;
+	}
 
-			// 设置是否为长连接.
-			if (m_keep_alive)
-			{
-				req_opt.insert(http_options::connection, "keep-alive");
-			}
+	return true;
+}
 
-			// 继续从上次未完成的位置开始请求.
-			if (m_accept_multi)
-			{
-				boost::int64_t begin = object.request_range.left + object.bytes_transferred;
-				boost::int64_t end = object.request_range.right;
+void multi_download::finish_download()
+{
+	// 还有异步写入时不能阻塞等待, 存储可能在当前的io_service中完成写入,
+	// 由最后一个handle_write完成后再保存最后的状态.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+		m_finish_pending = m_write_bytes != 0;
+		if (m_finish_pending)
+		{
+			return;
+		}
+	}
 
-				if (end - begin <= 0)
-				{
-					// 如果分配空闲空间失败, 则跳过这个socket.
-					if (!allocate_range(object.request_range))
-					{
-						object.done = true;	// 已经没什么可以下载了.
-						m_number_of_connections--;
-						continue;
-					}
-
-					object.bytes_transferred = 0;
-					begin = object.request_range.left;
-					end = object.request_range.right;
-				}
+	if (!m_remote_changed && m_accept_multi)
+		flush_meta();
+	if (m_file_meta.is_open())
+		m_file_meta.close();
+	check_fetch_requests(boost::asio::error::operation_aborted);
+	// 通知wait_for_complete退出.
+	boost::mutex::scoped_lock l(m_quit_mtx);
+	m_quit_cond.notify_one();
+}
 
-				req_opt.insert(http_options::range, boost::str(
-					boost::format("bytes=%lld-%lld", std::locale("C")) % begin % end));
-			}
+void multi_download::check_connection(int index, http_object_ptr object_ptr)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
 
-			// 添加代理设置.
-			stream.proxy(m_settings.proxy);
-			// 设置到请求选项中.
-			stream.request_options(req_opt);
-			// 如果是ssl连接, 默认为检查证书.
-			stream.check_certificate(m_settings.check_certificate);
-			// 禁用重定向.
-			stream.max_redirects(0);
+	if (m_abort || object_ptr->done)
+	{
+		return;
+	}
 
-			// 保存最后请求时间, 方便检查超时重置.
-			object.last_request_time = boost::posix_time::microsec_clock::local_time();
+	boost::posix_time::time_duration duration =
+		boost::posix_time::microsec_clock::local_time() - object_ptr->last_request_time;
+	bool expire = duration > boost::posix_time::seconds(m_settings.time_out)
+		&& !object_ptr->write_wait;
+	if (!expire && !object_ptr->direct_reconnect)
+	{
+		return;
+	}
 
-			change_outstranding(true);
-			// 重新发起异步请求, 传入object_item_ptr指针, 以确保线程安全.
-			stream.async_open(m_final_url,
-				boost::bind(&multi_download::handle_open,
-					this,
-					i, object_ptr,
-					boost::asio::placeholders::error
-				)
-			);
-		}
+#ifndef AVHTTP_DISABLE_THREAD
+	// 锁定m_streams容器进行操作, 保证m_streams操作的唯一性.
+	boost::mutex::scoped_lock lock(m_streams_mutex);
+#endif
+
+	// 连接已经被替换.
+	if (index >= static_cast<int>(m_streams.size()) || m_streams[index] != object_ptr)
+	{
+		return;
 	}
 
-	// 统计操作功能完成的http_stream的个数.
-	int done = 0;
-	for (std::size_t i = 0; i < m_streams.size(); i++)
+	// 超时或出错, 关闭并重新创建连接.
+	close_stream(object_ptr);
+
+	// 连接不再写入数据, 把累计的区间和写缓冲交给存储, 不能带到新的连接中.
+	publish_range(*object_ptr);
+
+	// 出现下列之一的错误, 将不再尝试连接服务器, 因为重试也是没有意义的.
+	if (object_ptr->ec == avhttp::errc::forbidden
+		|| object_ptr->ec == avhttp::errc::not_found
+		|| object_ptr->ec == avhttp::errc::method_not_allowed)
 	{
-		http_object_ptr& object_item_ptr = m_streams[i];
-		if (object_item_ptr->done)
-		{
-			done++;
-		}
+		object_ptr->done = true;
+		return;
 	}
 
-	// 当m_streams中所有连接都done时, 表示已经下载完成.
-	if (done == m_streams.size())
+	// 单连接模式, 表示下载停止, 终止下载.
+	if (!m_accept_multi)
 	{
-		boost::system::error_code ignore;
 		m_abort = true;
-		m_timer.cancel(ignore);
-		// 通知wait_for_complete退出.
-		boost::mutex::scoped_lock l(m_quit_mtx);
-		m_quit_cond.notify_one();
+		object_ptr->done = true;
+		m_number_of_connections--;
+		return;
+	}
+
+	// 已经退役的连接在完成当前区间后不再重连.
+	if (object_ptr->retire && (!object_ptr->ranges.empty()
+		|| object_ptr->bytes_transferred >= object_ptr->request_range.size()))
+	{
+		// 多区间请求释放没有下载的部分, 由其它连接下载.
+		if (!object_ptr->ranges.empty())
+		{
+			release_range(*object_ptr);
+		}
+		object_ptr->done = true;
+		m_number_of_connections--;
 		return;
 	}
+
+	// 重置重连标识.
+	object_ptr->direct_reconnect = false;
+
+	// 重新创建http_object和http_stream, 写缓冲, 已写入区间和管道属于旧的连接.
+	m_streams[index] = boost::make_shared<http_stream_object>(*object_ptr);
+	object_ptr = m_streams[index];
+	http_stream_object& object = *object_ptr;
+	object.open_ended = false;
+	object.write_buffer.reset();
+	object.written_left = 0;
+	object.written_right = 0;
+	object.pipe.reset();
+
+	// 被预读抢占的连接, 释放未下载完成的区间, 重新从读取点分配区间.
+	// 多区间请求中断后, 也释放没有下载的部分, 重新分配.
+	if (object.preempt || !object.ranges.empty())
+	{
+		object.preempt = false;
+		release_range(object);
+	}
+
+	// 使用新的http_stream对象.
+	create_stream(object);
+
+	http_stream& stream = *object.stream;
+
+	// 配置请求选项.
+	request_opts req_opt = m_settings.opts;
+
+	// 设置是否为长连接.
+	if (m_keep_alive)
+	{
+		req_opt.insert(http_options::connection, "keep-alive");
+	}
+
+	// 继续从上次未完成的位置开始请求.
+	boost::int64_t begin = object.request_range.left + object.bytes_transferred;
+	boost::int64_t end = object.request_range.right;
+
+	if (end - begin <= 0)
+	{
+		// 如果分配空闲空间失败, 则跳过这个socket.
+		if (!allocate_range(object.request_range, object.request_size))
+		{
+			object.done = true;	// 已经没什么可以下载了.
+			m_number_of_connections--;
+			return;
+		}
+
+		object.bytes_transferred = 0;
+		begin = object.request_range.left;
+		end = object.request_range.right;
+
+		// 区间被已经下载的数据截断时, 同时请求其它的空隙.
+		allocate_extra_ranges(object);
+		object.publish();
+	}
+
+	req_opt.insert(http_options::range, range_option(object, begin));
+
+	// 添加代理设置.
+	stream.proxy(m_settings.proxy);
+	// 设置到请求选项中.
+	stream.request_options(req_opt);
+	// 如果是ssl连接, 默认为检查证书.
+	stream.check_certificate(m_settings.check_certificate);
+	// 禁用重定向.
+	stream.max_redirects(0);
+
+	// 保存最后请求时间, 方便检查超时重置.
+	object.last_request_time = boost::posix_time::microsec_clock::local_time();
+	object.request_time = object.last_request_time;
+
+	change_outstranding(true);
+	// 重新发起异步请求, 传入object_item_ptr指针, 以确保线程安全.
+	stream.async_open(m_final_url,
+		object_ptr->strand->wrap(
+			boost::bind(&multi_download::handle_open,
+				this,
+				index, object_ptr,
+				boost::asio::placeholders::error
+			)
+		)
+	);
+}
+
+void multi_download::set_retire(http_object_ptr object_ptr, bool retire)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+	object_ptr->retire = retire;
+}
+
+void multi_download::set_preempt(http_object_ptr object_ptr)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+	object_ptr->preempt = true;
+}
+
+void multi_download::set_stream_preempt(http_object_ptr object_ptr)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+	object_ptr->write_wait = false;
+	object_ptr->preempt = true;
+	object_ptr->direct_reconnect = true;
 }
 
-bool multi_download::allocate_range(range& r)
+bool multi_download::allocate_range(range& r, boost::int64_t request_size)
 {
 #ifndef AVHTTP_DISABLE_THREAD
 	// 在多线程运行io_service时, 必须加锁, 避免重入时多次重复分配相同区域.
@@ -1647,10 +2692,27 @@ bool multi_download::allocate_range(range& r)
 		BOOST_ASSERT(temp.size() >= 0);
 
 		// 重新计算为最大max_request_bytes大小.
-		boost::int64_t max_request_bytes = m_settings.request_piece_num * m_settings.piece_size;
+		boost::int64_t max_request_bytes = request_size;
+		if (max_request_bytes <= 0)
+		{
+			max_request_bytes = static_cast<boost::int64_t>(m_settings.request_piece_num) * m_settings.piece_size;
+		}
+
+		// 在预读区间内每次只请求一个分片, 使多个连接按顺序下载读取点之后的数据.
+		if (m_read_ahead && temp.left >= m_download_point && temp.left < read_ahead_end())
+		{
+			max_request_bytes = m_settings.piece_size;
+		}
 		if (temp.size() > max_request_bytes)
 		{
 			temp.right = temp.left + max_request_bytes;
+
+			// 区间的结束位置尽量对齐到分片边界, 避免停止下载时留下不完整的分片.
+			boost::int64_t aligned = temp.right - temp.right % m_settings.piece_size;
+			if (aligned > temp.left)
+			{
+				temp.right = aligned;
+			}
 		}
 
 		r = temp;
@@ -1675,38 +2737,88 @@ bool multi_download::allocate_range(range& r)
 	return true;
 }
 
+bool multi_download::has_free_range()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+	range temp(-1, -1);
+	return m_rangefield.out_space(temp);
+}
+
 bool multi_download::open_meta(const fs::path& file_path)
 {
 	boost::system::error_code ec;
+	std::vector<char> buffer;
 
-	// 得到文件大小.
-	boost::uintmax_t size = fs::file_size(file_path, ec);
-	if (ec)
-	{
-		size = 0;
-	}
-
-	// 打开文件.
-	m_file_meta.close();
-	m_file_meta.open(file_path, file::read_write, ec);
-	if (ec)
+	if (m_settings.resume_store)
 	{
-		return false;
+		// 从共用的续传数据存储中读取, 没有数据表示新的下载.
+		m_settings.resume_store->load(file_path.string(), buffer);
 	}
-
-	// 如果有数据, 则解码meta数据.
-	if (size != 0)
+	else
 	{
-		std::vector<char> buffer;
+		// 得到文件大小.
+		boost::uintmax_t size = fs::file_size(file_path, ec);
+		if (ec)
+		{
+			size = 0;
+		}
 
-		buffer.resize(size);
-		const std::streamsize num = m_file_meta.read(&buffer[0], size);
-		if (num != size)
+		// 打开文件.
+		m_file_meta.close();
+		m_file_meta.open(file_path, file::read_write, ec);
+		if (ec)
 		{
 			return false;
 		}
 
-		entry e = bdecode(buffer.begin(), buffer.end());
+		if (size != 0)
+		{
+			buffer.resize(size);
+			const std::streamsize num = m_file_meta.read(&buffer[0], size);
+			if (static_cast<boost::uintmax_t>(num) != size)
+			{
+				return false;
+			}
+		}
+	}
+
+	// 如果有数据, 则解码meta数据.
+	if (!buffer.empty())
+	{
+
+		// 解码快照.
+		int snapshot_size = 0;
+		entry e = bdecode(buffer.begin(), buffer.end(), snapshot_size);
+		if (e.type() != entry::dictionary_t)
+		{
+			return false;
+		}
+
+		// 文件大小或校验器与服务器返回的不一致, 说明文件已经变化, 已经下载的数据
+		// 全部无效. 只在双方都有同一种校验器时比较, 兼容没有保存校验器的meta.
+		if (m_file_size != -1 && e["file_size"].integer() != m_file_size)
+		{
+			return false;
+		}
+		entry* etag = e.find_key("etag");
+		entry* last_modified = e.find_key("last_modified");
+		if (etag && etag->type() == entry::string_t && !m_etag.empty())
+		{
+			if (etag->string() != m_etag)
+			{
+				return false;
+			}
+		}
+		else if (last_modified && last_modified->type() == entry::string_t
+			&& !m_last_modified.empty())
+		{
+			if (last_modified->string() != m_last_modified)
+			{
+				return false;
+			}
+		}
 
 		// 最终的url.
 		if (m_settings.allow_use_meta_url)
@@ -1722,12 +2834,13 @@ bool multi_download::open_meta(const fs::path& file_path)
 		m_file_size = e["file_size"].integer();
 		m_rangefield.reset(m_file_size);
 		m_downlaoded_field.reset(m_file_size);
+		m_meta_pending.reset(m_file_size);
 
 		// 分片大小.
 		m_settings.piece_size = e["piece_size"].integer();
 
 		// 分片数.
-		int piece_num = e["piece_num"].integer();
+		boost::int64_t piece_num = e["piece_num"].integer();
 
 		// 位图数据.
 		std::string bitfield_data = e["bitfield"].string();
@@ -1738,14 +2851,149 @@ bool multi_download::open_meta(const fs::path& file_path)
 		// 更新到区间范围.
 		m_rangefield.bitfield_to_range(bf, m_settings.piece_size);
 		m_downlaoded_field.bitfield_to_range(bf, m_settings.piece_size);
+
+		// 已经通过校验的分片, 由init_verify检查是否与当前的校验设置一致.
+		entry* hash_piece_size = e.find_key("hash_piece_size");
+		entry* verified = e.find_key("verified");
+		if (hash_piece_size && verified && hash_piece_size->type() == entry::int_t
+			&& verified->type() == entry::string_t && hash_piece_size->integer() > 0)
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+			m_hash_piece_size = static_cast<int>(hash_piece_size->integer());
+			int num = static_cast<int>((m_file_size + m_hash_piece_size - 1) / m_hash_piece_size);
+			if (static_cast<int>(verified->string().size()) == (num + 7) / 8)
+			{
+				m_verified.assign(verified->string().c_str(), num);
+			}
+		}
+
+		// 重放快照之后追加的日志记录, 最后一个记录可能因为意外中止而不完整, 忽略之.
+		std::vector<char>::iterator pos = buffer.begin() + snapshot_size;
+		while (pos != buffer.end())
+		{
+			int len = 0;
+			entry record = bdecode(pos, buffer.end(), len);
+			if (record.type() != entry::list_t || len <= 0)
+			{
+				break;
+			}
+			pos += len;
+
+			const entry::list_type& l = record.list();
+			if (l.size() == 2 && l.front().type() == entry::int_t && l.back().type() == entry::int_t)
+			{
+				boost::int64_t left = l.front().integer();
+				boost::int64_t right = l.back().integer();
+				if (left >= 0 && left < right && right <= m_file_size)
+				{
+					m_rangefield.update(left, right);
+					m_downlaoded_field.update(left, right);
+				}
+			}
+			else if (l.size() == 1 && l.front().type() == entry::int_t)
+			{
+#ifndef AVHTTP_DISABLE_THREAD
+				boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+				boost::int64_t index = l.front().integer();
+				if (index >= 0 && index < static_cast<boost::int64_t>(m_verified.size()))
+				{
+					m_verified.set_bit(static_cast<int>(index));
+				}
+			}
+		}
 	}
 
 	return true;
 }
 
+void multi_download::check_downloaded()
+{
+	if (m_file_size == -1 || m_downlaoded_field.range_size() == 0)
+	{
+		return;
+	}
+
+	// 文件被删除, 截断或者替换后, meta中记录的已下载区间会落在文件空洞或文件尾之后,
+	// 通过存储查找空洞, 只需要每个区间几次系统调用, 不需要读取数据.
+	std::vector<range> ranges;
+	m_downlaoded_field.ranges(ranges);
+	std::vector<range> missing;
+	for (std::vector<range>::iterator i = ranges.begin(); i != ranges.end(); i++)
+	{
+		boost::int64_t offset = i->left;
+		while (offset < i->right)
+		{
+			boost::int64_t left = 0;
+			boost::int64_t right = 0;
+			if (!m_storage->find_hole(offset, left, right))
+			{
+				return;	// 存储不支持查找空洞.
+			}
+			if (left >= i->right)
+			{
+				break;
+			}
+			left = (std::max)(left, offset);
+			right = (right == -1) ? i->right : (std::min)(right, i->right);
+			if (right <= left)
+			{
+				break;
+			}
+			missing.push_back(range(left, right));
+			offset = right;
+		}
+	}
+
+	if (missing.empty())
+	{
+		return;
+	}
+
+	boost::int64_t missing_size = 0;
+	for (std::vector<range>::iterator i = missing.begin(); i != missing.end(); i++)
+	{
+		missing_size += i->right - i->left;
+		m_downlaoded_field.remove(*i);
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock l(m_rangefield_mutex);
+#endif
+			m_rangefield.remove(*i);
+		}
+
+		// 其中已经通过校验的分片需要重新校验.
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		if (m_hash_piece_size > 0)
+		{
+			boost::int64_t first = i->left / m_hash_piece_size;
+			boost::int64_t last = (i->right - 1) / m_hash_piece_size;
+			for (boost::int64_t index = first; index <= last && index < static_cast<boost::int64_t>(m_verified.size()); index++)
+			{
+				m_verified.clear_bit(index);
+			}
+		}
+	}
+
+	// 下次更新meta时重写快照.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		m_meta_compact = true;
+	}
+
+	AVHTTP_LOG_WARN << "Resume data does not match '" << file_name() << "', "
+		<< missing_size << " bytes in " << missing.size() << " holes will be downloaded again.";
+}
+
 void multi_download::update_meta()
 {
-	if (!m_file_meta.is_open())
+	if (!m_settings.resume_store && !m_file_meta.is_open())
 	{
 		boost::system::error_code ec;
 		m_file_meta.open(m_settings.meta_file, file::read_write, ec);
@@ -1755,6 +3003,114 @@ void multi_download::update_meta()
 		}
 	}
 
+	// 第一次写入, 校验失败删除了已下载的区间, 或者日志已经比快照大时, 重写快照.
+	bool compact = false;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		compact = m_meta_compact;
+		m_meta_compact = false;
+	}
+	if (compact || m_meta_size == 0 || m_meta_size - m_meta_snapshot_size > m_meta_snapshot_size)
+	{
+		write_meta_snapshot();
+		return;
+	}
+
+	// 只追加上次更新之后新下载完成的区间和通过校验的分片.
+	std::vector<range> ranges;
+	if (m_settings.sync_interval > 0)
+	{
+		// 定期同步数据, 只有已经同步到磁盘的区间才写入日志.
+		if (++m_sync_elapsed >= m_settings.sync_interval)
+		{
+			start_sync();
+		}
+		else
+		{
+			start_writeback();
+		}
+
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+		ranges.swap(m_synced);
+	}
+	else
+	{
+		m_meta_pending.ranges(ranges, true);
+	}
+	std::vector<int> verified;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		verified.swap(m_verified_pending);
+	}
+	if (ranges.empty() && verified.empty())
+	{
+		return;
+	}
+
+	std::vector<char> buffer;
+	for (std::vector<range>::iterator i = ranges.begin(); i != ranges.end(); i++)
+	{
+		entry e(entry::list_t);
+		e.list().push_back(entry(i->left));
+		e.list().push_back(entry(i->right));
+		bencode(back_inserter(buffer), e);
+	}
+	for (std::vector<int>::iterator i = verified.begin(); i != verified.end(); i++)
+	{
+		entry e(entry::list_t);
+		e.list().push_back(entry(entry::integer_type(*i)));
+		bencode(back_inserter(buffer), e);
+	}
+
+	if (m_settings.resume_store)
+	{
+		m_settings.resume_store->append(m_settings.meta_file.string(), &buffer[0], buffer.size());
+	}
+	else
+	{
+		m_file_meta.write(m_meta_size, &buffer[0], buffer.size());
+	}
+	m_meta_size += buffer.size();
+}
+
+void multi_download::write_meta_snapshot()
+{
+	// 快照只包含已经同步到磁盘的区间, 所以先复制已下载区间, 再从中删除还没有
+	// 同步的区间, 因为下载时先更新m_meta_pending, 复制之后新下载的区间不会被遗漏.
+	std::vector<range> ranges;
+	m_downlaoded_field.ranges(ranges);
+	rangefield durable(m_file_size);
+	for (std::vector<range>::iterator i = ranges.begin(); i != ranges.end(); i++)
+	{
+		durable.update(*i);
+	}
+	if (m_settings.sync_interval > 0)
+	{
+		m_meta_pending.ranges(ranges);
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+			ranges.insert(ranges.end(), m_sync_inflight.begin(), m_sync_inflight.end());
+			m_synced.clear();
+		}
+		for (std::vector<range>::iterator i = ranges.begin(); i != ranges.end(); i++)
+		{
+			durable.remove(*i);
+		}
+	}
+	else
+	{
+		// 待写入日志的区间都已经包含在快照中.
+		m_meta_pending.ranges(ranges, true);
+	}
+
 	entry e;
 
 	e["final_url"] = m_final_url.to_string();
@@ -1763,14 +3119,1968 @@ void multi_download::update_meta()
 	e["piece_num"] = (m_file_size / m_settings.piece_size) +
 		(m_file_size % m_settings.piece_size == 0 ? 0 : 1);
 	bitfield bf;
-	m_downlaoded_field.range_to_bitfield(bf, m_settings.piece_size);
+	durable.range_to_bitfield(bf, m_settings.piece_size);
 	std::string str(bf.bytes(), bf.bytes_size());
 	e["bitfield"] = str;
 
+	// 保存文件的校验器, 续传时用于确认文件没有变化.
+	if (!m_etag.empty())
+	{
+		e["etag"] = m_etag;
+	}
+	if (!m_last_modified.empty())
+	{
+		e["last_modified"] = m_last_modified;
+	}
+
+	// 保存已经通过校验的分片, 继续下载时无需重新校验.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		m_verified_pending.clear();
+		if (m_hash_piece_size > 0)
+		{
+			e["hash_piece_size"] = m_hash_piece_size;
+			e["verified"] = std::string(m_verified.bytes(), m_verified.bytes_size());
+		}
+	}
+
 	std::vector<char> buffer;
 	bencode(back_inserter(buffer), e);
 
-	m_file_meta.write(0, &buffer[0], buffer.size());
+	if (m_settings.resume_store)
+	{
+		meta_store& store = *m_settings.resume_store;
+		if (!store.replace(m_settings.meta_file.string(), &buffer[0], buffer.size()))
+		{
+			return;
+		}
+		if (m_settings.sync_interval > 0)
+		{
+			store.flush();
+		}
+
+		m_meta_size = buffer.size();
+		m_meta_snapshot_size = m_meta_size;
+		return;
+	}
+
+	// 先写入临时文件再替换meta文件, 避免写入快照时意外中止导致meta文件损坏.
+	boost::system::error_code ec;
+	fs::path temp_path = m_settings.meta_file.string() + ".tmp";
+	{
+		file temp;
+		temp.open(temp_path, file::read_write, ec);
+		if (ec)
+		{
+			return;
+		}
+		temp.set_size(0, ec);
+		if (temp.write(0, &buffer[0], buffer.size()) != static_cast<file::size_type>(buffer.size()))
+		{
+			return;
+		}
+		if (m_settings.sync_interval > 0)
+		{
+			temp.flush();
+		}
+	}
+
+	m_file_meta.close();
+	fs::rename(temp_path, m_settings.meta_file, ec);
+	m_file_meta.open(m_settings.meta_file, file::read_write, ec);
+	if (ec)
+	{
+		return;
+	}
+
+	m_meta_size = buffer.size();
+	m_meta_snapshot_size = m_meta_size;
+}
+
+void multi_download::remove_meta()
+{
+	if (m_file_meta.is_open())
+	{
+		m_file_meta.close();
+	}
+
+	if (m_settings.resume_store)
+	{
+		m_settings.resume_store->remove(m_settings.meta_file.string());
+	}
+	else
+	{
+		boost::system::error_code ignore;
+		fs::remove(m_settings.meta_file, ignore);
+	}
+}
+
+void multi_download::flush_meta()
+{
+	// 同步所有已经写入的数据, 包括正在同步线程中同步的区间.
+	boost::system::error_code ec;
+	if (m_settings.sync_interval > 0 && m_storage && (m_storage->sync(ec), !ec))
+	{
+		std::vector<range> ranges;
+		m_meta_pending.ranges(ranges, true);
+
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+		m_synced.insert(m_synced.end(), m_sync_inflight.begin(), m_sync_inflight.end());
+		m_synced.insert(m_synced.end(), ranges.begin(), ranges.end());
+		m_sync_inflight.clear();
+	}
+
+	update_meta();
+}
+
+void multi_download::start_sync()
+{
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+		if (m_syncing || m_abort || !m_storage)
+		{
+			return;
+		}
+		m_syncing = true;
+		m_sync_elapsed = 0;
+
+		// 取出已经写入的区间, 同步完成后写入meta日志.
+		m_meta_pending.ranges(m_sync_inflight, true);
+	}
+
+	change_outstranding(true);
+	sync_io_service().post(boost::bind(&multi_download::handle_sync, this));
+}
+
+void multi_download::start_writeback()
+{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+		if (m_syncing || m_abort || !m_storage || m_storage->native_handle() == -1)
+		{
+			return;
+		}
+		m_syncing = true;
+	}
+
+	change_outstranding(true);
+	sync_io_service().post(boost::bind(&multi_download::handle_writeback, this));
+#endif
+}
+
+void multi_download::handle_writeback()
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	writeback();
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+	m_syncing = false;
+}
+
+void multi_download::handle_sync()
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	// 只有fdatasync之后数据和新分配的块才真正持久化, 然后才能写入meta.
+	boost::system::error_code ec;
+	m_storage->sync(ec);
+	bool ok = !ec;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_sync_mutex);
+#endif
+	m_syncing = false;
+	if (ok)
+	{
+		m_synced.insert(m_synced.end(), m_sync_inflight.begin(), m_sync_inflight.end());
+	}
+	else
+	{
+		// 同步失败, 放回等待下一次同步.
+		for (std::vector<range>::iterator i = m_sync_inflight.begin();
+			i != m_sync_inflight.end(); i++)
+		{
+			m_meta_pending.update(*i);
+		}
+	}
+	m_sync_inflight.clear();
+}
+
+multi_download::http_object_ptr multi_download::create_connection(int index)
+{
+	http_object_ptr p = boost::make_shared<http_stream_object>();
+	range req_range;
+
+	// 从文件间区中得到一段空间.
+	if (!allocate_range(req_range))
+	{
+		return http_object_ptr();
+	}
+
+	// 保存请求区间.
+	p->request_range = req_range;
+
+	// 区间被已经下载的数据截断时, 同时请求其它的空隙.
+	allocate_extra_ranges(*p);
+	p->publish();
+
+	// 创建连接使用的http_stream.
+	create_stream(*p);
+	http_stream_ptr ptr = p->stream;
+
+	// 配置请求选项.
+	request_opts req_opt = m_settings.opts;
+
+	// 设置是否为长连接.
+	if (m_keep_alive)
+	{
+		req_opt.insert(http_options::connection, "keep-alive");
+	}
+	else
+	{
+		req_opt.insert(http_options::connection, "close");
+	}
+
+	// 设置请求区间到请求选项中.
+	req_opt.insert(http_options::range, range_option(*p, req_range.left));
+
+	// 设置请求选项.
+	ptr->request_options(req_opt);
+	// 如果是ssl连接, 默认为检查证书.
+	ptr->check_certificate(m_settings.check_certificate);
+	// 禁用重定向.
+	ptr->max_redirects(0);
+	// 添加代理设置.
+	ptr->proxy(m_settings.proxy);
+
+	// 保存最后请求时间, 方便检查超时重置.
+	p->last_request_time = boost::posix_time::microsec_clock::local_time();
+	p->request_time = p->last_request_time;
+
+	change_outstranding(true);
+
+	// 开始异步打开, 传入指针http_object_ptr, 以确保多线程安全.
+	p->stream->async_open(m_final_url,
+		p->strand->wrap(
+			boost::bind(&multi_download::handle_open,
+				this,
+				index, p,
+				boost::asio::placeholders::error
+			)
+		)
+	);
+
+	return p;
+}
+
+void multi_download::adjust_connections()
+{
+	// 调用者必须已经锁定m_streams_mutex.
+	const int limit = m_settings.connections_limit;
+	int active = 0;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		if (!m_streams[i]->done && !m_streams[i]->retire)
+		{
+			active++;
+		}
+	}
+
+	// 连接数超出限制, 从后向前将多余的连接标记为退役, 退役的连接
+	// 下载完当前区间后关闭, 这样不会留下已分配但未下载的区间.
+	for (std::size_t i = m_streams.size(); i > 0 && active > limit; i--)
+	{
+		http_object_ptr& object_ptr = m_streams[i - 1];
+		if (!object_ptr->done && !object_ptr->retire)
+		{
+			// 在连接所属的strand中修改, 避免与该连接上的回调并发访问.
+			change_outstranding(true);
+			object_ptr->strand->post(boost::bind(&multi_download::set_retire,
+				this, object_ptr, true));
+			active--;
+		}
+	}
+
+	// 连接数不足, 优先恢复尚未关闭的退役连接.
+	for (std::size_t i = 0; i < m_streams.size() && active < limit; i++)
+	{
+		http_object_ptr& object_ptr = m_streams[i];
+		if (!object_ptr->done && object_ptr->retire)
+		{
+			// 在连接所属的strand中修改, 避免与该连接上的回调并发访问.
+			change_outstranding(true);
+			object_ptr->strand->post(boost::bind(&multi_download::set_retire,
+				this, object_ptr, false));
+			active++;
+		}
+	}
+
+	// 然后再创建新的连接.
+	while (active < limit)
+	{
+		// 复用已经完成的连接位置, 包括退役和因校验或写入失败重新下载而结束的连接,
+		// 避免m_streams不断增长.
+		std::size_t index = m_streams.size();
+		for (std::size_t i = 0; i < m_streams.size(); i++)
+		{
+			if (m_streams[i]->done)
+			{
+				index = i;
+				break;
+			}
+		}
+
+		// 没有空闲的区间可分配了.
+		http_object_ptr p = create_connection(static_cast<int>(index));
+		if (!p)
+		{
+			break;
+		}
+
+		if (index < m_streams.size())
+		{
+			// 保留原连接的下载统计, 以免影响下载速率的计算.
+			p->bytes_downloaded = m_streams[index]->bytes_downloaded;
+			m_streams[index] = p;
+		}
+		else
+		{
+			m_streams.push_back(p);
+		}
+
+		active++;
+	}
+
+	// 重新统计连接数, 用于平分限速, 统计完再写入, 其它线程不会读到中间值.
+	int connections = 0;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		if (!m_streams[i]->done)
+		{
+			connections++;
+		}
+	}
+	m_number_of_connections = connections;
+}
+
+void multi_download::write_data(http_stream_object& object, boost::int64_t offset,
+	const char* data, std::size_t size, const boost::system::error_code& ec)
+{
+	// 文件大小未知时没有下载区间位图, 直接交给存储异步写入.
+	if (m_file_size == -1)
+	{
+		write_buffer(offset, boost::make_shared<std::vector<char> >(data, data + size));
+		return;
+	}
+
+	// 先在连接中累计连续的区间, 不连续时更新之前累计的部分.
+	if (object.written_right != offset)
+	{
+		publish_range(object);
+		object.written_left = offset;
+		object.written_right = offset;
+	}
+
+	bool write_behind = m_settings.write_cache_size > 0;
+	if (write_behind)
+	{
+		// 复制到写缓冲, 每个写缓冲对应文件中按块大小对齐的一块, 满一块即交给存储异步写入.
+		boost::int64_t block_size = (std::min)(default_write_block_size, m_settings.write_cache_size);
+		while (size != 0)
+		{
+			boost::int64_t block_end = (object.written_right / block_size + 1) * block_size;
+			std::size_t n = static_cast<std::size_t>(
+				(std::min)(block_end - object.written_right, static_cast<boost::int64_t>(size)));
+			if (!object.write_buffer)
+			{
+				object.write_buffer = boost::make_shared<std::vector<char> >();
+				object.write_buffer->reserve(static_cast<std::size_t>(block_size));
+			}
+			object.write_buffer->insert(object.write_buffer->end(), data, data + n);
+			object.written_right += n;
+			data += n;
+			size -= n;
+
+			if (object.written_right == block_end)
+			{
+				publish_range(object);
+			}
+		}
+	}
+	else
+	{
+		// 不使用写缓存, 收到的数据复制一份直接交给存储异步写入, 不在连接的strand中
+		// 等待磁盘, 写入完成后由handle_write更新下载区间位图.
+		write_buffer(offset, boost::make_shared<std::vector<char> >(data, data + size));
+		object.written_left = offset + size;
+		object.written_right = offset + size;
+	}
+
+	// 多区间请求时, 取得正在写入的部分所在的区间.
+	boost::int64_t part_right = object.request_range.right;
+	for (std::size_t i = 0; i < object.ranges.size(); i++)
+	{
+		if (offset >= object.ranges[i].left && offset <= object.ranges[i].right)
+		{
+			part_right = object.ranges[i].right;
+			break;
+		}
+	}
+
+	// 跨过分片边界, 请求的区间下载完成, 或者数据落在读取者等待的预读区间中时才
+	// 更新共享的下载区间位图, 避免每次读取都锁定位图.
+	boost::int64_t end = object.written_right;
+	if (end > part_right || end == m_file_size
+		|| ec || m_abort || object.preempt
+		|| in_read_ahead(object.written_left, end))
+	{
+		publish_range(object);
+	}
+}
+
+bool multi_download::write_multipart(http_stream_object& object,
+	std::size_t size, const boost::system::error_code& ec)
+{
+	const char* data = object.buffer.c_array();
+	boost::int64_t offset = 0;
+	const char* body = NULL;
+	std::size_t body_size = 0;
+
+	for (;;)
+	{
+		detail::byteranges_parser::result result =
+			object.parser.parse(data, size, offset, body, body_size);
+		if (result == detail::byteranges_parser::failed)
+		{
+			return false;
+		}
+		if (result != detail::byteranges_parser::body_part)
+		{
+			return true;
+		}
+
+		boost::int64_t end = offset + static_cast<boost::int64_t>(body_size);
+		if (end > m_file_size)
+		{
+			return false;
+		}
+
+		// 数据必须完全落在这个连接请求的区间中, 否则可能覆盖其它连接的区间或已经
+		// 下载的数据. 服务器可能把相邻的区间合并为一个部分, 所以按区间逐段检查.
+		boost::int64_t point = offset;
+		while (point < end)
+		{
+			std::size_t i = 0;
+			for (; i < object.ranges.size(); i++)
+			{
+				if (point >= object.ranges[i].left && point <= object.ranges[i].right)
+				{
+					break;
+				}
+			}
+			if (i == object.ranges.size())
+			{
+				return false;
+			}
+			point = object.ranges[i].right + 1;
+		}
+
+		write_data(object, offset, body, body_size, ec);
+
+		// 更新各区间已经连续下载的字节数, 服务器可能把相邻的区间合并为一个部分.
+		for (std::size_t i = 0; i < object.ranges.size(); i++)
+		{
+			const range& r = object.ranges[i];
+			boost::int64_t received = r.left + object.ranges_received[i];
+			if (offset <= received && end > received)
+			{
+				object.ranges_received[i] = (std::min)(end, r.right + 1) - r.left;
+			}
+		}
+	}
+}
+
+void multi_download::allocate_extra_ranges(http_stream_object& object)
+{
+	object.ranges.clear();
+	object.ranges_received.clear();
+	object.multipart = false;
+
+	if (!m_multi_range || m_settings.max_ranges <= 1)
+	{
+		return;
+	}
+
+	// 预读时需要按顺序下载, 不合并空隙.
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+		if (m_read_ahead)
+		{
+			return;
+		}
+	}
+
+	boost::int64_t request_size = object.request_size;
+	if (request_size <= 0)
+	{
+		request_size = static_cast<boost::int64_t>(m_settings.request_piece_num) * m_settings.piece_size;
+	}
+
+	// 只有区间被已经下载的数据截断, 即空隙比请求的大小小时, 才合并其它的空隙.
+	boost::int64_t total = object.request_range.size();
+	std::vector<range> ranges(1, object.request_range);
+	while (total < request_size && static_cast<int>(ranges.size()) < m_settings.max_ranges)
+	{
+		range r;
+		if (!allocate_range(r, request_size - total))
+		{
+			break;
+		}
+		ranges.push_back(r);
+		total += r.size();
+	}
+
+	if (ranges.size() > 1)
+	{
+		object.ranges.swap(ranges);
+		object.ranges_received.resize(object.ranges.size(), 0);
+	}
+}
+
+std::string multi_download::range_option(const http_stream_object& object, boost::int64_t begin) const
+{
+	std::string value = boost::str(boost::format("bytes=%lld-%lld", std::locale("C"))
+		% begin % object.request_range.right);
+	for (std::size_t i = 1; i < object.ranges.size(); i++)
+	{
+		value += boost::str(boost::format(",%lld-%lld", std::locale("C"))
+			% object.ranges[i].left % object.ranges[i].right);
+	}
+	return value;
+}
+
+bool multi_download::check_multipart(http_stream_object& object)
+{
+	if (object.ranges.empty())
+	{
+		return true;
+	}
+
+	std::string content_type;
+	object.stream->response_options().find(http_options::content_type, content_type);
+	std::string boundary = detail::byteranges_parser::boundary(content_type);
+	if (!boundary.empty())
+	{
+		object.multipart = true;
+		object.parser.reset(boundary);
+		return true;
+	}
+
+	// 服务器只返回了一个部分, 可能只支持单个区间, 或者把所有区间合并成了一个.
+	disable_multi_range(object);
+	return false;
+}
+
+void multi_download::disable_multi_range(http_stream_object& object)
+{
+	if (m_multi_range)
+	{
+		AVHTTP_LOG_WARN << "The server does not support multiple ranges, request one range at a time.";
+	}
+	m_multi_range = false;
+
+	// 释放所有区间, 由on_tick重新连接, 重新分配区间.
+	release_range(object);
+	object.direct_reconnect = true;
+}
+
+void multi_download::publish_range(http_stream_object& object)
+{
+	boost::int64_t left = object.written_left;
+	boost::int64_t right = object.written_right;
+	if (left >= right)
+	{
+		return;
+	}
+	object.written_left = right;
+
+	// 数据还在写缓冲中, 交给存储异步写入后再更新.
+	if (object.write_buffer)
+	{
+		boost::shared_ptr<std::vector<char> > buffer;
+		buffer.swap(object.write_buffer);
+		BOOST_ASSERT(static_cast<boost::int64_t>(buffer->size()) == right - left);
+		write_buffer(left, buffer);
+		return;
+	}
+
+	publish_range(left, right);
+}
+
+void multi_download::write_buffer(boost::int64_t offset, boost::shared_ptr<std::vector<char> > buffer)
+{
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+		m_write_bytes += buffer->size();
+	}
+
+	// 写缓冲在写入完成之前由handle_write持有.
+	change_outstranding(true);
+	m_storage->async_write(offset, async_storage_interface::const_buffers_type(
+		1, boost::asio::buffer(*buffer)), boost::bind(&multi_download::handle_write,
+			this, offset, buffer, boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred));
+}
+
+void multi_download::publish_range(boost::int64_t left, boost::int64_t right)
+{
+	m_meta_pending.update(left, right);
+	m_downlaoded_field.update(left, right);
+
+	// 完成等待这段数据的异步读取请求.
+	check_fetch_requests();
+
+	// 校验下载完成的分片.
+	check_pieces(left, right - left);
+
+	// 交出新的前缀.
+	start_stream();
+}
+
+void multi_download::check_fetch_requests(const boost::system::error_code& ec)
+{
+	std::vector<boost::function<void (const boost::system::error_code&)> > ready;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_fetch_mutex);
+#endif
+		std::list<fetch_request>::iterator i = m_fetch_requests.begin();
+		while (i != m_fetch_requests.end())
+		{
+			if (ec || m_downlaoded_field.check_range(i->offset, i->offset + i->length))
+			{
+				ready.push_back(i->handler);
+				i = m_fetch_requests.erase(i);
+				continue;
+			}
+			++i;
+		}
+	}
+
+	// 投递到io_service中读取数据并回调, 不在下载连接的回调中执行用户的handler.
+	for (std::size_t i = 0; i < ready.size(); i++)
+	{
+		change_outstranding(true);
+		m_io_service.post(boost::bind(ready[i], ec));
+	}
+}
+
+void multi_download::preempt_for_read_ahead()
+{
+	// 调用者必须已经锁定m_streams_mutex.
+	if (m_abort)
+	{
+		return;
+	}
+
+	// 预读区间已经全部分配出去了, 无需抢占.
+	boost::int64_t point = 0;
+	boost::int64_t end = 0;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+		if (!m_read_ahead)
+		{
+			return;
+		}
+
+		point = m_download_point;
+		end = read_ahead_end();
+
+		// 预读区间已经全部下载完成, 恢复正常的区间分配, 直到读取点再次移动.
+		if (point >= end || m_downlaoded_field.check_range(point, end))
+		{
+			m_read_ahead = false;
+			return;
+		}
+
+		boost::int64_t left = 0;
+		boost::int64_t right = 0;
+		if (!m_rangefield.out_space(point, left, right) || left < point || left >= end)
+		{
+			return;
+		}
+	}
+
+	// 选择离读取点最远, 且剩余数据多于一个分片的连接, 读取点之前的连接
+	// 视为最远. 每次tick只抢占一个连接, 避免同时断开太多连接.
+	http_object_ptr victim;
+	boost::int64_t max_distance = -1;
+	for (std::size_t i = 0; i < m_streams.size(); i++)
+	{
+		http_stream_object& object = *m_streams[i];
+		if (object.done || object.retire || object.preempt || object.direct_reconnect
+			|| object.multi_range)
+		{
+			continue;
+		}
+
+		// 使用strand发布的快照, 真正的抢占在连接的strand中由set_preempt完成.
+		boost::int64_t begin = object.position;
+		boost::int64_t remain = object.position_end - begin;
+		if (remain <= m_settings.piece_size)
+		{
+			continue;
+		}
+
+		// 已经在下载预读区间内的数据.
+		if (begin >= point && begin < end)
+		{
+			continue;
+		}
+
+		boost::int64_t distance = begin >= point ?
+			begin - point : m_file_size + (point - begin);
+		if (distance > max_distance)
+		{
+			max_distance = distance;
+			victim = m_streams[i];
+		}
+	}
+
+	if (victim)
+	{
+		// 在连接所属的strand中设置抢占标识, 由该连接的回调关闭连接.
+		change_outstranding(true);
+		victim->strand->post(boost::bind(&multi_download::set_preempt, this, victim));
+	}
+}
+
+void multi_download::release_range(http_stream_object& object)
+{
+	// 多区间请求, 释放每个区间没有下载的部分, 重连时重新分配所有区间.
+	if (!object.ranges.empty())
+	{
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+			for (std::size_t i = 0; i < object.ranges.size(); i++)
+			{
+				boost::int64_t begin = object.ranges[i].left + object.ranges_received[i];
+				boost::int64_t end = object.ranges[i].right + 1;
+				if (begin < end)
+				{
+					m_rangefield.remove(begin, end);
+				}
+			}
+		}
+
+		object.ranges.clear();
+		object.ranges_received.clear();
+		object.multipart = false;
+		object.bytes_transferred = 0;
+		object.request_range.right = object.request_range.left - 1;
+		object.publish();
+		return;
+	}
+
+	boost::int64_t begin = object.request_range.left + object.bytes_transferred;
+	boost::int64_t end = object.request_range.right + 1;
+
+	if (begin < end)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+		m_rangefield.remove(begin, end);
+	}
+
+	// 当前区间到此为止, 重连时将重新分配区间.
+	object.request_range.right = begin - 1;
+	object.publish();
+}
+
+void multi_download::move_read_point(boost::int64_t offset)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+	m_download_point = offset;
+	m_read_ahead = true;
+}
+
+bool multi_download::in_read_ahead(boost::int64_t left, boost::int64_t right)
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+	return m_read_ahead && left < read_ahead_end() && right > m_download_point;
+}
+
+boost::int64_t multi_download::read_ahead_end() const
+{
+	boost::int64_t read_ahead = m_settings.read_ahead;
+	if (read_ahead < 0)
+	{
+		read_ahead = static_cast<boost::int64_t>(m_settings.piece_size) * m_settings.request_piece_num;
+	}
+	return (std::min)(m_download_point + read_ahead, m_file_size);
+}
+
+void multi_download::apply_seed(boost::system::error_code& ec)
+{
+	if (m_settings.delta_control_file.empty() || m_settings.seed_file.empty())
+	{
+		return;
+	}
+
+	// 复制的块按区间标记为已经下载, 只能在多点下载模式下使用.
+	if (!m_accept_multi || m_file_size <= 0)
+	{
+		AVHTTP_LOG_WARN << "Delta download disabled, the server does not support range requests.";
+		return;
+	}
+
+	delta_control control;
+	control.load(m_settings.delta_control_file, ec);
+	if (ec)
+	{
+		return;
+	}
+	if (control.length() != m_file_size)
+	{
+		ec = errc::invalid_delta_control;
+		return;
+	}
+
+	// 旧版本的文件不存在或不可用时, 只是不能复制, 仍然可以完整下载.
+	boost::system::error_code seed_ec;
+	if (!fs::exists(m_settings.seed_file, seed_ec)
+		|| fs::equivalent(m_settings.seed_file, file_name(), seed_ec))
+	{
+		AVHTTP_LOG_WARN << "Delta download, seed file " << m_settings.seed_file.string()
+			<< " is missing or is the output file.";
+		return;
+	}
+
+	boost::int64_t seeded = 0;
+	control.match(m_settings.seed_file,
+		boost::bind(&multi_download::handle_seed_block, this, _1, _2, _3, boost::ref(seeded)),
+		seed_ec);
+	if (seed_ec)
+	{
+		AVHTTP_LOG_WARN << "Delta download, read seed file failed: " << seed_ec.message();
+	}
+
+	AVHTTP_LOG_DBG << "Delta download, " << seeded << " of " << m_file_size
+		<< " bytes copied from seed file.";
+}
+
+void multi_download::handle_seed_block(boost::int64_t offset,
+	const char* data, std::size_t size, boost::int64_t& seeded)
+{
+	boost::int64_t right = offset + static_cast<boost::int64_t>(size);
+
+	// 续传时已经下载的块不需要复制.
+	if (m_downlaoded_field.check_range(offset, right))
+	{
+		return;
+	}
+
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+		boost::system::error_code ec;
+		m_storage->write(offset, async_storage_interface::const_buffers_type(
+			1, boost::asio::buffer(data, size)), ec);
+		if (ec)
+		{
+			return;
+		}
+	}
+
+	// 与下载的数据一样先写入m_meta_pending, 同步到磁盘后再写入meta.
+	m_meta_pending.update(offset, right);
+	m_downlaoded_field.update(offset, right);
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+		m_rangefield.update(offset, right);
+	}
+
+	seeded += right - offset;
+}
+
+void multi_download::init_verify(boost::system::error_code& ec)
+{
+	// 从校验清单中加载分片的sha1.
+	if (m_settings.piece_hashes.empty() && !m_settings.hash_manifest.empty())
+	{
+		fs::ifstream manifest(m_settings.hash_manifest, std::ios::in | std::ios::binary);
+		std::vector<char> buffer((std::istreambuf_iterator<char>(manifest)),
+			std::istreambuf_iterator<char>());
+
+		entry e = bdecode(buffer.begin(), buffer.end());
+		entry* length = e.type() == entry::dictionary_t ? e.find_key("piece length") : NULL;
+		entry* pieces = e.type() == entry::dictionary_t ? e.find_key("pieces") : NULL;
+		if (!length || !pieces || length->type() != entry::int_t
+			|| pieces->type() != entry::string_t || length->integer() <= 0
+			|| pieces->string().size() % detail::sha1::digest_size != 0)
+		{
+			ec = errc::invalid_piece_hashes;
+			return;
+		}
+
+		m_settings.hash_piece_size = static_cast<int>(length->integer());
+		const std::string& data = pieces->string();
+		for (std::size_t i = 0; i < data.size(); i += detail::sha1::digest_size)
+		{
+			m_settings.piece_hashes.push_back(data.substr(i, detail::sha1::digest_size));
+		}
+	}
+
+	int hash_piece_size = 0;
+	if (!m_settings.piece_hashes.empty() || m_settings.file_digest)
+	{
+		hash_piece_size = m_settings.piece_hashes.empty() && m_settings.hash_piece_size <= 0 ?
+			m_settings.piece_size : m_settings.hash_piece_size;
+
+		// 校验失败的分片需要按区间重新下载, 所以只能在多点下载模式下校验.
+		if (!m_accept_multi || m_file_size <= 0)
+		{
+			AVHTTP_LOG_WARN << "Piece verification disabled, the server does not support range requests.";
+			hash_piece_size = 0;
+		}
+	}
+
+	if (hash_piece_size > 0 && !m_settings.piece_hashes.empty())
+	{
+		// 分片数必须与文件大小一致.
+		boost::int64_t num = (m_file_size + hash_piece_size - 1) / hash_piece_size;
+		bool valid = static_cast<boost::int64_t>(m_settings.piece_hashes.size()) == num;
+		for (std::size_t i = 0; valid && i < m_settings.piece_hashes.size(); i++)
+		{
+			valid = m_settings.piece_hashes[i].size() == detail::sha1::digest_size;
+		}
+		if (!valid)
+		{
+			ec = errc::invalid_piece_hashes;
+			return;
+		}
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+
+	if (hash_piece_size <= 0)
+	{
+		m_hash_piece_size = 0;
+		m_verified.resize(0);
+		m_hashing.resize(0);
+		return;
+	}
+
+	int num = static_cast<int>((m_file_size + hash_piece_size - 1) / hash_piece_size);
+
+	// meta中保存的校验结果与当前的分片大小不一致, 则全部重新校验.
+	if (m_hash_piece_size != hash_piece_size || static_cast<int>(m_verified.size()) != num)
+	{
+		m_verified.resize(0);
+		m_verified.resize(num, false);
+	}
+	m_hash_piece_size = hash_piece_size;
+	m_hashing.resize(0);
+	m_hashing.resize(num, false);
+
+	// 文件摘要在每次启动时重新计算, 已经下载的部分会从存储中读取.
+	m_file_hasher.reset();
+	m_digest_point = 0;
+	m_digesting = false;
+	m_file_digest.clear();
+
+#ifndef AVHTTP_DISABLE_THREAD
+	if (!m_hash_pool)
+	{
+		m_hash_pool.reset(new io_service_pool((std::max)(m_settings.hash_threads, 1)));
+		m_hash_pool->run();
+	}
+#endif
+
+#ifndef AVHTTP_DISABLE_THREAD
+	lock.unlock();
+#endif
+
+	// 提交已经下载但还没有校验的分片.
+	check_pieces(0, m_file_size);
+}
+
+void multi_download::check_pieces(boost::int64_t offset, boost::int64_t size)
+{
+	if (m_hash_piece_size <= 0 || size <= 0)
+	{
+		return;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+
+	int first = static_cast<int>(offset / m_hash_piece_size);
+	int last = static_cast<int>((offset + size - 1) / m_hash_piece_size);
+	bool digest = false;
+
+	for (int index = first; index <= last; index++)
+	{
+		if (m_verified.get_bit(index) || m_hashing.get_bit(index))
+		{
+			continue;
+		}
+
+		boost::int64_t left = static_cast<boost::int64_t>(index) * m_hash_piece_size;
+		boost::int64_t right = (std::min)(left + m_hash_piece_size, m_file_size);
+		if (!m_downlaoded_field.check_range(left, right))
+		{
+			continue;
+		}
+
+		// 只计算文件摘要时, 分片下载完成即视为通过.
+		if (m_settings.piece_hashes.empty())
+		{
+			m_verified.set_bit(index);
+			digest = true;
+			continue;
+		}
+
+		m_hashing.set_bit(index);
+		change_outstranding(true);
+		hash_io_service().post(boost::bind(&multi_download::handle_hash_piece, this, index));
+	}
+
+	if (digest)
+	{
+		start_digest();
+	}
+}
+
+void multi_download::handle_hash_piece(int index)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	std::vector<char> buffer;
+	bool pass = false;
+	if (!m_abort && read_piece(index, buffer))
+	{
+		detail::sha1 h;
+		h.update(&buffer[0], buffer.size());
+		pass = h.final() == m_settings.piece_hashes[index];
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+	m_hashing.clear_bit(index);
+
+	// 停止下载时还没有校验的分片, 在下次启动时重新校验.
+	if (m_abort)
+	{
+		return;
+	}
+
+	if (pass)
+	{
+		m_verified.set_bit(index);
+		m_verified_pending.push_back(index);
+		start_digest();
+
+		// 启用校验时流式处理只交出通过校验的分片.
+#ifndef AVHTTP_DISABLE_THREAD
+		lock.unlock();
+#endif
+		start_stream();
+		return;
+	}
+
+	// 校验失败, 从已下载区间和已分配区间中删除, 由连接重新下载.
+	m_hash_failures++;
+	m_meta_compact = true;
+	AVHTTP_LOG_WARN << "Piece " << index << " hash check failed, refetch it.";
+
+	boost::int64_t left = static_cast<boost::int64_t>(index) * m_hash_piece_size;
+	boost::int64_t right = (std::min)(left + m_hash_piece_size, m_file_size);
+	m_downlaoded_field.remove(left, right);
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock l(m_rangefield_mutex);
+#endif
+		m_rangefield.remove(left, right);
+	}
+}
+
+void multi_download::start_digest()
+{
+	// 调用者必须已经锁定m_hash_mutex.
+	if (!m_settings.file_digest || m_digesting || !m_file_digest.empty())
+	{
+		return;
+	}
+
+	if (m_digest_point >= m_file_size
+		|| !m_verified.get_bit(static_cast<int>(m_digest_point / m_hash_piece_size)))
+	{
+		return;
+	}
+
+	// 同一时间只有一个线程按顺序计算文件摘要.
+	m_digesting = true;
+	change_outstranding(true);
+	hash_io_service().post(boost::bind(&multi_download::handle_digest, this));
+}
+
+void multi_download::handle_digest()
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	std::vector<char> buffer;
+	for (;;)
+	{
+		int index = 0;
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+			index = static_cast<int>(m_digest_point / m_hash_piece_size);
+			if (m_abort || m_digest_point >= m_file_size || !m_verified.get_bit(index))
+			{
+				m_digesting = false;
+				return;
+			}
+		}
+
+		// 刚下载完成的数据一般还在系统缓存中, 读取的开销很小.
+		bool result = read_piece(index, buffer);
+
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		if (!result)
+		{
+			m_digesting = false;
+			return;
+		}
+
+		m_file_hasher.update(&buffer[0], buffer.size());
+		m_digest_point += buffer.size();
+		if (m_digest_point == m_file_size)
+		{
+			m_file_digest = m_file_hasher.final();
+			m_digesting = false;
+			return;
+		}
+	}
+}
+
+bool multi_download::verify_complete()
+{
+	if (m_hash_piece_size <= 0)
+	{
+		return true;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+	if (!m_verified.all_set())
+	{
+		return false;
+	}
+
+	if (m_settings.file_digest && m_file_digest.empty())
+	{
+		// 读取失败时文件摘要的计算会中断, 在这里重新开始.
+		start_digest();
+		return false;
+	}
+
+	return true;
+}
+
+bool multi_download::read_piece(int index, std::vector<char>& buffer)
+{
+	boost::int64_t offset = static_cast<boost::int64_t>(index) * m_hash_piece_size;
+	int size = static_cast<int>((std::min)(
+		static_cast<boost::int64_t>(m_hash_piece_size), m_file_size - offset));
+	buffer.resize(size);
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+	boost::system::error_code ec;
+	return m_storage->read(offset, async_storage_interface::mutable_buffers_type(
+		1, boost::asio::buffer(buffer)), ec) == buffer.size();
+}
+
+void multi_download::start_stream()
+{
+	if (!m_settings.stream_handler || m_file_size == -1 || m_abort)
+	{
+		return;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+
+	// 正在处理时由handle_stream在结束前再检查一次.
+	if (m_streaming)
+	{
+		m_stream_pending = true;
+		return;
+	}
+	if (!stream_ready())
+	{
+		return;
+	}
+
+	// 同一时间只有一个线程按顺序交出数据.
+	m_streaming = true;
+	m_stream_pending = false;
+	change_outstranding(true);
+	stream_io_service().post(boost::bind(&multi_download::handle_stream, this));
+}
+
+void multi_download::handle_stream()
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	std::vector<char> buffer;
+	for (;;)
+	{
+		boost::int64_t offset = m_stream_point;
+		boost::int64_t end = m_abort ? offset : stream_end();
+
+		if (end == offset)
+		{
+			{
+#ifndef AVHTTP_DISABLE_THREAD
+				boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+				// 检查期间有新的数据, 再检查一次.
+				if (m_stream_pending && !m_abort)
+				{
+					m_stream_pending = false;
+					continue;
+				}
+
+				if (offset != m_file_size || m_stream_eof || m_abort)
+				{
+					m_streaming = false;
+					return;
+				}
+				m_stream_eof = true;
+			}
+
+			// 整个文件已经交出, 以大小为0通知结束, 返回之后stream_complete才成立.
+			m_settings.stream_handler(offset, NULL, 0);
+
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+			m_streaming = false;
+			return;
+		}
+
+		std::size_t size = static_cast<std::size_t>((std::min)(end - offset,
+			static_cast<boost::int64_t>(default_write_block_size)));
+
+		// 存储支持视图时直接交出视图, 否则读取到缓冲中.
+		boost::shared_ptr<const char> view;
+		std::size_t length = 0;
+		const char* data = NULL;
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_storage_mutex);
+#endif
+			view = m_storage->view(offset, size, length);
+			if (view)
+			{
+				data = view.get();
+			}
+			else
+			{
+				buffer.resize(size);
+				boost::system::error_code ec;
+				length = m_storage->read(offset, async_storage_interface::mutable_buffers_type(
+					1, boost::asio::buffer(buffer)), ec);
+				data = &buffer[0];
+			}
+		}
+
+		// 读取失败, 由on_tick重试.
+		if (length == 0)
+		{
+			AVHTTP_LOG_WARN << "Stream read " << size << " bytes at " << offset << " failed.";
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+			m_streaming = false;
+			return;
+		}
+
+		m_settings.stream_handler(offset, data, length);
+
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+			m_stream_point = offset + length;
+		}
+
+		// 之后分配的区间从还没有交出的位置开始.
+		if (m_settings.stream_prefer_prefix || m_settings.stream_window > 0)
+		{
+			move_read_point(offset + length);
+		}
+
+		resume_stream_waiters();
+	}
+}
+
+boost::int64_t multi_download::stream_end()
+{
+	boost::int64_t offset = m_stream_point;
+	if (offset >= m_file_size)
+	{
+		return offset;
+	}
+
+	// 启用校验时只交出连续通过校验的分片.
+	if (m_hash_piece_size > 0)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		if (m_hash_piece_size > 0)
+		{
+			int index = static_cast<int>(offset / m_hash_piece_size);
+			int num = static_cast<int>(m_verified.size());
+			while (index < num && m_verified.get_bit(index))
+			{
+				index++;
+			}
+			return (std::max)(offset, (std::min)(m_file_size,
+				static_cast<boost::int64_t>(index) * m_hash_piece_size));
+		}
+	}
+
+	boost::int64_t left = offset;
+	boost::int64_t right = m_file_size;
+	if (!m_downlaoded_field.get_range(left, right))
+	{
+		return offset;
+	}
+	return right;
+}
+
+bool multi_download::stream_ready()
+{
+	// 调用者必须已经锁定m_stream_mutex.
+	if (m_stream_eof)
+	{
+		return false;
+	}
+	if (m_stream_point >= m_file_size)
+	{
+		return true;
+	}
+
+	if (m_hash_piece_size > 0)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_hash_mutex);
+#endif
+		int index = static_cast<int>(m_stream_point / m_hash_piece_size);
+		return m_hash_piece_size > 0 && index < static_cast<int>(m_verified.size())
+			&& m_verified.get_bit(index);
+	}
+
+	return m_downlaoded_field.check_range(m_stream_point, m_stream_point + 1);
+}
+
+bool multi_download::stream_complete()
+{
+	if (!m_settings.stream_handler || m_file_size == -1)
+	{
+		return true;
+	}
+
+	start_stream();
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+	return m_stream_eof && !m_streaming;
+}
+
+bool multi_download::defer_stream(int index, http_object_ptr object_ptr)
+{
+	if (m_settings.stream_window <= 0 || !m_settings.stream_handler
+		|| m_file_size == -1 || !object_ptr->ranges.empty())
+	{
+		return false;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+	if (m_abort || read_position(*object_ptr) < m_stream_point + m_settings.stream_window)
+	{
+		return false;
+	}
+
+	// 暂停期间不计算超时, 由resume_read继续读取.
+	object_ptr->write_wait = true;
+	m_stream_waiters.push_back(std::make_pair(index, object_ptr));
+	change_outstranding(true);
+	return true;
+}
+
+void multi_download::resume_stream_waiters()
+{
+	std::vector<std::pair<int, http_object_ptr> > waiters;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+		std::vector<std::pair<int, http_object_ptr> >::iterator i = m_stream_waiters.begin();
+		while (i != m_stream_waiters.end())
+		{
+			if (m_abort || read_position(*i->second) < m_stream_point + m_settings.stream_window)
+			{
+				waiters.push_back(*i);
+				i = m_stream_waiters.erase(i);
+				continue;
+			}
+			++i;
+		}
+	}
+
+	for (std::size_t i = 0; i < waiters.size(); i++)
+	{
+		const http_object_ptr& object_ptr = waiters[i].second;
+		object_ptr->strand->post(boost::bind(&multi_download::resume_read,
+			this, waiters[i].first, object_ptr));
+	}
+}
+
+void multi_download::preempt_for_stream()
+{
+	// 调用者必须已经锁定m_streams_mutex.
+	if (m_abort)
+	{
+		return;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_stream_mutex);
+#endif
+	if (m_stream_waiters.empty() || m_streaming)
+	{
+		return;
+	}
+
+	// 窗口内还有没有分配的空间, 才需要抢占.
+	boost::int64_t left = 0;
+	boost::int64_t right = 0;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock l(m_rangefield_mutex);
+#endif
+		if (!m_rangefield.out_space(m_stream_point, left, right)
+			|| left < m_stream_point || left >= m_stream_point + m_settings.stream_window)
+		{
+			return;
+		}
+	}
+
+	// 选择读取位置最远的连接, 由on_tick关闭后从m_download_point重新分配区间.
+	std::size_t victim = 0;
+	for (std::size_t i = 1; i < m_stream_waiters.size(); i++)
+	{
+		if (read_position(*m_stream_waiters[i].second)
+			> read_position(*m_stream_waiters[victim].second))
+		{
+			victim = i;
+		}
+	}
+
+	// 在连接所属的strand中设置抢占标识, 由check_connection关闭后重新分配区间.
+	// 暂停时计入的m_outstanding由set_stream_preempt释放.
+	http_object_ptr object_ptr = m_stream_waiters[victim].second;
+	m_stream_waiters.erase(m_stream_waiters.begin() + victim);
+	object_ptr->strand->post(boost::bind(&multi_download::set_stream_preempt, this, object_ptr));
+}
+
+boost::int64_t multi_download::read_position(const http_stream_object& object) const
+{
+	// 可能在其它连接的strand或tick中调用, 所以读取快照.
+	return object.position;
+}
+
+boost::asio::io_service& multi_download::stream_io_service()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	if (m_stream_pool)
+	{
+		return m_stream_pool->get_io_service();
+	}
+#endif
+	return m_io_service;
+}
+
+void multi_download::handle_write(boost::int64_t offset, boost::shared_ptr<std::vector<char> > buffer,
+	const boost::system::error_code& ec, std::size_t bytes_transferred)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	boost::int64_t size = static_cast<boost::int64_t>(buffer->size());
+	boost::int64_t written = ec ? 0 : (std::min)(
+		static_cast<boost::int64_t>(bytes_transferred), size);
+
+	// 数据写入后再更新完成下载区间位图, 保证读取时数据已经在存储中.
+	// 文件大小未知时没有下载区间位图.
+	if (written > 0 && m_file_size != -1)
+	{
+		publish_range(offset, offset + written);
+	}
+
+	// 没有写入的部分不能算作已下载, 放回可分配区间, 由连接重新下载.
+	if (written < size && m_file_size != -1)
+	{
+		AVHTTP_LOG_WARN << "Write " << size << " bytes at " << offset << " failed, wrote "
+			<< written << " bytes: " << ec.message() << ", refetch the rest.";
+		{
+#ifndef AVHTTP_DISABLE_THREAD
+			boost::mutex::scoped_lock lock(m_rangefield_mutex);
+#endif
+			m_rangefield.remove(offset + written, offset + size);
+		}
+	}
+
+	// 写缓存降到一半以下时, 恢复暂停读取的连接.
+	std::vector<std::pair<int, http_object_ptr> > waiters;
+	bool finish = false;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+		m_write_bytes -= size;
+		if (m_write_bytes <= m_settings.write_cache_size / 2)
+		{
+			waiters.swap(m_write_waiters);
+		}
+		finish = m_finish_pending && m_write_bytes == 0;
+	}
+
+	// 下载已经终止, 最后一个写入完成后保存最后的状态.
+	if (finish)
+	{
+		finish_download();
+	}
+
+	for (std::size_t i = 0; i < waiters.size(); i++)
+	{
+		const http_object_ptr& object_ptr = waiters[i].second;
+		object_ptr->strand->post(boost::bind(&multi_download::resume_read,
+			this, waiters[i].first, object_ptr));
+	}
+}
+
+bool multi_download::defer_read(int index, http_object_ptr object_ptr)
+{
+	// 不使用写缓存时, 有数据正在写入就暂停读取, 全部写入后由handle_write恢复.
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+	if (m_write_bytes < (std::max)(m_settings.write_cache_size, 1))
+	{
+		return false;
+	}
+
+	// 暂停期间不计算超时, 由resume_read继续读取.
+	object_ptr->write_wait = true;
+	m_write_waiters.push_back(std::make_pair(index, object_ptr));
+	change_outstranding(true);
+	return true;
+}
+
+void multi_download::resume_read(int index, http_object_ptr object_ptr)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	// 下载已经终止时连接已经关闭, 读取将返回错误, 在handle_read中处理.
+	object_ptr->write_wait = false;
+	async_read(index, object_ptr);
+}
+
+bool multi_download::writing()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_write_mutex);
+#endif
+	return m_write_bytes != 0;
+}
+
+boost::asio::io_service& multi_download::sync_io_service()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	if (!m_sync_pool)
+	{
+		m_sync_pool.reset(new io_service_pool(1));
+		m_sync_pool->run();
+	}
+	return m_sync_pool->get_io_service();
+#else
+	return m_io_service;
+#endif
+}
+
+boost::asio::io_service& multi_download::hash_io_service()
+{
+#ifndef AVHTTP_DISABLE_THREAD
+	if (m_hash_pool)
+	{
+		return m_hash_pool->get_io_service();
+	}
+#endif
+	return m_io_service;
+}
+
+void multi_download::create_stream(http_stream_object& object)
+{
+	// 从io_service池中轮询分配io_service, 没有池则使用m_io_service.
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::asio::io_service& io =
+		m_io_service_pool ? m_io_service_pool->get_io_service() : m_io_service;
+#else
+	boost::asio::io_service& io = m_io_service;
+#endif
+
+	object.stream = boost::make_shared<http_stream>(boost::ref(io));
+	object.strand = boost::make_shared<boost::asio::io_service::strand>(boost::ref(io));
+}
+
+void multi_download::writeback()
+{
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+	// 只发起脏页的写回, 不等待完成, 也不提交元数据和磁盘缓存, 所以不能据此认为
+	// 数据已经持久化, 下一次handle_sync中的fdatasync需要等待的数据因此变少.
+	// 出错时忽略, 由fdatasync报告.
+	int fd = m_storage->native_handle();
+	if (fd != -1)
+	{
+		::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+#endif
+}
+
+static void close_http_stream(boost::shared_ptr<http_stream> stream)
+{
+	boost::system::error_code ignore;
+	stream->close(ignore);
+}
+
+void multi_download::close_stream(const http_object_ptr& object_ptr)
+{
+	// 不访问multi_download本身, 所以无需计入m_outstanding.
+	object_ptr->strand->dispatch(boost::bind(&close_http_stream, object_ptr->stream));
+}
+
+void multi_download::save_validators(http_stream& h)
+{
+	m_etag.clear();
+	m_last_modified.clear();
+	h.response_options().find(http_options::etag, m_etag);
+	h.response_options().find(http_options::last_modified, m_last_modified);
+
+	// If-Range只能使用强校验器, 弱ETag(W/开头)不能保证字节相同, 此时使用Last-Modified.
+	if (boost::starts_with(m_etag, "W/"))
+	{
+		m_etag.clear();
+	}
+
+	// 之后的每个区间请求都带上If-Range, 文件变化时服务器将返回200而不是206.
+	m_settings.opts.remove(http_options::if_range);
+	if (!m_etag.empty())
+	{
+		m_settings.opts.insert(http_options::if_range, m_etag);
+	}
+	else if (!m_last_modified.empty())
+	{
+		m_settings.opts.insert(http_options::if_range, m_last_modified);
+	}
+}
+
+bool multi_download::validators_changed(http_stream& h) const
+{
+	std::string value;
+	if (!m_etag.empty())
+	{
+		h.response_options().find(http_options::etag, value);
+		return value != m_etag;
+	}
+	if (!m_last_modified.empty())
+	{
+		h.response_options().find(http_options::last_modified, value);
+		return value != m_last_modified;
+	}
+	return false;
+}
+
+bool multi_download::check_partial_content(http_stream_object& object)
+{
+	if (!m_accept_multi)
+	{
+		return true;
+	}
+
+	std::string status_code;
+	object.stream->response_options().find(http_options::status_code, status_code);
+	if (status_code == "206")
+	{
+		return true;
+	}
+
+	// 只有返回200并且ETag/Last-Modified与保存的不一致, 才说明文件已经变化.
+	if (status_code == "200" && validators_changed(*object.stream))
+	{
+		AVHTTP_LOG_WARN << "Range request returned 200 with new validators"
+			", the remote file has changed, abort download.";
+
+		object.ec = errc::remote_file_changed;
+		m_remote_changed = true;
+		stop();
+		return false;
+	}
+
+	// 多区间请求返回了整个文件, 而文件没有变化, 说明服务器不支持多区间请求.
+	if (!object.ranges.empty() && status_code == "200")
+	{
+		disable_multi_range(object);
+		return false;
+	}
+
+	// 其它响应(如503或者代理忽略了Range)不能说明文件变化, 保留meta, 由on_tick重新连接.
+	AVHTTP_LOG_WARN << "Range request returned " << status_code << ", reconnect.";
+	object.direct_reconnect = true;
+	return false;
+}
+
+void multi_download::update_rtt(http_stream_object& object)
+{
+	object.response_time = object.last_request_time;
+	object.response_bytes = object.bytes_transferred;
+	if (object.request_time.is_not_a_date_time())
+	{
+		return;
+	}
+
+	// 新建连接时往返时间包含了建立连接的时间, 这也是每次请求需要付出的代价.
+	int sample = static_cast<int>((object.response_time - object.request_time).total_milliseconds());
+	if (object.rtt < 0)
+	{
+		object.rtt = sample;
+	}
+	else
+	{
+		object.rtt = (object.rtt * 7 + sample) / 8;
+	}
+}
+
+void multi_download::update_request_size(http_stream_object& object)
+{
+	if (m_settings.request_duration <= 0 || object.response_time.is_not_a_date_time())
+	{
+		return;
+	}
+
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+	boost::int64_t elapsed = (now - object.response_time).total_milliseconds();
+	boost::int64_t bytes = object.bytes_transferred - object.response_bytes;
+	if (bytes <= 0)
+	{
+		return;
+	}
+
+	// 计算本次区间的下载速率, 并平滑到连接的下载速率中.
+	boost::int64_t rate = bytes * 1000 / (std::max)(elapsed, boost::int64_t(1));
+	if (object.throughput == 0)
+	{
+		object.throughput = rate;
+	}
+	else
+	{
+		object.throughput = (object.throughput + rate) / 2;
+	}
+
+	// 请求持续的时间至少为往返时间的10倍, 使每次请求等待响应的开销不超过10%.
+	boost::int64_t duration = static_cast<boost::int64_t>(m_settings.request_duration) * 1000;
+	if (object.rtt > 0)
+	{
+		duration = (std::max)(duration, static_cast<boost::int64_t>(object.rtt) * 10);
+	}
+
+	// 最小为一个分片, 最大为平均每个连接的下载量, 避免一个连接占用大部分文件.
+	boost::int64_t piece_size = m_settings.piece_size;
+	boost::int64_t min_size = piece_size;
+	boost::int64_t max_size = min_size;
+	int connections = m_number_of_connections;
+	if (m_file_size > 0 && connections > 0)
+	{
+		max_size = (std::max)(min_size, m_file_size / connections);
+	}
+
+	boost::int64_t size = object.throughput * duration / 1000;
+	size = (std::max)(min_size, (std::min)(size, max_size));
+
+	// 按分片大小取整.
+	object.request_size = (size + piece_size - 1) / piece_size * piece_size;
+}
+
+void multi_download::refill_rate_bytes()
+{
+	int limit = m_settings.download_rate_limit;
+	boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+	if (m_rate_time.is_not_a_date_time())
+	{
+		// 第一次使用时给满一秒的配额.
+		m_rate_bytes = limit;
+	}
+	else
+	{
+		boost::int64_t elapsed = (now - m_rate_time).total_microseconds();
+		boost::int64_t bytes = m_rate_bytes + elapsed * limit / 1000000;
+		// 最多积累一秒的配额, 避免空闲之后突发大量读取.
+		m_rate_bytes = static_cast<int>((std::min)(bytes, static_cast<boost::int64_t>(limit)));
+	}
+	m_rate_time = now;
+}
+
+int multi_download::available_bytes(int max_bytes)
+{
+	if (m_settings.download_rate_limit == -1)
+	{
+		return max_bytes;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rate_mutex);
+#endif
+	refill_rate_bytes();
+	int available_bytes = (std::min)(m_rate_bytes, max_bytes);
+	m_rate_bytes -= available_bytes;
+	return available_bytes;
+}
+
+void multi_download::release_bytes(int bytes)
+{
+	if (m_settings.download_rate_limit == -1 || bytes <= 0)
+	{
+		return;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rate_mutex);
+#endif
+	m_rate_bytes += bytes;
+}
+
+bool multi_download::defer_rate(int index, http_object_ptr object_ptr)
+{
+	int limit = m_settings.download_rate_limit;
+	if (limit == -1 || m_abort)
+	{
+		return false;
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	boost::mutex::scoped_lock lock(m_rate_mutex);
+#endif
+	refill_rate_bytes();
+	if (m_rate_bytes > 0)
+	{
+		return false;
+	}
+
+	// 暂停期间不计算超时, 由handle_rate_timer继续读取.
+	object_ptr->write_wait = true;
+	m_rate_waiters.push_back(std::make_pair(index, object_ptr));
+	change_outstranding(true);
+
+	if (!m_rate_timer_armed)
+	{
+		// 等到积累一次读取的配额时恢复, 至少等待1毫秒.
+		boost::int64_t bytes = (std::min)(limit, static_cast<int>(default_buffer_size)) - m_rate_bytes;
+		boost::int64_t wait = (std::max)(bytes * 1000000 / (std::max)(limit, 1),
+			static_cast<boost::int64_t>(1000));
+		m_rate_timer_armed = true;
+		change_outstranding(true);
+		m_rate_timer.expires_from_now(boost::posix_time::microseconds(wait));
+		m_rate_timer.async_wait(boost::bind(&multi_download::handle_rate_timer,
+			this, boost::asio::placeholders::error));
+	}
+
+	return true;
+}
+
+void multi_download::handle_rate_timer(const boost::system::error_code&)
+{
+	auto_outstanding ao(*this);
+	change_outstranding(false);
+
+	// 下载终止时定时器被取消, 同样恢复所有连接, 连接关闭后读取将返回错误.
+	std::vector<std::pair<int, http_object_ptr> > waiters;
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_rate_mutex);
+#endif
+		m_rate_timer_armed = false;
+		waiters.swap(m_rate_waiters);
+	}
+
+	for (std::size_t i = 0; i < waiters.size(); i++)
+	{
+		const http_object_ptr& object_ptr = waiters[i].second;
+		object_ptr->strand->post(boost::bind(&multi_download::resume_read,
+			this, waiters[i].first, object_ptr));
+	}
 }
 
 void multi_download::change_outstranding(bool addref/* = true*/)
@@ -15,9 +15,17 @@
 # error Do not compile avhttp library source with AVHTTP_HEADER_ONLY defined
 #endif
 
+#include "avhttp/impl/async_storage.ipp"
+#include "avhttp/impl/delta_control.ipp"
+#include "avhttp/impl/direct_storage.ipp"
 #include "avhttp/impl/file.ipp"
 #include "avhttp/impl/file_upload.ipp"
 #include "avhttp/impl/http_stream.ipp"
+#include "avhttp/impl/io_uring_service.ipp"
+#include "avhttp/impl/memory_storage.ipp"
+#include "avhttp/impl/meta_store.ipp"
+#include "avhttp/impl/mmap_storage.ipp"
 #include "avhttp/impl/multi_download.ipp"
+#include "avhttp/impl/download_manager.ipp"
 
 #endif // AVHTTP_IMPL_SRC_HPP
@@ -0,0 +1,171 @@
+﻿//
+// io_service_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_IO_SERVICE_POOL_HPP
+#define AVHTTP_IO_SERVICE_POOL_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/assert.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#ifndef AVHTTP_DISABLE_THREAD
+#	include <boost/thread.hpp>
+#endif
+
+namespace avhttp {
+
+#ifdef AVHTTP_DISABLE_THREAD
+
+// 定义AVHTTP_DISABLE_THREAD时没有io_service池, 使用池的接口也都被禁用.
+class io_service_pool;
+
+#else
+
+// io_service池, 每个io_service由一个独立的线程运行, 一般按cpu核心数创建.
+// 通过get_io_service以轮询的方式分配io_service, 这样multi_download中的各个连接
+// 就可以分散到不同的cpu核心上执行TLS解密, 解压缩等计算.
+class io_service_pool : public boost::noncopyable
+{
+	typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
+	typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
+
+public:
+
+	///构造io_service池.
+	// @param pool_size指定io_service的个数, 为0时使用硬件线程数.
+	explicit io_service_pool(std::size_t pool_size = 0)
+		: m_next_io_service(0)
+	{
+		if (pool_size == 0)
+		{
+			pool_size = boost::thread::hardware_concurrency();
+			if (pool_size == 0)
+			{
+				pool_size = 1;
+			}
+		}
+
+		for (std::size_t i = 0; i < pool_size; i++)
+		{
+			io_service_ptr io = boost::make_shared<boost::asio::io_service>(1);
+			m_io_services.push_back(io);
+			m_works.push_back(boost::make_shared<boost::asio::io_service::work>(boost::ref(*io)));
+		}
+	}
+
+	~io_service_pool()
+	{
+		stop();
+		join();
+	}
+
+public:
+
+	///为每个io_service启动一个线程运行.
+	void run()
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		if (m_threads.size() != 0)
+		{
+			return;
+		}
+
+		for (std::size_t i = 0; i < m_io_services.size(); i++)
+		{
+			m_threads.push_back(boost::make_shared<boost::thread>(
+				boost::bind(&io_service_pool::run_io_service, m_io_services[i])));
+		}
+	}
+
+	///停止所有io_service, 尚未执行的handler将被丢弃.
+	void stop()
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_works.clear();
+		for (std::size_t i = 0; i < m_io_services.size(); i++)
+		{
+			m_io_services[i]->stop();
+		}
+	}
+
+	///等待所有线程退出.
+	void join()
+	{
+		std::vector<boost::shared_ptr<boost::thread> > threads;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			threads.swap(m_threads);
+		}
+
+		for (std::size_t i = 0; i < threads.size(); i++)
+		{
+			if (threads[i]->get_id() != boost::this_thread::get_id())
+			{
+				threads[i]->join();
+			}
+		}
+	}
+
+	///以轮询的方式返回池中的一个io_service.
+	boost::asio::io_service& get_io_service()
+	{
+		boost::mutex::scoped_lock lock(m_mutex);
+		boost::asio::io_service& io = *m_io_services[m_next_io_service];
+		if (++m_next_io_service == m_io_services.size())
+		{
+			m_next_io_service = 0;
+		}
+		return io;
+	}
+
+	///返回池中io_service的个数.
+	std::size_t size() const
+	{
+		return m_io_services.size();
+	}
+
+private:
+
+	static void run_io_service(io_service_ptr io)
+	{
+		boost::system::error_code ignore;
+		io->run(ignore);
+	}
+
+private:
+	// 池中所有io_service.
+	std::vector<io_service_ptr> m_io_services;
+
+	// 保证io_service在没有任务时也不会退出.
+	std::vector<work_ptr> m_works;
+
+	// 运行io_service的线程.
+	std::vector<boost::shared_ptr<boost::thread> > m_threads;
+
+	// 下一个将被分配的io_service.
+	std::size_t m_next_io_service;
+
+	// 保护上面的成员.
+	mutable boost::mutex m_mutex;
+};
+
+#endif // AVHTTP_DISABLE_THREAD
+
+} // namespace avhttp
+
+#endif // AVHTTP_IO_SERVICE_POOL_HPP
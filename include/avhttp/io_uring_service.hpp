@@ -0,0 +1,210 @@
+﻿//
+// io_uring_service.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_IO_URING_SERVICE_HPP
+#define AVHTTP_IO_URING_SERVICE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#ifndef AVHTTP_DISABLE_THREAD
+#	include <boost/thread.hpp>
+#	include <boost/thread/condition.hpp>
+#endif
+
+namespace avhttp {
+
+// Linux io_uring的文件读写服务, 多个下载的存储共用一个ring.
+// 需要定义AVHTTP_ENABLE_IO_URING并且内核版本不低于5.1才启用, 否则或者内核不支持,
+// 被禁止(如seccomp), 以及定义了AVHTTP_DISABLE_THREAD时is_open返回false, 使用者应改为
+// 直接读写文件.
+// 各线程提交的请求由同一次io_uring_enter批量提交, 完成事件由一个单独的线程收取,
+// 同步请求在调用线程中等待, 异步请求的handler投递到发起请求时指定的io_service.
+// 文件和缓冲都预先注册到ring, 减少每次读写时内核查找文件和锁定页面的开销.
+// @begin example
+//  avhttp::io_uring_service& ring = avhttp::io_uring_service::shared();
+//  int handle = ring.register_file(fd);
+//  ring.write(handle, offset, data, size, ec);
+//  ring.async_write(handle, offset, data, size, io, handler);
+//  ring.unregister_file(handle);
+// @end example
+class io_uring_service : public boost::noncopyable
+{
+	struct operation;
+	struct sync_operation;
+	struct async_operation;
+
+public:
+
+	// 异步读写完成的回调, 参数为错误码和读写的字节数.
+	typedef boost::function<void (const boost::system::error_code&, std::size_t)> handler_type;
+
+	enum
+	{
+		// ring的大小, 即同时进行的请求数.
+		default_entries = 256,
+
+		// 注册的文件数.
+		default_files = 256,
+
+		// 注册的缓冲数及每个缓冲的大小.
+		default_buffers = 16,
+		default_buffer_size = 256 * 1024
+	};
+
+	/// Constructor.
+	// @param entries指定ring的大小.
+	// @param buffers指定注册的缓冲数, 为0时不注册缓冲.
+	// @param buffer_size指定每个缓冲的大小.
+	AVHTTP_DECL explicit io_uring_service(unsigned entries = default_entries,
+		std::size_t buffers = default_buffers, std::size_t buffer_size = default_buffer_size);
+
+	/// Destructor.
+	// 等待所有请求完成后关闭ring.
+	AVHTTP_DECL ~io_uring_service();
+
+	///返回进程内共享的实例, 第一次调用时创建.
+	AVHTTP_DECL static io_uring_service& shared();
+
+	///ring是否可用.
+	AVHTTP_DECL bool is_open() const;
+
+	///注册文件.
+	// @param fd文件描述符, 在unregister_file之前必须保持打开.
+	// @返回用于读写的句柄, ring不可用时返回-1.
+	// @备注: 注册的文件已满或者内核不支持注册文件时, 直接使用fd提交请求.
+	AVHTTP_DECL int register_file(int fd);
+
+	///取消注册文件, 需要在关闭文件之前调用.
+	AVHTTP_DECL void unregister_file(int handle);
+
+	///写入数据, 在调用线程中等待写入完成.
+	// @返回值为实际写入的字节数, 返回-1表示写入失败, ec包含详细的错误信息.
+	AVHTTP_DECL std::streamsize write(int handle, boost::int64_t offset,
+		const char* buf, std::size_t size, boost::system::error_code& ec);
+
+	///读取数据, 在调用线程中等待读取完成.
+	// @返回值为实际读取的字节数, 返回-1表示读取失败, ec包含详细的错误信息.
+	AVHTTP_DECL std::streamsize read(int handle, boost::int64_t offset,
+		char* buf, std::size_t size, boost::system::error_code& ec);
+
+	///异步写入数据, 完成后在io中调用handler.
+	// @备注: buf在handler调用之前必须保持有效.
+	AVHTTP_DECL void async_write(int handle, boost::int64_t offset, const char* buf,
+		std::size_t size, boost::asio::io_service& io, handler_type handler);
+
+	///异步读取数据, 完成后在io中调用handler.
+	// @备注: buf在handler调用之前必须保持有效.
+	AVHTTP_DECL void async_read(int handle, boost::int64_t offset, char* buf,
+		std::size_t size, boost::asio::io_service& io, handler_type handler);
+
+private:
+
+	// 准备并提交一个读写请求, 请求完成时调用op->complete.
+	AVHTTP_DECL void submit(operation* op);
+
+	// 收取完成事件的线程.
+	AVHTTP_DECL void run();
+
+	// 完成一个请求, 在收取完成事件的线程中调用.
+	AVHTTP_DECL void complete(operation* op, int result);
+
+	// 写入一个sqe到提交队列, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL void push_sqe(operation* op);
+
+	// 同步读写, 短读写时继续读写剩下的部分.
+	AVHTTP_DECL std::streamsize sync_io(bool is_write, int handle, boost::int64_t offset,
+		char* buf, std::size_t size, boost::system::error_code& ec);
+
+	// 异步读写.
+	AVHTTP_DECL void start_async_io(bool is_write, int handle, boost::int64_t offset,
+		char* buf, std::size_t size, boost::asio::io_service& io, handler_type handler);
+
+	AVHTTP_DECL void close();
+
+private:
+
+	// ring的文件描述符, -1表示不可用.
+	int m_ring_fd;
+
+	// mmap得到的提交队列, 完成队列以及sqe数组.
+	void* m_sq_ring;
+	std::size_t m_sq_ring_size;
+	void* m_cq_ring;
+	std::size_t m_cq_ring_size;
+	void* m_sqes;
+	std::size_t m_sqes_size;
+
+	// 提交队列和完成队列中的各字段.
+	unsigned* m_sq_head;
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	unsigned m_sq_entries;
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	void* m_cqes;
+	unsigned m_cq_entries;
+
+	// 句柄对应的文件描述符, -1为空闲.
+	std::vector<int> m_files;
+
+	// 句柄对应的文件是否注册到了ring中, 注册的文件以句柄作为ring中的索引.
+	std::vector<char> m_fixed;
+
+	// 内核是否支持注册文件.
+	bool m_files_registered;
+
+	// 注册的缓冲, 以及空闲的缓冲.
+	char* m_buffers;
+	std::size_t m_buffer_size;
+	std::vector<int> m_free_buffers;
+
+	// 已经写入提交队列但还没有提交的请求数.
+	unsigned m_unsubmitted;
+
+	// 已经提交但还没有完成的请求数.
+	unsigned m_inflight;
+
+	// 是否有线程正在提交.
+	bool m_submitting;
+
+	// 正在关闭.
+	bool m_stopping;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面的成员.
+	boost::mutex m_mutex;
+
+	// 提交队列有空间或者有缓冲释放时通知.
+	boost::condition m_space_cond;
+
+	// 收取完成事件的线程.
+	boost::scoped_ptr<boost::thread> m_thread;
+#endif
+};
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/io_uring_service.ipp"
+#endif
+
+#endif // AVHTTP_IO_URING_SERVICE_HPP
@@ -0,0 +1,165 @@
+﻿//
+// memory_storage.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// path LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_MEMORY_STORAGE_HPP
+#define AVHTTP_MEMORY_STORAGE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "avhttp/storage_interface.hpp"
+
+namespace avhttp {
+
+// 把数据保存在内存中的存储, 不读写文件, 用于下载小文件后直接在内存中使用.
+// 数据保存在按块分配的内存中, 块在第一次写入时分配, 所以可以乱序写入. 文件大小已知
+// (allocate)且不超过contiguous_limit时只使用一个连续的块, 下载完成后可以通过release
+// 把数据移动到调用者的缓冲中, 不需要再复制一次; 也可以通过data以缓冲序列的形式直接访问.
+// 打开时清空之前的数据, 关闭时保留数据, 直到下一次打开或者storage销毁.
+// @begin example
+//  avhttp::settings s;
+//  s.storage = avhttp::memory_storage_constructor;
+//  d.start(url, s);
+//  d.wait_for_complete();
+//  std::vector<char> body;
+//  static_cast<avhttp::memory_storage*>(d.storage())->release(body);
+// @end example
+class memory_storage : public storage_interface
+{
+	typedef boost::shared_ptr<std::vector<char> > chunk_ptr;
+
+public:
+
+	enum
+	{
+		// 文件大小未知或者超过contiguous_limit时, 每块的大小.
+		default_chunk_size = 1024 * 1024,
+
+		// 文件大小不超过这个大小时使用一个连续的块.
+		default_contiguous_limit = 64 * 1024 * 1024
+	};
+
+	/// Constructor.
+	// @param chunk_size指定块的大小.
+	// @param contiguous_limit指定使用一个连续块的最大文件大小, 为0时总是按块分配.
+	AVHTTP_DECL explicit memory_storage(std::size_t chunk_size = default_chunk_size,
+		std::size_t contiguous_limit = default_contiguous_limit);
+
+	/// Destructor.
+	AVHTTP_DECL virtual ~memory_storage();
+
+	// 存储组件初始化, 清空之前的数据.
+	// @param file_path不使用.
+	// @param ec在出错时保存了详细的错误信息.
+	AVHTTP_DECL virtual void open(const fs::path& file_path, boost::system::error_code& ec);
+
+	// 关闭存储组件, 数据仍然保留.
+	AVHTTP_DECL virtual void close();
+
+	// 在当前位置写入数据.
+	AVHTTP_DECL virtual std::streamsize write(const char* buf, int size);
+
+	// 写入数据.
+	// @param buf是需要写入的数据缓冲.
+	// @param offset是写入的偏移位置.
+	// @param size指定了写入的数据缓冲大小.
+	// @返回值为实际写入的字节数, 返回-1表示写入失败.
+	AVHTTP_DECL virtual std::streamsize write(const char* buf, boost::int64_t offset, int size);
+
+	// 在当前位置读取数据.
+	AVHTTP_DECL virtual std::streamsize read(char* buf, int size);
+
+	// 读取数据, 没有写入过的部分为0.
+	// @param buf是需要读取的数据缓冲.
+	// @param offset是读取的偏移位置.
+	// @param size指定了读取的数据缓冲大小.
+	// @返回值为实际读取的字节数, 返回-1表示读取失败.
+	AVHTTP_DECL virtual std::streamsize read(char* buf, boost::int64_t offset, int size);
+
+	// 判断是否文件结束.
+	AVHTTP_DECL virtual bool eof();
+
+	// 设置数据大小, 不超过contiguous_limit时改为使用一个连续的块.
+	// @param size是数据大小.
+	// @param ec在出错时保存了详细的错误信息.
+	AVHTTP_DECL virtual void allocate(boost::int64_t size, boost::system::error_code& ec);
+
+	// 查找offset之后第一个没有分配的块, 续传时使用.
+	AVHTTP_DECL virtual bool find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right);
+
+	// 返回块中的只读视图, 视图不会跨越块的边界, 持有期间块不会被释放.
+	AVHTTP_DECL virtual boost::shared_ptr<const char> view(boost::int64_t offset,
+		std::size_t size, std::size_t& length);
+
+	///返回数据大小.
+	AVHTTP_DECL boost::int64_t size();
+
+	///返回[0, size())的数据, 每个缓冲对应一个块, 没有写入过的部分为0.
+	// @备注: 返回的缓冲在下一次open, release或者storage销毁之前有效.
+	AVHTTP_DECL std::vector<boost::asio::const_buffer> data();
+
+	///把所有数据移动到buffer中, 之后storage为空.
+	// @param buffer保存数据, 原来的内容被替换.
+	// @备注: 只有一个块并且没有被view引用时直接交换, 不复制数据, 否则合并所有块.
+	AVHTTP_DECL void release(std::vector<char>& buffer);
+
+private:
+
+	// 返回index对应的块, create为true时不存在则分配.
+	AVHTTP_DECL chunk_ptr chunk(std::size_t index, bool create);
+
+	// 块的实际长度, 最后一块可能不满.
+	AVHTTP_DECL std::size_t chunk_length(std::size_t index) const;
+
+private:
+
+	// 块大小及使用连续块的最大文件大小.
+	std::size_t m_chunk_size;
+	std::size_t m_contiguous_limit;
+
+	// 当前使用的块大小.
+	std::size_t m_block_size;
+
+	// 数据大小, 由allocate指定, 否则为已经写入的最大位置.
+	boost::int64_t m_size;
+	bool m_allocated;
+
+	// 顺序读写的位置.
+	boost::int64_t m_offset;
+
+	// 所有块, 没有写入过的块为空.
+	std::vector<chunk_ptr> m_chunks;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 各连接在不同的线程中写入, 同时可能有读取.
+	boost::mutex m_mutex;
+#endif
+};
+
+// 内存存储对象.
+inline storage_interface* memory_storage_constructor()
+{
+	return new memory_storage();
+}
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/memory_storage.ipp"
+#endif
+
+#endif // AVHTTP_MEMORY_STORAGE_HPP
@@ -0,0 +1,149 @@
+﻿//
+// meta_store.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_META_STORE_HPP
+#define AVHTTP_META_STORE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+#ifndef AVHTTP_DISABLE_THREAD
+#	include <boost/thread/mutex.hpp>
+#endif
+
+#include "avhttp/storage_interface.hpp"	// for fs
+#include "avhttp/file.hpp"
+
+namespace avhttp {
+
+// 多个下载共用的续传数据存储, 用于代替每个下载各自的meta文件.
+// 所有数据保存在一个只追加的日志文件中, 每个记录包含key(即meta文件名, 由url
+// 的crc32得到)以及数据, 打开时只扫描记录头建立索引, 数据在load时才读取, 这样
+// 大量未完成的下载也可以快速启动. 无效的记录超过一半时自动整理日志文件.
+// @begin example
+//  avhttp::meta_store store;
+//  store.open("downloads.store", ec);
+//  std::vector<std::string> keys = store.keys();
+//  avhttp::settings s;
+//  s.resume_store = &store;
+//  d.start("http://www.boost.org/LICENSE_1_0.txt", s);
+// @end example
+class meta_store : public boost::noncopyable
+{
+	// 一个key的数据由最后一次replace的记录以及之后append的记录依次连接而成.
+	struct segment
+	{
+		boost::int64_t offset;
+		boost::uint32_t size;
+		boost::uint32_t crc;
+	};
+	typedef std::vector<segment> segments;
+	typedef std::map<std::string, segments> index_type;
+
+public:
+
+	/// Constructor.
+	AVHTTP_DECL meta_store();
+
+	/// Destructor.
+	AVHTTP_DECL ~meta_store();
+
+public:
+
+	///打开存储文件, 不存在则创建.
+	// @param file_path存储文件路径.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	// @备注: 文件末尾不完整的记录(如写入时意外中止)将被截断.
+	AVHTTP_DECL void open(const fs::path& file_path, boost::system::error_code& ec);
+
+	///关闭存储文件.
+	AVHTTP_DECL void close();
+
+	///是否已经打开.
+	AVHTTP_DECL bool is_open() const;
+
+	///返回所有key.
+	AVHTTP_DECL std::vector<std::string> keys() const;
+
+	///是否存在指定的key.
+	AVHTTP_DECL bool contains(const std::string& key) const;
+
+	///读取key对应的数据.
+	// @param key指定的key.
+	// @param data返回的数据.
+	// @返回false表示key不存在或者数据损坏.
+	AVHTTP_DECL bool load(const std::string& key, std::vector<char>& data) const;
+
+	///替换key对应的数据.
+	// @返回false表示写入失败.
+	AVHTTP_DECL bool replace(const std::string& key, const char* data, std::size_t size);
+
+	///追加数据到key对应的数据之后.
+	// @返回false表示写入失败.
+	AVHTTP_DECL bool append(const std::string& key, const char* data, std::size_t size);
+
+	///删除key.
+	AVHTTP_DECL bool remove(const std::string& key);
+
+	///同步存储文件到磁盘.
+	AVHTTP_DECL bool flush();
+
+	///整理存储文件, 只保留每个key的有效数据.
+	// @param ec当发生错误时, 包含详细的错误信息.
+	AVHTTP_DECL void compact(boost::system::error_code& ec);
+
+private:
+
+	// 写入一个记录, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL bool write_record(char type, const std::string& key,
+		const char* data, std::size_t size, segment& seg);
+
+	// 整理存储文件, 调用者必须已经锁定m_mutex.
+	AVHTTP_DECL void compact_impl(boost::system::error_code& ec);
+
+private:
+
+	// 存储文件.
+	mutable file m_file;
+
+	// 存储文件路径.
+	fs::path m_path;
+
+	// 存储文件大小, 即下一个记录写入的位置.
+	boost::int64_t m_size;
+
+	// 有效数据的总大小, 用于判断是否需要整理.
+	boost::int64_t m_live_size;
+
+	// 每个key对应的数据记录.
+	index_type m_index;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 多个下载可能在不同的线程中同时访问.
+	mutable boost::mutex m_mutex;
+#endif
+};
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/meta_store.ipp"
+#endif
+
+#endif // AVHTTP_META_STORE_HPP
@@ -0,0 +1,161 @@
+﻿//
+// mmap_storage.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// path LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_MMAP_STORAGE_HPP
+#define AVHTTP_MMAP_STORAGE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <map>
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "avhttp/default_storage.hpp"
+
+namespace avhttp {
+
+// 通过内存映射读写文件的存储.
+// 文件大小已知时(allocate)把文件设置为该大小, 然后按固定大小的窗口映射文件, 写入的
+// 数据直接复制到映射中, read及view也直接访问映射, 不需要系统调用. 映射的窗口数受地址
+// 空间预算限制, 超出时解除最久未使用的窗口, 仍被view引用的窗口在引用释放后才解除映射.
+// 文件大小未知或映射失败时, 与default_storge相同, 直接读写文件.
+// @begin example
+//  avhttp::settings s;
+//  s.storage = avhttp::mmap_storage_constructor;
+//  d.start(url, s);
+//  ...
+//  std::size_t length = 0;
+//  boost::shared_ptr<const char> data = d.fetch_view(offset, 65536, length);
+// @end example
+class mmap_storage : public default_storge
+{
+	// 一个映射窗口, 析构时解除映射.
+	struct window
+	{
+		AVHTTP_DECL ~window();
+
+		// 窗口在文件中的起始位置.
+		boost::int64_t offset;
+
+		// 映射的地址及大小.
+		char* data;
+		std::size_t size;
+	};
+	typedef boost::shared_ptr<window> window_ptr;
+	typedef std::list<window_ptr> window_list;
+
+public:
+
+	enum
+	{
+		// 映射窗口的大小, 必须是页面大小以及windows下分配粒度(64KB)的整数倍.
+		default_window_size = 64 * 1024 * 1024,
+
+		// 同时映射的窗口数, 即地址空间预算, 64位下为16GB, 32位下为512MB.
+		default_max_windows = sizeof(void*) >= 8 ? 256 : 8
+	};
+
+	/// Constructor.
+	// @param window_size指定映射窗口的大小.
+	// @param max_windows指定同时映射的最大窗口数.
+	AVHTTP_DECL explicit mmap_storage(std::size_t window_size = default_window_size,
+		std::size_t max_windows = default_max_windows);
+
+	/// Destructor.
+	AVHTTP_DECL virtual ~mmap_storage();
+
+	// 关闭存储组件, 已经返回的view在释放前仍然有效.
+	AVHTTP_DECL virtual void close();
+
+	// 写入数据.
+	// @param buf是需要写入的数据缓冲.
+	// @param offset是写入的偏移位置.
+	// @param size指定了写入的数据缓冲大小.
+	// @返回值为实际写入的字节数, 返回-1表示写入失败.
+	AVHTTP_DECL virtual std::streamsize write(const char* buf, boost::int64_t offset, int size);
+
+	// 读取数据.
+	// @param buf是需要读取的数据缓冲.
+	// @param offset是读取的偏移位置.
+	// @param size指定了读取的数据缓冲大小.
+	// @返回值为实际读取的字节数, 返回-1表示读取失败.
+	AVHTTP_DECL virtual std::streamsize read(char* buf, boost::int64_t offset, int size);
+
+	// 将已经写入的数据同步到磁盘.
+	// @返回值true表示同步成功.
+	AVHTTP_DECL virtual bool sync();
+
+	// 设置文件大小并准备映射.
+	// @param size是文件大小.
+	// @param ec在出错时保存了详细的错误信息.
+	AVHTTP_DECL virtual void allocate(boost::int64_t size, boost::system::error_code& ec);
+
+	// 返回映射中的只读视图, 视图不会跨越窗口边界.
+	// @param offset是视图的起始位置.
+	// @param size是视图的最大长度.
+	// @param length返回视图的实际长度.
+	// @返回值为空表示文件没有映射.
+	AVHTTP_DECL virtual boost::shared_ptr<const char> view(boost::int64_t offset,
+		std::size_t size, std::size_t& length);
+
+	///文件是否已经映射.
+	AVHTTP_DECL bool is_mapped() const;
+
+private:
+
+	// 返回offset所在的窗口, 没有映射则映射它, 失败返回空.
+	AVHTTP_DECL window_ptr map_window(boost::int64_t offset);
+
+	// 解除所有窗口及文件映射.
+	AVHTTP_DECL void unmap();
+
+private:
+
+	// 窗口大小及最大窗口数.
+	std::size_t m_window_size;
+	std::size_t m_max_windows;
+
+	// 映射的文件大小, -1表示没有映射.
+	boost::int64_t m_size;
+
+	// 已经映射的窗口, 最近使用的在前.
+	window_list m_windows;
+
+	// 窗口起始位置到m_windows中位置的索引.
+	std::map<boost::int64_t, window_list::iterator> m_index;
+
+#ifdef WIN32
+	// 文件映射对象.
+	HANDLE m_mapping;
+#endif
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 写入线程与读取线程可能同时访问窗口.
+	boost::mutex m_mutex;
+#endif
+};
+
+// 内存映射存储对象.
+inline storage_interface* mmap_storage_constructor()
+{
+	return new mmap_storage();
+}
+
+} // namespace avhttp
+
+#if defined(AVHTTP_HEADER_ONLY)
+#	include "avhttp/impl/mmap_storage.ipp"
+#endif
+
+#endif // AVHTTP_MMAP_STORAGE_HPP
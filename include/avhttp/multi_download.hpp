@@ -18,6 +18,7 @@
 #include <vector>
 #include <list>
 #include <algorithm>    // for std::min/std::max
+#include <cstring>      // for std::memcpy
 
 #include <boost/assert.hpp>
 #include <boost/noncopyable.hpp>
@@ -35,8 +36,22 @@
 
 #include "avhttp/http_stream.hpp"
 #include "avhttp/rangefield.hpp"
+#include "avhttp/bitfield.hpp"
+#include "avhttp/detail/sha1.hpp"
+#include "avhttp/detail/byteranges_parser.hpp"
+#include "avhttp/detail/splice_pipe.hpp"
 #include "avhttp/entry.hpp"
 #include "avhttp/settings.hpp"
+#include "avhttp/meta_store.hpp"
+#include "avhttp/delta_control.hpp"
+#include "avhttp/io_service_pool.hpp"
+#include "avhttp/async_storage.hpp"
+
+// 多个线程读写的状态标志和计数在有boost.atomic时不需要锁定.
+#if !defined(AVHTTP_DISABLE_THREAD) && (BOOST_VERSION >= 105300)
+#	include <boost/atomic.hpp>
+#	define AVHTTP_ATOMIC_STATE
+#endif
 
 
 namespace avhttp {
@@ -53,6 +68,12 @@ class multi_download : public boost::noncopyable
 	// 重定义http_object_ptr指针.
 	typedef boost::shared_ptr<http_stream_object> http_object_ptr;
 
+	// 重定义strand_ptr指针, 每个连接使用一个strand保证其回调串行执行.
+	typedef boost::shared_ptr<boost::asio::io_service::strand> strand_ptr;
+
+	// 等待数据下载完成的异步读取请求.
+	struct fetch_request;
+
 	// 用于计算下载速率.
 	struct download_stat;
 	typedef boost::shared_ptr<download_stat> download_stat_ptr;
@@ -61,11 +82,41 @@ class multi_download : public boost::noncopyable
 	struct auto_outstanding;
 	friend struct auto_outstanding;
 
+	// 在连接的strand, tick和用户线程之间共享的状态.
+#ifdef AVHTTP_ATOMIC_STATE
+	typedef boost::atomic<bool> atomic_bool;
+	typedef boost::atomic<int> atomic_int;
+
+	// 连接对象在重连时会被复制, 所以连接中的原子状态需要可以复制.
+	template <typename T>
+	struct copyable_atomic;
+	typedef copyable_atomic<bool> object_bool;
+	typedef copyable_atomic<boost::int64_t> object_int64;
+#else
+	typedef bool atomic_bool;
+	typedef int atomic_int;
+	typedef bool object_bool;
+	typedef boost::int64_t object_int64;
+#endif
+
+	// download_manager统一驱动各下载的tick以及调整连接数.
+	friend class download_manager;
+
 public:
 
 	/// Constructor.
 	AVHTTP_DECL explicit multi_download(boost::asio::io_service& io);
 
+#ifndef AVHTTP_DISABLE_THREAD
+	/// Constructor.
+	// @param pool指定的io_service池, 每个连接将从池中轮询分配一个io_service,
+	// 并通过各自的strand执行回调, 这样各连接的TLS解密, 解压缩, 存储写入等
+	// 工作就可以分散在多个cpu核心上并行执行.
+	// @备注: 由用户负责调用pool.run()运行io_service池, 并保证pool的生命期
+	// 长于multi_download.
+	AVHTTP_DECL explicit multi_download(io_service_pool& pool);
+#endif
+
 	/// Destructor.
 	AVHTTP_DECL ~multi_download();
 
@@ -155,11 +206,46 @@ public:
 	// @param buffers 指定的数据缓冲. 这个类型必须满足MutableBufferSequence的定义,
 	//          MutableBufferSequence的定义在boost.asio文档中.
 	// @param offset 读取数据的指定偏移位置, 注意: offset影响内部下载位置从offset开始下载.
-	// 返回读取数据的大小.
+	// 返回读取数据的大小, offset处的数据还没有下载时立即返回0, 需要等待数据时使用async_fetch.
 	template <typename MutableBufferSequence>
 	std::size_t fetch_data(const MutableBufferSequence& buffers,
 		boost::int64_t offset);
 
+	///获取指定数据的只读视图, 不复制数据, 并改变下载点的位置.
+	// @param offset 读取数据的指定偏移位置, 与fetch_data相同, 影响内部下载位置.
+	// @param size 视图的最大长度.
+	// @param length 返回视图的实际长度, 可能因为数据未下载完成或映射窗口边界而小于size.
+	// 返回指向数据的指针, 持有期间数据保持有效. 数据未下载或存储不支持视图(如
+	// default_storge)时返回空, 此时可以使用fetch_data.
+	// @begin example
+	//  avhttp::settings s;
+	//  s.storage = avhttp::mmap_storage_constructor;
+	//  h.start(url, s);
+	//  std::size_t length = 0;
+	//  boost::shared_ptr<const char> data = h.fetch_view(offset, 65536, length);
+	// @end example
+	AVHTTP_DECL boost::shared_ptr<const char> fetch_view(boost::int64_t offset,
+		std::size_t size, std::size_t& length);
+
+	///异步读取指定位置的数据, 并将下载点移动到offset处优先下载.
+	// @param offset 读取数据的指定偏移位置, offset之后settings::read_ahead字节内的数据
+	//          将被优先按顺序下载.
+	// @param buffers 指定的数据缓冲. 这个类型必须满足MutableBufferSequence的定义,
+	//          MutableBufferSequence的定义在boost.asio文档中.
+	// @param handler 当buffers所请求的数据全部下载完成(到文件尾时为剩余的数据)后读取
+	//          数据并回调, 它必须满足以下条件:
+	// @begin code
+	//  void handler(
+	//    const boost::system::error_code& ec, // 用于返回操作状态.
+	//    std::size_t bytes_transferred        // 返回读取的数据字节数.
+	//  );
+	// @end code
+	// @备注: 必须在下载启动完成后调用, 文件大小未知时返回operation_not_supported,
+	// offset到达文件尾时返回eof, 停止下载时未完成的请求返回operation_aborted.
+	template <typename MutableBufferSequence, typename Handler>
+	void async_fetch(boost::int64_t offset, const MutableBufferSequence& buffers,
+		Handler handler);
+
 	///返回当前设置信息.
 	AVHTTP_DECL const settings& set() const;
 
@@ -188,6 +274,7 @@ public:
 	AVHTTP_DECL std::string file_name() const;
 
 	///当前已经下载的字节总数.
+	// @备注: 各连接按分片更新下载区间, 所以可能比实际略少, 每个连接最多相差一个分片.
 	AVHTTP_DECL boost::int64_t bytes_download() const;
 
 	///当前下载速率, 单位byte/s.
@@ -199,6 +286,35 @@ public:
 	///返回当前限速.
 	AVHTTP_DECL int download_rate_limit() const;
 
+	///设置并发连接数, 下载过程中调整将在下一次tick时生效, 最少为1个连接.
+	AVHTTP_DECL void connections_limit(int limit);
+
+	///返回当前并发连接数限制.
+	AVHTTP_DECL int connections_limit() const;
+
+	///返回当前活动的连接数.
+	AVHTTP_DECL int number_of_connections() const;
+
+	///服务器是否支持多点下载, 启动完成之后才有效.
+	AVHTTP_DECL bool accept_multi() const;
+
+	///返回整个文件的sha1(20字节二进制), 需要启用settings::file_digest.
+	// @下载完成前返回空字符串.
+	AVHTTP_DECL std::string file_digest() const;
+
+	///返回分片校验失败的次数.
+	AVHTTP_DECL int hash_failures() const;
+
+	///返回下载使用的存储.
+	// @没有启动下载时返回NULL, 否则在下一次start或者multi_download销毁之前有效.
+	// @备注: 使用memory_storage时, 下载完成后通过它取出数据. 通过settings::async_storage
+	// 指定了异步存储时返回NULL.
+	AVHTTP_DECL storage_interface* storage() const;
+
+	///返回下载使用的异步存储, storage_interface由storage_adapter包装.
+	// @没有启动下载时返回NULL, 否则在下一次start或者multi_download销毁之前有效.
+	AVHTTP_DECL async_storage_interface* async_storage() const;
+
 protected:
 
 	AVHTTP_DECL void handle_open(const int index,
@@ -207,24 +323,309 @@ protected:
 	AVHTTP_DECL void handle_read(const int index,
 		http_object_ptr object_ptr, int bytes_transferred, const boost::system::error_code& ec);
 
+	// 连接收到的数据写入存储之后, 判断区间是否下载完成, 继续读取或者发起新的请求.
+	AVHTTP_DECL void handle_received(const int index, http_object_ptr object_ptr,
+		int bytes_transferred, bool malformed, const boost::system::error_code& ec);
+
+	AVHTTP_DECL void handle_splice(const int index,
+		http_object_ptr object_ptr, const boost::system::error_code& ec);
+
 	AVHTTP_DECL void handle_request(const int index,
 		http_object_ptr object_ptr, const boost::system::error_code& ec);
 
 	template <typename Handler>
 	void handle_start(Handler handler, http_object_ptr object_ptr, const boost::system::error_code& ec);
 
+	// 在校验线程中复制差分下载的相同块, 完成后回到连接的strand中调用start_connections.
+	template <typename Handler>
+	void handle_seed(Handler handler, http_object_ptr object_ptr);
+
+	// 初始化分片校验, 开始第1个连接的下载并创建其它连接, 然后回调handler.
+	template <typename Handler>
+	void start_connections(Handler handler, http_object_ptr object_ptr, const boost::system::error_code& ec);
+
+	template <typename MutableBufferSequence, typename Handler>
+	void handle_fetch(const MutableBufferSequence& buffers, boost::int64_t offset,
+		std::size_t length, Handler handler, const boost::system::error_code& ec);
+
+	// 存储异步读取完成, 在m_io_service中回调async_fetch的handler.
+	template <typename Handler>
+	void handle_fetch_read(Handler handler, const boost::system::error_code& ec,
+		std::size_t bytes_transferred);
+
 	AVHTTP_DECL void on_tick(const boost::system::error_code& e);
 
-	AVHTTP_DECL bool allocate_range(range& r);
+	// m_timer只在m_io_service中操作, 其它线程通过下面的函数投递启动和取消.
+	AVHTTP_DECL void start_timer();
+	AVHTTP_DECL void handle_start_timer();
+	AVHTTP_DECL void cancel_timer();
+	AVHTTP_DECL void handle_cancel_timer();
+
+	// 每秒执行一次的维护工作, 包括更新meta, 计算速率, 超时重连和调整连接数.
+	// 返回false表示下载已经终止.
+	AVHTTP_DECL bool tick();
+
+	// 下载终止时保存最后的状态并通知wait_for_complete, 还有异步写入时推迟到
+	// 最后一个写入完成.
+	AVHTTP_DECL void finish_download();
+
+	// 在连接所属的strand中检查连接是否超时或需要重连, 并重新创建连接.
+	AVHTTP_DECL void check_connection(int index, http_object_ptr object_ptr);
+
+	// 在连接所属的strand中设置连接的退役标识.
+	AVHTTP_DECL void set_retire(http_object_ptr object_ptr, bool retire);
+
+	// 在连接所属的strand中设置连接被预读抢占.
+	AVHTTP_DECL void set_preempt(http_object_ptr object_ptr);
+
+	// 在连接所属的strand中设置因流式处理暂停的连接被抢占, 并立即重连.
+	AVHTTP_DECL void set_stream_preempt(http_object_ptr object_ptr);
+
+	// 分配一段下载区间, request_size为连接期望的请求大小, 0为默认大小.
+	AVHTTP_DECL bool allocate_range(range& r, boost::int64_t request_size = 0);
 
+	// 是否还有没有分配的区间.
+	AVHTTP_DECL bool has_free_range();
+
+	// 打开meta文件, 解码快照并重放快照之后追加的日志记录.
+	// meta中保存的ETag/Last-Modified与服务器返回的不一致时, 返回false.
 	AVHTTP_DECL bool open_meta(const fs::path& file_path);
 
+	// 保存第一次请求返回的ETag/Last-Modified, 并设置后续区间请求的If-Range.
+	AVHTTP_DECL void save_validators(http_stream& h);
+
+	// 检查区间请求的响应, 返回200且校验器变化时说明文件在下载过程中发生了变化, 终止下载;
+	// 其它非206的响应保留meta, 重新连接.
+	AVHTTP_DECL bool check_partial_content(http_stream_object& object);
+
+	// 响应中的ETag/Last-Modified与保存的不一致时返回true.
+	AVHTTP_DECL bool validators_changed(http_stream& h) const;
+
+	// 多区间请求的响应不是multipart/byteranges时, 改为每次请求一个区间, 返回false.
+	AVHTTP_DECL bool check_multipart(http_stream_object& object);
+
+	// 服务器不支持多区间请求, 释放连接的所有区间并重新连接.
+	AVHTTP_DECL void disable_multi_range(http_stream_object& object);
+
+	// 追加新下载完成的区间和通过校验的分片到meta文件, 必要时重写快照.
 	AVHTTP_DECL void update_meta();
 
+	// 重写meta文件的快照并清空日志记录.
+	AVHTTP_DECL void write_meta_snapshot();
+
+	// 删除meta文件或续传数据存储中对应的数据.
+	AVHTTP_DECL void remove_meta();
+
+	// 停止或完成下载时, 同步所有数据到磁盘并更新meta文件.
+	AVHTTP_DECL void flush_meta();
+
+	// 在同步线程中把已经下载的数据同步到磁盘.
+	AVHTTP_DECL void start_sync();
+
+	AVHTTP_DECL void handle_sync();
+
+	// 两次同步之间, 在同步线程中提前发起脏页写回, 缩短下一次同步的时间.
+	AVHTTP_DECL void start_writeback();
+
+	AVHTTP_DECL void handle_writeback();
+
+	// linux下对文件描述符使用sync_file_range发起写回, 不等待完成, 不保证持久化.
+	AVHTTP_DECL void writeback();
+
+	// 返回执行磁盘同步的io_service.
+	AVHTTP_DECL boost::asio::io_service& sync_io_service();
+
 private:
 
 	AVHTTP_DECL void change_outstranding(bool addref = true);
 
+	// 为连接创建新的http_stream及strand, 如果使用了io_service池, 则从池中分配io_service.
+	AVHTTP_DECL void create_stream(http_stream_object& object);
+
+	// 分配下载区间并创建一个新的连接发起请求, 无区间可分配时返回空指针.
+	AVHTTP_DECL http_object_ptr create_connection(int index);
+
+	// 按connections_limit增加或者减少连接.
+	AVHTTP_DECL void adjust_connections();
+
+	// 更新下载点位置, 并返回offset之后最多length字节中已经下载完成的长度.
+	AVHTTP_DECL std::size_t readable_length(boost::int64_t offset, std::size_t length);
+
+	// 返回offset之后最多length字节中已经连续下载完成的长度, 不改变下载点.
+	AVHTTP_DECL std::size_t downloaded_length(boost::int64_t offset, std::size_t length);
+
+	// 从存储中读取[offset, offset + length)的数据到buffers.
+	template <typename MutableBufferSequence>
+	std::size_t read_data(const MutableBufferSequence& buffers,
+		boost::int64_t offset, std::size_t length);
+
+	// 将连接累计的区间更新到下载区间位图中, 启用写缓存时先交给存储异步写入.
+	AVHTTP_DECL void publish_range(http_stream_object& object);
+
+	// 将已经写入存储的区间[left, right)更新到下载区间位图中.
+	AVHTTP_DECL void publish_range(boost::int64_t left, boost::int64_t right);
+
+	// 把buffer交给存储异步写入到offset, 写入完成后由handle_write更新下载区间位图.
+	AVHTTP_DECL void write_buffer(boost::int64_t offset, boost::shared_ptr<std::vector<char> > buffer);
+
+	// 存储异步写完一块数据, 更新下载区间位图.
+	AVHTTP_DECL void handle_write(boost::int64_t offset, boost::shared_ptr<std::vector<char> > buffer,
+		const boost::system::error_code& ec, std::size_t bytes_transferred);
+
+	// 写缓存已满时暂停连接的读取, 返回true表示已经暂停.
+	AVHTTP_DECL bool defer_read(int index, http_object_ptr object_ptr);
+
+	// 写缓存有空间后继续读取.
+	AVHTTP_DECL void resume_read(int index, http_object_ptr object_ptr);
+
+	// 继续读取连接的数据.
+	AVHTTP_DECL void async_read(int index, http_object_ptr object_ptr);
+
+	// 等待socket可读后通过splice读取, 返回false表示这个连接当前不能使用splice.
+	AVHTTP_DECL bool async_splice(int index, http_object_ptr object_ptr);
+
+	// 通过splice把socket中的数据经管道写入文件中连接的下载位置, 返回写入的字节数.
+	// 没有数据可读时ec为would_block.
+	AVHTTP_DECL std::size_t splice_data(http_stream_object& object, boost::system::error_code& ec);
+
+	// 是否还有没有写完的异步写入.
+	AVHTTP_DECL bool writing();
+
+	// 清空上一次下载的连接, 校验, 流式处理和同步等状态, 并保存设置.
+	// start和async_start开始时调用.
+	AVHTTP_DECL void reset_state(const settings& s);
+
+	// 打开存储, 核对续传数据, 预分配文件并处理默认设置, 之后由调用者复制差分下载的
+	// 相同块并初始化分片校验. 返回false表示不需要继续启动, 出错时ec为错误, 否则文件
+	// 已经下载完成.
+	AVHTTP_DECL bool prepare_storage(boost::system::error_code& ec);
+
+	// 按settings创建存储对象并打开文件.
+	AVHTTP_DECL void open_storage(boost::system::error_code& ec);
+
+	// 写入[offset, offset + size)的数据到存储, 并累计到连接已经写入的区间.
+	AVHTTP_DECL void write_data(http_stream_object& object, boost::int64_t offset,
+		const char* data, std::size_t size, const boost::system::error_code& ec);
+
+	// 解析multipart/byteranges响应并写入每个部分的数据, 格式错误或者部分超出请求的区间时返回false.
+	AVHTTP_DECL bool write_multipart(http_stream_object& object,
+		std::size_t size, const boost::system::error_code& ec);
+
+	// request_range被已经下载的数据截断时, 再分配一些空隙, 在一次请求中下载.
+	AVHTTP_DECL void allocate_extra_ranges(http_stream_object& object);
+
+	// 生成连接的Range请求选项, begin为第一个区间的起始位置.
+	AVHTTP_DECL std::string range_option(const http_stream_object& object, boost::int64_t begin) const;
+
+	// 完成数据已经下载完成的异步读取请求, ec非空时完成所有请求.
+	AVHTTP_DECL void check_fetch_requests(
+		const boost::system::error_code& ec = boost::system::error_code());
+
+	// 读取点之后的预读区间还有未分配的空间时, 抢占一个远离读取点的连接.
+	// 预读区间已经全部下载完成时结束预读.
+	AVHTTP_DECL void preempt_for_read_ahead();
+
+	// 释放连接未下载完成的区间, 以便重新分配.
+	AVHTTP_DECL void release_range(http_stream_object& object);
+
+	// 返回预读区间的右边界.
+	AVHTTP_DECL boost::int64_t read_ahead_end() const;
+
+	// 移动读取点并启用预读, 之后分配的区间从offset开始. 读取点与区间分配
+	// 共用m_rangefield_mutex, 可以在任意线程中调用.
+	AVHTTP_DECL void move_read_point(boost::int64_t offset);
+
+	// 区间[left, right)与读取者等待的预读区间重叠时返回true.
+	AVHTTP_DECL bool in_read_ahead(boost::int64_t left, boost::int64_t right);
+
+	// 续传时通过存储查找文件空洞, 删除meta中记录但实际没有写入文件的区间.
+	AVHTTP_DECL void check_downloaded();
+
+	// 差分下载, 从旧版本的本地文件中复制与新版本相同的块.
+	AVHTTP_DECL void apply_seed(boost::system::error_code& ec);
+
+	// 复制旧版本文件中找到的相同的块, 标记为已经下载.
+	AVHTTP_DECL void handle_seed_block(boost::int64_t offset,
+		const char* data, std::size_t size, boost::int64_t& seeded);
+
+	// 根据设置初始化分片校验, 加载校验清单并提交已经下载但未校验的分片.
+	AVHTTP_DECL void init_verify(boost::system::error_code& ec);
+
+	// 提交[offset, offset + size)所在的已经下载完成的分片进行校验.
+	AVHTTP_DECL void check_pieces(boost::int64_t offset, boost::int64_t size);
+
+	// 在校验线程中校验分片, 失败则放回m_rangefield重新下载.
+	AVHTTP_DECL void handle_hash_piece(int index);
+
+	// 在校验线程中按顺序计算整个文件的sha1.
+	AVHTTP_DECL void handle_digest();
+
+	// 提交下一段文件摘要计算, 调用者必须已经锁定m_hash_mutex.
+	AVHTTP_DECL void start_digest();
+
+	// 是否所有分片都已经通过校验.
+	AVHTTP_DECL bool verify_complete();
+
+	// 从存储中读取一个校验分片.
+	AVHTTP_DECL bool read_piece(int index, std::vector<char>& buffer);
+
+	// 返回执行校验的io_service.
+	AVHTTP_DECL boost::asio::io_service& hash_io_service();
+
+	// 有新的前缀可以交给settings::stream_handler时, 提交到流式处理线程.
+	AVHTTP_DECL void start_stream();
+
+	// 在流式处理线程中按顺序把下载完成的前缀交给settings::stream_handler.
+	AVHTTP_DECL void handle_stream();
+
+	// 从m_stream_point开始连续可以交出的数据的结束位置.
+	AVHTTP_DECL boost::int64_t stream_end();
+
+	// m_stream_point处是否有数据可以交出, 调用者必须已经锁定m_stream_mutex.
+	AVHTTP_DECL bool stream_ready();
+
+	// 流式处理是否已经交出整个文件.
+	AVHTTP_DECL bool stream_complete();
+
+	// 连接领先流式处理超过stream_window时暂停读取, 返回true表示已经暂停.
+	AVHTTP_DECL bool defer_stream(int index, http_object_ptr object_ptr);
+
+	// 流式处理跟上后, 恢复已经回到窗口内的连接, 下载终止时恢复所有连接.
+	AVHTTP_DECL void resume_stream_waiters();
+
+	// 流式处理需要的数据没有连接下载而连接都已暂停时, 抢占一个暂停的连接.
+	AVHTTP_DECL void preempt_for_stream();
+
+	// 连接当前读取的位置.
+	AVHTTP_DECL boost::int64_t read_position(const http_stream_object& object) const;
+
+	// 返回执行流式处理的io_service.
+	AVHTTP_DECL boost::asio::io_service& stream_io_service();
+
+	// 在连接所属的strand中关闭连接, 避免与该连接上正在执行的回调并发访问socket.
+	AVHTTP_DECL void close_stream(const http_object_ptr& object_ptr);
+
+	// 收到响应时更新连接的往返时间.
+	AVHTTP_DECL void update_rtt(http_stream_object& object);
+
+	// 区间下载完成时, 根据连接的下载速率和往返时间计算下一次请求的大小.
+	AVHTTP_DECL void update_request_size(http_stream_object& object);
+
+	// 按经过的时间向共享的限速配额中补充字节数, 调用时需持有m_rate_mutex.
+	AVHTTP_DECL void refill_rate_bytes();
+
+	// 计算本次可请求读取的字节数, 最多为max_bytes, 并从共享的限速配额中扣除.
+	AVHTTP_DECL int available_bytes(int max_bytes = default_buffer_size);
+
+	// 退回没有用到的限速配额.
+	AVHTTP_DECL void release_bytes(int bytes);
+
+	// 限速配额用完时暂停连接的读取, 返回true表示已经暂停.
+	AVHTTP_DECL bool defer_rate(int index, http_object_ptr object_ptr);
+
+	// 限速配额补充后继续读取暂停的连接.
+	AVHTTP_DECL void handle_rate_timer(const boost::system::error_code& ec);
+
 	// 默认根据文件大小自动计算分片大小.
 	AVHTTP_DECL std::size_t default_piece_size(const boost::int64_t& file_size) const;
 
@@ -232,8 +633,11 @@ private:
 	// io_service引用.
 	boost::asio::io_service& m_io_service;
 
+	// io_service池, 为空表示所有连接都运行在m_io_service上.
+	io_service_pool* m_io_service_pool;
+
 	// 每一个http_stream_obj是一个http连接.
-	// 注意: 容器中的http_object_ptr只能在on_tick一处进行写操作, 并且确保其它地方
+	// 注意: 容器中的http_object_ptr只能在on_tick和check_connection中进行写操作, 并且确保其它地方
 	// 是新的副本, 这主要体现在发起新的异步操作的时候将http_object_ptr作为参数形式
 	// 传入, 这样在异步回调中只需要访问http_object_ptr的副本指针, 而不是直接访问
 	// m_streams!!!
@@ -247,8 +651,8 @@ private:
 	// 最终的url, 如果有跳转的话, 是跳转最后的那个url.
 	url m_final_url;
 
-	// 是否支持多点下载.
-	bool m_accept_multi;
+	// 是否支持多点下载, 由启动的连接设置, download_manager在调度时读取.
+	atomic_bool m_accept_multi;
 
 	// 是否支持长连接.
 	bool m_keep_alive;
@@ -268,34 +672,124 @@ private:
 	// 动态计算速率.
 	download_stat_ptr m_download_rate;
 
-	// 实际连接数.
-	int m_number_of_connections;
+	// 实际连接数, 在连接的strand和tick中修改, 用户线程中读取.
+	atomic_int m_number_of_connections;
 
 	// 下载计时.
 	int m_time_total;
 
 	// 下载数据存储接口指针, 可由用户定义, 并在open时指定.
-	boost::scoped_ptr<storage_interface> m_storage;
+	boost::scoped_ptr<async_storage_interface> m_storage;
+
+	// settings::storage创建的存储, 由m_storage中的storage_adapter持有.
+	storage_interface* m_legacy_storage;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 各连接可能运行在不同的线程中, 保证m_storage读写的唯一性.
+	boost::mutex m_storage_mutex;
+#endif
 
 	// meta文件, 用于续传.
+	// 文件以bencode编码的快照开始, 之后追加日志记录, 每个记录是一个bencode列表,
+	// 两个整数[left, right)表示新下载完成的区间, 一个整数表示通过校验的分片.
 	file m_file_meta;
 
+	// 文件的ETag和Last-Modified, 保存在meta中, 续传时用于确认文件没有变化.
+	std::string m_etag;
+	std::string m_last_modified;
+
+	// 文件在下载过程中发生了变化, 已经下载的数据无效, 终止时删除meta文件.
+	bool m_remote_changed;
+
+	// 服务器是否支持多区间请求, 不支持时每次只请求一个区间.
+	bool m_multi_range;
+
+	// meta文件的大小, 为0表示需要重写快照.
+	boost::int64_t m_meta_size;
+
+	// meta文件中快照部分的大小, 日志超过快照大小时重写快照.
+	boost::int64_t m_meta_snapshot_size;
+
 	// 下载点位置.
 	boost::int64_t m_download_point;
 
+	// 是否有读取数据的请求, 有则按预读区间优先顺序下载.
+	bool m_read_ahead;
+
 	// 文件区间图, 每次请求将由m_rangefield来分配空间区间.
 	rangefield m_rangefield;
 
 	// 已经下载的文件区间.
 	rangefield m_downlaoded_field;
 
+	// 已经下载但还没有同步到磁盘(或者不同步时还没有写入meta日志)的区间.
+	// 必须先于m_downlaoded_field更新, 这样快照中不会包含还没有同步的数据.
+	rangefield m_meta_pending;
+
+	// 正在同步到磁盘的区间.
+	std::vector<range> m_sync_inflight;
+
+	// 已经同步到磁盘但还没有写入meta日志的区间.
+	std::vector<range> m_synced;
+
+	// 同步线程是否正在同步或发起写回.
+	bool m_syncing;
+
+	// 距离上一次同步的秒数.
+	int m_sync_elapsed;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面同步相关的成员.
+	boost::mutex m_sync_mutex;
+
+	// 执行磁盘同步的线程.
+	boost::scoped_ptr<io_service_pool> m_sync_pool;
+#endif
+
+	// 已经交给存储但还没有写入的字节数.
+	boost::int64_t m_write_bytes;
+
+	// 下载已经终止, 等待最后一个异步写入完成后调用finish_download.
+	bool m_finish_pending;
+
+	// 因写缓存已满而暂停读取的连接.
+	std::vector<std::pair<int, http_object_ptr> > m_write_waiters;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面写缓存相关的成员.
+	boost::mutex m_write_mutex;
+#endif
+
+	// 所有连接共享的限速配额, 按download_rate_limit随时间补充.
+	int m_rate_bytes;
+
+	// 上一次补充限速配额的时间.
+	boost::posix_time::ptime m_rate_time;
+
+	// 因限速配额用完而暂停读取的连接.
+	std::vector<std::pair<int, http_object_ptr> > m_rate_waiters;
+
+	// 限速定时器, 配额补充后恢复暂停的连接.
+	boost::asio::deadline_timer m_rate_timer;
+	bool m_rate_timer_armed;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面限速相关的成员.
+	boost::mutex m_rate_mutex;
+#endif
+
 	// 保证分配空闲区间的唯一性.
 #ifndef AVHTTP_DISABLE_THREAD
 	boost::mutex m_rangefield_mutex;
 #endif
 
-	// 用于限速.
-	int m_drop_size;
+	// 等待数据下载完成的异步读取请求.
+	std::list<fetch_request> m_fetch_requests;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护m_fetch_requests.
+	boost::mutex m_fetch_mutex;
+#endif
 
 	// 用于异步工作计数.
 	int m_outstanding;
@@ -308,8 +802,70 @@ private:
 	mutable boost::mutex m_quit_mtx;
 	mutable boost::condition m_quit_cond;
 
-	// 是否中止工作.
-	bool m_abort;
+#ifndef AVHTTP_DISABLE_THREAD
+	// 校验线程池, 启用分片校验或文件摘要时创建.
+	boost::scoped_ptr<io_service_pool> m_hash_pool;
+#endif
+
+	// 校验分片的大小.
+	int m_hash_piece_size;
+
+	// 已经通过校验的分片, 只计算文件摘要时下载完成即视为通过.
+	bitfield m_verified;
+
+	// 正在校验的分片.
+	bitfield m_hashing;
+
+	// 计算中的整个文件的sha1, 已经计算到m_digest_point.
+	detail::sha1 m_file_hasher;
+	boost::int64_t m_digest_point;
+
+	// 是否正在计算文件摘要.
+	bool m_digesting;
+
+	// 整个文件的sha1.
+	std::string m_file_digest;
+
+	// 分片校验失败的次数.
+	int m_hash_failures;
+
+	// 已经通过校验但还没有写入meta日志的分片.
+	std::vector<int> m_verified_pending;
+
+	// 校验失败删除了已下载的区间, 需要重写meta文件的快照.
+	bool m_meta_compact;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面校验相关的成员.
+	mutable boost::mutex m_hash_mutex;
+#endif
+
+	// 已经交给settings::stream_handler的位置.
+	boost::int64_t m_stream_point;
+
+	// 是否正在流式处理, 以及处理期间是否有新的数据.
+	bool m_streaming;
+	bool m_stream_pending;
+
+	// 是否已经交出整个文件.
+	bool m_stream_eof;
+
+	// 因领先流式处理太多而暂停读取的连接.
+	std::vector<std::pair<int, http_object_ptr> > m_stream_waiters;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面流式处理相关的成员.
+	boost::mutex m_stream_mutex;
+
+	// 执行流式处理的线程.
+	boost::scoped_ptr<io_service_pool> m_stream_pool;
+#endif
+
+	// 是否中止工作, 由多个线程读写.
+	atomic_bool m_abort;
+
+	// 由外部(download_manager)驱动tick, 此时不再启动m_timer.
+	bool m_external_tick;
 };
 
 } // avhttp
@@ -20,6 +20,7 @@
 #include <algorithm>    // for std::min/std::max
 
 #include <boost/cstdint.hpp>
+#include <boost/version.hpp>
 #include <boost/assert.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/shared_ptr.hpp>
@@ -27,6 +28,12 @@
 
 #include "avhttp/bitfield.hpp"
 
+// 区间总大小在有boost.atomic时不需要锁定就可以读取.
+#if !defined(AVHTTP_DISABLE_THREAD) && (BOOST_VERSION >= 105300)
+#	include <boost/atomic.hpp>
+#	define AVHTTP_ATOMIC_RANGE_SIZE
+#endif
+
 
 
 namespace avhttp {
@@ -67,6 +74,8 @@ struct range
 };
 
 // 一个按区域来划分的位图实现(类似Range tree).
+// 内部的区间总是整理过的, 即互不重叠也不相邻, 按左边界排序, 所以查找和分配
+// 空闲空间都只需要O(log n), 大量碎片区间的续传也不会使分配变慢.
 class rangefield
 {
 	typedef std::map<boost::int64_t, boost::int64_t> range_map;
@@ -74,8 +83,8 @@ class rangefield
 public:
 	// @param size表示区间的总大小.
 	inline rangefield(boost::int64_t size = 0)
-		: m_need_merge(false)
-		, m_size(size)
+		: m_size(size)
+		, m_covered(0)
 #ifndef AVHTTP_DISABLE_THREAD
 		, m_mutex(boost::make_shared<boost::mutex>())
 #endif
@@ -86,9 +95,12 @@ public:
 
 	rangefield(const rangefield& rhs)
 	{
-		m_need_merge = rhs.m_need_merge;
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(*rhs.m_mutex);
+#endif
 		m_ranges = rhs.m_ranges;
 		m_size = rhs.m_size;
+		m_covered = boost::int64_t(rhs.m_covered);
 #ifndef AVHTTP_DISABLE_THREAD
 		m_mutex = boost::make_shared<boost::mutex>();
 #endif
@@ -96,12 +108,25 @@ public:
 
 	const rangefield& operator=(const rangefield& rhs)
 	{
-		m_need_merge = rhs.m_need_merge;
-		m_ranges = rhs.m_ranges;
-		m_size = rhs.m_size;
+		if (this == &rhs)
+			return *this;
+		range_map ranges;
+		boost::int64_t size;
+		boost::int64_t covered;
+		{
 #ifndef AVHTTP_DISABLE_THREAD
-		m_mutex = boost::make_shared<boost::mutex>();
+			boost::mutex::scoped_lock lock(*rhs.m_mutex);
+#endif
+			ranges = rhs.m_ranges;
+			size = rhs.m_size;
+			covered = rhs.m_covered;
+		}
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
+		m_ranges.swap(ranges);
+		m_size = size;
+		m_covered = covered;
 		return *this;
 	}
 
@@ -115,8 +140,8 @@ public:
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 		m_size = size;
-		m_need_merge = false;
 		m_ranges.clear();
+		m_covered = 0;
 	}
 
 	///获得区域的大小.
@@ -148,8 +173,58 @@ public:
 
 		if ((left < 0 || right > m_size) || (right <= left))
 			return false;
-		m_ranges[left] = right;
-		m_need_merge = true;
+		insert_impl(left, right);
+		return true;
+	}
+
+	///从range中删除区间[r.left, r.right).
+	// @param r区间, 不包含右边界处.
+	// @备注: 被删除的区间可以不在range中, 成功返回true.
+	inline bool remove(const range& r)
+	{
+		return remove(r.left, r.right);
+	}
+
+	///从range中删除区间[left, right).
+	// @param left左边边界.
+	// @param right右边边界, 不包含边界处.
+	// @备注: 被删除的区间可以不在range中, 成功返回true.
+	inline bool remove(const boost::int64_t& left, const boost::int64_t& right)
+	{
+		if ((left < 0 || right > m_size) || (right <= left))
+			return false;
+
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(*m_mutex);
+#endif
+
+		// 从可能与[left, right)重叠的第一个区间开始.
+		range_map::iterator i = m_ranges.upper_bound(left);
+		if (i != m_ranges.begin())
+			--i;
+
+		while (i != m_ranges.end() && i->first < right)
+		{
+			boost::int64_t l = i->first;
+			boost::int64_t r = i->second;
+			if (r <= left)
+			{
+				++i;
+				continue;
+			}
+
+			// 删除这个区间, 保留两端不在[left, right)中的部分.
+			m_ranges.erase(i++);
+			m_covered -= (std::min)(r, right) - (std::max)(l, left);
+			if (l < left)
+				m_ranges[l] = left;
+			if (r > right)
+			{
+				m_ranges[right] = r;
+				break;
+			}
+		}
+
 		return true;
 	}
 
@@ -171,22 +246,13 @@ public:
 	{
 		BOOST_ASSERT((left >= 0 && left < right) && right <= m_size);
 
-		// 先整理.
-		if (m_need_merge)
-			merge();
-
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 
-		for (range_map::iterator i = m_ranges.begin();
-			i != m_ranges.end(); i++)
-		{
-			if (left >= i->first && right <= i->second)
-				return true;
-		}
-
-		return false;
+		// 区间互不相邻, 只有包含left的区间可能完整包含[left, right).
+		range_map::const_iterator i = find_impl(left);
+		return i != m_ranges.end() && right <= i->second;
 	}
 
 	///获取在[left, right)区间的最大段.
@@ -198,30 +264,16 @@ public:
 	{
 		BOOST_ASSERT((left >= 0 && left < right) && right <= m_size);
 
-		// 先整理.
-		if (m_need_merge)
-			merge();
-
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 
-		for (range_map::iterator i = m_ranges.begin();
-			i != m_ranges.end(); i++)
-		{
-			if (left >= i->first)
-			{
-				if (right <= i->second)
-					return true;
-				if (right > i->first && i->second > left)
-				{
-					right = i->second;
-					return true;
-				}
-			}
-		}
-
-		return false;
+		range_map::const_iterator i = find_impl(left);
+		if (i == m_ranges.end())
+			return false;
+		if (right > i->second)
+			right = i->second;
+		return true;
 	}
 
 	///输出空隙空间.
@@ -240,9 +292,6 @@ public:
 	// @备注: 输出的区间是一个半开区间[left, right), 即不包含右边界.
 	inline bool out_space(boost::int64_t& left, boost::int64_t& right)
 	{
-		// 先整理.
-		if (m_need_merge)
-			merge();
 		return out_space(0, left, right);
 	}
 
@@ -252,58 +301,44 @@ public:
 	// @param right 表示右边的边界, 不包括边界处.
 	// @返回false表示没有空间或失败.
 	// @备注: 输出的区间是一个半开区间[left, right), 即不包含右边界.
+	// offset在空隙中时返回[offset, 空隙结束), 否则返回offset之后的第一个空隙,
+	// offset之后没有空隙时返回第一个空隙.
 	inline bool out_space(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
 	{
-		// 先整理.
-		if (m_need_merge)
-			merge();
-
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 
-		// inv里的每一个元素都是空间, 从元素中返回区间.
-		range_map inv = inverse_impl();
+		if (offset < 0)
+			offset = 0;
 
-		// 没有空间.
-		if (inv.size() == 0)
-			return false;
-		range_map::iterator i;
-		for (i = inv.begin(); i != inv.end(); i++)
+		if (offset < m_size)
 		{
-			// 偏移位置在空间里, 就返回这段空间.
-			if (offset >= i->first)
+			range_map::const_iterator next = m_ranges.upper_bound(offset);
+			boost::int64_t start = offset;
+			if (next != m_ranges.begin())
 			{
-				if (offset < i->second)
-				{
-					left = offset;
-					right = i->second;
-					return true;
-				}
+				range_map::const_iterator prev = next;
+				--prev;
+				if (prev->second > offset)
+					start = prev->second;	// offset已经在区间中, 空隙从区间结束处开始.
 			}
-			else // offset不在区间内, 直接返回第一个空间.
+
+			if (start < m_size)
 			{
-				left = i->first;
-				right = i->second;
+				left = start;
+				right = (next == m_ranges.end()) ? m_size : next->first;
 				return true;
 			}
 		}
 
-		// 走到这, 还没找到有效的空间, 则直接返回第一块空间.
-		i = inv.begin();
-		left = i->first;
-		right = i->second;
-
-		return true;
+		// offset之后没有空隙, 返回第一个空隙.
+		return first_space_impl(left, right);
 	}
 
 	///检查位图是否已经满了.
 	inline bool is_full()
 	{
-		// 先整理.
-		if (m_need_merge)
-			merge();
-
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
@@ -319,135 +354,97 @@ public:
 	}
 
 	///得到区间所有大小.
+	// @备注: 大小在修改区间时增量维护, 可以频繁调用, 如用于显示下载进度.
 	inline boost::int64_t range_size() const
 	{
-#ifndef AVHTTP_DISABLE_THREAD
+#if !defined(AVHTTP_DISABLE_THREAD) && !defined(AVHTTP_ATOMIC_RANGE_SIZE)
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
-		boost::int64_t size = 0;
-		for (range_map::const_iterator i = m_ranges.begin();
-			i != m_ranges.end(); i++)
-		{
-			size += i->second - i->first;
-		}
-
-		return size;
+		return m_covered;
 	}
 
 	///按指定大小输出为位图块.
 	// @param bitfield以int为单位的位图数组, 每个元素表示1个piece, 为0表示空, 为1表示满.
 	// @param piece_size指定的piece大小.
-	inline void range_to_bitfield(bitfield& bf, int piece_size)
+	inline void range_to_bitfield(bitfield& bf, boost::int64_t piece_size)
 	{
-		// 先整理连续的空间, 将连续的区间合并为一个区间.
-		if (m_need_merge)
-			merge();
-
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 
 		// 计算出分片总数.
-		int piece_num = (m_size / piece_size) + (m_size % piece_size == 0 ? 0 : 1);
+		boost::int64_t piece_num = (m_size + piece_size - 1) / piece_size;
 
 		// 分配位图空间, 默认为0.
-		bf.resize(piece_num, 0);
-
-		boost::int64_t l = 0;
-		boost::int64_t r = 0;
-		range_map::iterator it = m_ranges.begin();
-		range_map::iterator end = m_ranges.end();
+		bf.resize(piece_num);
+		bf.clear_all();
 
-		// 从0位置开始, 每次检查piece_size大小的空间是否数据完整, 数据
-		// 完整则设置到位图为1, 表示有数据.
-		for (int i = 0; i < piece_num; i++)
+		// 区间是整理过的, 每个区间中完整包含的分片都是有数据的, 最后一个分片
+		// 可能不足piece_size, 到文件尾即为完整.
+		for (range_map::iterator it = m_ranges.begin(); it != m_ranges.end(); it++)
 		{
-			l = i * piece_size;
-			r = (i + 1) * piece_size;
-			r = r > m_size ? m_size : r;
-
-			bool is_complete = false;
-			if (it != end)
-			{
-				// 在已经下载的区间中.
-				if (l >= it->first && r <= it->second)
-				{
-					is_complete = true;
-				}
-				else
-				{
-					// 除非右边界大于等于当前区间的右边界, 否则一直使用当前区间判断.
-					// 这样就避免了每次从头循环遍历.
-					if (r >= it->second)
-					{
-						if (++it != end)
-						{
-							if (l >= it->first && r <= it->second)
-							{
-								is_complete = true;
-							}
-						}
-					}
-				}
-			}
-
-			if (is_complete)
-			{
-				bf.set_bit(i);
-			}
+			boost::int64_t first = (it->first + piece_size - 1) / piece_size;
+			boost::int64_t last = it->second == m_size ? piece_num : it->second / piece_size;
+			bf.set_range(first, (std::max)(first, last));
 		}
 	}
 
 	///按指定的分片大小bitfield更新rangefield.
 	// @param bf为指定的bitfield.
 	// @param piece_size是指定的分片大小.
-	inline void bitfield_to_range(const bitfield& bf, int piece_size)
+	inline void bitfield_to_range(const bitfield& bf, boost::int64_t piece_size)
 	{
 #ifndef AVHTTP_DISABLE_THREAD
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 		m_ranges.clear();
 
-		boost::int64_t left = 0;
-		boost::int64_t right = 0;
-		bool left_record = false;
-		int index = 0;
+		boost::int64_t covered = 0;
 
-		for (bitfield::const_iterator i = bf.begin(); i != bf.end(); i++, index++)
+		// 连续的分片为一个区间, 区间之间至少隔着一个分片, 所以不需要再整理.
+		boost::int64_t first = bf.find_first_set();
+		while (first != -1)
 		{
-			BOOST_ASSERT(index * piece_size < m_size);
-
-			if (*i && !left_record)
-			{
-				left = index * piece_size;
-				right = left + piece_size;
+			boost::int64_t last = bf.find_first_clear(first);
+			if (last == -1)
+				last = bf.size();
 
-				left_record = true;
-				continue;
-			}
+			BOOST_ASSERT(first * piece_size < m_size);
+			boost::int64_t left = first * piece_size;
+			boost::int64_t right = (std::min)(last * piece_size, m_size);
+			if (left >= right)
+				break;
 
-			if (*i && left_record)
-			{
-				right += piece_size;
-			}
+			m_ranges.insert(m_ranges.end(), std::make_pair(left, right));
+			covered += right - left;
 
-			if (left_record && !(*i))
-			{
-				// 得到区间.
-				right = (std::min)(right, m_size);
-				m_ranges[left] = right;
-				left_record = false;
-			}
+			first = bf.find_first_set(last);
 		}
 
-		if (left_record)
+		m_covered = covered;
+	}
+
+	///输出所有区间.
+	// @param result输出的区间列表, 每个区间不包含右边界处.
+	// @param clear输出后是否清空, 清空与输出是原子的, 不会丢失并发添加的区间.
+	inline void ranges(std::vector<range>& result, bool clear = false)
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(*m_mutex);
+#endif
+
+		result.clear();
+		for (range_map::iterator i = m_ranges.begin();
+			i != m_ranges.end(); i++)
 		{
-			right = (std::min)(right, m_size);
-			m_ranges[left] = right;
-			left_record = false;
+			result.push_back(range(i->first, i->second));
 		}
 
-		m_need_merge = true;
+		if (clear)
+		{
+			m_ranges.clear();
+			m_covered = 0;
+		}
 	}
 
 	///输出range内容, 调试使用.
@@ -470,11 +467,9 @@ public:
 		boost::mutex::scoped_lock lock(*m_mutex);
 #endif
 
-		range_map m = inverse_impl();
 		rangefield f(m_size);
-
-		f.m_need_merge = m_need_merge;
-		f.m_ranges = m;
+		f.m_ranges = inverse_impl();
+		f.m_covered = m_size - m_covered;
 
 		return f;
 	}
@@ -484,10 +479,6 @@ protected:
 	///返回翻转的range_item.
 	inline range_map inverse_impl()
 	{
-		// 先整理.
-		if (m_need_merge)
-			merge();
-
 		range_map reverse_map;
 		boost::int64_t point = 0;
 
@@ -495,96 +486,106 @@ protected:
 		for (range_map::iterator i = m_ranges.begin();
 			i != m_ranges.end(); i++)
 		{
-			if (i == m_ranges.begin())
-			{
-				if (i->first != 0)
-				{
-					point = 0;
-					reverse_map.insert(std::make_pair(point, i->first));
-					point = i->second;
-					continue;
-				}
-				else
-				{
-					point = i->second;
-					continue;
-				}
-			}
-
-			reverse_map.insert(std::make_pair(point, i->first));
+			if (i->first != point)
+				reverse_map.insert(reverse_map.end(), std::make_pair(point, i->first));
 			point = i->second;
 		}
 
 		// 尾部判断.
-		if (point != m_size || m_ranges.size() == 0)
+		if (point != m_size)
 		{
-			reverse_map.insert(std::make_pair(point, m_size));
+			reverse_map.insert(reverse_map.end(), std::make_pair(point, m_size));
 		}
 
 		return reverse_map;
 	}
 
-	///整理回收range中的重叠部分.
-	inline void merge()
+	///插入区间[left, right), 并与重叠或相邻的区间合并, 调用者必须已经锁定.
+	inline void insert_impl(boost::int64_t left, boost::int64_t right)
 	{
-#ifndef AVHTTP_DISABLE_THREAD
-		boost::mutex::scoped_lock lock(*m_mutex);
-#endif
-		std::map<boost::int64_t, boost::int64_t> result;
-		std::pair<boost::int64_t, boost::int64_t> max_value;
-		max_value.first = 0;
-		max_value.second = 0;
-		for (range_map::iterator i = m_ranges.begin();
-			i != m_ranges.end(); i++)
+		range_map::iterator i = m_ranges.upper_bound(left);
+		if (i != m_ranges.begin())
 		{
-			// i 在max_value 之间, 忽略之.
-			// [        ]
-			//   [    ]
-			// --------------
-			// [         ]
-			if (i->first >= max_value.first && i->second <= max_value.second)
-				continue;
-			// 情况如下:
-			//      [   ]
-			// [       ]
-			// --------------
-			// [        ]
-			if (i->first <= max_value.first && (i->second >= max_value.first && i->second <= max_value.second))
-			{
-				max_value.first = i->first;	// 更新首部位置.
-				continue;
-			}
-			// 情况如下:
-			// [   ]
-			//     [     ]
-			// --------------
-			// [         ]
-			if ((i->first > max_value.first && i->first <= max_value.second))
-			{
-				max_value.second = i->second;
-				continue;
-			}
-			// 情况如下:
-			// [   ]
-			//       [     ]
-			// --------------
-			// [   ] [     ]
-			if ((i->first > max_value.second) || (max_value.first == 0 && max_value.second == 0))
+			range_map::iterator prev = i;
+			--prev;
+			if (prev->second >= left)
 			{
-				if (max_value.first != 0 || max_value.second != 0)
-					result.insert(max_value);
-				max_value = *i;
+				// 已经完整包含, 无需更新.
+				if (prev->second >= right)
+					return;
+
+				// 与前一个区间重叠或相邻, 从前一个区间开始合并.
+				left = prev->first;
+				i = prev;
 			}
 		}
-		result.insert(max_value);
-		m_ranges = result;
-		m_need_merge = false;
+
+		// 合并所有起始位置不超过right的区间.
+		boost::int64_t merged = 0;
+		while (i != m_ranges.end() && i->first <= right)
+		{
+			if (i->second > right)
+				right = i->second;
+			merged += i->second - i->first;
+			m_ranges.erase(i++);
+		}
+
+		m_ranges.insert(i, std::make_pair(left, right));
+		m_covered += right - left - merged;
+	}
+
+	///查找包含offset的区间, 不存在返回end, 调用者必须已经锁定.
+	inline range_map::const_iterator find_impl(boost::int64_t offset) const
+	{
+		range_map::const_iterator i = m_ranges.upper_bound(offset);
+		if (i == m_ranges.begin())
+			return m_ranges.end();
+		--i;
+		if (i->second > offset)
+			return i;
+		return m_ranges.end();
+	}
+
+	///输出第一个空隙, 调用者必须已经锁定.
+	inline bool first_space_impl(boost::int64_t& left, boost::int64_t& right) const
+	{
+		if (m_size <= 0)
+			return false;
+
+		range_map::const_iterator i = m_ranges.begin();
+		if (i == m_ranges.end())
+		{
+			left = 0;
+			right = m_size;
+			return true;
+		}
+
+		if (i->first > 0)
+		{
+			left = 0;
+			right = i->first;
+			return true;
+		}
+
+		if (i->second >= m_size)
+			return false;
+
+		left = i->second;
+		range_map::const_iterator next = i;
+		++next;
+		right = (next == m_ranges.end()) ? m_size : next->first;
+		return true;
 	}
 
 private:
-	bool m_need_merge;
 	boost::int64_t m_size;
 	range_map m_ranges;
+	// 所有区间的总大小, 只在锁定时修改.
+#ifdef AVHTTP_ATOMIC_RANGE_SIZE
+	boost::atomic<boost::int64_t> m_covered;
+#else
+	boost::int64_t m_covered;
+#endif
 #ifndef AVHTTP_DISABLE_THREAD
 	typedef boost::shared_ptr<boost::mutex> mutex_ptr;
 	mutex_ptr m_mutex;
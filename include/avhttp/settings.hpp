@@ -19,6 +19,7 @@
 #include <map>
 #include <string>
 #include <boost/algorithm/string.hpp>
+#include <boost/function.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time.hpp>
 
@@ -26,6 +27,8 @@
 
 namespace avhttp {
 
+class meta_store;
+
 // 如果没有定义最大重定向次数, 则默认为5次最大重定向.
 #ifndef AVHTTP_MAX_REDIRECTS
 #define AVHTTP_MAX_REDIRECTS 5
@@ -56,6 +59,9 @@ namespace http_options {
 	static const std::string accept_encoding("Accept-Encoding");
 	static const std::string transfer_encoding("Transfer-Encoding");
 	static const std::string content_encoding("Content-Encoding");
+	static const std::string etag("ETag");
+	static const std::string last_modified("Last-Modified");
+	static const std::string if_range("If-Range");
 
 } // namespace http_options
 
@@ -252,10 +258,18 @@ struct proxy_settings
 
 // 一些默认的值.
 static const int default_request_piece_num = 10;
+static const int default_request_duration = 4;
+static const int default_max_ranges = 16;
+static const int default_sync_interval = 0;
+static const int default_write_cache_size = 8 * 1024 * 1024;
+static const int default_write_block_size = 256 * 1024;
 static const int default_time_out = 11;
 static const int default_connections_limit = 5;
 static const int default_buffer_size = 1024;
 
+// 流式处理的回调, 参数为数据在文件中的位置, 数据及大小, 大小为0表示文件结束.
+typedef boost::function<void (boost::int64_t, const char*, std::size_t)> stream_handler_type;
+
 // multi_download下载设置.
 
 struct settings
@@ -266,10 +280,23 @@ struct settings
 		, piece_size(-1)
 		, time_out(default_time_out)
 		, request_piece_num(default_request_piece_num)
+		, request_duration(default_request_duration)
+		, max_ranges(default_max_ranges)
+		, read_ahead(-1)
+		, resume_store(NULL)
 		, allow_use_meta_url(true)
 		, disable_multi_download(false)
+		, hash_piece_size(-1)
+		, file_digest(false)
+		, hash_threads(1)
+		, sync_interval(default_sync_interval)
+		, write_cache_size(default_write_cache_size)
+		, zero_copy(false)
+		, stream_window(0)
+		, stream_prefer_prefix(false)
 		, check_certificate(true)
 		, storage(NULL)
+		, async_storage(NULL)
 	{}
 
 	// 下载速率限制, -1为无限制, 单位为: byte/s.
@@ -284,12 +311,31 @@ struct settings
 	// 超时断开, 默认为11秒.
 	int time_out;
 
-	// 每次请求的分片数, 默认为10.
+	// 每次请求的分片数, 默认为10, 启用request_duration时只用于每个连接的第一次请求.
 	int request_piece_num;
 
+	// 每次请求的目标持续时间, 默认为4秒. 每个连接根据自己的下载速率和往返时间
+	// 调整请求的大小, 使快的连接不会频繁的发起请求, 慢的连接也不会占用一个很大
+	// 的区间迟迟不能完成. 请求大小与分片大小无关, 分片大小只用于位图和meta文件.
+	// 为0时每次请求固定为request_piece_num个分片.
+	int request_duration;
+
+	// 一次请求最多包含的区间数, 默认为16. 续传或者差分下载后剩下很多小的空隙时,
+	// 一次请求多个空隙(Range: bytes=a-b,c-d), 减少请求次数. 服务器不支持时自动
+	// 改为每次请求一个区间, 为1时禁用.
+	int max_ranges;
+
+	// 预读大小, 读取数据(fetch_data/async_fetch)时, 读取位置之后read_ahead字节内
+	// 的数据将优先按顺序下载, -1为默认, 即piece_size * request_piece_num.
+	int read_ahead;
+
 	// meta_file路径, 默认为当前路径下同文件名的.meta文件.
 	fs::path meta_file;
 
+	// 多个下载共用的续传数据存储, 不为空时续传数据以meta_file为key保存在其中,
+	// 不再创建单独的meta文件. 由用户负责打开, 并保证生命期长于使用它的下载.
+	meta_store* resume_store;
+
 	// 允许使用meta中保存的url, 默认为允许. 针对一些变动的url, 我们应该禁用.
 	bool allow_use_meta_url;
 
@@ -304,12 +350,84 @@ struct settings
 	// 下载文件路径, 默认为当前目录.
 	fs::path save_path;
 
+	// 每个校验分片的sha1(20字节二进制), 每下载完成一个分片即在校验线程中校验,
+	// 校验失败的分片将被重新下载. 为空时不校验.
+	std::vector<std::string> piece_hashes;
+
+	// 校验分片的大小, 使用piece_hashes时必须指定.
+	int hash_piece_size;
+
+	// 校验清单文件, bencode编码的字典, 包含"piece length"和"pieces"(所有分片的
+	// sha1连接在一起), piece_hashes为空时从这个文件加载.
+	fs::path hash_manifest;
+
+	// 是否在下载过程中计算整个文件的sha1, 通过multi_download::file_digest获得.
+	bool file_digest;
+
+	// 差分下载的控制文件, 由delta_control::create生成, 与seed_file一起使用.
+	fs::path delta_control_file;
+
+	// 差分下载使用的旧版本本地文件, 不能是下载保存的文件. 开始下载时先从这个文件
+	// 中复制与新版本相同的块, 只有变化的部分才从服务器下载. async_start在校验线程
+	// 中扫描这个文件, 复制完成后才开始下载并回调handler.
+	fs::path seed_file;
+
+	// 校验线程数.
+	int hash_threads;
+
+	// 同步数据到磁盘的间隔(秒), 默认为0, 即不同步, 下载的区间直接写入meta文件.
+	// 大于0时下载的区间只有在数据同步到磁盘之后才写入meta文件, 这样意外断电后续传
+	// 不会信任还没有写入磁盘的数据. 同步在单独的线程中执行, 不会阻塞下载, 每次同步
+	// 都使用fdatasync, linux下两次同步之间用sync_file_range提前发起写回.
+	int sync_interval;
+
+	// 写缓存大小, 默认为8MB. 每个连接接收的数据先累计成按default_write_block_size
+	// 对齐的块, 再交给存储异步写入, 磁盘慢时不会阻塞网络读取. 交给存储但还没有
+	// 写入的数据超过write_cache_size时, 连接暂停读取, 直到写入一半后再继续. 为0时
+	// 不在连接中累计, 每次收到的数据直接交给存储异步写入, 有数据正在写入时连接暂停
+	// 读取. 定义AVHTTP_DISABLE_THREAD时总是为0.
+	int write_cache_size;
+
+	// 零拷贝接收, 默认为禁用. 启用后在linux下, 对于没有使用ssl, gzip和chunked编码的
+	// 响应, 通过splice把数据从socket经管道直接写入文件, 不再复制到用户态的缓冲, 同时
+	// 不经过写缓存. 存储不支持(storage_interface::native_handle返回-1), multipart响应
+	// 或者splice失败时自动改为普通的读取. 注意管道到文件的splice是在连接的io线程中
+	// 同步执行的, 磁盘慢时会阻塞这个线程上的其它连接.
+	bool zero_copy;
+
+	// 流式处理, 默认为空. 文件大小已知时, 在单独的线程中按顺序把已经下载完成的前缀
+	// 交给这个回调, 每次最多default_write_block_size字节, 以便在下载的同时解压, 校验
+	// 或者转发数据; 启用分片校验时只交出通过校验的分片. 整个文件交出后以大小为0
+	// 调用一次, 之后wait_for_complete才返回. 回调阻塞时后面的数据留在存储中, 由下一次
+	// 调用交出. 续传时从文件头开始交出, 启动时文件已经下载完成也同样从文件头开始交出.
+	stream_handler_type stream_handler;
+
+	// 流式处理的窗口大小, 默认为0, 即不限制. 大于0时, 连接读取的位置领先已经交给
+	// stream_handler的位置超过这个大小后暂停读取, 流式处理跟上后再继续, 同时总是
+	// 优先分配前缀的区间.
+	int stream_window;
+
+	// 启用stream_handler时优先分配前缀的区间, 默认为禁用. 与async_fetch的预读相同,
+	// 还没有交出的位置之后read_ahead字节内的数据将优先按顺序下载.
+	bool stream_prefer_prefix;
+
 	// 设置是否检查证书, 默认检查证书.
 	bool check_certificate;
 
-	// 存储接口创建函数指针, 默认为multi_download提供的file.hpp实现.
+	// 存储接口创建函数, 默认为multi_download提供的file.hpp实现. multi_download通过
+	// storage_adapter在后台线程中使用它.
 	storage_constructor_type storage;
 
+	// 异步存储接口创建函数, 设置后不使用storage. 写缓存中的数据通过async_write
+	// 交给存储, 不再经过multi_download的后台写入线程. 例如uring_async_storage_constructor
+	// 把读写直接提交到io_uring中.
+	// 下载数据的写入和async_fetch的读取都通过async_write/async_read完成, 不会在
+	// io线程中等待磁盘. 仍然使用同步read/write的有: fetch和fetch_view在调用者的
+	// 线程中读取; 分片校验, 文件摘要和差分下载的复制在校验线程中读写; stream_handler
+	// 在流式处理线程中读取; 以及zero_copy的splice. 定义AVHTTP_DISABLE_THREAD时校验
+	// 线程即为multi_download的io_service.
+	async_storage_constructor_type async_storage;
+
 	// 请求选项.
 	request_opts opts;
 
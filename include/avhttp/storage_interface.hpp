@@ -15,9 +15,15 @@
 # pragma once
 #endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
 
+#include <vector>
+
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
 
 namespace avhttp {
 
@@ -68,10 +74,162 @@ struct storage_interface
 	// 判断是否文件结束.
 	// 返回值true表示文件结束.
 	virtual bool eof() = 0;
+
+	// 将已经写入的数据同步到磁盘.
+	// @返回值true表示同步成功.
+	// 备注: multi_download在单独的线程中定期调用sync, 可能与write同时执行,
+	// 只有同步成功后, 之前写入的数据才会被记录到meta文件中用于续传.
+	virtual bool sync() { return true; }
+
+	// 设置文件大小.
+	// @param size是文件大小.
+	// @param ec在出错时保存了详细的错误信息.
+	// 备注: multi_download在文件大小已知时, 于open之后调用, 存储可以据此预分配或映射文件.
+	virtual void allocate(boost::int64_t /*size*/, boost::system::error_code& /*ec*/) {}
+
+	// 查找offset之后的第一个文件空洞(从未写入过数据的区域).
+	// @param offset是开始查找的位置.
+	// @param left返回空洞的起始位置.
+	// @param right返回空洞的结束位置(不包含), -1表示空洞一直到文件尾之后.
+	// @返回值false表示不支持查找.
+	// 备注: multi_download在续传时用它核对meta中记录的已下载区间, 落在空洞中的区间
+	// 将被重新下载.
+	virtual bool find_hole(boost::int64_t /*offset*/, boost::int64_t& /*left*/, boost::int64_t& /*right*/)
+	{
+		return false;
+	}
+
+	// 返回存储所写入文件的描述符.
+	// @返回值-1表示不支持, 数据只能通过write写入.
+	// 备注: 启用settings::zero_copy时, multi_download在linux下通过splice把数据从socket
+	// 直接写入这个描述符, 之后通过read读取时必须能读到这些数据, 所以自己缓存了数据的
+	// 存储不应返回描述符.
+	virtual int native_handle()
+	{
+		return -1;
+	}
+
+	// 返回已写入数据的只读视图, 不复制数据.
+	// @param offset是视图的起始位置.
+	// @param size是视图的最大长度.
+	// @param length返回视图的实际长度, 可能小于size.
+	// @返回值为指向数据的指针, 持有期间数据保持有效; 返回空表示不支持, 应改用read读取.
+	virtual boost::shared_ptr<const char> view(boost::int64_t /*offset*/,
+		std::size_t /*size*/, std::size_t& length)
+	{
+		length = 0;
+		return boost::shared_ptr<const char>();
+	}
+};
+
+// storage_interface的创建函数, 在multi_download内部通过调用它来完成创建storage_interface.
+// 可以是函数指针, 也可以是boost::bind绑定了参数的函数对象, 以便创建时携带状态.
+typedef boost::function<storage_interface* ()> storage_constructor_type;
+
+// 打开存储时的提示信息.
+struct storage_hints
+{
+	storage_hints()
+		: size(-1)
+		, io_service(NULL)
+	{}
+
+	// 文件大小, -1表示未知. 大小已知时multi_download仍会在open之后调用allocate.
+	boost::int64_t size;
+
+	// 下载所在的io_service, 存储可以用它完成异步操作, 也可以使用自己的线程.
+	boost::asio::io_service* io_service;
+};
+
+// 异步数据存储接口.
+// 与storage_interface不同, 写入和读取以缓冲序列为单位, 通过回调通知完成, 不阻塞调用者.
+// 同一个存储上的异步写入按发起的顺序完成, 回调可能在任意线程中执行, 但不会在发起操作
+// 的函数返回之前执行. 回调完成时数据已经可以通过read读取, 但不一定已经写入磁盘,
+// 需要async_sync或sync之后才能保证. 各函数可能在不同的线程中同时调用, 存储需要自己加锁.
+// 为了兼容已有的实现, storage_interface可以通过storage_adapter(async_storage.hpp)使用.
+struct async_storage_interface
+{
+	typedef std::vector<boost::asio::const_buffer> const_buffers_type;
+	typedef std::vector<boost::asio::mutable_buffer> mutable_buffers_type;
+
+	// 读写完成的回调, 参数为错误码及实际读写的字节数.
+	typedef boost::function<void (const boost::system::error_code&, std::size_t)> io_handler_type;
+
+	// flush和sync完成的回调.
+	typedef boost::function<void (const boost::system::error_code&)> completion_handler_type;
+
+	async_storage_interface() {}
+	virtual ~async_storage_interface() {}
+
+	// 存储组件初始化.
+	// @param file_path指定了文件名路径信息.
+	// @param hints是文件大小等提示信息.
+	// @param ec在出错时保存了详细的错误信息.
+	virtual void open(const fs::path& file_path, const storage_hints& hints,
+		boost::system::error_code& ec) = 0;
+
+	// 关闭存储组件, 之前发起的异步操作仍会完成.
+	virtual void close() = 0;
+
+	// 异步写入数据.
+	// @param offset是写入的偏移位置, 缓冲序列依次写入连续的位置.
+	// @param buffers是需要写入的缓冲序列, 回调之前必须保持有效.
+	// @param handler在写入完成后调用, 写入的字节数小于缓冲大小时ec中保存了错误信息.
+	virtual void async_write(boost::int64_t offset, const const_buffers_type& buffers,
+		io_handler_type handler) = 0;
+
+	// 异步读取数据.
+	// @param offset是读取的偏移位置.
+	// @param buffers是保存数据的缓冲序列, 回调之前必须保持有效.
+	// @param handler在读取完成后调用, 读到文件尾时读取的字节数可能小于缓冲大小.
+	virtual void async_read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		io_handler_type handler) = 0;
+
+	// 等待之前发起的所有异步写入完成后调用handler.
+	virtual void async_flush(completion_handler_type handler) = 0;
+
+	// 等待之前发起的所有异步写入完成, 并同步到磁盘后调用handler.
+	virtual void async_sync(completion_handler_type handler) = 0;
+
+	// 同步写入数据, 在调用者的线程中完成.
+	// @返回值为实际写入的字节数, 小于缓冲大小时ec中保存了错误信息.
+	virtual std::size_t write(boost::int64_t offset, const const_buffers_type& buffers,
+		boost::system::error_code& ec) = 0;
+
+	// 同步读取数据, 在调用者的线程中完成. 用于校验和按需读取等必须立即得到数据的地方.
+	// @返回值为实际读取的字节数.
+	virtual std::size_t read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		boost::system::error_code& ec) = 0;
+
+	// 同步地将已经写入的数据同步到磁盘, 可能与异步写入同时执行.
+	virtual void sync(boost::system::error_code& ec)
+	{
+		ec = boost::system::error_code();
+	}
+
+	// 以下与storage_interface中的同名函数相同.
+	virtual void allocate(boost::int64_t /*size*/, boost::system::error_code& /*ec*/) {}
+
+	virtual bool find_hole(boost::int64_t /*offset*/, boost::int64_t& /*left*/, boost::int64_t& /*right*/)
+	{
+		return false;
+	}
+
+	virtual int native_handle()
+	{
+		return -1;
+	}
+
+	virtual boost::shared_ptr<const char> view(boost::int64_t /*offset*/,
+		std::size_t /*size*/, std::size_t& length)
+	{
+		length = 0;
+		return boost::shared_ptr<const char>();
+	}
 };
 
-// 重定义storage_interface创建函数指针, 在multi_download内部通过调用它来完成创建storage_interface.
-typedef storage_interface* (*storage_constructor_type)();
+// async_storage_interface的创建函数.
+typedef boost::function<async_storage_interface* ()> async_storage_constructor_type;
 
 }
 
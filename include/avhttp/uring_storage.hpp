@@ -0,0 +1,567 @@
+﻿//
+// uring_storage.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2013 Jack (jack dot wgm at gmail dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// path LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AVHTTP_URING_STORAGE_HPP
+#define AVHTTP_URING_STORAGE_HPP
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+# pragma once
+#endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
+
+#include <set>
+#include <list>
+#include <boost/make_shared.hpp>
+#ifndef AVHTTP_DISABLE_THREAD
+#	include <boost/thread/condition.hpp>
+#endif
+
+#include "avhttp/default_storage.hpp"
+#include "avhttp/io_uring_service.hpp"
+#include "avhttp/async_storage.hpp"
+
+namespace avhttp {
+
+// 通过io_uring_service::shared()读写文件的存储, 所有使用它的下载共用一个ring.
+// io_uring不可用时(没有定义AVHTTP_ENABLE_IO_URING, 内核不支持或者被禁止),
+// 与default_storge相同, 直接读写文件.
+// @begin example
+//  avhttp::settings s;
+//  s.storage = avhttp::uring_storage_constructor;
+//  d.start(url, s);
+// @end example
+class uring_storage : public default_storge
+{
+public:
+	uring_storage()
+		: m_service(io_uring_service::shared())
+		, m_handle(-1)
+	{}
+
+	virtual ~uring_storage()
+	{
+		close();
+	}
+
+	// 存储组件初始化.
+	// @param file_path指定了文件名路径信息.
+	// @param ec在出错时保存了详细的错误信息.
+	virtual void open(const fs::path& file_path, boost::system::error_code& ec)
+	{
+		default_storge::open(file_path, ec);
+		if (!ec)
+		{
+			m_handle = m_service.register_file(m_file.native_handle());
+		}
+	}
+
+	// 关闭存储组件.
+	virtual void close()
+	{
+		if (m_handle != -1)
+		{
+			m_service.unregister_file(m_handle);
+			m_handle = -1;
+		}
+		default_storge::close();
+	}
+
+	// 写入数据.
+	// @param buf是需要写入的数据缓冲.
+	// @param offset是写入的偏移位置.
+	// @param size指定了写入的数据缓冲大小.
+	// @返回值为实际写入的字节数, 返回-1表示写入失败.
+	virtual std::streamsize write(const char* buf, boost::int64_t offset, int size)
+	{
+		if (m_handle == -1)
+		{
+			return default_storge::write(buf, offset, size);
+		}
+
+		boost::system::error_code ec;
+		return m_service.write(m_handle, offset, buf, size, ec);
+	}
+
+	// 读取数据.
+	// @param buf是需要读取的数据缓冲.
+	// @param offset是读取的偏移位置.
+	// @param size指定了读取的数据缓冲大小.
+	// @返回值为实际读取的字节数, 返回-1表示读取失败.
+	virtual std::streamsize read(char* buf, boost::int64_t offset, int size)
+	{
+		if (m_handle == -1)
+		{
+			return default_storge::read(buf, offset, size);
+		}
+
+		boost::system::error_code ec;
+		return m_service.read(m_handle, offset, buf, size, ec);
+	}
+
+	// 返回在ring中注册的文件句柄, -1表示直接读写文件.
+	int handle() const
+	{
+		return m_handle;
+	}
+
+protected:
+	io_uring_service& m_service;
+
+	// 在ring中注册的文件句柄, -1表示直接读写文件.
+	int m_handle;
+};
+
+// io_uring存储对象.
+inline storage_interface* uring_storage_constructor()
+{
+	return new uring_storage();
+}
+
+// 通过io_uring_service的异步接口读写文件的异步存储. 异步读写直接提交到ring中并发执行,
+// 不经过storage_adapter的后台线程. 异步操作的handler都投递到open时storage_hints::io_service
+// 指定的io_service, 没有指定时在任意线程中回调. 同步的read/write(分片校验, fetch等必须
+// 立即得到数据的地方), sync以及其它操作由storage_adapter包装的uring_storage完成. ring
+// 不可用, 没有指定io_service或者定义了AVHTTP_DISABLE_THREAD时, 异步操作也交给storage_adapter.
+// 备注: ring中的写入不一定按发起的顺序完成, 不能对同一区域发起重叠的异步写入,
+// async_flush和async_sync仍然等待之前发起的所有写入完成.
+// @begin example
+//  avhttp::settings s;
+//  s.async_storage = avhttp::uring_async_storage_constructor;
+//  d.start(url, s);
+// @end example
+class uring_async_storage
+	: public async_storage_interface
+	, public boost::noncopyable
+{
+	// 一次异步读写, 缓冲序列中的每个缓冲分别提交到ring中, 全部完成后回调.
+	struct io_request
+	{
+		io_request(bool write, const io_handler_type& h)
+			: is_write(write)
+			, seq(0)
+			, pending(0)
+			, handler(h)
+		{}
+
+		bool is_write;
+
+		// 写入的序号, 用于async_flush等待之前发起的写入.
+		boost::uint64_t seq;
+
+		// 还没有完成的缓冲数.
+		std::size_t pending;
+
+		// 每个缓冲的大小以及已经读写的字节数.
+		std::vector<std::size_t> sizes;
+		std::vector<std::size_t> done;
+
+		boost::system::error_code ec;
+		io_handler_type handler;
+	};
+	typedef boost::shared_ptr<io_request> io_request_ptr;
+
+	// 等待之前的写入完成后执行的操作.
+	typedef boost::function<void ()> flush_action;
+
+public:
+	uring_async_storage()
+		: m_storage(new uring_storage())
+		, m_adapter(m_storage)
+		, m_io_service(NULL)
+		, m_issued(0)
+		, m_inflight(0)
+	{}
+
+	virtual ~uring_async_storage()
+	{
+		close();
+	}
+
+	// 打开文件并注册到ring中.
+	virtual void open(const fs::path& file_path, const storage_hints& hints,
+		boost::system::error_code& ec)
+	{
+		m_adapter.open(file_path, hints, ec);
+		m_io_service = hints.io_service;
+#ifndef AVHTTP_DISABLE_THREAD
+		if (!ec && use_ring() && !m_pool)
+		{
+			// ring的完成事件在这个线程中记账, 再把handler投递到m_io_service,
+			// 这样close等待请求完成时不会阻塞m_io_service.
+			m_pool.reset(new io_service_pool(1));
+			m_pool->run();
+		}
+#endif
+	}
+
+	// 等待ring中的请求完成后关闭文件.
+	virtual void close()
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		boost::mutex::scoped_lock lock(m_mutex);
+		while (m_inflight != 0)
+		{
+			m_inflight_cond.wait(lock);
+		}
+		lock.unlock();
+#endif
+		m_adapter.close();
+	}
+
+	// 把缓冲序列中的每个缓冲分别提交到ring中写入.
+	virtual void async_write(boost::int64_t offset, const const_buffers_type& buffers,
+		io_handler_type handler)
+	{
+		if (!use_ring())
+		{
+			m_adapter.async_write(offset, buffers, wrap_io(handler));
+			return;
+		}
+
+#ifndef AVHTTP_DISABLE_THREAD
+		io_request_ptr req = boost::make_shared<io_request>(true, handler);
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			req->sizes.push_back(boost::asio::buffer_size(buffers[i]));
+		}
+		start_request(req);
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			submit(req, i, offset, const_cast<char*>(
+				boost::asio::buffer_cast<const char*>(buffers[i])), req->sizes[i]);
+			offset += req->sizes[i];
+		}
+#endif
+	}
+
+	// 把缓冲序列中的每个缓冲分别提交到ring中读取.
+	virtual void async_read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		io_handler_type handler)
+	{
+		if (!use_ring())
+		{
+			m_adapter.async_read(offset, buffers, wrap_io(handler));
+			return;
+		}
+
+#ifndef AVHTTP_DISABLE_THREAD
+		io_request_ptr req = boost::make_shared<io_request>(false, handler);
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			req->sizes.push_back(boost::asio::buffer_size(buffers[i]));
+		}
+		start_request(req);
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			submit(req, i, offset, boost::asio::buffer_cast<char*>(buffers[i]), req->sizes[i]);
+			offset += req->sizes[i];
+		}
+#endif
+	}
+
+	// 之前发起的写入完成后调用handler.
+	virtual void async_flush(completion_handler_type handler)
+	{
+		if (!use_ring())
+		{
+			m_adapter.async_flush(wrap_completion(handler));
+			return;
+		}
+
+#ifndef AVHTTP_DISABLE_THREAD
+		wait_writes(boost::bind(&uring_async_storage::post_completion,
+			this, handler, boost::system::error_code()));
+#endif
+	}
+
+	// 之前发起的写入完成后调用uring_storage的sync, 再调用handler.
+	virtual void async_sync(completion_handler_type handler)
+	{
+		if (!use_ring())
+		{
+			m_adapter.async_sync(wrap_completion(handler));
+			return;
+		}
+
+#ifndef AVHTTP_DISABLE_THREAD
+		// storage_adapter中没有其它操作, 它的async_sync会立即在后台线程中同步.
+		wait_writes(boost::bind(&storage_adapter::async_sync, &m_adapter, wrap_completion(handler)));
+#endif
+	}
+
+	// 同步读写在调用者的线程中通过ring完成.
+	virtual std::size_t write(boost::int64_t offset, const const_buffers_type& buffers,
+		boost::system::error_code& ec)
+	{
+		return m_adapter.write(offset, buffers, ec);
+	}
+
+	virtual std::size_t read(boost::int64_t offset, const mutable_buffers_type& buffers,
+		boost::system::error_code& ec)
+	{
+		return m_adapter.read(offset, buffers, ec);
+	}
+
+	// 以下转发给uring_storage.
+	virtual void sync(boost::system::error_code& ec)
+	{
+		m_adapter.sync(ec);
+	}
+
+	virtual void allocate(boost::int64_t size, boost::system::error_code& ec)
+	{
+		m_adapter.allocate(size, ec);
+	}
+
+	virtual bool find_hole(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right)
+	{
+		return m_adapter.find_hole(offset, left, right);
+	}
+
+	virtual int native_handle()
+	{
+		return m_adapter.native_handle();
+	}
+
+	virtual boost::shared_ptr<const char> view(boost::int64_t offset,
+		std::size_t size, std::size_t& length)
+	{
+		return m_adapter.view(offset, size, length);
+	}
+
+private:
+	// 是否通过ring完成异步读写.
+	bool use_ring() const
+	{
+#ifndef AVHTTP_DISABLE_THREAD
+		return m_io_service && m_storage->handle() != -1;
+#else
+		return false;
+#endif
+	}
+
+	// storage_adapter在它的线程中回调, 指定了io_service时转到io_service中回调.
+	io_handler_type wrap_io(const io_handler_type& handler)
+	{
+		if (!m_io_service)
+		{
+			return handler;
+		}
+		return boost::bind(&uring_async_storage::post_io, this, handler, _1, _2);
+	}
+
+	completion_handler_type wrap_completion(const completion_handler_type& handler)
+	{
+		if (!m_io_service)
+		{
+			return handler;
+		}
+		return boost::bind(&uring_async_storage::post_completion, this, handler, _1);
+	}
+
+	void post_io(io_handler_type handler, const boost::system::error_code& ec, std::size_t bytes)
+	{
+		m_io_service->post(boost::asio::detail::bind_handler(handler, ec, bytes));
+	}
+
+	void post_completion(completion_handler_type handler, const boost::system::error_code& ec)
+	{
+		m_io_service->post(boost::asio::detail::bind_handler(handler, ec));
+	}
+
+#ifndef AVHTTP_DISABLE_THREAD
+	void start_request(const io_request_ptr& req)
+	{
+		req->pending = req->sizes.size();
+		req->done.resize(req->sizes.size(), 0);
+
+		boost::mutex::scoped_lock lock(m_mutex);
+		m_inflight++;
+		if (req->is_write)
+		{
+			req->seq = m_issued++;
+			m_writes.insert(req->seq);
+		}
+
+		// 空的缓冲序列直接完成.
+		if (req->pending == 0)
+		{
+			lock.unlock();
+			finish(req);
+		}
+	}
+
+	void submit(const io_request_ptr& req, std::size_t index,
+		boost::int64_t offset, char* data, std::size_t size)
+	{
+		if (req->is_write)
+		{
+			io_uring_service::shared().async_write(m_storage->handle(), offset, data, size,
+				m_pool->get_io_service(), boost::bind(&uring_async_storage::handle_io,
+					this, req, index, offset, data, size, _1, _2));
+		}
+		else
+		{
+			io_uring_service::shared().async_read(m_storage->handle(), offset, data, size,
+				m_pool->get_io_service(), boost::bind(&uring_async_storage::handle_io,
+					this, req, index, offset, data, size, _1, _2));
+		}
+	}
+
+	// 在m_pool的线程中执行, 短读写时继续读写剩下的部分.
+	void handle_io(io_request_ptr req, std::size_t index, boost::int64_t offset,
+		char* data, std::size_t size, const boost::system::error_code& ec, std::size_t bytes)
+	{
+		if (ec == boost::asio::error::interrupted || ec == boost::asio::error::try_again)
+		{
+			submit(req, index, offset, data, size);
+			return;
+		}
+
+		boost::system::error_code err = ec;
+		if (!err)
+		{
+			req->done[index] += bytes;
+			if (bytes != 0 && bytes < size)
+			{
+				submit(req, index, offset + bytes, data + bytes, size - bytes);
+				return;
+			}
+
+			// 写入0字节说明无法继续写入, 读取0字节为文件结束.
+			if (bytes == 0 && req->is_write && size != 0)
+			{
+				err = boost::system::errc::make_error_code(boost::system::errc::io_error);
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (err && !req->ec)
+			{
+				req->ec = err;
+			}
+			if (--req->pending != 0)
+			{
+				return;
+			}
+		}
+
+		finish(req);
+	}
+
+	// 所有缓冲都完成后回调, 读写的字节数为从头开始连续完成的部分.
+	void finish(const io_request_ptr& req)
+	{
+		std::size_t bytes = 0;
+		for (std::size_t i = 0; i < req->sizes.size(); i++)
+		{
+			bytes += req->done[i];
+			if (req->done[i] < req->sizes[i])
+			{
+				break;
+			}
+		}
+		m_io_service->post(boost::asio::detail::bind_handler(req->handler, req->ec, bytes));
+
+		std::vector<flush_action> ready;
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (req->is_write)
+			{
+				m_writes.erase(req->seq);
+				ready_flush(ready);
+			}
+			m_inflight--;
+			if (m_inflight == 0)
+			{
+				m_inflight_cond.notify_all();
+			}
+		}
+
+		for (std::size_t i = 0; i < ready.size(); i++)
+		{
+			ready[i]();
+		}
+	}
+
+	// 之前发起的写入都完成后执行action.
+	void wait_writes(const flush_action& action)
+	{
+		{
+			boost::mutex::scoped_lock lock(m_mutex);
+			if (!m_writes.empty())
+			{
+				m_flush_waiters.push_back(std::make_pair(m_issued, action));
+				return;
+			}
+		}
+		action();
+	}
+
+	// 取出序号之前的写入都已经完成的等待者, 调用者必须已经锁定m_mutex.
+	void ready_flush(std::vector<flush_action>& ready)
+	{
+		boost::uint64_t lowest = m_writes.empty() ? m_issued : *m_writes.begin();
+		std::list<std::pair<boost::uint64_t, flush_action> >::iterator i = m_flush_waiters.begin();
+		while (i != m_flush_waiters.end())
+		{
+			if (i->first <= lowest)
+			{
+				ready.push_back(i->second);
+				i = m_flush_waiters.erase(i);
+				continue;
+			}
+			++i;
+		}
+	}
+#endif
+
+private:
+	// 打开文件并完成同步读写的存储, 由m_adapter负责删除.
+	uring_storage* m_storage;
+	storage_adapter m_adapter;
+
+	// open时指定的io_service, 异步读写的handler在这里执行.
+	boost::asio::io_service* m_io_service;
+
+	// 已经发起的写入数.
+	boost::uint64_t m_issued;
+
+	// 还没有完成的写入的序号.
+	std::set<boost::uint64_t> m_writes;
+
+	// 等待写入完成的async_flush和async_sync.
+	std::list<std::pair<boost::uint64_t, flush_action> > m_flush_waiters;
+
+	// 提交到ring中还没有完成的请求数.
+	int m_inflight;
+
+#ifndef AVHTTP_DISABLE_THREAD
+	// 保护上面的成员.
+	boost::mutex m_mutex;
+
+	// 请求全部完成时通知close.
+	boost::condition m_inflight_cond;
+
+	// 收取ring完成事件的线程.
+	// 备注: 必须最后定义, 保证先于其它成员析构.
+	boost::scoped_ptr<io_service_pool> m_pool;
+#endif
+};
+
+// io_uring异步存储对象.
+inline async_storage_interface* uring_async_storage_constructor()
+{
+	return new uring_async_storage();
+}
+
+} // namespace avhttp
+
+#endif // AVHTTP_URING_STORAGE_HPP
@@ -0,0 +1,121 @@
+﻿#include <vector>
+#include <cstring>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+// 记录异步操作的完成顺序, 并等待最后一个操作完成.
+struct completion_log
+{
+	completion_log()
+		: done(false)
+	{}
+
+	void on_io(int id, const boost::system::error_code& ec, std::size_t bytes)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		BOOST_ASSERT(!ec);
+		order.push_back(id);
+		transferred.push_back(bytes);
+	}
+
+	void on_complete(const boost::system::error_code& ec)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		BOOST_ASSERT(!ec);
+		done = true;
+		cond.notify_all();
+	}
+
+	void wait()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		while (!done)
+		{
+			cond.wait(lock);
+		}
+		done = false;
+	}
+
+	std::vector<int> order;
+	std::vector<std::size_t> transferred;
+	bool done;
+	boost::mutex mutex;
+	boost::condition cond;
+};
+
+// 带参数的创建函数, 通过boost::bind作为storage_constructor_type使用.
+avhttp::storage_interface* create_memory_storage(std::size_t chunk_size)
+{
+	return new avhttp::memory_storage(chunk_size);
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	std::vector<char> expected(50000);
+	for (std::size_t i = 0; i < expected.size(); i++)
+	{
+		expected[i] = static_cast<char>((i * 7 + 3) & 0xff);
+	}
+
+	avhttp::storage_constructor_type constructor = boost::bind(&create_memory_storage, 4096);
+	boost::scoped_ptr<avhttp::async_storage_interface> storage(
+		avhttp::make_storage_adapter(constructor));
+
+	avhttp::storage_hints hints;
+	hints.size = expected.size();
+	storage->open("memory", hints, ec);
+	BOOST_ASSERT(!ec);
+	storage->allocate(hints.size, ec);
+	BOOST_ASSERT(!ec);
+
+	// 每次写入两个缓冲, 跨越块的边界, 写入按发起的顺序完成.
+	completion_log log;
+	const std::size_t piece = 10000;
+	for (std::size_t offset = 0; offset < expected.size(); offset += piece)
+	{
+		avhttp::async_storage_interface::const_buffers_type buffers;
+		buffers.push_back(boost::asio::buffer(&expected[offset], 3000));
+		buffers.push_back(boost::asio::buffer(&expected[offset + 3000], piece - 3000));
+		storage->async_write(offset, buffers, boost::bind(&completion_log::on_io,
+			&log, static_cast<int>(offset / piece), _1, _2));
+	}
+	storage->async_flush(boost::bind(&completion_log::on_complete, &log, _1));
+	log.wait();
+
+	BOOST_ASSERT(log.order.size() == expected.size() / piece);
+	for (std::size_t i = 0; i < log.order.size(); i++)
+	{
+		BOOST_ASSERT(log.order[i] == static_cast<int>(i));
+		BOOST_ASSERT(log.transferred[i] == piece);
+	}
+
+	// flush之后同步读取可以读到所有数据.
+	std::vector<char> data(expected.size());
+	avhttp::async_storage_interface::mutable_buffers_type buffers;
+	buffers.push_back(boost::asio::buffer(&data[0], 123));
+	buffers.push_back(boost::asio::buffer(&data[123], data.size() - 123));
+	BOOST_ASSERT(storage->read(0, buffers, ec) == data.size() && !ec);
+	BOOST_ASSERT(data == expected);
+
+	// 异步读取, 读到数据末尾时返回实际的字节数.
+	std::vector<char> tail(1000);
+	storage->async_read(expected.size() - 100,
+		avhttp::async_storage_interface::mutable_buffers_type(1, boost::asio::buffer(tail)),
+		boost::bind(&completion_log::on_io, &log, -1, _1, _2));
+	storage->async_sync(boost::bind(&completion_log::on_complete, &log, _1));
+	log.wait();
+	BOOST_ASSERT(log.order.back() == -1 && log.transferred.back() == 100);
+	BOOST_ASSERT(std::memcmp(&tail[0], &expected[expected.size() - 100], 100) == 0);
+
+	// 同步写入, 视图转发给原存储.
+	char c = 'x';
+	BOOST_ASSERT(storage->write(5, avhttp::async_storage_interface::const_buffers_type(
+		1, boost::asio::buffer(&c, 1)), ec) == 1 && !ec);
+	std::size_t length = 0;
+	boost::shared_ptr<const char> view = storage->view(5, 1, length);
+	BOOST_ASSERT(view && length == 1 && *view == 'x');
+
+	storage->close();
+	return 0;
+}
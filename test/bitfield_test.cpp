@@ -0,0 +1,109 @@
+﻿#include <vector>
+#include <cstdlib>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+// 与std::vector<bool>对照, 检查bitfield的结果.
+void check(const avhttp::bitfield& bf, const std::vector<bool>& bits)
+{
+	BOOST_ASSERT(bf.size() == bits.size());
+
+	boost::int64_t count = 0;
+	for (std::size_t i = 0; i < bits.size(); i++)
+	{
+		BOOST_ASSERT(bf.get_bit(i) == bits[i]);
+		count += bits[i] ? 1 : 0;
+	}
+	BOOST_ASSERT(bf.count() == count);
+	BOOST_ASSERT(bf.all_set() == (count == static_cast<boost::int64_t>(bits.size())));
+
+	for (int n = 0; n < 20 && !bits.empty(); n++)
+	{
+		boost::int64_t from = std::rand() % bits.size();
+		boost::int64_t set = -1;
+		boost::int64_t clear = -1;
+		for (std::size_t i = from; i < bits.size(); i++)
+		{
+			if (set == -1 && bits[i])
+				set = i;
+			if (clear == -1 && !bits[i])
+				clear = i;
+		}
+		BOOST_ASSERT(bf.find_first_set(from) == set);
+		BOOST_ASSERT(bf.find_first_clear(from) == clear);
+	}
+
+	// 末尾不足一个字节的位保持为0, 保存到meta中的数据才是确定的.
+	if (bits.size() % 8)
+		BOOST_ASSERT((bf.bytes()[bf.bytes_size() - 1] & (0xff >> (bits.size() % 8))) == 0);
+}
+
+int main(int argc, char* argv[])
+{
+	// 位的顺序与meta文件中保存的格式一致, 高位在前.
+	{
+		avhttp::bitfield bf(12);
+		bf.clear_all();
+		bf.set_bit(0);
+		bf.set_bit(9);
+		BOOST_ASSERT(bf.bytes_size() == 2);
+		BOOST_ASSERT(static_cast<unsigned char>(bf.bytes()[0]) == 0x80);
+		BOOST_ASSERT(static_cast<unsigned char>(bf.bytes()[1]) == 0x40);
+
+		avhttp::bitfield copy(bf.bytes(), 12);
+		BOOST_ASSERT(copy.get_bit(0) && copy.get_bit(9) && copy.count() == 2);
+
+		avhttp::bitfield empty;
+		BOOST_ASSERT(empty.find_first_set() == -1 && empty.find_first_clear() == -1);
+		BOOST_ASSERT(empty.count() == 0 && empty.all_set());
+	}
+
+	// 随机的区间操作.
+	std::srand(1);
+	for (int round = 0; round < 50; round++)
+	{
+		std::size_t size = std::rand() % 1000;
+		avhttp::bitfield bf(size, false);
+		std::vector<bool> bits(size, false);
+		check(bf, bits);
+
+		for (int n = 0; n < 100 && size != 0; n++)
+		{
+			boost::int64_t first = std::rand() % size;
+			boost::int64_t last = first + std::rand() % (size - first + 1);
+			bool val = std::rand() % 2 == 0;
+			if (val)
+				bf.set_range(first, last);
+			else
+				bf.clear_range(first, last);
+			for (boost::int64_t i = first; i < last; i++)
+				bits[i] = val;
+			check(bf, bits);
+		}
+
+		// 扩大时新的位按指定的值填充.
+		std::size_t grow = size + std::rand() % 100;
+		bf.resize(grow, true);
+		bits.resize(grow, true);
+		check(bf, bits);
+	}
+
+	// 按分片转换rangefield, 最后一个分片不足piece_size.
+	{
+		avhttp::rangefield rf(1000);
+		rf.update(0, 250);
+		rf.update(300, 1000);
+		avhttp::bitfield bf;
+		rf.range_to_bitfield(bf, 100);
+		BOOST_ASSERT(bf.size() == 10 && bf.count() == 9 && !bf.get_bit(2));
+
+		avhttp::rangefield rf2(950);
+		rf2.update(900, 950);
+		rf2.range_to_bitfield(bf, 100);
+		BOOST_ASSERT(bf.size() == 10 && bf.count() == 1 && bf.get_bit(9));
+		rf2.bitfield_to_range(bf, 100);
+		BOOST_ASSERT(rf2.range_size() == 50 && rf2.check_range(900, 950));
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+﻿#include <string>
+#include <vector>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+using avhttp::detail::byteranges_parser;
+
+// 每次输入step字节, 把解析出的数据写入file, 返回最后的解析结果.
+byteranges_parser::result parse(const std::string& body, std::size_t step, std::string& file)
+{
+	byteranges_parser parser;
+	parser.reset("THIS_STRING_SEPARATES");
+
+	byteranges_parser::result result = byteranges_parser::need_more;
+	for (std::size_t pos = 0; pos < body.size(); pos += step)
+	{
+		const char* data = body.data() + pos;
+		std::size_t size = (std::min)(step, body.size() - pos);
+		boost::int64_t offset;
+		const char* part;
+		std::size_t part_size;
+		while ((result = parser.parse(data, size, offset, part, part_size))
+			== byteranges_parser::body_part)
+		{
+			BOOST_ASSERT(offset + part_size <= file.size());
+			file.replace(static_cast<std::size_t>(offset), part_size, part, part_size);
+		}
+		if (result == byteranges_parser::failed)
+		{
+			return result;
+		}
+		BOOST_ASSERT(size == 0);
+	}
+	BOOST_ASSERT(parser.is_finished() == (result == byteranges_parser::finished));
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	BOOST_ASSERT(byteranges_parser::boundary(
+		"multipart/byteranges; boundary=THIS_STRING_SEPARATES") == "THIS_STRING_SEPARATES");
+	BOOST_ASSERT(byteranges_parser::boundary(
+		"Multipart/ByteRanges; boundary=\"abc\"; charset=x") == "abc");
+	BOOST_ASSERT(byteranges_parser::boundary("application/octet-stream").empty());
+	BOOST_ASSERT(byteranges_parser::boundary("multipart/byteranges").empty());
+
+	// RFC 7233中的例子, 数据中包含分隔符也不影响解析.
+	std::string body =
+		"\r\n--THIS_STRING_SEPARATES\r\n"
+		"Content-Type: application/pdf\r\n"
+		"Content-Range: bytes 5-9/20\r\n"
+		"\r\n"
+		"--THI\r\n"
+		"--THIS_STRING_SEPARATES\r\n"
+		"content-range:bytes 14-17/20\r\n"
+		"\r\n"
+		"wxyz\r\n"
+		"--THIS_STRING_SEPARATES--\r\n";
+
+	for (std::size_t step = 1; step <= body.size(); step++)
+	{
+		std::string file(20, '.');
+		BOOST_ASSERT(parse(body, step, file) == byteranges_parser::finished);
+		BOOST_ASSERT(file == ".....--THI....wxyz..");
+	}
+
+	// 没有结束分隔符时需要更多数据.
+	std::string file(20, '.');
+	BOOST_ASSERT(parse(body.substr(0, body.size() - 10), 7, file) == byteranges_parser::need_more);
+
+	// 缺少Content-Range.
+	std::string bad =
+		"--THIS_STRING_SEPARATES\r\n"
+		"Content-Type: application/pdf\r\n"
+		"\r\n"
+		"abc";
+	BOOST_ASSERT(parse(bad, 3, file) == byteranges_parser::failed);
+
+	// 区间无效.
+	bad =
+		"--THIS_STRING_SEPARATES\r\n"
+		"Content-Range: bytes 9-5/20\r\n"
+		"\r\n";
+	BOOST_ASSERT(parse(bad, 64, file) == byteranges_parser::failed);
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+﻿#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/assert.hpp>
+#include <boost/bind.hpp>
+#include "avhttp.hpp"
+
+void write_file(const std::string& name, const std::string& data)
+{
+	boost::filesystem::ofstream f(name, std::ios::out | std::ios::binary | std::ios::trunc);
+	f.write(data.c_str(), data.size());
+}
+
+// 将找到的块复制到输出中.
+void copy_block(std::string& output, std::vector<bool>& copied, int block_size,
+	boost::int64_t offset, const char* data, std::size_t size)
+{
+	BOOST_ASSERT(!copied[offset / block_size]);
+	copied[offset / block_size] = true;
+	output.replace(static_cast<std::size_t>(offset), size, data, size);
+}
+
+int main(int argc, char* argv[])
+{
+	const int block_size = 1024;
+
+	// 新版本的文件, 最后一个块不足block_size.
+	std::string data;
+	std::srand(1);
+	for (int i = 0; i < 200 * block_size + 100; i++)
+	{
+		data += static_cast<char>(std::rand());
+	}
+
+	// 旧版本的文件: 开头插入一些数据, 中间修改一个块, 删除一个块.
+	std::string seed = "inserted" + data;
+	seed[8 + 50 * block_size + 7] ^= 0xff;
+	seed.erase(120 * block_size + 8, block_size);
+
+	write_file("delta_new.bin", data);
+	write_file("delta_seed.bin", seed);
+
+	boost::system::error_code ec;
+	avhttp::delta_control control;
+	control.create("delta_new.bin", block_size, ec);
+	BOOST_ASSERT(!ec);
+	BOOST_ASSERT(control.block_num() == 201 && control.length() == static_cast<boost::int64_t>(data.size()));
+
+	control.save("delta_new.bin.delta", ec);
+	BOOST_ASSERT(!ec);
+
+	avhttp::delta_control loaded;
+	loaded.load("delta_new.bin.delta", ec);
+	BOOST_ASSERT(!ec);
+	BOOST_ASSERT(loaded.block_size() == block_size && loaded.block_num() == 201);
+
+	std::string output(data.size(), '\0');
+	std::vector<bool> copied(loaded.block_num(), false);
+	loaded.match("delta_seed.bin",
+		boost::bind(&copy_block, boost::ref(output), boost::ref(copied), block_size, _1, _2, _3), ec);
+	BOOST_ASSERT(!ec);
+
+	// 只有修改和删除的两个块找不到.
+	int missing = 0;
+	for (int i = 0; i < loaded.block_num(); i++)
+	{
+		if (!copied[i])
+		{
+			missing++;
+			continue;
+		}
+		BOOST_ASSERT(output.compare(i * block_size, block_size, data, i * block_size, block_size) == 0);
+	}
+	BOOST_ASSERT(missing == 2 && !copied[50] && !copied[120] && copied[200]);
+
+	// 损坏的控制文件.
+	write_file("delta_bad.delta", "d10:block sizei1024e6:lengthi5000e9:checksums3:abce");
+	loaded.load("delta_bad.delta", ec);
+	BOOST_ASSERT(ec == avhttp::errc::invalid_delta_control);
+
+	boost::filesystem::remove("delta_new.bin");
+	boost::filesystem::remove("delta_seed.bin");
+	boost::filesystem::remove("delta_new.bin.delta");
+	boost::filesystem::remove("delta_bad.delta");
+
+	return 0;
+}
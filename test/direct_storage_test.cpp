@@ -0,0 +1,91 @@
+﻿#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+static const std::string file_name = "direct_storage_test.tmp";
+
+void fill(std::vector<char>& data, int seed)
+{
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<char>((i * 11 + seed) & 0xff);
+	}
+}
+
+// 以不对齐的位置和大小乱序写入整个文件, 写入过程中读取已经写入的数据.
+void write_shuffled(avhttp::direct_storage& storage, const std::vector<char>& expected)
+{
+	const int chunk = 10007;
+	std::vector<int> offsets;
+	for (int offset = 0; offset < static_cast<int>(expected.size()); offset += chunk)
+	{
+		offsets.push_back(offset);
+	}
+	std::srand(1);
+	std::random_shuffle(offsets.begin(), offsets.end());
+
+	std::vector<char> data(chunk);
+	for (std::size_t i = 0; i < offsets.size(); i++)
+	{
+		int bytes = (std::min)(chunk, static_cast<int>(expected.size()) - offsets[i]);
+		BOOST_ASSERT(storage.write(&expected[offsets[i]], offsets[i], bytes) == bytes);
+		BOOST_ASSERT(storage.read(&data[0], offsets[i], bytes) == bytes);
+		BOOST_ASSERT(std::equal(data.begin(), data.begin() + bytes, expected.begin() + offsets[i]));
+
+		// 中途同步, 未写满的块需要读出合并后写回.
+		if (i == offsets.size() / 2)
+		{
+			BOOST_ASSERT(storage.sync());
+		}
+	}
+}
+
+void check_file(const std::vector<char>& expected)
+{
+	std::ifstream in(file_name.c_str(), std::ios::binary);
+	std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	BOOST_ASSERT(data == expected);
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	std::vector<char> expected(1000 * 1000 + 17);
+	fill(expected, 5);
+
+	// 文件大小已知.
+	{
+		avhttp::direct_storage storage(64 * 1024, 3);
+		storage.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+
+		storage.allocate(expected.size(), ec);
+		BOOST_ASSERT(!ec);
+		write_shuffled(storage, expected);
+
+		std::vector<char> data(expected.size());
+		BOOST_ASSERT(storage.read(&data[0], 0, data.size()) == static_cast<int>(data.size()));
+		BOOST_ASSERT(data == expected);
+		BOOST_ASSERT(storage.read(&data[0], expected.size() - 10, 100) == 10);
+		storage.close();
+	}
+	check_file(expected);
+	avhttp::fs::remove(file_name, ec);
+
+	// 文件大小未知, 最后一个块在关闭时写出并截断到实际大小.
+	fill(expected, 9);
+	{
+		avhttp::direct_storage storage(64 * 1024, 3);
+		storage.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		write_shuffled(storage, expected);
+	}
+	check_file(expected);
+	avhttp::fs::remove(file_name, ec);
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include <boost/lexical_cast.hpp>
+#include "avhttp.hpp"
+
+typedef avhttp::download_manager manager;
+
+// 每个下载使用各自的文件和meta文件, 同一个url可以添加多次.
+avhttp::settings make_settings(int n, int connections = avhttp::default_connections_limit,
+	int rate = -1)
+{
+	avhttp::settings s;
+	s.save_path = "download_manager_test_" + boost::lexical_cast<std::string>(n) + ".tmp";
+	s.meta_file = s.save_path.string() + ".meta";
+	s.connections_limit = connections;
+	s.download_rate_limit = rate;
+	return s;
+}
+
+void remove_files(int count)
+{
+	boost::system::error_code ec;
+	for (int n = 0; n < count; n++)
+	{
+		avhttp::settings s = make_settings(n);
+		avhttp::fs::remove(s.save_path, ec);
+		avhttp::fs::remove(s.meta_file, ec);
+	}
+}
+
+void sleep_ms(int ms)
+{
+	boost::this_thread::sleep(boost::posix_time::millisec(ms));
+}
+
+// 等待直到所有下载都已经停止, 超时返回false.
+bool wait_stopped(manager& m)
+{
+	for (int i = 0; i < 600 && !m.stopped(); i++)
+	{
+		sleep_ms(50);
+	}
+	return m.stopped();
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		std::cerr << "usage: " << argv[0] << " <url>\n";
+		return -1;
+	}
+
+	const std::string url = argv[1];
+	remove_files(5);
+
+	avhttp::io_service_pool pool(4);
+	pool.run();
+
+	{
+		// 同一主机只允许1个连接, 排队中的下载按优先级依次下载, 相同优先级按添加顺序.
+		manager m(pool);
+		m.connections_limit(4);
+		m.per_host_connections_limit(1);
+		m.download_rate_limit(1024 * 1024);
+
+		int low = m.add(url, make_settings(0), 0);
+		int high = m.add(url, make_settings(1), 5);
+		int middle = m.add(url, make_settings(2), 1);
+		m.start();
+
+		// start时立即调度一次, 只有优先级最高的下载得到主机的连接数额.
+		BOOST_ASSERT(m.state(high) == manager::running);
+		BOOST_ASSERT(m.state(middle) == manager::queued);
+		BOOST_ASSERT(m.state(low) == manager::queued);
+
+		std::vector<int> order;
+		int ids[3] = { high, middle, low };
+		for (int t = 0; t < 1200 && order.size() < 3; t++)
+		{
+			int running = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				manager::download_state state = m.state(ids[i]);
+				if (state == manager::running)
+				{
+					running++;
+				}
+				if (state == manager::finished
+					&& std::find(order.begin(), order.end(), ids[i]) == order.end())
+				{
+					order.push_back(ids[i]);
+				}
+			}
+			BOOST_ASSERT(running <= 1);
+			sleep_ms(50);
+		}
+
+		BOOST_ASSERT(order.size() == 3);
+		BOOST_ASSERT(order[0] == high && order[1] == middle && order[2] == low);
+		for (int i = 0; i < 3; i++)
+		{
+			manager::multi_download_ptr d = m.download(ids[i]);
+			BOOST_ASSERT(!m.error(ids[i]));
+			BOOST_ASSERT(d->file_size() > 0 && d->bytes_download() == d->file_size());
+		}
+
+		m.stop();
+		BOOST_ASSERT(wait_stopped(m));
+	}
+
+	{
+		// 全局限速按分配到的连接数分给各下载, 下载自身的限速更小时使用自身的限速.
+		manager m(pool);
+		m.connections_limit(4);
+		m.per_host_connections_limit(4);
+		m.download_rate_limit(400000);
+
+		int shared = m.add(url, make_settings(3, 3));
+		int own = m.add(url, make_settings(4, 1, 50000));
+		m.start();
+
+		// 两个下载共4个连接, 分别得到3个和1个, 全局限速按3:1分配.
+		manager::multi_download_ptr a = m.download(shared);
+		manager::multi_download_ptr b = m.download(own);
+		for (int t = 0; t < 100 && (a->download_rate_limit() != 300000
+			|| b->download_rate_limit() != 50000); t++)
+		{
+			sleep_ms(50);
+		}
+		BOOST_ASSERT(a->download_rate_limit() == 300000);
+		BOOST_ASSERT(b->download_rate_limit() == 50000);
+		BOOST_ASSERT(m.state(shared) == manager::running);
+		BOOST_ASSERT(m.state(own) == manager::running);
+
+		// 停止后回到排队状态, 删除后不再调度.
+		m.stop();
+		BOOST_ASSERT(wait_stopped(m));
+		BOOST_ASSERT(m.state(shared) == manager::queued);
+		m.remove(shared);
+		m.remove(own);
+		BOOST_ASSERT(!m.download(shared));
+		BOOST_ASSERT(wait_stopped(m));
+	}
+
+	pool.stop();
+	pool.join();
+	remove_files(5);
+
+	std::cout << "download_manager test passed\n";
+	return 0;
+}
@@ -0,0 +1,93 @@
+﻿#include <vector>
+#include <string>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+static const std::string file_name = "file_test.tmp";
+
+void fill(std::vector<char>& data, int seed)
+{
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<char>((i * 13 + seed) & 0xff);
+	}
+}
+
+// 多个线程同时对同一个file进行定位读写, 每个线程负责交错的不同块.
+void write_blocks(avhttp::file* f, int thread, int blocks, int block_size)
+{
+	std::vector<char> data(block_size);
+	std::vector<char> check(block_size);
+	for (int i = thread; i < blocks; i += 4)
+	{
+		fill(data, i);
+		boost::system::error_code ec;
+		avhttp::file::size_type offset = static_cast<avhttp::file::size_type>(i) * block_size;
+
+		// 分成两个buffer写入, 测试多个iovec.
+		avhttp::file::iovec_t bufs[2];
+		bufs[0].iov_base = &data[0];
+		bufs[0].iov_len = block_size / 3;
+		bufs[1].iov_base = &data[block_size / 3];
+		bufs[1].iov_len = block_size - block_size / 3;
+		BOOST_ASSERT(f->writev(offset, bufs, 2, ec) == block_size);
+		BOOST_ASSERT(!ec);
+
+		BOOST_ASSERT(f->read(offset, &check[0], block_size) == block_size);
+		BOOST_ASSERT(check == data);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	avhttp::file f;
+	f.open(file_name, avhttp::file::read_write, ec);
+	BOOST_ASSERT(!ec);
+
+	const int blocks = 256;
+	const int block_size = 64 * 1024 + 7;
+	boost::thread_group threads;
+	for (int i = 0; i < 4; i++)
+	{
+		threads.create_thread(boost::bind(&write_blocks, &f, i, blocks, block_size));
+	}
+	threads.join_all();
+
+	// 定位读写不移动文件指针.
+	BOOST_ASSERT(f.offset(ec) == 0);
+
+	std::vector<char> expected(block_size);
+	std::vector<char> data(block_size);
+	for (int i = 0; i < blocks; i++)
+	{
+		fill(expected, i);
+		BOOST_ASSERT(f.read(static_cast<avhttp::file::size_type>(i) * block_size,
+			&data[0], block_size) == block_size);
+		BOOST_ASSERT(data == expected);
+	}
+
+	// 读取超过文件末尾时返回实际读取的字节数.
+	avhttp::file::size_type size = static_cast<avhttp::file::size_type>(blocks) * block_size;
+	BOOST_ASSERT(f.get_size(ec) == size);
+	BOOST_ASSERT(f.read(size - 100, &data[0], block_size) == 100);
+
+	// 顺序读写使用并移动文件指针.
+	fill(expected, 0);
+	BOOST_ASSERT(f.read(&data[0], block_size) == block_size);
+	BOOST_ASSERT(data == expected);
+	BOOST_ASSERT(f.offset(ec) == block_size);
+
+	// io_dsync在不支持pwritev2时由fdatasync完成.
+	avhttp::file::iovec_t buf;
+	buf.iov_base = &expected[0];
+	buf.iov_len = 100;
+	BOOST_ASSERT(f.writev(10, &buf, 1, ec, avhttp::file::io_dsync) == 100);
+	BOOST_ASSERT(!ec);
+	BOOST_ASSERT(f.read(10, &data[0], 100) == 100);
+	BOOST_ASSERT(std::equal(data.begin(), data.begin() + 100, expected.begin()));
+
+	f.close();
+	avhttp::fs::remove(file_name, ec);
+	return 0;
+}
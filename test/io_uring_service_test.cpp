@@ -0,0 +1,168 @@
+﻿#include <vector>
+#include <string>
+#include <cstdlib>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+// 定义AVHTTP_ENABLE_IO_URING编译时测试io_uring, 否则测试直接读写文件的回退.
+
+static const std::string file_name = "io_uring_service_test.tmp";
+
+void fill(std::vector<char>& data, int seed)
+{
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<char>((i * 31 + seed) & 0xff);
+	}
+}
+
+void on_write(const boost::system::error_code& ec, std::size_t bytes, std::size_t expected, int* done)
+{
+	BOOST_ASSERT(!ec);
+	BOOST_ASSERT(bytes == expected);
+	(*done)++;
+}
+
+void on_flush(const boost::system::error_code& ec, int* done)
+{
+	BOOST_ASSERT(!ec);
+	(*done)++;
+}
+
+// 多个线程同时写入不同的区间, 请求被批量提交.
+void write_blocks(avhttp::uring_storage* storage, int thread, int blocks, int block_size)
+{
+	std::vector<char> data(block_size);
+	for (int i = thread; i < blocks; i += 4)
+	{
+		fill(data, i);
+		BOOST_ASSERT(storage->write(&data[0], static_cast<boost::int64_t>(i) * block_size,
+			block_size) == block_size);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	avhttp::io_uring_service& ring = avhttp::io_uring_service::shared();
+#if !defined(AVHTTP_ENABLE_IO_URING) || !defined(__linux__)
+	BOOST_ASSERT(!ring.is_open());
+#endif
+
+	boost::system::error_code ec;
+	{
+		avhttp::uring_storage storage;
+		storage.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+
+		// 大于注册缓冲的数据不使用注册缓冲.
+		const int blocks = 64;
+		const int block_size = 300 * 1024;
+		boost::thread_group threads;
+		for (int i = 0; i < 4; i++)
+		{
+			threads.create_thread(boost::bind(&write_blocks, &storage, i, blocks, block_size));
+		}
+		threads.join_all();
+
+		std::vector<char> expected(block_size);
+		std::vector<char> data(block_size);
+		for (int i = 0; i < blocks; i++)
+		{
+			fill(expected, i);
+			BOOST_ASSERT(storage.read(&data[0], static_cast<boost::int64_t>(i) * block_size,
+				block_size) == block_size);
+			BOOST_ASSERT(data == expected);
+		}
+
+		// 小块使用注册缓冲, 读取超过文件末尾时返回实际读取的字节数.
+		fill(expected, 7);
+		BOOST_ASSERT(storage.write(&expected[0], 5, 1000) == 1000);
+		BOOST_ASSERT(storage.read(&data[0], 5, 1000) == 1000);
+		BOOST_ASSERT(std::equal(data.begin(), data.begin() + 1000, expected.begin()));
+		boost::int64_t size = static_cast<boost::int64_t>(blocks) * block_size;
+		BOOST_ASSERT(storage.read(&data[0], size - 100, 1000) == 100);
+		storage.close();
+	}
+
+	// 异步读写, 完成后在io_service中回调.
+	if (ring.is_open())
+	{
+		avhttp::file f(file_name, avhttp::file::read_write, ec);
+		BOOST_ASSERT(!ec);
+		int handle = ring.register_file(f.native_handle());
+		BOOST_ASSERT(handle != -1);
+
+		boost::asio::io_service io;
+		boost::asio::io_service::work work(io);
+		std::vector<std::vector<char> > buffers(100, std::vector<char>(4096));
+		int done = 0;
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			fill(buffers[i], static_cast<int>(i) + 100);
+			ring.async_write(handle, i * 4096, &buffers[i][0], 4096, io,
+				boost::bind(&on_write, _1, _2, 4096, &done));
+		}
+		while (done != static_cast<int>(buffers.size()))
+		{
+			io.run_one();
+		}
+
+		std::vector<char> data(4096);
+		for (std::size_t i = 0; i < buffers.size(); i++)
+		{
+			BOOST_ASSERT(ring.read(handle, i * 4096, &data[0], 4096, ec) == 4096);
+			BOOST_ASSERT(!ec && data == buffers[i]);
+		}
+
+		ring.unregister_file(handle);
+		BOOST_ASSERT(ring.read(handle, 0, &data[0], 4096, ec) == -1 && ec);
+	}
+
+	// 异步存储, 缓冲序列中的每个缓冲分别提交, 完成后在open指定的io_service中回调.
+	{
+		boost::asio::io_service io;
+		boost::asio::io_service::work work(io);
+		avhttp::storage_hints hints;
+		hints.io_service = &io;
+		avhttp::uring_async_storage storage;
+		storage.open(file_name, hints, ec);
+		BOOST_ASSERT(!ec);
+
+		std::vector<char> first(4096);
+		std::vector<char> second(300 * 1024);
+		fill(first, 200);
+		fill(second, 201);
+		avhttp::async_storage_interface::const_buffers_type buffers;
+		buffers.push_back(boost::asio::buffer(first));
+		buffers.push_back(boost::asio::buffer(second));
+		int done = 0;
+		storage.async_write(8192, buffers,
+			boost::bind(&on_write, _1, _2, first.size() + second.size(), &done));
+		storage.async_sync(boost::bind(&on_flush, _1, &done));
+		while (done != 2)
+		{
+			io.run_one();
+		}
+
+		// 同步读取必须能读到异步写入的数据.
+		std::vector<char> data(first.size() + second.size());
+		avhttp::async_storage_interface::mutable_buffers_type read_buffers(
+			1, boost::asio::buffer(data));
+		BOOST_ASSERT(storage.read(8192, read_buffers, ec) == data.size());
+		BOOST_ASSERT(std::equal(first.begin(), first.end(), data.begin()));
+		BOOST_ASSERT(std::equal(second.begin(), second.end(), data.begin() + first.size()));
+
+		std::fill(data.begin(), data.end(), 0);
+		storage.async_read(8192, read_buffers,
+			boost::bind(&on_write, _1, _2, data.size(), &done));
+		while (done != 3)
+		{
+			io.run_one();
+		}
+		BOOST_ASSERT(std::equal(second.begin(), second.end(), data.begin() + first.size()));
+		storage.close();
+	}
+
+	avhttp::fs::remove(file_name, ec);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+void fill(std::vector<char>& data, int seed)
+{
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<char>((i * 13 + seed) & 0xff);
+	}
+}
+
+// 以乱序写入整个数据.
+void write_shuffled(avhttp::memory_storage& storage, const std::vector<char>& expected)
+{
+	const int chunk = 1000;
+	std::vector<int> offsets;
+	for (int offset = 0; offset < static_cast<int>(expected.size()); offset += chunk)
+	{
+		offsets.push_back(offset);
+	}
+	std::srand(3);
+	std::random_shuffle(offsets.begin(), offsets.end());
+
+	for (std::size_t i = 0; i < offsets.size(); i++)
+	{
+		int bytes = (std::min)(chunk, static_cast<int>(expected.size()) - offsets[i]);
+		BOOST_ASSERT(storage.write(&expected[offsets[i]], offsets[i], bytes) == bytes);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	std::vector<char> expected(100 * 1000 + 7);
+	fill(expected, 1);
+
+	// 大小已知, 使用一个连续的块, release不复制数据.
+	{
+		avhttp::memory_storage storage;
+		storage.open("memory", ec);
+		BOOST_ASSERT(!ec);
+		storage.allocate(expected.size(), ec);
+		BOOST_ASSERT(!ec);
+
+		// 没有写入过的部分为0, 也没有视图.
+		std::size_t length = 0;
+		char c = 1;
+		BOOST_ASSERT(storage.read(&c, 100, 1) == 1 && c == 0);
+		BOOST_ASSERT(!storage.view(100, 1, length) && length == 0);
+
+		write_shuffled(storage, expected);
+
+		std::vector<char> data(expected.size());
+		BOOST_ASSERT(storage.read(&data[0], 0, data.size()) == static_cast<int>(data.size()));
+		BOOST_ASSERT(data == expected);
+		BOOST_ASSERT(storage.read(&data[0], expected.size() - 10, 100) == 10);
+
+		std::vector<boost::asio::const_buffer> buffers = storage.data();
+		BOOST_ASSERT(buffers.size() == 1);
+		BOOST_ASSERT(boost::asio::buffer_size(buffers[0]) == expected.size());
+		const char* p = boost::asio::buffer_cast<const char*>(buffers[0]);
+
+		{
+			boost::shared_ptr<const char> v = storage.view(10, 100, length);
+			BOOST_ASSERT(v && length == 100 && v.get() == p + 10);
+		}
+
+		std::vector<char> body;
+		storage.release(body);
+		BOOST_ASSERT(body == expected);
+		BOOST_ASSERT(&body[0] == p);
+		BOOST_ASSERT(storage.size() == 0);
+	}
+
+	// 大小未知, 按块分配, 跨越块边界读写.
+	fill(expected, 2);
+	{
+		avhttp::memory_storage storage(4096);
+		storage.open("memory", ec);
+		BOOST_ASSERT(!ec);
+		write_shuffled(storage, expected);
+		BOOST_ASSERT(storage.size() == static_cast<boost::int64_t>(expected.size()));
+
+		std::size_t length = 0;
+		boost::shared_ptr<const char> v = storage.view(4000, 1000, length);
+		BOOST_ASSERT(v && length == 96);
+		BOOST_ASSERT(std::memcmp(v.get(), &expected[4000], length) == 0);
+
+		std::vector<boost::asio::const_buffer> buffers = storage.data();
+		BOOST_ASSERT(boost::asio::buffer_size(buffers) == expected.size());
+		std::vector<char> data(expected.size());
+		boost::asio::buffer_copy(boost::asio::buffer(data), buffers);
+		BOOST_ASSERT(data == expected);
+
+		// 视图在release之后仍然有效.
+		std::vector<char> body;
+		storage.release(body);
+		BOOST_ASSERT(body == expected);
+		BOOST_ASSERT(std::memcmp(v.get(), &expected[4000], length) == 0);
+	}
+
+	return 0;
+}
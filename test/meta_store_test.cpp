@@ -0,0 +1,189 @@
+#include <vector>
+#include <string>
+#include <cstring>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+static const std::string file_name = "meta_store_test.tmp";
+
+std::string load(const avhttp::meta_store& store, const std::string& key)
+{
+	std::vector<char> data;
+	if (!store.load(key, data))
+	{
+		return "<none>";
+	}
+	return std::string(data.begin(), data.end());
+}
+
+bool put(avhttp::meta_store& store, const std::string& key, const std::string& data)
+{
+	return store.replace(key, data.data(), data.size());
+}
+
+bool add(avhttp::meta_store& store, const std::string& key, const std::string& data)
+{
+	return store.append(key, data.data(), data.size());
+}
+
+boost::int64_t store_size()
+{
+	boost::system::error_code ec;
+	boost::int64_t size = static_cast<boost::int64_t>(avhttp::fs::file_size(file_name, ec));
+	BOOST_ASSERT(!ec);
+	return size;
+}
+
+// 把存储文件最后一个字节取反, 模拟数据损坏.
+void corrupt_last_byte()
+{
+	boost::system::error_code ec;
+	avhttp::file f;
+	f.open(file_name, avhttp::file::read_write, ec);
+	BOOST_ASSERT(!ec);
+	boost::int64_t size = f.get_size(ec);
+	char c = 0;
+	BOOST_ASSERT(f.read(size - 1, &c, 1) == 1);
+	c = ~c;
+	BOOST_ASSERT(f.write(size - 1, &c, 1) == 1);
+}
+
+// 截断存储文件, 模拟写入记录时意外中止.
+void truncate(boost::int64_t size)
+{
+	boost::system::error_code ec;
+	avhttp::file f;
+	f.open(file_name, avhttp::file::read_write, ec);
+	BOOST_ASSERT(!ec);
+	f.set_size(size, ec);
+	BOOST_ASSERT(!ec);
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	avhttp::fs::remove(file_name, ec);
+
+	avhttp::meta_store store;
+	{
+		// 新文件只有标识, 没有任何key.
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(store.is_open());
+		BOOST_ASSERT(store.keys().empty());
+		BOOST_ASSERT(load(store, "a") == "<none>");
+
+		// replace之后append的数据依次连接, 再次replace覆盖之前所有的数据.
+		BOOST_ASSERT(put(store, "a", "stale"));
+		BOOST_ASSERT(put(store, "a", "hello"));
+		BOOST_ASSERT(add(store, "a", " world"));
+		BOOST_ASSERT(put(store, "b", "bravo"));
+		BOOST_ASSERT(add(store, "b", ""));
+		BOOST_ASSERT(load(store, "a") == "hello world");
+		BOOST_ASSERT(load(store, "b") == "bravo");
+
+		BOOST_ASSERT(store.remove("b"));
+		BOOST_ASSERT(!store.contains("b"));
+		BOOST_ASSERT(load(store, "b") == "<none>");
+		// 删除不存在的key也算成功.
+		BOOST_ASSERT(store.remove("b"));
+
+		BOOST_ASSERT(put(store, "c", "charlie"));
+		BOOST_ASSERT(store.flush());
+		store.close();
+		BOOST_ASSERT(!store.is_open());
+	}
+
+	{
+		// 重新打开后通过日志恢复出相同的数据.
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		std::vector<std::string> keys = store.keys();
+		BOOST_ASSERT(keys.size() == 2 && keys[0] == "a" && keys[1] == "c");
+		BOOST_ASSERT(load(store, "a") == "hello world");
+		BOOST_ASSERT(load(store, "c") == "charlie");
+		BOOST_ASSERT(!store.contains("b"));
+	}
+
+	{
+		// 反复replace产生大量无效记录, 整理后文件变小, 数据不变.
+		std::string big(64 * 1024, 'x');
+		for (int i = 0; i < 8; i++)
+		{
+			big[0] = static_cast<char>('0' + i);
+			BOOST_ASSERT(put(store, "c", big));
+		}
+		boost::int64_t before = store_size();
+		store.compact(ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(store_size() < before);
+		BOOST_ASSERT(load(store, "a") == "hello world");
+		BOOST_ASSERT(load(store, "c") == big);
+
+		// 整理之后仍可以继续追加, 并且重新打开后数据一致.
+		BOOST_ASSERT(add(store, "a", "!"));
+		store.close();
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(load(store, "a") == "hello world!");
+		BOOST_ASSERT(load(store, "c") == big);
+		BOOST_ASSERT(put(store, "c", "charlie"));
+		store.compact(ec);
+		BOOST_ASSERT(!ec);
+	}
+
+	{
+		// 末尾的记录只写入了一部分, 打开时截断, 之前的记录不受影响.
+		boost::int64_t good_size = store_size();
+		BOOST_ASSERT(add(store, "a", " torn"));
+		store.close();
+		truncate(store_size() - 2);
+
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(store_size() == good_size);
+		BOOST_ASSERT(load(store, "a") == "hello world!");
+
+		// 截断之后新的记录写在完好的记录之后.
+		BOOST_ASSERT(add(store, "a", "?"));
+		store.close();
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(load(store, "a") == "hello world!?");
+	}
+
+	{
+		// 末尾记录的数据crc不符, 只返回之前完好的部分.
+		BOOST_ASSERT(add(store, "a", " bad"));
+		store.close();
+		corrupt_last_byte();
+
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(load(store, "a") == "hello world!?");
+		BOOST_ASSERT(load(store, "c") == "charlie");
+
+		// 整理时丢弃损坏的数据, 不会以新的crc保存下来.
+		store.compact(ec);
+		BOOST_ASSERT(!ec);
+		store.close();
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(load(store, "a") == "hello world!?");
+
+		// 唯一的记录损坏时key的数据不可用.
+		BOOST_ASSERT(put(store, "d", "delta"));
+		store.close();
+		corrupt_last_byte();
+		store.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(store.contains("d"));
+		BOOST_ASSERT(load(store, "d") == "<none>");
+		BOOST_ASSERT(load(store, "a") == "hello world!?");
+	}
+
+	store.close();
+	avhttp::fs::remove(file_name, ec);
+
+	return 0;
+}
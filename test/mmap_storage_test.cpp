@@ -0,0 +1,78 @@
+﻿#include <vector>
+#include <string>
+#include <cstring>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+static const std::string file_name = "mmap_storage_test.tmp";
+
+void fill(std::vector<char>& data, int seed)
+{
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<char>((i * 7 + seed) & 0xff);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	boost::system::error_code ec;
+	{
+		// 使用很小的窗口, 测试跨窗口读写以及窗口被解除时视图仍然有效.
+		const std::size_t window_size = 64 * 1024;
+		avhttp::mmap_storage storage(window_size, 2);
+		storage.open(file_name, ec);
+		BOOST_ASSERT(!ec);
+
+		// 没有allocate之前直接读写文件, 不支持视图.
+		std::size_t length = 0;
+		BOOST_ASSERT(!storage.is_mapped());
+		BOOST_ASSERT(!storage.view(0, 100, length) && length == 0);
+
+		const int size = 10 * window_size + 1000;
+		storage.allocate(size, ec);
+		BOOST_ASSERT(!ec);
+		BOOST_ASSERT(storage.is_mapped());
+
+		// 每次写入跨越窗口边界.
+		std::vector<char> expected(size);
+		fill(expected, 3);
+		const int block = 100000;
+		for (int offset = 0; offset < size; offset += block)
+		{
+			int bytes = (std::min)(block, size - offset);
+			BOOST_ASSERT(storage.write(&expected[offset], offset, bytes) == bytes);
+		}
+		BOOST_ASSERT(storage.sync());
+
+		std::vector<char> data(size);
+		BOOST_ASSERT(storage.read(&data[0], 0, size) == size);
+		BOOST_ASSERT(data == expected);
+
+		// 读取超过文件末尾时返回实际读取的字节数.
+		BOOST_ASSERT(storage.read(&data[0], size - 100, 1000) == 100);
+
+		// 视图不跨越窗口边界.
+		boost::shared_ptr<const char> first = storage.view(window_size - 10, 100, length);
+		BOOST_ASSERT(first && length == 10);
+		BOOST_ASSERT(std::memcmp(first.get(), &expected[window_size - 10], length) == 0);
+
+		// 访问其它窗口使第一个窗口被解除, 但持有的视图仍然有效.
+		for (int offset = 0; offset < size; offset += window_size)
+		{
+			BOOST_ASSERT(storage.view(offset, window_size, length) && length > 0);
+		}
+		BOOST_ASSERT(std::memcmp(first.get(), &expected[window_size - 10], 10) == 0);
+
+		boost::shared_ptr<const char> last = storage.view(size - 1000, window_size, length);
+		BOOST_ASSERT(last && length == 1000);
+		BOOST_ASSERT(!storage.view(size, 100, length) && length == 0);
+
+		storage.close();
+		BOOST_ASSERT(std::memcmp(last.get(), &expected[size - 1000], 1000) == 0);
+	}
+
+	BOOST_ASSERT(avhttp::fs::file_size(file_name) == 10 * 64 * 1024 + 1000);
+	avhttp::fs::remove(file_name, ec);
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <cstring>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+// 检查流式处理按顺序交出数据, 并且在最后只收到一次长度为0的结束回调.
+struct stream_checker
+{
+	stream_checker()
+		: next(0)
+		, calls(0)
+		, eof_calls(0)
+	{}
+
+	void operator()(boost::int64_t offset, const char* data, std::size_t size)
+	{
+		// 结束回调之后不应再有任何回调.
+		BOOST_ASSERT(eof_calls == 0);
+
+		// 每次交出的数据都紧接在上一次之后.
+		BOOST_ASSERT(offset == next);
+
+		if (size == 0)
+		{
+			eof_calls++;
+			return;
+		}
+
+		BOOST_ASSERT(data != NULL);
+		content.insert(content.end(), data, data + size);
+		next += size;
+		calls++;
+	}
+
+	boost::int64_t next;
+	int calls;
+	int eof_calls;
+	std::vector<char> content;
+};
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2 && argc != 3)
+	{
+		std::cerr << "usage: " << argv[0] << " <url> [reference file]\n";
+		return -1;
+	}
+
+	boost::asio::io_service io;
+	avhttp::multi_download d(io);
+
+	stream_checker checker;
+	avhttp::settings s;
+	s.stream_handler = boost::ref(checker);
+	// 只在已交出位置之后256KB的窗口内下载, 窗口外的连接等待.
+	s.stream_window = 256 * 1024;
+	s.stream_prefer_prefix = true;
+
+	d.start(argv[1], s);
+	boost::thread t(boost::bind(&boost::asio::io_service::run, &io));
+	bool ok = d.wait_for_complete();
+	t.join();
+
+	// 下载完成时整个文件都已经按顺序交出, 并且收到了一次结束回调.
+	BOOST_ASSERT(ok);
+	BOOST_ASSERT(checker.next == d.file_size());
+	BOOST_ASSERT(checker.eof_calls == 1);
+	BOOST_ASSERT(checker.calls > 0);
+
+	if (argc == 3)
+	{
+		std::ifstream f(argv[2], std::ios::binary);
+		std::vector<char> reference((std::istreambuf_iterator<char>(f)),
+			std::istreambuf_iterator<char>());
+		BOOST_ASSERT(reference.size() == checker.content.size());
+		BOOST_ASSERT(std::memcmp(&reference[0], &checker.content[0], reference.size()) == 0);
+	}
+
+	std::cout << "streamed " << checker.next << " bytes in " << checker.calls << " calls\n";
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+﻿#include <vector>
+#include <cstdlib>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+// 用简单的位数组作为对照, 检查rangefield的结果.
+struct naive_field
+{
+	naive_field(boost::int64_t size)
+		: bits(static_cast<std::size_t>(size), false)
+	{}
+
+	void set(boost::int64_t left, boost::int64_t right, bool value)
+	{
+		for (boost::int64_t i = left; i < right; i++)
+			bits[i] = value;
+	}
+
+	bool covered(boost::int64_t left, boost::int64_t right) const
+	{
+		for (boost::int64_t i = left; i < right; i++)
+			if (!bits[i])
+				return false;
+		return true;
+	}
+
+	boost::int64_t gap_end(boost::int64_t left) const
+	{
+		boost::int64_t size = bits.size();
+		while (left < size && !bits[left])
+			left++;
+		return left;
+	}
+
+	// 与rangefield::out_space相同的语义.
+	bool out_space(boost::int64_t offset, boost::int64_t& left, boost::int64_t& right) const
+	{
+		boost::int64_t size = bits.size();
+		for (boost::int64_t i = (std::max)(offset, boost::int64_t(0)); i < size; i++)
+		{
+			if (!bits[i])
+			{
+				left = i;
+				right = gap_end(i);
+				return true;
+			}
+		}
+		for (boost::int64_t i = 0; i < size; i++)
+		{
+			if (!bits[i])
+			{
+				left = i;
+				right = gap_end(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::vector<bool> bits;
+};
+
+void check(avhttp::rangefield& rf, const naive_field& nf)
+{
+	boost::int64_t size = rf.size();
+	boost::int64_t total = 0;
+	for (boost::int64_t i = 0; i < size; i++)
+		total += nf.bits[i] ? 1 : 0;
+	BOOST_ASSERT(rf.range_size() == total);
+	BOOST_ASSERT(rf.is_full() == (total == size));
+
+	// 输出的区间互不重叠也不相邻.
+	std::vector<avhttp::range> ranges;
+	rf.ranges(ranges);
+	for (std::size_t i = 0; i < ranges.size(); i++)
+	{
+		BOOST_ASSERT(ranges[i].left < ranges[i].right);
+		BOOST_ASSERT(nf.covered(ranges[i].left, ranges[i].right));
+		if (i > 0)
+			BOOST_ASSERT(ranges[i - 1].right < ranges[i].left);
+	}
+
+	for (int n = 0; n < 20; n++)
+	{
+		boost::int64_t l = std::rand() % size;
+		boost::int64_t r = l + 1 + std::rand() % (size - l);
+		BOOST_ASSERT(rf.check_range(l, r) == nf.covered(l, r));
+
+		boost::int64_t gl = l, gr = r;
+		bool found = rf.get_range(gl, gr);
+		BOOST_ASSERT(found == nf.bits[l]);
+		if (found)
+		{
+			BOOST_ASSERT(gl == l);
+			BOOST_ASSERT(nf.covered(gl, gr));
+			BOOST_ASSERT(gr == r || !nf.bits[gr]);
+		}
+
+		boost::int64_t offset = std::rand() % (size + 2) - 1;
+		boost::int64_t sl = 0, sr = 0, nl = 0, nr = 0;
+		bool s1 = rf.out_space(offset, sl, sr);
+		bool s2 = nf.out_space(offset, nl, nr);
+		BOOST_ASSERT(s1 == s2);
+		if (s1)
+			BOOST_ASSERT(sl == nl && sr == nr);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	// 边界情况.
+	{
+		avhttp::rangefield rf(100);
+		boost::int64_t left = 0, right = 0;
+		BOOST_ASSERT(rf.out_space(left, right) && left == 0 && right == 100);
+		BOOST_ASSERT(rf.out_space(50, left, right) && left == 50 && right == 100);
+
+		rf.update(10, 20);
+		rf.update(20, 30);	// 相邻的区间合并.
+		BOOST_ASSERT(rf.check_range(10, 30));
+		BOOST_ASSERT(!rf.check_range(9, 30));
+		BOOST_ASSERT(rf.out_space(15, left, right) && left == 30 && right == 100);
+		BOOST_ASSERT(rf.out_space(5, left, right) && left == 5 && right == 10);
+
+		rf.update(30, 100);
+		BOOST_ASSERT(rf.out_space(50, left, right) && left == 0 && right == 10);
+
+		rf.update(0, 10);
+		BOOST_ASSERT(rf.is_full());
+		BOOST_ASSERT(!rf.out_space(0, left, right));
+
+		rf.remove(40, 60);
+		BOOST_ASSERT(rf.check_range(0, 40) && rf.check_range(60, 100));
+		BOOST_ASSERT(rf.out_space(70, left, right) && left == 40 && right == 60);
+
+		avhttp::rangefield inv = rf.inverse();
+		BOOST_ASSERT(inv.range_size() == 20 && inv.check_range(40, 60));
+
+		avhttp::bitfield bf;
+		rf.range_to_bitfield(bf, 30);
+		BOOST_ASSERT(bf.size() == 4);
+		BOOST_ASSERT(bf[0] && !bf[1] && bf[2] && bf[3]);
+
+		avhttp::rangefield rf2(100);
+		rf2.bitfield_to_range(bf, 30);
+		BOOST_ASSERT(rf2.range_size() == 70);
+		BOOST_ASSERT(rf2.check_range(0, 30) && rf2.check_range(60, 100));
+	}
+
+	// 随机添加删除, 与位数组对照.
+	std::srand(1);
+	for (int round = 0; round < 20; round++)
+	{
+		boost::int64_t size = 1 + std::rand() % 2000;
+		avhttp::rangefield rf(size);
+		naive_field nf(size);
+		for (int n = 0; n < 300; n++)
+		{
+			boost::int64_t l = std::rand() % size;
+			boost::int64_t r = l + 1 + std::rand() % (std::min)(size - l, boost::int64_t(64));
+			if (std::rand() % 3 == 0)
+			{
+				rf.remove(l, r);
+				nf.set(l, r, false);
+			}
+			else
+			{
+				rf.update(l, r);
+				nf.set(l, r, true);
+			}
+			check(rf, nf);
+		}
+	}
+
+	// 大量碎片区间.
+	{
+		const boost::int64_t size = 4000000;
+		avhttp::rangefield rf(size);
+		for (boost::int64_t i = 0; i < size; i += 40)
+			rf.update(i, i + 20);
+		std::vector<avhttp::range> ranges;
+		rf.ranges(ranges);
+		BOOST_ASSERT(ranges.size() == 100000);
+
+		boost::int64_t left = 0, right = 0;
+		for (boost::int64_t offset = 0; offset < size; offset += 997)
+		{
+			BOOST_ASSERT(rf.out_space(offset, left, right));
+			BOOST_ASSERT(right - left <= 20 && left % 40 >= 20);
+		}
+	}
+
+	return 0;
+}
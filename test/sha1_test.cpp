@@ -0,0 +1,29 @@
+﻿#include <cstring>
+#include <boost/assert.hpp>
+#include "avhttp.hpp"
+
+std::string sha1_hex(const std::string& data, std::size_t step)
+{
+	avhttp::detail::sha1 h;
+	for (std::size_t i = 0; i < data.size(); i += step)
+	{
+		h.update(data.c_str() + i, (std::min)(step, data.size() - i));
+	}
+	return avhttp::detail::sha1::to_hex(h.final());
+}
+
+int main(int argc, char* argv[])
+{
+	// FIPS 180-1中的测试数据.
+	BOOST_ASSERT(sha1_hex("", 1) == "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+	BOOST_ASSERT(sha1_hex("abc", 1) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+	BOOST_ASSERT(sha1_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 64)
+		== "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+	// 分多次添加数据, 结果应该与一次添加相同.
+	std::string million(1000000, 'a');
+	BOOST_ASSERT(sha1_hex(million, million.size()) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+	BOOST_ASSERT(sha1_hex(million, 777) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+
+	return 0;
+}